@@ -0,0 +1,1447 @@
+#!/usr/bin/env python
+"""
+bench.py
+--------
+Benchmarks for cTCP. Each run prints one line of JSON, so results can be saved
+and compared between changes:
+
+  ./bench.py bulk --bytes 10M -w 1,4,16 --drop 0,1,5 > results.json
+  ./bench.py latency --size 64 --concurrency 1,4 --echo inproc,cat
+  ./bench.py scale --connections 1,10,100,1000
+  ./bench.py fairness --flows 2,4 -w 8,16 --rate 2000 --aqm droptail,codel
+  ./bench.py diff --bytes 10M -w 1,8 --drop 0,5
+  ./bench.py bulk --repeat 5 --save && ./bench.py compare HEAD~1
+
+Benchmarks:
+  bulk     Throughput of a one-way transfer.
+  latency  Round-trip times of fixed-size requests echoed back by the server,
+           one outstanding request per client.
+  scale    How an echo server copes with more and more connections, all made
+           by one ctcp_load process.
+  fairness How flows started one after another share a bottleneck link, in
+           the simulator.
+  diff     Bulk and latency runs with our binary and the reference binary in
+           every pairing of client and server, side by side.
+  builds   The same runs with different builds of our binary, e.g. optimized
+           ones (see make pgo).
+
+With --save, results are also kept under bench-results/, by machine and git
+commit. compare then checks one commit's results against another's and flags
+regressions.
+
+Transports:
+  unix   The real ctcp binary, client and server on this machine talking over
+         Unix sockets.
+  sim    ctcp_sim, on a virtual clock. Goodput is in virtual time, so it shows
+         what the protocol does rather than how fast the code is.
+
+Works with both Python 2 and Python 3.
+"""
+
+from __future__ import division, print_function
+
+import argparse
+import filecmp
+import hashlib
+import itertools
+import json
+import math
+import multiprocessing
+import os
+import platform
+import random
+import select
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+CTCP_BINARY = "./ctcp"
+SIM_BINARY = "./ctcp_sim"
+LOAD_BINARY = "./ctcp_load"
+REFERENCE_BINARY = "./reference"
+
+TRANSPORTS = ["unix", "sim"]
+
+# How the server echoes requests back: in the library itself (--echo), or by
+# running a program.
+ECHO_SERVERS = {
+  "inproc": ["--echo"],
+  "cat": ["--", "cat"],
+}
+
+# Pairings of client and server binaries for diff, named client-server. The
+# client sends the data in bulk transfers and the requests in latency runs.
+PAIRINGS = {
+  "ours-ours": (CTCP_BINARY, CTCP_BINARY),
+  "ours-ref": (CTCP_BINARY, REFERENCE_BINARY),
+  "ref-ours": (REFERENCE_BINARY, CTCP_BINARY),
+  "ref-ref": (REFERENCE_BINARY, REFERENCE_BINARY),
+}
+
+# Metrics diff compares, for each scenario.
+DIFF_METRICS = {
+  "bulk": ["goodput_mbps", "retransmits", "retx_ratio", "sender_cpu_s",
+           "receiver_cpu_s", "cpu_s_per_gb"],
+  "latency": ["p50_us", "p99_us", "p999_us", "throughput_rps", "errors",
+              "client_cpu_s", "server_cpu_s"],
+}
+
+# Metrics builds compares, for each scenario.
+BUILD_METRICS = {
+  "bulk": ["goodput_mbps", "cpu_s_per_gb", "sender_cpu_s", "receiver_cpu_s"],
+  "latency": ["p50_us", "p99_us", "p999_us", "throughput_rps", "client_cpu_s",
+              "server_cpu_s"],
+}
+
+# Most clients a server takes (MAX_NUM_CLIENTS).
+MAX_CLIENTS = 10
+
+# Seconds to wait for the server to start up, and for it to finish writing
+# out once the client is done.
+SERVER_START_TIMEOUT = 3
+SERVER_DRAIN_TIMEOUT = 5
+
+# Statistics printed by the library with --summary.
+STATS_PREFIX = "[STATS] "
+
+# Where --save keeps results, one file of JSON lines per commit under a
+# directory per machine.
+RESULTS_DIR = "bench-results"
+
+# Metrics compare looks at, and whether higher values are better.
+COMPARE_METRICS = {
+  "goodput_mbps": True,
+  "throughput_rps": True,
+  "p50_us": False,
+  "p99_us": False,
+  "p999_us": False,
+  "cpu_s_per_gb": False,
+}
+
+# Fields that say what was run. Results with the same values for all of them
+# are runs of the same configuration, so every setting a benchmark reports
+# has to be here, or runs with different values of it are pooled.
+CONFIG_FIELDS = ["bench", "scenario", "transport", "echo", "bytes", "size",
+                 "window", "drop", "delay", "concurrency", "requests",
+                 "connections", "messages", "arrival_rate", "message_rate",
+                 "flows", "stagger_ms", "flow_window", "flow_rt_timeout",
+                 "rate_kbps", "latency_ms", "jitter_ms", "queue", "aqm",
+                 "timer_ms", "interval_ms", "fair_threshold", "binary",
+                 "baseline", "flags", "sim_flags"]
+
+# Two-sided critical values of Student's t distribution, by confidence and
+# degrees of freedom. Past the end of a row, the last value (the normal
+# distribution) is used.
+T_TABLE = {
+  90: [6.314, 2.920, 2.353, 2.132, 2.015, 1.943, 1.895, 1.860, 1.833, 1.812,
+       1.796, 1.782, 1.771, 1.761, 1.753, 1.746, 1.740, 1.734, 1.729, 1.725,
+       1.721, 1.717, 1.714, 1.711, 1.708, 1.706, 1.703, 1.701, 1.699, 1.697,
+       1.645],
+  95: [12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+       2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+       2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+       1.960],
+  99: [63.657, 9.925, 5.841, 4.604, 4.032, 3.707, 3.499, 3.355, 3.250, 3.169,
+       3.106, 3.055, 3.012, 2.977, 2.947, 2.921, 2.898, 2.878, 2.861, 2.845,
+       2.831, 2.819, 2.807, 2.797, 2.787, 2.779, 2.771, 2.763, 2.756, 2.750,
+       2.576],
+}
+
+# File results are also saved to with --save, if any.
+store = None
+
+################################### HELPERS ####################################
+
+def parse_size(size):
+  """
+  Function: parse_size
+  --------------------
+  Parses a size with an optional K, M or G suffix (powers of 1024).
+  """
+  units = {"k": 1024, "m": 1024 ** 2, "g": 1024 ** 3}
+  size = size.strip()
+  if size and size[-1].lower() in units:
+    return int(float(size[:-1]) * units[size[-1].lower()])
+  return int(float(size))
+
+
+def parse_list(values, convert=int):
+  """
+  Function: parse_list
+  --------------------
+  Parses a comma-separated list.
+  """
+  return [convert(v) for v in values.split(",") if v]
+
+
+def choose_ports(min_port=20000, max_port=60000):
+  """
+  Function: choose_ports
+  ----------------------
+  Picks a random pair of different ports for a client and server.
+  """
+  server_port = random.randint(min_port, max_port)
+  return str(server_port + 1), str(server_port)
+
+
+def sample_rss(proc, binary):
+  """
+  Function: sample_rss
+  --------------------
+  Samples the peak memory use of a running process, in KB, and keeps the
+  largest sample in proc.peak_rss_kb. The rusage of a child includes the
+  memory of the Python process it was forked from, so it can't be used. This
+  reads the high-water mark of the process itself once it has become binary.
+  """
+  try:
+    exe = os.readlink("/proc/%d/exe" % proc.pid)
+    if os.path.basename(exe) != os.path.basename(binary):
+      return
+    with open("/proc/%d/status" % proc.pid) as f:
+      for line in f:
+        if line.startswith("VmHWM:"):
+          rss = int(line.split()[1])
+          proc.peak_rss_kb = max(getattr(proc, "peak_rss_kb", 0), rss)
+  except (IOError, OSError):
+    pass
+
+
+def wait_usage(proc, binary, timeout=None):
+  """
+  Function: wait_usage
+  --------------------
+  Waits for a process to exit and gets its resource usage, sampling its peak
+  memory use while it runs.
+
+  binary: Binary the process runs.
+  timeout: Seconds to wait before giving up, or None to wait forever.
+  returns: The resource usage, or None if the process is still running.
+  """
+  end = None if timeout is None else time.time() + timeout
+  while True:
+    sample_rss(proc, binary)
+    pid, status, usage = os.wait4(proc.pid, os.WNOHANG)
+    if pid != 0:
+      proc.returncode = status
+      return usage
+    if end is not None and time.time() >= end:
+      return None
+    time.sleep(0.01)
+
+
+def stop(proc, binary):
+  """
+  Function: stop
+  --------------
+  Stops a process, if it is still running, and gets its resource usage.
+  """
+  usage = wait_usage(proc, binary, 0)
+  if usage is None:
+    os.kill(proc.pid, signal.SIGTERM)
+    usage = wait_usage(proc, binary)
+  return usage
+
+
+def cpu_seconds(usage):
+  return usage.ru_utime + usage.ru_stime
+
+
+def own_flags(binary, flags):
+  """
+  Function: own_flags
+  -------------------
+  Flags only our binary understands (--summary, --echo, link emulation and so
+  on). The reference binary gets none of them.
+  """
+  return flags if binary != REFERENCE_BINARY else []
+
+
+def read_stats(path):
+  """
+  Function: read_stats
+  --------------------
+  Reads the statistics printed by the library with --summary.
+
+  returns: The statistics of the last connection, or None if there are none.
+  """
+  stats = None
+  with open(path) as f:
+    for line in f:
+      if line.startswith(STATS_PREFIX):
+        stats = json.loads(line[len(STATS_PREFIX):])
+  return stats
+
+
+def proc_usage(proc):
+  """
+  Function: proc_usage
+  --------------------
+  Reads the CPU time and memory use of a running process from /proc.
+
+  returns: CPU seconds and resident memory in KB, or None if the process is
+           gone.
+  """
+  try:
+    with open("/proc/%d/stat" % proc.pid) as f:
+      fields = f.read().rsplit(")", 1)[1].split()
+    with open("/proc/%d/status" % proc.pid) as f:
+      rss = [int(line.split()[1]) for line in f if line.startswith("VmRSS:")]
+  except (IOError, OSError):
+    return None
+  ticks = os.sysconf("SC_CLK_TCK")
+  return (int(fields[11]) + int(fields[12])) / ticks, rss[0] if rss else 0
+
+
+def wait_for(condition, timeout):
+  """
+  Function: wait_for
+  ------------------
+  Waits until a condition is true.
+
+  returns: Whether or not the condition came true in time.
+  """
+  end = time.time() + timeout
+  while not condition():
+    if time.time() >= end:
+      return False
+    time.sleep(0.01)
+  return True
+
+
+def input_file(workdir, size):
+  """
+  Function: input_file
+  --------------------
+  Makes a file of random data to transfer, or reuses one already made.
+  """
+  path = os.path.join(workdir, "input-%d" % size)
+  if not os.path.exists(path):
+    with open(path, "wb") as f:
+      left = size
+      while left > 0:
+        chunk = min(left, 1024 * 1024)
+        f.write(os.urandom(chunk))
+        left -= chunk
+  return path
+
+
+def percentile(samples, p):
+  """
+  Function: percentile
+  --------------------
+  Gets a percentile of sorted samples, by nearest rank.
+
+  returns: The percentile, or None if there are no samples.
+  """
+  if not samples:
+    return None
+  rank = int(math.ceil(p / 100 * len(samples)))
+  return samples[max(rank, 1) - 1]
+
+
+def emit(result, out):
+  """
+  Function: emit
+  --------------
+  Prints out one result as a line of JSON.
+  """
+  out.write(json.dumps(result, sort_keys=True) + "\n")
+  out.flush()
+  if store:
+    saved = dict(result, time=time.time())
+    store.write(json.dumps(saved, sort_keys=True) + "\n")
+    store.flush()
+
+################################ RESULTS STORE #################################
+
+def git_commit(name="HEAD"):
+  """
+  Function: git_commit
+  --------------------
+  Gets the short hash of a commit. For HEAD, "-dirty" is added if tracked
+  files have changed since.
+
+  returns: The hash, or None if it is not a commit or git is not there.
+  """
+  try:
+    with open(os.devnull, "wb") as null:
+      commit = subprocess.check_output(["git", "rev-parse", "--short",
+                                        "--verify", name + "^{commit}"],
+                                       stderr=null).decode("utf-8").strip()
+      if name == "HEAD":
+        changes = subprocess.check_output(["git", "status", "--porcelain",
+                                           "--untracked-files=no", "."],
+                                          stderr=null)
+        if changes.strip():
+          commit += "-dirty"
+  except (OSError, subprocess.CalledProcessError):
+    return None
+  return commit
+
+
+def machine_info():
+  """
+  Function: machine_info
+  ----------------------
+  Describes this machine: what it is, what it runs, and its CPU and memory.
+  """
+  cpu = platform.processor()
+  memory = None
+  try:
+    with open("/proc/cpuinfo") as f:
+      models = [line.split(":", 1)[1].strip() for line in f
+                if line.startswith("model name")]
+      cpu = models[0] if models else cpu
+    with open("/proc/meminfo") as f:
+      memory = [int(line.split()[1]) for line in f
+                if line.startswith("MemTotal:")][0]
+  except (IOError, OSError, IndexError):
+    pass
+  return {
+    "hostname": platform.node(),
+    "system": platform.system(),
+    "release": platform.release(),
+    "arch": platform.machine(),
+    "cpu": cpu,
+    "cpus": multiprocessing.cpu_count(),
+    "memory_kb": memory,
+  }
+
+
+def machine_fingerprint(info):
+  """
+  Function: machine_fingerprint
+  -----------------------------
+  Short hash of a machine description, to keep results from different
+  machines apart.
+  """
+  text = json.dumps(info, sort_keys=True).encode("utf-8")
+  return hashlib.sha1(text).hexdigest()[:12]
+
+
+def open_store():
+  """
+  Function: open_store
+  --------------------
+  Opens the file to save results of this commit on this machine to, and
+  writes out the machine description next to it.
+  """
+  info = machine_info()
+  machine_dir = os.path.join(RESULTS_DIR, machine_fingerprint(info))
+  if not os.path.isdir(machine_dir):
+    os.makedirs(machine_dir)
+  with open(os.path.join(machine_dir, "machine.json"), "w") as f:
+    f.write(json.dumps(info, sort_keys=True) + "\n")
+  commit = git_commit() or "unknown"
+  return open(os.path.join(machine_dir, commit + ".json"), "a")
+
+
+def load_results(machine, commit):
+  """
+  Function: load_results
+  ----------------------
+  Loads the saved results of a commit on a machine, grouped by configuration.
+
+  returns: A dict from configuration to the results of it, or None if there
+           are no results.
+  """
+  path = os.path.join(RESULTS_DIR, machine, commit + ".json")
+  if not os.path.exists(path):
+    return None
+  groups = {}
+  with open(path) as f:
+    for line in f:
+      result = json.loads(line)
+      config = tuple((field, result.get(field)) for field in CONFIG_FIELDS)
+      groups.setdefault(config, []).append(result)
+  return groups
+
+
+def mean_var(values):
+  """
+  Function: mean_var
+  ------------------
+  Gets the mean and sample variance of some values.
+  """
+  mean = sum(values) / len(values)
+  if len(values) < 2:
+    return mean, None
+  return mean, sum((v - mean) ** 2 for v in values) / (len(values) - 1)
+
+
+def t_critical(confidence, df):
+  """
+  Function: t_critical
+  --------------------
+  Gets the two-sided critical value of Student's t distribution, rounding the
+  degrees of freedom down so the interval errs on the wide side.
+  """
+  row = T_TABLE[confidence]
+  df = max(int(df), 1)
+  return row[df - 1] if df < len(row) else row[-1]
+
+
+def compare_metric(base, new, higher_better, confidence, threshold):
+  """
+  Function: compare_metric
+  ------------------------
+  Compares a metric between two sets of runs. The confidence interval of the
+  difference of means comes from Welch's t-test, so the two sets may have
+  different sizes and variances. It is a regression if the whole interval is
+  on the worse side of no change and the change is worse than the threshold.
+
+  base, new: Values of the metric in each run.
+  higher_better: Whether higher values are better.
+  confidence: Confidence level, in percent.
+  threshold: Smallest change that counts, in percent of the baseline mean.
+  returns: The comparison. The interval and the verdict are None with fewer
+           than two runs on either side.
+  """
+  base_mean, base_var = mean_var(base)
+  new_mean, new_var = mean_var(new)
+  result = {
+    "baseline_mean": base_mean,
+    "mean": new_mean,
+    "baseline_runs": len(base),
+    "runs": len(new),
+    "delta_pct": delta_pct(new_mean, base_mean),
+    "ci_low_pct": None,
+    "ci_high_pct": None,
+    "regression": None,
+  }
+  if base_var is None or new_var is None or base_mean == 0:
+    return result
+
+  # Welch-Satterthwaite degrees of freedom.
+  base_se, new_se = base_var / len(base), new_var / len(new)
+  se = math.sqrt(base_se + new_se)
+  if se > 0:
+    df = (base_se + new_se) ** 2 / (base_se ** 2 / (len(base) - 1) +
+                                    new_se ** 2 / (len(new) - 1))
+  else:
+    df = len(base) + len(new) - 2
+  margin = t_critical(confidence, df) * se
+  diff = new_mean - base_mean
+  result["ci_low_pct"] = (diff - margin) / abs(base_mean) * 100
+  result["ci_high_pct"] = (diff + margin) / abs(base_mean) * 100
+  if higher_better:
+    result["regression"] = result["ci_high_pct"] < 0 and \
+                           result["delta_pct"] < -threshold
+  else:
+    result["regression"] = result["ci_low_pct"] > 0 and \
+                           result["delta_pct"] > threshold
+  return result
+
+################################## TRANSPORTS ##################################
+
+def bulk_unix(args, workdir, window, drop, delay, seed,
+              client_binary=CTCP_BINARY, server_binary=CTCP_BINARY):
+  """
+  Function: bulk_unix
+  -------------------
+  Transfers a file from a client to a server using the real binary, or the
+  reference binary at either end. Statistics come from the client, so they are
+  None if it is the reference.
+  """
+  infile = input_file(workdir, args.bytes)
+  outfile = os.path.join(workdir, "output")
+  server_err = os.path.join(workdir, "server.err")
+  client_err = os.path.join(workdir, "client.err")
+  client_port, server_port = choose_ports()
+
+  # The server has nothing to send, so it closes its end once the client has.
+  with open(os.devnull, "rb") as inp, open(outfile, "wb") as out, \
+       open(server_err, "w") as err:
+    server = subprocess.Popen([server_binary, "-s", "-p", server_port,
+                               "-w", str(window)] +
+                              own_flags(server_binary,
+                                        ["--summary"] + args.flags),
+                              stdin=inp, stdout=out, stderr=err)
+  wait_for(lambda: "Server started" in open(server_err).read(),
+           SERVER_START_TIMEOUT)
+
+  client_flags = ["-w", str(window), "--seed", str(seed)]
+  if drop:
+    client_flags += ["--drop", str(drop)]
+  if delay:
+    client_flags += ["--delay", str(delay)]
+  client_flags += own_flags(client_binary, ["--summary"] + args.flags)
+  with open(infile, "rb") as inp, open(os.devnull, "wb") as out, \
+       open(client_err, "w") as err:
+    start = time.time()
+    client = subprocess.Popen([client_binary, "-c", "localhost:" + server_port,
+                               "-p", client_port] + client_flags,
+                              stdin=inp, stdout=out, stderr=err)
+    client_usage = wait_usage(client, client_binary, args.timeout)
+    elapsed = time.time() - start
+  completed = client_usage is not None
+  if not completed:
+    client_usage = stop(client, client_binary)
+
+  # Give the server a moment to write out the last of it.
+  wait_for(lambda: os.path.getsize(outfile) >= args.bytes,
+           SERVER_DRAIN_TIMEOUT if completed else 0)
+  server_usage = stop(server, server_binary)
+
+  stats = read_stats(client_err)
+  delivered = os.path.getsize(outfile)
+  return {
+    "completed": completed and delivered == args.bytes,
+    "verified": delivered == args.bytes and
+                filecmp.cmp(infile, outfile, shallow=False),
+    "delivered": delivered,
+    "elapsed_s": elapsed,
+    "sender_cpu_s": cpu_seconds(client_usage),
+    "receiver_cpu_s": cpu_seconds(server_usage),
+    "sender_rss_kb": getattr(client, "peak_rss_kb", None),
+    "receiver_rss_kb": getattr(server, "peak_rss_kb", None),
+    "stats": stats,
+  }
+
+
+def bulk_sim(args, workdir, window, drop, delay, seed):
+  """
+  Function: bulk_sim
+  ------------------
+  Transfers data from a sender to a receiver in the simulator.
+  """
+  sim = subprocess.Popen([SIM_BINARY, "--bytes", str(args.bytes),
+                          "-w", str(window), "--drop", str(drop),
+                          "--delay", str(delay), "--seed", str(seed)] +
+                         args.sim_flags, stdout=subprocess.PIPE)
+  output = sim.stdout.read()
+  usage = wait_usage(sim, SIM_BINARY)
+  result = json.loads(output.decode("utf-8").splitlines()[-1])
+
+  # Both ends run in the same process.
+  return {
+    "completed": result["completed"],
+    "verified": result["verified"],
+    "delivered": result["delivered"],
+    "elapsed_s": result["virtual_s"],
+    "sender_cpu_s": cpu_seconds(usage),
+    "receiver_cpu_s": 0.0,
+    "sender_rss_kb": result["peak_rss_kb"] if result["peak_rss_kb"] >= 0
+                     else None,
+    "receiver_rss_kb": None,
+    "stats": result["sender"],
+  }
+
+
+TRANSPORT_RUNNERS = {
+  "unix": bulk_unix,
+  "sim": bulk_sim,
+}
+
+################################### COMMANDS ###################################
+
+def bulk(args):
+  """
+  Function: bulk
+  --------------
+  Bulk transfer benchmark. Runs every combination of transport, window size,
+  drop and delay, and reports goodput, retransmissions, CPU time per GB and
+  peak memory use.
+  """
+  workdir = tempfile.mkdtemp(prefix="ctcp-bench-")
+  try:
+    combos = itertools.product(args.transport, args.window, args.drop,
+                               args.delay, range(args.repeat))
+    for transport, window, drop, delay, rep in combos:
+      seed = args.seed + rep
+      run = TRANSPORT_RUNNERS[transport](args, workdir, window, drop, delay,
+                                         seed)
+      result = {
+        "bench": "bulk",
+        "transport": transport,
+        "bytes": args.bytes,
+        "window": window,
+        "drop": drop,
+        "delay": delay,
+        "seed": seed,
+        "flags": " ".join(args.flags) if transport == "unix" else "",
+        "sim_flags": " ".join(args.sim_flags) if transport == "sim" else "",
+      }
+      result.update(bulk_metrics(run))
+      emit(result, args.output)
+  finally:
+    shutil.rmtree(workdir, ignore_errors=True)
+
+
+def bulk_metrics(run):
+  """
+  Function: bulk_metrics
+  ----------------------
+  Works out goodput, CPU time per GB and retransmissions from a bulk transfer.
+  Retransmission figures are None if the sender printed no statistics.
+  """
+  stats = run.pop("stats")
+  elapsed = run["elapsed_s"]
+  cpu = run["sender_cpu_s"] + run["receiver_cpu_s"]
+  result = {
+    "goodput_mbps": run["delivered"] * 8 / elapsed / 1e6
+                    if elapsed > 0 else 0,
+    "cpu_s_per_gb": cpu / (run["delivered"] / 1e9)
+                    if run["delivered"] > 0 else None,
+    "retx_ratio": stats["retx_ratio"] if stats else None,
+    "retransmits": stats["retransmits"] if stats else None,
+    "rto_events": stats["rto_events"] if stats else None,
+    "dup_acks": stats["dup_acks"] if stats else None,
+    "srtt_ms": stats["srtt_ms"] if stats else None,
+  }
+  result.update(run)
+  return result
+
+
+def latency_run(args, workdir, echo, concurrency, window, drop, delay, seed,
+                client_binary=CTCP_BINARY, server_binary=CTCP_BINARY):
+  """
+  Function: latency_run
+  ---------------------
+  Starts an echo server and some clients, and sends requests through each
+  client one at a time, timing how long each takes to come back. Either end
+  may be the reference binary, as long as the server echoes with cat.
+
+  returns: Round-trip times in seconds, the number of requests that did not
+           come back correctly, how long it took, the server, its usage and
+           the CPU time the clients took over the requests.
+  """
+  client_port, server_port = choose_ports(max_port=60000 - MAX_CLIENTS)
+  server_err = os.path.join(workdir, "server.err")
+  impair = []
+  if drop:
+    impair += ["--drop", str(drop)]
+  if delay:
+    impair += ["--delay", str(delay)]
+
+  # Impairment applies to both directions.
+  with open(os.devnull, "rb") as inp, open(os.devnull, "wb") as out, \
+       open(server_err, "w") as err:
+    server = subprocess.Popen([server_binary, "-s", "-p", server_port,
+                               "-w", str(window), "--seed", str(seed)] +
+                              impair + own_flags(server_binary, args.flags) +
+                              ECHO_SERVERS[echo],
+                              stdin=inp, stdout=out, stderr=err)
+  wait_for(lambda: "Server started" in open(server_err).read(),
+           SERVER_START_TIMEOUT)
+
+  clients = []
+  for i in range(concurrency):
+    client_err = os.path.join(workdir, "client-%d.err" % i)
+    with open(client_err, "w") as err:
+      client = subprocess.Popen([client_binary,
+                                 "-c", "localhost:" + server_port,
+                                 "-p", str(int(server_port) + 1 + i),
+                                 "-w", str(window),
+                                 "--seed", str(seed + 1 + i)] +
+                                impair + own_flags(client_binary, args.flags),
+                                stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                                stderr=err)
+    client.err_path = client_err
+    client.sent = 0
+    client.reply = b""
+    clients.append(client)
+  for client in clients:
+    wait_for(lambda: "Connected to server" in open(client.err_path).read(),
+             SERVER_START_TIMEOUT)
+
+  # One outstanding request per client. The first few are not timed.
+  request = os.urandom(args.size)
+  total = args.warmup + args.requests
+  rtts = []
+  errors = 0
+  start = time.time()
+  end = start + args.timeout
+
+  def send(client):
+    client.sent += 1
+    client.reply = b""
+    client.started = time.time()
+    os.write(client.stdin.fileno(), request)
+
+  for client in clients:
+    send(client)
+  waiting = dict((client.stdout.fileno(), client) for client in clients)
+  while waiting and time.time() < end:
+    ready, _, _ = select.select(list(waiting), [], [], end - time.time())
+    for fd in ready:
+      client = waiting[fd]
+      data = os.read(fd, 65536)
+      now = time.time()
+
+      # Client exited.
+      if not data:
+        del waiting[fd]
+        continue
+      client.reply += data
+      if len(client.reply) < len(request):
+        continue
+
+      if client.reply != request:
+        errors += 1
+      elif client.sent > args.warmup:
+        rtts.append(now - client.started)
+      if client.sent < total:
+        send(client)
+      else:
+        del waiting[fd]
+  elapsed = time.time() - start
+
+  # Requests that never came back.
+  for client in waiting.values():
+    errors += total - client.sent + 1
+
+  # CPU time of the clients up to now, leaving out teardown.
+  usages = [proc_usage(client) for client in clients]
+  client_cpu = sum(usage[0] for usage in usages if usage)
+
+  # Closing input ends each connection.
+  for client in clients:
+    client.stdin.close()
+  for client in clients:
+    if wait_usage(client, client_binary, SERVER_DRAIN_TIMEOUT) is None:
+      stop(client, client_binary)
+    client.stdout.close()
+  server_usage = stop(server, server_binary)
+  return rtts, errors, elapsed, server, server_usage, client_cpu
+
+
+def latency(args):
+  """
+  Function: latency
+  -----------------
+  Request/response latency benchmark. Runs every combination of echo server,
+  concurrency, window size, drop and delay, and reports percentiles of the
+  round-trip time of each request.
+  """
+  workdir = tempfile.mkdtemp(prefix="ctcp-bench-")
+  try:
+    combos = itertools.product(args.echo, args.concurrency, args.window,
+                               args.drop, args.delay, range(args.repeat))
+    for echo, concurrency, window, drop, delay, rep in combos:
+      seed = args.seed + rep
+      result = {
+        "bench": "latency",
+        "transport": "unix",
+        "echo": echo,
+        "size": args.size,
+        "concurrency": concurrency,
+        "window": window,
+        "drop": drop,
+        "delay": delay,
+        "seed": seed,
+        "requests": args.requests * concurrency,
+        "flags": " ".join(args.flags),
+      }
+      result.update(latency_metrics(*latency_run(args, workdir, echo,
+                                                 concurrency, window, drop,
+                                                 delay, seed)))
+      emit(result, args.output)
+  finally:
+    shutil.rmtree(workdir, ignore_errors=True)
+
+
+def latency_metrics(rtts, errors, elapsed, server, server_usage, client_cpu):
+  """
+  Function: latency_metrics
+  -------------------------
+  Works out round-trip time percentiles and request rate from a latency run.
+  """
+  rtts.sort()
+  to_us = lambda t: t * 1e6 if t is not None else None
+  return {
+    "completed": len(rtts),
+    "errors": errors,
+    "p50_us": to_us(percentile(rtts, 50)),
+    "p99_us": to_us(percentile(rtts, 99)),
+    "p999_us": to_us(percentile(rtts, 99.9)),
+    "max_us": to_us(rtts[-1] if rtts else None),
+    "mean_us": to_us(sum(rtts) / len(rtts) if rtts else None),
+    "throughput_rps": len(rtts) / elapsed if elapsed > 0 else 0,
+    "elapsed_s": elapsed,
+    "client_cpu_s": client_cpu,
+    "server_cpu_s": cpu_seconds(server_usage),
+    "server_rss_kb": getattr(server, "peak_rss_kb", None),
+  }
+
+
+def delta_pct(value, baseline):
+  """
+  Function: delta_pct
+  -------------------
+  Percentage change from a baseline.
+
+  returns: The change, or None if either is missing or the baseline is 0.
+  """
+  if value is None or baseline is None or baseline == 0:
+    return None
+  return (value - baseline) / baseline * 100
+
+
+def diff(args):
+  """
+  Function: diff
+  --------------
+  Differential benchmark against the reference binary. Runs the same bulk
+  transfer and latency scenarios with each pairing of our binary and the
+  reference as client and server, and prints one line per scenario with the
+  metrics of every pairing side by side, along with the percentage change of
+  each from the baseline pairing. Metrics only our binary reports (such as
+  retransmissions, which come from the sender) are None when the reference
+  has that role.
+  """
+  workdir = tempfile.mkdtemp(prefix="ctcp-bench-")
+  try:
+    combos = itertools.product(args.scenario, args.window, args.drop,
+                               args.delay, range(args.repeat))
+    for scenario, window, drop, delay, rep in combos:
+      seed = args.seed + rep
+      results = {}
+      for pairing in args.pairings:
+        client_binary, server_binary = PAIRINGS[pairing]
+        if scenario == "bulk":
+          run = bulk_metrics(bulk_unix(args, workdir, window, drop, delay,
+                                       seed, client_binary, server_binary))
+        else:
+          run = latency_metrics(*latency_run(args, workdir, "cat",
+                                             args.concurrency, window, drop,
+                                             delay, seed, client_binary,
+                                             server_binary))
+        results[pairing] = dict((metric, run[metric])
+                                for metric in DIFF_METRICS[scenario])
+        results[pairing]["completed"] = run["completed"]
+
+      baseline = results.get(args.baseline, {})
+      emit({
+        "bench": "diff",
+        "scenario": scenario,
+        "transport": "unix",
+        "bytes": args.bytes if scenario == "bulk" else None,
+        "size": args.size if scenario == "latency" else None,
+        "window": window,
+        "drop": drop,
+        "delay": delay,
+        "seed": seed,
+        "baseline": args.baseline,
+        "flags": " ".join(args.flags),
+        "results": results,
+        "delta_pct": dict((pairing, dict(
+                            (metric, delta_pct(values[metric],
+                                               baseline.get(metric)))
+                            for metric in DIFF_METRICS[scenario]))
+                          for pairing, values in results.items()
+                          if pairing != args.baseline),
+      }, args.output)
+  finally:
+    shutil.rmtree(workdir, ignore_errors=True)
+
+
+def scale(args):
+  """
+  Function: scale
+  ---------------
+  Connection scaling benchmark. For each number of connections, starts an echo
+  server and has ctcp_load open that many connections to it, then reports
+  accept latency, per-connection throughput, and the server's CPU time and
+  memory per connection while under load.
+  """
+  workdir = tempfile.mkdtemp(prefix="ctcp-bench-")
+  try:
+    combos = itertools.product(args.connections, args.window,
+                               range(args.repeat))
+    for connections, window, rep in combos:
+      server_err = os.path.join(workdir, "server.err")
+      _, server_port = choose_ports(max_port=65000 - connections)
+      with open(os.devnull, "rb") as inp, open(os.devnull, "wb") as out, \
+           open(server_err, "w") as err:
+        server = subprocess.Popen([CTCP_BINARY, "-s", "-p", server_port,
+                                   "-w", str(window), "--echo",
+                                   "--max-clients", str(connections)] +
+                                  args.flags, stdin=inp, stdout=out, stderr=err)
+      wait_for(lambda: "Server started" in open(server_err).read(),
+               SERVER_START_TIMEOUT)
+      sample_rss(server, CTCP_BINARY)
+      before = proc_usage(server)
+
+      load = subprocess.Popen([LOAD_BINARY, "-c", "localhost:" + server_port,
+                               "-p", str(int(server_port) + 1),
+                               "-n", str(connections), "-w", str(window),
+                               "--size", str(args.size),
+                               "--messages", str(args.messages),
+                               "--arrival-rate", str(args.arrival_rate),
+                               "--message-rate", str(args.message_rate),
+                               "--time-limit", str(args.timeout)],
+                              stdout=subprocess.PIPE)
+      output = b""
+      while load.poll() is None:
+        sample_rss(server, CTCP_BINARY)
+        time.sleep(0.01)
+      output = load.stdout.read()
+      after = proc_usage(server)
+      stop(server, CTCP_BINARY)
+
+      lines = output.decode("utf-8").splitlines()
+      result = json.loads(lines[-1]) if lines else {}
+      peak = getattr(server, "peak_rss_kb", None)
+      result.update({
+        "bench": "scale",
+        "transport": "unix",
+        "window": window,
+        "flags": " ".join(args.flags),
+        "server_cpu_s": after[0] - before[0] if before and after else None,
+        "server_rss_kb": peak,
+        "server_rss_per_conn_kb": (peak - before[1]) / connections
+                                  if peak and before else None,
+      })
+      result["load_cpu_s"] = result.pop("cpu_s", None)
+      result["load_rss_kb"] = result.pop("peak_rss_kb", None)
+      emit(result, args.output)
+  finally:
+    shutil.rmtree(workdir, ignore_errors=True)
+
+
+def fairness(args):
+  """
+  Function: fairness
+  ------------------
+  Multi-flow fairness benchmark. For each number of flows and queue management
+  discipline, runs that many flows through one bottleneck link in the
+  simulator, started one after another, and reports the throughput of each
+  over time, Jain's fairness index, how long they took to converge and the
+  queue occupancy. Windows and retransmission timeouts are handed out to the
+  flows in turn.
+  """
+  combos = itertools.product(args.flows, args.aqm, range(args.repeat))
+  for flows, aqm, rep in combos:
+    seed = args.seed + rep
+    sim = subprocess.Popen([SIM_BINARY, "--flows", str(flows),
+                            "--stagger", str(args.stagger),
+                            "--flow-window", ",".join(map(str, args.window)),
+                            "--flow-rt-timeout",
+                            ",".join(map(str, args.rt_timeout)),
+                            "--bytes", str(args.bytes),
+                            "--rate", str(args.rate),
+                            "--latency", str(args.latency),
+                            "--queue", str(args.queue), "--aqm", aqm,
+                            "--interval", str(args.interval),
+                            "--fair-threshold", str(args.threshold),
+                            "--seed", str(seed)] + args.sim_flags,
+                           stdout=subprocess.PIPE)
+    output = sim.stdout.read()
+    usage = wait_usage(sim, SIM_BINARY)
+    lines = output.decode("utf-8").splitlines()
+    result = {"bench": "fairness", "transport": "sim"}
+    result.update(json.loads(lines[-1]) if lines else {"seed": seed})
+    result.update({
+      "flow_window": ",".join(map(str, args.window)),
+      "flow_rt_timeout": ",".join(map(str, args.rt_timeout)),
+      "fair_threshold": args.threshold,
+      "sim_flags": " ".join(args.sim_flags),
+    })
+    result["cpu_s"] = cpu_seconds(usage)
+    emit(result, args.output)
+
+
+def builds(args):
+  """
+  Function: builds
+  ----------------
+  Compares builds of our binary, e.g. optimized ones against a plain -O2
+  build. Runs the same bulk transfer and latency scenarios with each binary at
+  both ends, taking turns so that drift in the machine affects them alike.
+  Prints one line per scenario and binary, with the mean of each metric and
+  its change from the baseline binary, with a confidence interval.
+  """
+  binaries = [args.baseline] + [b for b in args.binaries if b != args.baseline]
+  for binary in binaries:
+    if not os.access(binary, os.X_OK):
+      sys.stderr.write("Cannot run %s\n" % binary)
+      sys.exit(1)
+
+  workdir = tempfile.mkdtemp(prefix="ctcp-bench-")
+  try:
+    combos = itertools.product(args.scenario, args.window, args.drop,
+                               args.delay)
+    for scenario, window, drop, delay in combos:
+      runs = dict((binary, []) for binary in binaries)
+      for rep in range(args.repeat):
+        seed = args.seed + rep
+        for binary in binaries:
+          if scenario == "bulk":
+            run = bulk_metrics(bulk_unix(args, workdir, window, drop, delay,
+                                         seed, binary, binary))
+          else:
+            run = latency_metrics(*latency_run(args, workdir, "inproc",
+                                               args.concurrency, window, drop,
+                                               delay, seed, binary, binary))
+          runs[binary].append(run)
+
+      for binary in binaries:
+        result = {
+          "bench": "builds",
+          "scenario": scenario,
+          "transport": "unix",
+          "bytes": args.bytes if scenario == "bulk" else None,
+          "size": args.size if scenario == "latency" else None,
+          "window": window,
+          "drop": drop,
+          "delay": delay,
+          "binary": binary,
+          "baseline": args.baseline,
+          "flags": " ".join(args.flags),
+          "runs": len(runs[binary]),
+          "gain": {},
+        }
+        for metric in BUILD_METRICS[scenario]:
+          values = [r[metric] for r in runs[binary] if r[metric] is not None]
+          base = [r[metric] for r in runs[args.baseline]
+                  if r[metric] is not None]
+          result[metric] = sum(values) / len(values) if values else None
+          if binary != args.baseline and values and base:
+            gain = compare_metric(base, values,
+                                  COMPARE_METRICS.get(metric, False),
+                                  args.confidence, 0)
+            result["gain"][metric] = {
+              "delta_pct": gain["delta_pct"],
+              "ci_low_pct": gain["ci_low_pct"],
+              "ci_high_pct": gain["ci_high_pct"],
+            }
+        emit(result, args.output)
+  finally:
+    shutil.rmtree(workdir, ignore_errors=True)
+
+
+def compare(args):
+  """
+  Function: compare
+  -----------------
+  Compares the saved results of a commit with those of a baseline commit, on
+  the same machine. For each configuration run at both and each metric in
+  COMPARE_METRICS, prints one line with the means, the change and its
+  confidence interval, and whether it is a regression. Exits with status 1 if
+  anything regressed.
+  """
+  machine = args.machine or machine_fingerprint(machine_info())
+  baseline = git_commit(args.baseline) or args.baseline
+  commit = git_commit(args.commit) if args.commit else git_commit()
+  commit = commit or args.commit
+  groups = {}
+  for name in [baseline, commit]:
+    groups[name] = load_results(machine, name or "unknown")
+    if groups[name] is None:
+      sys.stderr.write("No results for %s on machine %s in %s\n" %
+                       (name, machine, RESULTS_DIR))
+      sys.exit(1)
+
+  regressions = 0
+  for config in sorted(groups[commit], key=str):
+    if config not in groups[baseline]:
+      continue
+    for metric, higher_better in sorted(COMPARE_METRICS.items()):
+      base = [r[metric] for r in groups[baseline][config]
+              if r.get(metric) is not None]
+      new = [r[metric] for r in groups[commit][config]
+             if r.get(metric) is not None]
+      if not base or not new:
+        continue
+      result = dict((field, value) for field, value in config
+                    if value is not None)
+      result.update({
+        "machine": machine,
+        "baseline": baseline,
+        "commit": commit,
+        "metric": metric,
+        "confidence": args.confidence,
+        "threshold_pct": args.threshold,
+      })
+      result.update(compare_metric(base, new, higher_better, args.confidence,
+                                   args.threshold))
+      regressions += bool(result["regression"])
+      emit(result, args.output)
+
+  if regressions:
+    sys.stderr.write("%d regression(s) from %s to %s\n" %
+                     (regressions, baseline, commit))
+    sys.exit(1)
+
+
+def parse_args():
+  """
+  Function: parse_args
+  --------------------
+  Parses command-line arguments.
+  """
+  parser = argparse.ArgumentParser(
+    description="Benchmarks for cTCP. Prints one line of JSON per run.")
+  commands = parser.add_subparsers(dest="command")
+
+  parser_bulk = commands.add_parser("bulk", help="Bulk transfer throughput")
+  parser_bulk.add_argument("--bytes", type=parse_size, default="4M",
+                           help="Bytes to transfer (K, M, G suffixes)")
+  parser_bulk.add_argument("-w", "--window", type=parse_list, default="1,8",
+                           help="Window sizes, comma-separated")
+  parser_bulk.add_argument("--drop", type=parse_list, default="0",
+                           help="Drop percentages, comma-separated")
+  parser_bulk.add_argument("--delay", type=parse_list, default="0",
+                           help="Delay percentages, comma-separated")
+  parser_bulk.add_argument("--transport", default=",".join(TRANSPORTS),
+                           type=lambda t: parse_list(t, str),
+                           help="Transports, comma-separated (%s)" %
+                                ", ".join(TRANSPORTS))
+  parser_bulk.add_argument("--repeat", type=int, default=1,
+                           help="Runs of each combination, with different "
+                                "seeds")
+  parser_bulk.add_argument("--seed", type=int, default=144,
+                           help="Seed of the first run")
+  parser_bulk.add_argument("--timeout", type=float, default=120,
+                           help="Seconds a real transfer may take")
+  parser_bulk.add_argument("--flags", default="", type=str.split,
+                           help="Extra flags for both ends of the real binary")
+  parser_bulk.add_argument("--sim-flags", default="", type=str.split,
+                           help="Extra flags for the simulator")
+  parser_bulk.set_defaults(func=bulk)
+
+  parser_latency = commands.add_parser("latency",
+                                       help="Request/response latency")
+  parser_latency.add_argument("--size", type=parse_size, default="64",
+                              help="Bytes per request (K, M, G suffixes)")
+  parser_latency.add_argument("--requests", type=int, default=1000,
+                              help="Timed requests per client")
+  parser_latency.add_argument("--warmup", type=int, default=10,
+                              help="Untimed requests per client, sent first")
+  parser_latency.add_argument("--concurrency", type=parse_list, default="1,4",
+                              help="Numbers of clients, comma-separated (at "
+                                   "most %d)" % MAX_CLIENTS)
+  parser_latency.add_argument("--echo", default="inproc",
+                              type=lambda e: parse_list(e, str),
+                              help="Echo servers, comma-separated (%s)" %
+                                   ", ".join(sorted(ECHO_SERVERS)))
+  parser_latency.add_argument("-w", "--window", type=parse_list, default="1",
+                              help="Window sizes, comma-separated")
+  parser_latency.add_argument("--drop", type=parse_list, default="0",
+                              help="Drop percentages, comma-separated")
+  parser_latency.add_argument("--delay", type=parse_list, default="0",
+                              help="Delay percentages, comma-separated")
+  parser_latency.add_argument("--repeat", type=int, default=1,
+                              help="Runs of each combination, with different "
+                                   "seeds")
+  parser_latency.add_argument("--seed", type=int, default=144,
+                              help="Seed of the first run")
+  parser_latency.add_argument("--timeout", type=float, default=60,
+                              help="Seconds a run may take")
+  parser_latency.add_argument("--flags", default="", type=str.split,
+                              help="Extra flags for both ends")
+  parser_latency.set_defaults(func=latency)
+
+  parser_scale = commands.add_parser("scale", help="Connection scaling")
+  parser_scale.add_argument("--connections", type=parse_list,
+                            default="1,10,100",
+                            help="Numbers of connections, comma-separated")
+  parser_scale.add_argument("--size", type=parse_size, default="1K",
+                            help="Bytes per message (K, M, G suffixes)")
+  parser_scale.add_argument("--messages", type=int, default=20,
+                            help="Messages per connection")
+  parser_scale.add_argument("--arrival-rate", type=float, default=0,
+                            help="Connections opened per second (0 for all "
+                                 "at once)")
+  parser_scale.add_argument("--message-rate", type=float, default=0,
+                            help="Messages per second per connection (0 for "
+                                 "back to back)")
+  parser_scale.add_argument("-w", "--window", type=parse_list, default="1",
+                            help="Window sizes, comma-separated")
+  parser_scale.add_argument("--repeat", type=int, default=1,
+                            help="Runs of each combination")
+  parser_scale.add_argument("--timeout", type=float, default=120,
+                            help="Seconds a run may take")
+  parser_scale.add_argument("--flags", default="", type=str.split,
+                            help="Extra flags for the server")
+  parser_scale.set_defaults(func=scale)
+
+  parser_fairness = commands.add_parser("fairness",
+                                        help="Multi-flow fairness")
+  parser_fairness.add_argument("--flows", type=parse_list, default="2,4",
+                               help="Numbers of flows, comma-separated")
+  parser_fairness.add_argument("--stagger", type=int, default=1000,
+                               help="Milliseconds between flow starts")
+  parser_fairness.add_argument("-w", "--window", type=parse_list, default="8",
+                               help="Window of each flow, comma-separated and "
+                                    "handed out in turn")
+  parser_fairness.add_argument("--rt-timeout", type=parse_list, default="200",
+                               help="Retransmission timeout of each flow in "
+                                    "ms, comma-separated and handed out in "
+                                    "turn")
+  parser_fairness.add_argument("--bytes", type=parse_size, default="1M",
+                               help="Bytes each flow transfers (K, M, G "
+                                    "suffixes)")
+  parser_fairness.add_argument("--rate", type=int, default=2000,
+                               help="Bottleneck rate, in kbit/s")
+  parser_fairness.add_argument("--latency", type=float, default=20,
+                               help="One-way latency, in ms")
+  parser_fairness.add_argument("--queue", type=int, default=0,
+                               help="Bottleneck queue limit, in segments (0 "
+                                    "for the default)")
+  parser_fairness.add_argument("--aqm", default="droptail",
+                               type=lambda a: parse_list(a, str),
+                               help="Queue management, comma-separated "
+                                    "(droptail, red, codel)")
+  parser_fairness.add_argument("--interval", type=int, default=500,
+                               help="Sampling interval, in ms")
+  parser_fairness.add_argument("--threshold", type=float, default=0.95,
+                               help="Fairness index that counts as converged")
+  parser_fairness.add_argument("--repeat", type=int, default=1,
+                               help="Runs of each combination, with different "
+                                    "seeds")
+  parser_fairness.add_argument("--seed", type=int, default=144,
+                               help="Seed of the first run")
+  parser_fairness.add_argument("--sim-flags", default="", type=str.split,
+                               help="Extra flags for the simulator")
+  parser_fairness.set_defaults(func=fairness)
+
+  parser_diff = commands.add_parser("diff",
+                                    help="Comparison with the reference binary")
+  parser_diff.add_argument("--scenario", default="bulk,latency",
+                           type=lambda s: parse_list(s, str),
+                           help="Scenarios, comma-separated (%s)" %
+                                ", ".join(sorted(DIFF_METRICS)))
+  parser_diff.add_argument("--pairings", default="ours-ours,ours-ref,"
+                           "ref-ours,ref-ref",
+                           type=lambda p: parse_list(p, str),
+                           help="Client-server pairings, comma-separated (%s)"
+                                % ", ".join(sorted(PAIRINGS)))
+  parser_diff.add_argument("--baseline", default="ref-ref",
+                           help="Pairing the others are compared against")
+  parser_diff.add_argument("--bytes", type=parse_size, default="4M",
+                           help="Bytes per bulk transfer (K, M, G suffixes)")
+  parser_diff.add_argument("--size", type=parse_size, default="64",
+                           help="Bytes per latency request (K, M, G "
+                                "suffixes)")
+  parser_diff.add_argument("--requests", type=int, default=1000,
+                           help="Timed requests per client")
+  parser_diff.add_argument("--warmup", type=int, default=10,
+                           help="Untimed requests per client, sent first")
+  parser_diff.add_argument("--concurrency", type=int, default=1,
+                           help="Latency clients (at most %d)" % MAX_CLIENTS)
+  parser_diff.add_argument("-w", "--window", type=parse_list, default="1",
+                           help="Window sizes, comma-separated")
+  parser_diff.add_argument("--drop", type=parse_list, default="0",
+                           help="Drop percentages, comma-separated")
+  parser_diff.add_argument("--delay", type=parse_list, default="0",
+                           help="Delay percentages, comma-separated")
+  parser_diff.add_argument("--repeat", type=int, default=1,
+                           help="Runs of each combination, with different "
+                                "seeds")
+  parser_diff.add_argument("--seed", type=int, default=144,
+                           help="Seed of the first run")
+  parser_diff.add_argument("--timeout", type=float, default=120,
+                           help="Seconds a run may take")
+  parser_diff.add_argument("--flags", default="", type=str.split,
+                           help="Extra flags for our binary only")
+  parser_diff.set_defaults(func=diff)
+
+  parser_builds = commands.add_parser("builds",
+                                      help="Comparison of builds of ctcp")
+  parser_builds.add_argument("binaries", nargs="+",
+                             help="Binaries to compare with the baseline")
+  parser_builds.add_argument("--baseline", default=CTCP_BINARY,
+                             help="Binary the others are compared against")
+  parser_builds.add_argument("--scenario", default="bulk,latency",
+                             type=lambda s: parse_list(s, str),
+                             help="Scenarios, comma-separated (%s)" %
+                                  ", ".join(sorted(BUILD_METRICS)))
+  parser_builds.add_argument("--bytes", type=parse_size, default="4M",
+                             help="Bytes per bulk transfer (K, M, G "
+                                  "suffixes)")
+  parser_builds.add_argument("--size", type=parse_size, default="64",
+                             help="Bytes per latency request (K, M, G "
+                                  "suffixes)")
+  parser_builds.add_argument("--requests", type=int, default=1000,
+                             help="Timed requests per client")
+  parser_builds.add_argument("--warmup", type=int, default=10,
+                             help="Untimed requests per client, sent first")
+  parser_builds.add_argument("--concurrency", type=int, default=1,
+                             help="Latency clients (at most %d)" %
+                                  MAX_CLIENTS)
+  parser_builds.add_argument("-w", "--window", type=parse_list, default="8",
+                             help="Window sizes, comma-separated")
+  parser_builds.add_argument("--drop", type=parse_list, default="0",
+                             help="Drop percentages, comma-separated")
+  parser_builds.add_argument("--delay", type=parse_list, default="0",
+                             help="Delay percentages, comma-separated")
+  parser_builds.add_argument("--repeat", type=int, default=3,
+                             help="Runs of each binary in each scenario")
+  parser_builds.add_argument("--seed", type=int, default=144,
+                             help="Seed of the first run")
+  parser_builds.add_argument("--confidence", type=int, default=95,
+                             choices=sorted(T_TABLE),
+                             help="Confidence level of the intervals, in "
+                                  "percent")
+  parser_builds.add_argument("--timeout", type=float, default=120,
+                             help="Seconds a run may take")
+  parser_builds.add_argument("--flags", default="", type=str.split,
+                             help="Extra flags for both ends")
+  parser_builds.set_defaults(func=builds)
+
+  parser_compare = commands.add_parser("compare",
+                                       help="Compare saved results")
+  parser_compare.add_argument("baseline",
+                              help="Commit to compare against")
+  parser_compare.add_argument("commit", nargs="?",
+                              help="Commit to compare (default the current "
+                                   "one)")
+  parser_compare.add_argument("--machine",
+                              help="Fingerprint of the machine the results "
+                                   "are from (default this one)")
+  parser_compare.add_argument("--confidence", type=int, default=95,
+                              choices=sorted(T_TABLE),
+                              help="Confidence level of the intervals, in "
+                                   "percent")
+  parser_compare.add_argument("--threshold", type=float, default=5,
+                              help="Smallest change that counts as a "
+                                   "regression, in percent")
+  parser_compare.set_defaults(func=compare)
+
+  for command in [parser_bulk, parser_latency, parser_scale, parser_fairness,
+                  parser_diff]:
+    command.add_argument("--save", action="store_true",
+                         help="Also save results under %s, by commit and "
+                              "machine" % RESULTS_DIR)
+  for command in [parser_bulk, parser_latency, parser_scale, parser_fairness,
+                  parser_diff, parser_builds, parser_compare]:
+    command.add_argument("-o", "--output", type=argparse.FileType("w"),
+                         default=sys.stdout, help="Where to write results")
+
+  args = parser.parse_args()
+  if not getattr(args, "func", None):
+    parser.print_help()
+    sys.exit(1)
+  for transport in getattr(args, "transport", []):
+    if transport not in TRANSPORT_RUNNERS:
+      parser.error("unknown transport: %s" % transport)
+  for echo in getattr(args, "echo", []):
+    if echo not in ECHO_SERVERS:
+      parser.error("unknown echo server: %s" % echo)
+  for scenario in getattr(args, "scenario", []):
+    if scenario not in (BUILD_METRICS if args.func == builds else
+                        DIFF_METRICS):
+      parser.error("unknown scenario: %s" % scenario)
+  for pairing in getattr(args, "pairings", []):
+    if pairing not in PAIRINGS:
+      parser.error("unknown pairing: %s" % pairing)
+  if hasattr(args, "pairings") and args.baseline not in args.pairings:
+    parser.error("baseline must be one of the pairings")
+  counts = getattr(args, "concurrency", [])
+  for concurrency in counts if isinstance(counts, list) else [counts]:
+    if not 1 <= concurrency <= MAX_CLIENTS:
+      parser.error("concurrency must be from 1 to %d" % MAX_CLIENTS)
+  return args
+
+
+if __name__ == "__main__":
+  args = parse_args()
+  os.chdir(os.path.dirname(os.path.abspath(__file__)))
+  if getattr(args, "save", False):
+    store = open_store()
+  args.func(args)
@@ -0,0 +1,112 @@
+#include <stdbool.h>
+
+#include "ctcp_alloc.h"
+
+#ifndef CTCP_NO_ALLOC_STATS
+
+/** Counts for one site. */
+typedef struct {
+  uint64_t allocs;              /* Allocations */
+  uint64_t bytes;               /* Bytes allocated */
+  uint64_t live;                /* Objects neither freed nor handed on */
+  uint64_t live_bytes;          /* Bytes in them */
+  uint64_t max_live;            /* Most objects live at once */
+  uint64_t max_live_bytes;      /* Most bytes live at once */
+} alloc_stats_t;
+
+/** Counts for each site. The thread that sends resets allocates too, so they
+    are updated atomically. */
+static alloc_stats_t alloc_stats[NUM_ALLOC_SITES];
+
+/** Names of the sites, as printed. */
+static const char *site_names[NUM_ALLOC_SITES] = {
+  "convert_to_ctcp", "conn_send", "create_datagram", "cksum_tcp",
+  "ll_create_node", "conn_output", "conn_inject", "tcp_new_connection"
+};
+
+
+/**
+ * Raises a high-water mark. Another thread may raise it at the same time, so
+ * only ever raises it.
+ */
+static void alloc_raise(uint64_t *max, uint64_t value) {
+  uint64_t old = __atomic_load_n(max, __ATOMIC_RELAXED);
+  while (value > old &&
+         !__atomic_compare_exchange_n(max, &old, value, true, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED))
+    ;
+}
+
+/**
+ * Counts an allocation.
+ */
+static void alloc_count(enum alloc_site site, size_t size) {
+  alloc_stats_t *stats = &alloc_stats[site];
+  __atomic_add_fetch(&stats->allocs, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stats->bytes, size, __ATOMIC_RELAXED);
+  alloc_raise(&stats->max_live,
+              __atomic_add_fetch(&stats->live, 1, __ATOMIC_RELAXED));
+  alloc_raise(&stats->max_live_bytes,
+              __atomic_add_fetch(&stats->live_bytes, size, __ATOMIC_RELAXED));
+}
+
+void *tagged_calloc(enum alloc_site site, size_t size) {
+  alloc_count(site, size);
+  return calloc(size, 1);
+}
+
+void *tagged_malloc(enum alloc_site site, size_t size) {
+  alloc_count(site, size);
+  return malloc(size);
+}
+
+void tagged_free(enum alloc_site site, void *ptr, size_t size) {
+  if (ptr == NULL)
+    return;
+  tagged_release(site, size);
+  free(ptr);
+}
+
+void tagged_release(enum alloc_site site, size_t size) {
+  alloc_stats_t *stats = &alloc_stats[site];
+  __atomic_sub_fetch(&stats->live, 1, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&stats->live_bytes, size, __ATOMIC_RELAXED);
+}
+
+uint64_t alloc_total(void) {
+  uint64_t total = 0;
+  int i;
+  for (i = 0; i < NUM_ALLOC_SITES; i++)
+    total += __atomic_load_n(&alloc_stats[i].allocs, __ATOMIC_RELAXED);
+  return total;
+}
+
+void alloc_print_json(FILE *file) {
+  fprintf(file, "{");
+  int i;
+  for (i = 0; i < NUM_ALLOC_SITES; i++) {
+    alloc_stats_t stats = alloc_stats[i];
+    fprintf(file, "%s\"%s\": {\"allocs\": %llu, \"bytes\": %llu, "
+            "\"live\": %llu, \"live_bytes\": %llu, \"max_live\": %llu, "
+            "\"max_live_bytes\": %llu}", i > 0 ? ", " : "", site_names[i],
+            (unsigned long long) stats.allocs,
+            (unsigned long long) stats.bytes,
+            (unsigned long long) stats.live,
+            (unsigned long long) stats.live_bytes,
+            (unsigned long long) stats.max_live,
+            (unsigned long long) stats.max_live_bytes);
+  }
+  fprintf(file, "}");
+}
+
+#else
+
+uint64_t alloc_total(void) {
+  return 0;
+}
+
+void alloc_print_json(FILE *file) {
+  fprintf(file, "null");
+}
+
+#endif
@@ -0,0 +1,94 @@
+/******************************************************************************
+ * ctcp_alloc.h
+ * ------------
+ * Allocation counts for the library's data path. Each place that allocates
+ * memory for every segment, datagram or chunk of output tags its allocations
+ * with where they come from, and for each of those this keeps count of the
+ * allocations, the bytes allocated, the objects still live and the most there
+ * have been at once.
+ *
+ * An object stops being live when it is freed, or when it is handed to code
+ * that frees it itself (tagged_release()), such as a segment passed on to
+ * ctcp_receive() or the impairments. So "live" is what each place is holding
+ * on to, not everything it ever allocated that has not been freed yet.
+ *
+ * Built with -DCTCP_NO_ALLOC_STATS (as make release does), the tagged
+ * functions are plain calloc(), malloc() and free(), and nothing is counted.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_ALLOC_H
+#define CTCP_ALLOC_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/** Where memory is allocated. */
+enum alloc_site {
+  ALLOC_CONVERT_TO_CTCP,        /* Segments received, by convert_to_ctcp() */
+  ALLOC_CONN_SEND,              /* Copies of segments sent, and segments held
+                                   back by pacing, by conn_send() */
+  ALLOC_CREATE_DATAGRAM,        /* Datagrams, by create_datagram() */
+  ALLOC_CKSUM_TCP,              /* Pseudo-headers, by cksum_tcp() */
+  ALLOC_LL_NODE,                /* Linked list nodes, by ll_create_node() */
+  ALLOC_CONN_OUTPUT,            /* Output waiting to be written, by
+                                   conn_output() */
+  ALLOC_CONN_INJECT,            /* Input waiting to be read, by
+                                   conn_inject() */
+  ALLOC_NEW_CONNECTION,         /* Connections and their configuration, by
+                                   tcp_new_connection() */
+  NUM_ALLOC_SITES
+};
+
+#ifndef CTCP_NO_ALLOC_STATS
+
+/**
+ * calloc() and malloc(), counted towards a site.
+ *
+ * site: Where the memory is allocated.
+ * size: Bytes to allocate.
+ */
+void *tagged_calloc(enum alloc_site site, size_t size);
+void *tagged_malloc(enum alloc_site site, size_t size);
+
+/**
+ * free(), for memory allocated by tagged_calloc() or tagged_malloc().
+ *
+ * site: Where the memory was allocated.
+ * ptr: The memory. Nothing happens if it is NULL.
+ * size: Bytes that were allocated.
+ */
+void tagged_free(enum alloc_site site, void *ptr, size_t size);
+
+/**
+ * Stops counting memory as live without freeing it, once it is handed to code
+ * that frees it itself.
+ *
+ * site: Where the memory was allocated.
+ * size: Bytes that were allocated.
+ */
+void tagged_release(enum alloc_site site, size_t size);
+
+#else
+
+#define tagged_calloc(site, size) calloc(size, 1)
+#define tagged_malloc(site, size) malloc(size)
+#define tagged_free(site, ptr, size) free(ptr)
+#define tagged_release(site, size) do {} while (0)
+
+#endif
+
+/**
+ * Returns the number of allocations counted so far, from every site. Always 0
+ * when built with -DCTCP_NO_ALLOC_STATS.
+ */
+uint64_t alloc_total(void);
+
+/**
+ * Prints the counts of each site as a single JSON object, without a trailing
+ * newline. Prints null when built with -DCTCP_NO_ALLOC_STATS.
+ */
+void alloc_print_json(FILE *file);
+
+#endif /* CTCP_ALLOC_H */
@@ -0,0 +1,511 @@
+#!/usr/bin/env python
+"""
+ctcp_analyze.py
+---------------
+Offline analysis of the segment logs of one run. Takes the logs written by
+ctcp -l on either or both ends, as binary traces (<timestamp>-<port>.trace) or
+as tab-separated logs (from ctcp_trace2csv, or older <timestamp>-<port>.csv
+files), and prints one line of JSON for each direction data went in on each
+connection:
+
+  ./ctcp_analyze.py 1445000000-9999.trace 1445000002-12345.trace
+
+Each line has a summary (goodput, RTT, retransmissions, spurious
+retransmissions, reordering and idle gaps) and, unless --no-series is given,
+time series to plot: goodput per interval and every RTT sample.
+
+Which numbers can be worked out depends on which logs are given:
+  - The sender's log gives RTT samples (data segments matched to the first
+    ACK that covers them, leaving out retransmitted ones), retransmissions and
+    goodput from the ACKs.
+  - The receiver's log gives reordering (segments sent once that arrive
+    behind later ones) and spurious retransmissions exactly (copies of data
+    that had already arrived). Without it, a retransmission counts as
+    spurious if it is ACKed sooner than the smallest RTT seen.
+Times in the series are seconds since the first segment of the connection,
+on the clock of the host whose log they came from.
+
+Works with both Python 2 and Python 3.
+"""
+
+from __future__ import division, print_function
+
+import argparse
+import bisect
+import collections
+import json
+import os
+import re
+import socket
+import struct
+import sys
+
+# Binary trace format (see ctcp_trace.h).
+TRACE_MAGIC = b"CTCPTRC\0"
+TRACE_VERSION = 1
+TRACE_HEADER = struct.Struct("<8sIIIIQQ")
+TRACE_RECORD = struct.Struct("<qIIHHIIIHHHHB7x80s")
+TRACE_SENT = 0x1
+TRACE_UNIX = 0x2
+
+# Size of a cTCP header (sizeof(ctcp_segment_t)).
+CTCP_HDR_SIZE = 20
+
+# TCP flags. Segments may carry them in either byte order.
+TH_FIN = 0x01
+TH_SYN = 0x02
+TH_ACK = 0x10
+
+# Log names, which end in the port of the host that wrote them.
+LOG_NAME = re.compile(r"\d+-(\d+)\.(csv|trace)$")
+
+# A segment from a log. time is in seconds, and sent is whether the host that
+# wrote the log sent it.
+Segment = collections.namedtuple(
+  "Segment", ["time", "src", "dst", "seqno", "ackno", "data_len", "fin",
+              "window", "sent"])
+
+################################### READING ####################################
+
+def has_flag(flags, flag):
+  """
+  Function: has_flag
+  ------------------
+  Whether a flag is set, in host or network-byte order.
+  """
+  return bool(flags & flag) or bool(flags & (flag << 24))
+
+
+def read_trace(path):
+  """
+  Function: read_trace
+  --------------------
+  Reads a binary trace.
+
+  returns: A list of Segments.
+  """
+  with open(path, "rb") as f:
+    header = TRACE_HEADER.unpack(f.read(TRACE_HEADER.size))
+    if header[0] != TRACE_MAGIC:
+      raise ValueError("%s is not a trace" % path)
+    if header[1] != TRACE_VERSION or header[2] != TRACE_RECORD.size:
+      raise ValueError("%s is version %d of the trace format, not %d" %
+                       (path, header[1], TRACE_VERSION))
+    data = f.read()
+
+  segments = []
+  for offset in range(0, len(data) - TRACE_RECORD.size + 1,
+                      TRACE_RECORD.size):
+    (time, src_ip, dst_ip, src_port, dst_port, seqno, ackno, flags, length,
+     window, _, _, kind, _) = TRACE_RECORD.unpack_from(data, offset)
+    if kind & TRACE_UNIX:
+      src = "localhost:%d" % src_port
+      dst = "localhost:%d" % dst_port
+    else:
+      src = "%s:%d" % (socket.inet_ntoa(struct.pack("<I", src_ip)), src_port)
+      dst = "%s:%d" % (socket.inet_ntoa(struct.pack("<I", dst_ip)), dst_port)
+    segments.append(Segment(time / 1e9, src, dst, seqno, ackno,
+                            max(length - CTCP_HDR_SIZE, 0),
+                            has_flag(flags, TH_FIN), window,
+                            bool(kind & TRACE_SENT)))
+  return segments
+
+
+def read_csv(path):
+  """
+  Function: read_csv
+  ------------------
+  Reads a tab-separated log. Which rows were sent is worked out from the port
+  in the file name, or else from the port that is in every row.
+
+  returns: A list of Segments.
+  """
+  rows = []
+  with open(path) as f:
+    f.readline()
+    for line in f:
+      fields = line.rstrip("\n").split("\t")
+      if len(fields) < 11:
+        continue
+      rows.append(fields)
+
+  match = LOG_NAME.search(os.path.basename(path))
+  if match:
+    port = match.group(1)
+  else:
+    ports = set(rows[0][2:5:2]) if rows else set()
+    for row in rows:
+      ports &= set(row[2:5:2])
+    if len(ports) != 1:
+      raise ValueError("can't tell which host wrote %s" % path)
+    port = ports.pop()
+
+  segments = []
+  for row in rows:
+    flags = row[8].split()
+    segments.append(Segment(int(row[0]) / 1e3, "%s:%s" % (row[1], row[2]),
+                            "%s:%s" % (row[3], row[4]), int(row[5]) & 0xffffffff,
+                            int(row[6]) & 0xffffffff,
+                            max(int(row[7]) - CTCP_HDR_SIZE, 0), "FIN" in flags,
+                            int(row[9]), row[2] == port))
+  return segments
+
+
+def read_log(path):
+  """
+  Function: read_log
+  ------------------
+  Reads a log of either kind.
+
+  returns: A list of Segments.
+  """
+  with open(path, "rb") as f:
+    magic = f.read(len(TRACE_MAGIC))
+  if magic == TRACE_MAGIC:
+    return read_trace(path)
+  return read_csv(path)
+
+################################### ANALYSIS ###################################
+
+def summarize(values):
+  """
+  Function: summarize
+  -------------------
+  Summarizes samples: count, smallest, mean, median, 90th and 99th percentiles
+  and largest.
+  """
+  values = sorted(values)
+  if not values:
+    return {"count": 0}
+
+  def pct(p):
+    return values[min(int(p / 100 * len(values)), len(values) - 1)]
+  return {"count": len(values), "min": values[0],
+          "avg": round(sum(values) / len(values), 3), "p50": pct(50),
+          "p90": pct(90), "p99": pct(99), "max": values[-1]}
+
+
+def seq_end(segment):
+  """
+  Function: seq_end
+  -----------------
+  Sequence number just past a segment's data (and FIN).
+  """
+  return segment.seqno + segment.data_len + (1 if segment.fin else 0)
+
+
+def sender_side(sent, acks):
+  """
+  Function: sender_side
+  ---------------------
+  Works out what the sender's log says about one direction: RTT samples,
+  retransmissions and goodput from the ACKs.
+
+  sent: Data segments sent, in order.
+  acks: Segments received from the other end, in order.
+  returns: A dict of results, and the sequence number ranges retransmitted.
+  """
+  events = [(s.time, 0, s) for s in sent] + [(a.time, 1, a) for a in acks]
+  events.sort(key=lambda e: (e[0], e[1]))
+
+  snd_max = None
+  snd_una = None
+  outstanding = {}              # End sequence number -> (time sent, valid)
+  retransmitted = []            # (seqno, end, time) of each retransmission
+  rtts = []
+  acked = []                    # (time, bytes newly ACKed)
+  for time, is_ack, segment in events:
+    if not is_ack:
+      end = seq_end(segment)
+      if snd_max is None:
+        snd_max = snd_una = segment.seqno
+      if end <= snd_max:
+        retransmitted.append((segment.seqno, end, time))
+        for key in list(outstanding):
+          if key > segment.seqno and key - 1 < end:
+            outstanding[key] = (outstanding[key][0], False)
+        if end in outstanding:
+          outstanding[end] = (outstanding[end][0], False)
+      else:
+        outstanding[end] = (time, segment.seqno >= snd_max)
+        snd_max = end
+      continue
+
+    if snd_una is None or segment.ackno <= snd_una:
+      continue
+    acked.append((time, segment.ackno - snd_una))
+    snd_una = segment.ackno
+    for end in [e for e in outstanding if e <= segment.ackno]:
+      sent_time, valid = outstanding.pop(end)
+      if valid:
+        rtts.append((time, (time - sent_time) * 1e3))
+
+  return {
+    "rtts": rtts,
+    "acked": acked,
+    "retransmits": len(retransmitted),
+    "retransmitted_bytes": sum(end - seq for seq, end, _ in retransmitted),
+  }, retransmitted
+
+
+def receiver_side(received, retransmitted_seqs):
+  """
+  Function: receiver_side
+  -----------------------
+  Works out what the receiver's log says about one direction: copies of data
+  that had already arrived (spurious retransmissions, or duplicates), and
+  reordering.
+
+  received: Data segments received, in order.
+  retransmitted_seqs: Sequence numbers the sender retransmitted, or None if
+                      the sender's log is not there.
+  returns: A dict of results.
+  """
+  seen = set()
+  arrived = []                  # Sorted sequence numbers that have arrived
+  duplicates = 0
+  reordered = 0
+  max_depth = 0
+  max_extent = 0
+  highest = None
+  delivered = []                # (time, new bytes)
+  for segment in received:
+    key = (segment.seqno, seq_end(segment))
+    if key in seen:
+      duplicates += 1
+      continue
+    seen.add(key)
+    delivered.append((segment.time, segment.data_len))
+
+    # Reordering: segments with higher sequence numbers already arrived. A
+    # retransmission filling a hole does not count, if we can tell.
+    resent = retransmitted_seqs is not None and \
+             segment.seqno in retransmitted_seqs
+    if highest is not None and segment.seqno < highest and not resent:
+      depth = len(arrived) - bisect.bisect_right(arrived, segment.seqno)
+      reordered += 1
+      max_depth = max(max_depth, depth)
+      max_extent = max(max_extent, highest - segment.seqno)
+    bisect.insort(arrived, segment.seqno)
+    highest = seq_end(segment) if highest is None else \
+              max(highest, seq_end(segment))
+
+  return {
+    "duplicates": duplicates,
+    "reordered": reordered,
+    "reorder_max_depth": max_depth,
+    "reorder_max_extent_bytes": max_extent,
+    "delivered": delivered,
+  }
+
+
+def goodput_series(points, start, interval):
+  """
+  Function: goodput_series
+  ------------------------
+  Bins (time, bytes) points into intervals.
+
+  returns: A list of [seconds since start, Mbit/s] for each interval.
+  """
+  if not points:
+    return []
+  bins = collections.defaultdict(int)
+  for time, nbytes in points:
+    bins[int((time - start) / interval)] += nbytes
+  return [[round(i * interval, 6), round(bins[i] * 8 / interval / 1e6, 3)]
+          for i in range(max(bins) + 1)]
+
+
+def idle_gaps(times, start, threshold):
+  """
+  Function: idle_gaps
+  -------------------
+  Finds gaps longer than threshold seconds between segments.
+
+  returns: A dict with the number of gaps, their total and longest length in
+           seconds, and a list of [seconds since start, length] of each one.
+  """
+  times = sorted(times)
+  gaps = [[round(a - start, 6), round(b - a, 6)]
+          for a, b in zip(times, times[1:]) if b - a > threshold]
+  return {"count": len(gaps), "total_s": round(sum(g[1] for g in gaps), 6),
+          "longest_s": max([g[1] for g in gaps] or [0]), "gaps": gaps}
+
+
+def analyze_direction(sender, receiver, logs, args):
+  """
+  Function: analyze_direction
+  ---------------------------
+  Analyzes the data sent one way on a connection.
+
+  sender: Endpoint sending the data.
+  receiver: Endpoint receiving it.
+  logs: Segments of the connection from each endpoint's log, by endpoint.
+  returns: A result, or None if no data went this way.
+  """
+  sender_log = logs.get(sender)
+  receiver_log = logs.get(receiver)
+
+  result = {"from": sender, "to": receiver,
+            "logs": sorted(e for e in (sender, receiver) if e in logs)}
+  series = {}
+  retransmitted = None
+  min_rtt = None
+  sender_results = None
+
+  if sender_log:
+    sent = [s for s in sender_log if s.sent and (s.data_len or s.fin)]
+    if not sent:
+      return None
+    acks = [s for s in sender_log if not s.sent]
+    start = sender_log[0].time
+    sender_results, retransmitted = sender_side(sent, acks)
+    rtts = [rtt for _, rtt in sender_results["rtts"]]
+    min_rtt = min(rtts) if rtts else None
+    result["data_segments"] = len(sent)
+    result["retransmits"] = sender_results["retransmits"]
+    result["retransmitted_bytes"] = sender_results["retransmitted_bytes"]
+    result["rtt_ms"] = summarize([round(r, 3) for r in rtts])
+    series["rtt_ms"] = [[round(t - start, 6), round(r, 3)]
+                        for t, r in sender_results["rtts"]]
+
+    acked = sender_results["acked"]
+    data_bytes = sum(n for _, n in acked)
+    duration = (acked[-1][0] - sent[0].time) if acked else 0
+    result["acked_bytes"] = data_bytes
+    result["duration_s"] = round(duration, 6)
+    result["goodput_mbps"] = round(data_bytes * 8 / duration / 1e6, 3) \
+                             if duration > 0 else None
+    series["goodput_mbps"] = goodput_series(acked, start, args.interval)
+
+  if receiver_log:
+    received = [s for s in receiver_log if not s.sent and
+                s.src == sender and (s.data_len or s.fin)]
+    if not received and not sender_log:
+      return None
+    seqs = set(seq for seq, _, _ in retransmitted) \
+           if retransmitted is not None else None
+    receiver_results = receiver_side(received, seqs)
+    result["reordered"] = receiver_results["reordered"]
+    result["reorder_max_depth"] = receiver_results["reorder_max_depth"]
+    result["reorder_max_extent_bytes"] = \
+      receiver_results["reorder_max_extent_bytes"]
+    result["spurious_retransmits"] = receiver_results["duplicates"]
+    result["spurious_method"] = "receiver"
+    if not sender_log:
+      delivered = receiver_results["delivered"]
+      start = receiver_log[0].time
+      data_bytes = sum(n for _, n in delivered)
+      duration = delivered[-1][0] - delivered[0][0] if delivered else 0
+      result["delivered_bytes"] = data_bytes
+      result["duration_s"] = round(duration, 6)
+      result["goodput_mbps"] = round(data_bytes * 8 / duration / 1e6, 3) \
+                               if duration > 0 else None
+      series["goodput_mbps"] = goodput_series(delivered, start, args.interval)
+  else:
+    result["reordered"] = None
+    result["spurious_retransmits"] = spurious_from_acks(
+      retransmitted, [s for s in sender_log if not s.sent], min_rtt)
+    result["spurious_method"] = "ack_timing"
+
+  log = sender_log or receiver_log
+  result["idle"] = idle_gaps([s.time for s in log], log[0].time,
+                             args.idle / 1e3)
+  if args.no_series:
+    del result["idle"]["gaps"]
+  else:
+    result["series"] = series
+  return result
+
+
+def spurious_from_acks(retransmitted, acks, min_rtt):
+  """
+  Function: spurious_from_acks
+  ----------------------------
+  Guesses how many retransmissions were spurious from the sender's log alone:
+  those ACKed sooner after being sent than the smallest RTT, so the ACK must
+  have been for an earlier copy.
+
+  returns: The number of spurious retransmissions, or None if there are no RTT
+           samples to go by.
+  """
+  if min_rtt is None:
+    return None
+  ack_times = [a.time for a in acks]
+  count = 0
+  for seq, end, time in retransmitted:
+    i = bisect.bisect_left(ack_times, time)
+    while i < len(acks) and acks[i].ackno < end:
+      i += 1
+    if i < len(acks) and (acks[i].time - time) * 1e3 < min_rtt:
+      count += 1
+  return count
+
+
+def analyze(paths, args):
+  """
+  Function: analyze
+  -----------------
+  Reads logs, groups their segments by connection, and analyzes each
+  direction of each connection.
+
+  returns: A list of results.
+  """
+  # Segments of each connection, by the endpoint whose log they came from.
+  connections = collections.OrderedDict()
+  for path in paths:
+    for segment in read_log(path):
+      local, remote = (segment.src, segment.dst) if segment.sent else \
+                      (segment.dst, segment.src)
+      key = tuple(sorted([local, remote]))
+      logs = connections.setdefault(key, {})
+      logs.setdefault(local, []).append(segment)
+
+  results = []
+  for (a, b), logs in connections.items():
+    for segments in logs.values():
+      segments.sort(key=lambda s: s.time)
+    for sender, receiver in [(a, b), (b, a)]:
+      result = analyze_direction(sender, receiver, logs, args)
+      if result is not None:
+        results.append(result)
+  return results
+
+
+def parse_args():
+  """
+  Function: parse_args
+  --------------------
+  Parses command-line arguments.
+  """
+  parser = argparse.ArgumentParser(
+    description="Analyzes the segment logs of a cTCP run. Prints one line of "
+                "JSON for each direction of each connection.")
+  parser.add_argument("logs", nargs="+",
+                      help="Logs (.trace or tab-separated) from one or both "
+                           "ends")
+  parser.add_argument("--interval", type=float, default=100,
+                      help="Length of each goodput interval, in ms")
+  parser.add_argument("--idle", type=float, default=200,
+                      help="Shortest gap between segments that counts as idle, "
+                           "in ms")
+  parser.add_argument("--no-series", action="store_true",
+                      help="Only print the summaries")
+  parser.add_argument("-o", "--output", type=argparse.FileType("w"),
+                      default=sys.stdout, help="Where to write results")
+  args = parser.parse_args()
+  if args.interval <= 0:
+    parser.error("interval must be positive")
+  args.interval /= 1e3
+  return args
+
+
+if __name__ == "__main__":
+  args = parse_args()
+  try:
+    results = analyze(args.logs, args)
+  except (IOError, ValueError, struct.error) as e:
+    sys.stderr.write("[ERROR] %s\n" % e)
+    sys.exit(1)
+  for result in results:
+    args.output.write(json.dumps(result, sort_keys=True) + "\n")
@@ -0,0 +1,233 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ctcp_control.h"
+
+struct control {
+  int socket;                   /* Listening socket */
+  char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+                                /* Where it is */
+  control_fn fn;                /* Handler for commands */
+  void *ctx;                    /* Its context */
+
+  int client;                   /* Client, -1 if none */
+  char line[CONTROL_LINE];      /* Start of the next command */
+  size_t line_len;
+  bool discarding;              /* Whether the command is too long, and the
+                                   rest of it is being thrown away */
+  bool quitting;                /* Whether to hang up once the replies are
+                                   sent */
+
+  char *out;                    /* Replies not sent yet */
+  size_t out_len;
+  size_t out_sent;
+};
+
+
+/**
+ * Makes a file descriptor non-blocking.
+ */
+static int control_async(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * Hangs up on the client.
+ */
+static void control_hang_up(control_t *control) {
+  close(control->client);
+  control->client = -1;
+  control->line_len = 0;
+  control->discarding = false;
+  control->quitting = false;
+  free(control->out);
+  control->out = NULL;
+  control->out_len = control->out_sent = 0;
+}
+
+/**
+ * Queues up a reply.
+ */
+static void control_reply(control_t *control, const char *buf, size_t len) {
+  control->out = realloc(control->out, control->out_len + len);
+  memcpy(control->out + control->out_len, buf, len);
+  control->out_len += len;
+}
+
+/**
+ * Runs a command and queues up its reply.
+ *
+ * control: The control socket.
+ * line: The command, without its newline. Split up in place.
+ * returns: Whether the client asked to hang up.
+ */
+static bool control_run(control_t *control, char *line) {
+  char *argv[CONTROL_ARGS];
+  int argc = 0;
+  char *save = NULL;
+  char *word = strtok_r(line, " \t\r", &save);
+  while (word && argc < CONTROL_ARGS) {
+    argv[argc++] = word;
+    word = strtok_r(NULL, " \t\r", &save);
+  }
+  if (argc == 0)
+    return false;
+  if (strcmp(argv[0], "quit") == 0)
+    return true;
+
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *reply = open_memstream(&buf, &len);
+  const char *error = word ? "too many words" :
+                      control->fn(control->ctx, argc, argv, reply);
+  if (error)
+    fprintf(reply, "ERR %s\n", error);
+  else
+    fprintf(reply, "OK\n");
+  fclose(reply);
+  control_reply(control, buf, len);
+  free(buf);
+  return false;
+}
+
+/**
+ * Reads commands from the client and runs them.
+ */
+static void control_read(control_t *control) {
+  char buf[CONTROL_LINE];
+  ssize_t r = read(control->client, buf, sizeof(buf));
+  if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+    control_hang_up(control);
+    return;
+  }
+
+  ssize_t i;
+  for (i = 0; i < r; i++) {
+    if (buf[i] != '\n') {
+      if (control->line_len < CONTROL_LINE - 1)
+        control->line[control->line_len++] = buf[i];
+      else
+        control->discarding = true;
+      continue;
+    }
+
+    control->line[control->line_len] = '\0';
+    control->line_len = 0;
+    if (control->discarding) {
+      static const char too_long[] = "ERR command too long\n";
+      control_reply(control, too_long, sizeof(too_long) - 1);
+      control->discarding = false;
+    }
+    else if (control_run(control, control->line)) {
+      control->quitting = true;
+      if (control->out == NULL)
+        control_hang_up(control);
+      return;
+    }
+  }
+}
+
+/**
+ * Sends as much of the queued replies as the client will take.
+ */
+static void control_write(control_t *control) {
+  ssize_t w = write(control->client, control->out + control->out_sent,
+                    control->out_len - control->out_sent);
+  if (w < 0) {
+    if (errno != EAGAIN && errno != EINTR)
+      control_hang_up(control);
+    return;
+  }
+  control->out_sent += w;
+  if (control->out_sent == control->out_len) {
+    free(control->out);
+    control->out = NULL;
+    control->out_len = control->out_sent = 0;
+    if (control->quitting)
+      control_hang_up(control);
+  }
+}
+
+
+control_t *control_open(const char *path, control_fn fn, void *ctx) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "[ERROR] Control socket path %s is too long\n", path);
+    return NULL;
+  }
+  strcpy(addr.sun_path, path);
+
+  /* Only replace a socket left behind by an earlier run, never a file. */
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "[ERROR] Could not create control socket %s: not a "
+              "socket\n", path);
+      return NULL;
+    }
+    unlink(path);
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      listen(fd, 4) < 0 || control_async(fd) < 0) {
+    fprintf(stderr, "[ERROR] Could not create control socket %s: %s\n", path,
+            strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return NULL;
+  }
+
+  control_t *control = calloc(sizeof(control_t), 1);
+  control->socket = fd;
+  strcpy(control->path, path);
+  control->fn = fn;
+  control->ctx = ctx;
+  control->client = -1;
+  return control;
+}
+
+void control_poll(control_t *control, struct pollfd *fds) {
+  /* Only one client at a time. The rest wait to be accepted. */
+  fds[0].fd = control->client < 0 ? control->socket : -1;
+  fds[0].events = POLLIN;
+  fds[0].revents = 0;
+
+  fds[1].fd = control->client;
+  fds[1].events = control->out ? POLLOUT : POLLIN;
+  fds[1].revents = 0;
+}
+
+void control_handle(control_t *control, struct pollfd *fds) {
+  if (fds[0].revents & POLLIN) {
+    control->client = accept(control->socket, NULL, NULL);
+    if (control->client >= 0 && control_async(control->client) < 0)
+      control_hang_up(control);
+    return;
+  }
+
+  if (control->client < 0)
+    return;
+  if (fds[1].revents & POLLOUT)
+    control_write(control);
+  else if (fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+    control_read(control);
+}
+
+void control_close(control_t *control) {
+  if (control->client >= 0)
+    control_hang_up(control);
+  close(control->socket);
+  unlink(control->path);
+  free(control);
+}
@@ -0,0 +1,89 @@
+/******************************************************************************
+ * ctcp_control.h
+ * --------------
+ * Control socket (--control). A Unix stream socket that takes commands, one
+ * per line, from one client at a time, and runs off the main loop's poll():
+ *
+ *     $ nc -U /tmp/ctcp.ctl
+ *     list
+ *     localhost:12345 ...
+ *     OK
+ *     set rto 500 12345
+ *     OK
+ *     set nonsense 1
+ *     ERR unknown setting nonsense
+ *
+ * A command is split into words on spaces and tabs, and handed to a handler.
+ * Whatever the handler writes is sent back, followed by a line with "OK", or
+ * "ERR" and a message if the handler failed. "quit" closes the connection.
+ *
+ * Replies are sent without blocking. While one is still going out, no more
+ * commands are read from that client.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_CONTROL_H
+#define CTCP_CONTROL_H
+
+#include <poll.h>
+#include <stdio.h>
+
+/** Number of pollfds the control socket needs: the socket, and its client. */
+#define CONTROL_FDS 2
+
+/** Longest command. */
+#define CONTROL_LINE 1024
+
+/** Most words in a command. */
+#define CONTROL_ARGS 16
+
+/**
+ * Handles a command.
+ *
+ * ctx: Context passed to control_open().
+ * argc: Number of words in the command. At least 1.
+ * argv: The words.
+ * reply: Where to write the reply.
+ * returns: NULL if the command succeeded, or a message saying why not.
+ */
+typedef const char *(*control_fn)(void *ctx, int argc, char *argv[],
+                                  FILE *reply);
+
+typedef struct control control_t;
+
+
+/**
+ * Creates a control socket.
+ *
+ * path: Where to create it. Replaces a socket that is there already, but
+ *       fails if anything else is.
+ * fn: Handler for commands.
+ * ctx: Context to pass to the handler.
+ * returns: The control socket, or NULL if it could not be created.
+ */
+control_t *control_open(const char *path, control_fn fn, void *ctx);
+
+/**
+ * Sets up the pollfds for the control socket, before poll().
+ *
+ * control: The control socket.
+ * fds: CONTROL_FDS pollfds to set up.
+ */
+void control_poll(control_t *control, struct pollfd *fds);
+
+/**
+ * Accepts a client, runs its commands and sends replies, after poll().
+ *
+ * control: The control socket.
+ * fds: The pollfds set up by control_poll().
+ */
+void control_handle(control_t *control, struct pollfd *fds);
+
+/**
+ * Closes the control socket and removes it.
+ *
+ * control: The control socket. Freed.
+ */
+void control_close(control_t *control);
+
+#endif /* CTCP_CONTROL_H */
@@ -0,0 +1,66 @@
+/******************************************************************************
+ * ctcp_cycles.h
+ * -------------
+ * Cheap cycle counter for timing short stretches of code. On x86 this reads
+ * the time-stamp counter, which ticks at a constant rate on anything recent
+ * (so it counts reference cycles, not core cycles if the clock is scaled).
+ * Elsewhere it falls back to a monotonic clock in nanoseconds, and
+ * cycles_per_ns() is 1.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_CYCLES_H
+#define CTCP_CYCLES_H
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLE_COUNTER 1
+#else
+#define HAVE_CYCLE_COUNTER 0
+#endif
+
+/**
+ * Returns nanoseconds from a monotonic clock.
+ */
+static inline uint64_t cycles_clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Returns the current cycle count. Only differences between two counts mean
+ * anything.
+ */
+static inline uint64_t cycles_now(void) {
+#if HAVE_CYCLE_COUNTER
+  return __rdtsc();
+#else
+  return cycles_clock_ns();
+#endif
+}
+
+/**
+ * Works out how many cycles go by per nanosecond, by watching the counter
+ * against the monotonic clock for a while.
+ *
+ * ms: How long to watch for, in milliseconds.
+ */
+static inline double cycles_per_ns(unsigned ms) {
+#if HAVE_CYCLE_COUNTER
+  uint64_t start_ns = cycles_clock_ns(), start = cycles_now();
+  uint64_t end_ns;
+  do {
+    end_ns = cycles_clock_ns();
+  } while (end_ns - start_ns < ms * 1000000ULL);
+  return (double) (cycles_now() - start) / (end_ns - start_ns);
+#else
+  (void) ms;
+  return 1;
+#endif
+}
+
+#endif /* CTCP_CYCLES_H */
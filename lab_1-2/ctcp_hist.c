@@ -0,0 +1,124 @@
+#include <stdbool.h>
+
+#include "ctcp_hist.h"
+
+/** Percentiles printed by hist_print_json(). */
+static const double hist_fractions[] = { 0.5, 0.9, 0.99, 0.999 };
+static const char *hist_fraction_names[] = { "p50", "p90", "p99", "p999" };
+
+
+/**
+ * Finds the bucket a value goes in. Values below HIST_SUB_BUCKETS get one
+ * bucket each. After that, the top HIST_SUB_BITS + 1 bits of a value pick
+ * its bucket.
+ */
+static int hist_index(uint64_t us) {
+  if (us < HIST_SUB_BUCKETS)
+    return us;
+  int top = 63 - __builtin_clzll(us);
+  if (top >= HIST_SUB_BITS + HIST_OCTAVES)
+    return HIST_BUCKETS - 1;
+  int shift = top - HIST_SUB_BITS;
+  return (shift + 1) * HIST_SUB_BUCKETS +
+         ((us >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+/**
+ * Lowest value in a bucket.
+ */
+static uint32_t hist_low(int index) {
+  if (index < HIST_SUB_BUCKETS)
+    return index;
+  int shift = index / HIST_SUB_BUCKETS - 1;
+  return (uint32_t) (HIST_SUB_BUCKETS + index % HIST_SUB_BUCKETS) << shift;
+}
+
+/**
+ * Highest value in a bucket.
+ */
+static uint32_t hist_high(int index) {
+  if (index < HIST_SUB_BUCKETS)
+    return index;
+  int shift = index / HIST_SUB_BUCKETS - 1;
+  return hist_low(index) + (1u << shift) - 1;
+}
+
+
+void hist_record(hist_t *hist, int64_t ns) {
+  uint64_t us = ns > 0 ? ns / 1000 : 0;
+  if (us > UINT32_MAX)
+    us = UINT32_MAX;
+  if (hist->count == 0 || us < hist->min)
+    hist->min = us;
+  if (us > hist->max)
+    hist->max = us;
+  hist->count++;
+  hist->sum += us;
+  hist->buckets[hist_index(us)]++;
+}
+
+void hist_merge(hist_t *into, const hist_t *from) {
+  if (from->count == 0)
+    return;
+  if (into->count == 0 || from->min < into->min)
+    into->min = from->min;
+  if (from->max > into->max)
+    into->max = from->max;
+  into->count += from->count;
+  into->sum += from->sum;
+
+  int i;
+  for (i = 0; i < HIST_BUCKETS; i++)
+    into->buckets[i] += from->buckets[i];
+}
+
+uint32_t hist_percentile(const hist_t *hist, double fraction) {
+  if (hist->count == 0)
+    return 0;
+
+  /* The value ranked at least as high as the fraction, counting from 1. */
+  uint64_t rank = fraction * hist->count + 0.5;
+  if (rank < 1)
+    rank = 1;
+
+  uint64_t seen = 0;
+  int i;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen >= rank)
+      break;
+  }
+  if (i == HIST_BUCKETS)
+    return hist->max;
+
+  /* Every value in the bucket is as good as its highest one, but no value
+     was outside [min, max]. */
+  uint32_t value = hist_high(i);
+  if (value > hist->max)
+    value = hist->max;
+  if (value < hist->min)
+    value = hist->min;
+  return value;
+}
+
+void hist_print_json(const hist_t *hist, FILE *file) {
+  fprintf(file, "{\"count\": %llu, \"min_ms\": %.3f, \"mean_ms\": %.3f, ",
+          (unsigned long long) hist->count, hist->min / 1e3,
+          hist->count > 0 ? hist->sum / 1e3 / hist->count : 0);
+  size_t i;
+  for (i = 0; i < sizeof(hist_fractions) / sizeof(hist_fractions[0]); i++) {
+    fprintf(file, "\"%s_ms\": %.3f, ", hist_fraction_names[i],
+            hist_percentile(hist, hist_fractions[i]) / 1e3);
+  }
+  fprintf(file, "\"max_ms\": %.3f, \"buckets\": [", hist->max / 1e3);
+
+  bool first = true;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    if (hist->buckets[i] == 0)
+      continue;
+    fprintf(file, "%s[%u, %u]", first ? "" : ", ", hist_low(i),
+            hist->buckets[i]);
+    first = false;
+  }
+  fprintf(file, "]}");
+}
@@ -0,0 +1,73 @@
+/******************************************************************************
+ * ctcp_hist.h
+ * -----------
+ * Latency histograms in the style of HdrHistogram. Buckets are log-linear:
+ * every power of two is split into HIST_SUB_BUCKETS equal buckets, so a value
+ * lands in a bucket no wider than 1/16th of it (about 6%), whatever its size.
+ * Values are kept in microseconds, from 0 up to about 268 seconds. Anything
+ * larger goes in the last bucket.
+ *
+ * Recording a value is a few shifts and an increment. A histogram is plain old
+ * data of a fixed size (about 1.6KB), and two of them can be merged by adding
+ * up their buckets, e.g. to get the RTTs of every connection at once.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_HIST_H
+#define CTCP_HIST_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/** Buckets per power of two, and how many powers of two there are. */
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_OCTAVES 24
+#define HIST_BUCKETS ((HIST_OCTAVES + 1) * HIST_SUB_BUCKETS)
+
+/** A histogram. Values are in microseconds. */
+struct hist {
+  uint64_t count;               /* Values recorded */
+  uint64_t sum;                 /* Sum of the values */
+  uint32_t min;                 /* Smallest value */
+  uint32_t max;                 /* Largest value */
+  uint32_t buckets[HIST_BUCKETS];
+};
+typedef struct hist hist_t;
+
+
+/**
+ * Records a value.
+ *
+ * hist: The histogram.
+ * ns: The value, in nanoseconds. Rounded down to microseconds.
+ */
+void hist_record(hist_t *hist, int64_t ns);
+
+/**
+ * Adds the values of one histogram to another.
+ *
+ * into: Histogram to add them to.
+ * from: Histogram to add.
+ */
+void hist_merge(hist_t *into, const hist_t *from);
+
+/**
+ * Finds the value a given fraction of the values are at or below. Only as
+ * precise as the bucket it is in.
+ *
+ * hist: The histogram.
+ * fraction: Fraction of the values, between 0 and 1.
+ * returns: The value, in microseconds, or 0 if there are none.
+ */
+uint32_t hist_percentile(const hist_t *hist, double fraction);
+
+/**
+ * Prints a histogram as a single JSON object, without a trailing newline: the
+ * count, min, mean, max and percentiles in ms, and the buckets that are not
+ * empty as [lowest value in us, count] pairs, so histograms printed out can be
+ * merged later.
+ */
+void hist_print_json(const hist_t *hist, FILE *file);
+
+#endif /* CTCP_HIST_H */
@@ -0,0 +1,163 @@
+#include <stddef.h>
+
+#include "ctcp_impair.h"
+#include "ctcp_utils.h"
+
+/** A segment being held by an impairer. */
+struct delayed {
+  impair_t *impair;         /* Impairer holding the segment */
+  conn_t *conn;             /* Connection the segment belongs to */
+  ctcp_segment_t *segment;  /* The segment */
+  size_t len;               /* Length of the segment */
+};
+typedef struct delayed delayed_t;
+
+impair_t *impair_create(const char *name, impair_config_t *config,
+                        uint64_t seed, sched_t *sched, impair_output_fn output,
+                        void *ctx) {
+  impair_t *impair = calloc(sizeof(impair_t), 1);
+  impair->name = name;
+  impair->config = *config;
+  if (impair->config.max_delay <= 0)
+    impair->config.max_delay = IMPAIR_MAX_DELAY;
+  prng_seed(&impair->prng, seed);
+  impair->sched = sched;
+  impair->output = output;
+  impair->ctx = ctx;
+  return impair;
+}
+
+void impair_destroy(impair_t *impair) {
+  free(impair);
+}
+
+bool impair_enabled(impair_t *impair) {
+  impair_config_t *config = &impair->config;
+  return config->drop || config->corrupt || config->delay ||
+         config->duplicate;
+}
+
+/**
+ * Decides whether a segment gets a particular impairment. In once mode, only
+ * the first segment is impaired, with the first configured impairment.
+ *
+ * impair: The impairer.
+ * percent: Percentage of segments that get this impairment.
+ */
+static bool impair_roll(impair_t *impair, int percent) {
+  if (impair->once) {
+    if (impair->did_once || percent <= 0)
+      return false;
+    impair->did_once = true;
+    return true;
+  }
+  return prng_percent(&impair->prng, percent);
+}
+
+/**
+ * Prints out a segment being impaired, in debug mode.
+ */
+static void impair_debug(impair_t *impair, const char *what,
+                         ctcp_segment_t *segment) {
+  if (impair->debug) {
+    fprintf(stderr, "[DEBUG] %s segment (%s)\n", what, impair->name);
+    print_hdr_ctcp(segment);
+  }
+}
+
+/**
+ * Flips a random bit in a segment. Only bits after the flags are flipped, since
+ * corrupting the flags may cause problems.
+ */
+static void impair_flip_bit(impair_t *impair, ctcp_segment_t *segment,
+                            size_t len) {
+  size_t first = offsetof(ctcp_segment_t, window) * 8;
+  size_t bit = first + prng_below(&impair->prng, (len * 8) - first);
+  ((uint8_t *) segment)[bit / 8] ^= 1 << (bit % 8);
+}
+
+/**
+ * Passes a held segment on once it is due.
+ */
+static void impair_release(void *arg, bool cancelled) {
+  delayed_t *delayed = arg;
+  if (cancelled) {
+    free(delayed->segment);
+  }
+  else {
+    delayed->impair->stats.delivered++;
+    delayed->impair->output(delayed->impair->ctx, delayed->conn,
+                            delayed->segment, delayed->len);
+  }
+  free(delayed);
+}
+
+/**
+ * Delays and corrupts a single copy of a segment, then passes it on.
+ */
+static void impair_copy(impair_t *impair, conn_t *conn,
+                        ctcp_segment_t *segment, size_t len) {
+  bool delay = impair_roll(impair, impair->config.delay);
+  if (impair_roll(impair, impair->config.corrupt)) {
+    impair->stats.corrupted++;
+    impair_debug(impair, "Corrupting", segment);
+    impair_flip_bit(impair, segment, len);
+  }
+
+  if (!delay) {
+    impair->stats.delivered++;
+    impair->output(impair->ctx, conn, segment, len);
+    return;
+  }
+
+  /* Hold on to it for a while. */
+  impair->stats.delayed++;
+  impair_debug(impair, "Delaying", segment);
+  delayed_t *delayed = calloc(sizeof(delayed_t), 1);
+  delayed->impair = impair;
+  delayed->conn = conn;
+  delayed->segment = segment;
+  delayed->len = len;
+  long long hold = prng_below(&impair->prng, impair->config.max_delay + 1);
+  sched_at(impair->sched, current_time_ns() + hold * 1000000, impair_release,
+           delayed, conn);
+}
+
+void impair_segment(impair_t *impair, conn_t *conn, ctcp_segment_t *segment,
+                    size_t len) {
+  impair->stats.segments++;
+
+  /* Nothing to do. Skip the dice rolls. */
+  if (!impair_enabled(impair)) {
+    impair->stats.delivered++;
+    impair->output(impair->ctx, conn, segment, len);
+    return;
+  }
+
+  /* Segment drop. */
+  if (impair_roll(impair, impair->config.drop)) {
+    impair->stats.dropped++;
+    impair_debug(impair, "Dropping", segment);
+    free(segment);
+    return;
+  }
+
+  /* Segment duplication. Each copy is delayed and corrupted independently. */
+  if (impair_roll(impair, impair->config.duplicate)) {
+    impair->stats.duplicated++;
+    impair_debug(impair, "Duplicating", segment);
+    ctcp_segment_t *copy = malloc(len);
+    memcpy(copy, segment, len);
+    impair_copy(impair, conn, copy, len);
+  }
+  impair_copy(impair, conn, segment, len);
+}
+
+void impair_print_stats(impair_t *impair, FILE *file) {
+  impair_stats_t *stats = &impair->stats;
+  fprintf(file, "[INFO] Impairment (%s): %llu segments, %llu dropped, "
+                "%llu corrupted, %llu delayed, %llu duplicated, "
+                "%llu delivered\n",
+          impair->name, stats->segments, stats->dropped, stats->corrupted,
+          stats->delayed, stats->duplicated, stats->delivered);
+}
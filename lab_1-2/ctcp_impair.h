@@ -0,0 +1,117 @@
+/******************************************************************************
+ * ctcp_impair.h
+ * -------------
+ * Network impairment: segment drop, corruption, delay and duplication. An
+ * impairer sits in front of some output function (e.g. the one that actually
+ * puts a segment on the wire) and decides what happens to each segment passed
+ * to it. Delayed segments are held on a scheduler and passed on when they are
+ * due, so impairment never blocks and never forks.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_IMPAIR_H
+#define CTCP_IMPAIR_H
+
+#include "ctcp_prng.h"
+#include "ctcp_sched.h"
+#include "ctcp_sys.h"
+
+/** Maximum time a delayed segment is held for, in milliseconds. */
+#define IMPAIR_MAX_DELAY 4000
+
+/** Impairment settings. Each is a percentage of segments. */
+struct impair_config {
+  int drop;                 /* Segments dropped */
+  int corrupt;              /* Segments with a bit flipped */
+  int delay;                /* Segments held for up to max_delay ms */
+  int duplicate;            /* Segments sent twice */
+  int max_delay;            /* Maximum delay, in milliseconds */
+};
+typedef struct impair_config impair_config_t;
+
+/** Impairment statistics. */
+struct impair_stats {
+  unsigned long long segments;    /* Segments passed in */
+  unsigned long long dropped;     /* Segments dropped */
+  unsigned long long corrupted;   /* Segments corrupted */
+  unsigned long long delayed;     /* Segments delayed */
+  unsigned long long duplicated;  /* Segments duplicated */
+  unsigned long long delivered;   /* Segments passed on to the output */
+};
+typedef struct impair_stats impair_stats_t;
+
+/**
+ * Output of an impairer. Takes ownership of the segment and must free it.
+ *
+ * ctx: Context given to impair_create().
+ * conn: Connection the segment belongs to.
+ * segment: The segment.
+ * len: Length of the segment, including headers.
+ */
+typedef void (*impair_output_fn)(void *ctx, conn_t *conn,
+                                 ctcp_segment_t *segment, size_t len);
+
+/** An impairer. */
+struct impair {
+  const char *name;         /* Name, used when printing statistics */
+  impair_config_t config;   /* Settings */
+  prng_t prng;              /* Random number generator */
+  sched_t *sched;           /* Scheduler to hold delayed segments on */
+  impair_output_fn output;  /* Where segments go after impairment */
+  void *ctx;                /* Context for output */
+
+  bool once;                /* Only impair the first segment, always (used by
+                               the tester) */
+  bool did_once;            /* Whether that segment has been impaired */
+  bool debug;               /* Print out each impaired segment */
+
+  impair_stats_t stats;     /* Statistics */
+};
+typedef struct impair impair_t;
+
+
+/**
+ * Creates an impairer. This must be freed later with impair_destroy(), after
+ * the scheduler has been destroyed (which drops any delayed segments).
+ *
+ * name: Name of the impairer (e.g. the direction it impairs).
+ * config: Settings.
+ * seed: Seed for the random number generator.
+ * sched: Scheduler to hold delayed segments on.
+ * output: Where segments go after impairment.
+ * ctx: Context for output.
+ * returns: The new impairer.
+ */
+impair_t *impair_create(const char *name, impair_config_t *config,
+                        uint64_t seed, sched_t *sched, impair_output_fn output,
+                        void *ctx);
+
+/**
+ * Destroys an impairer.
+ */
+void impair_destroy(impair_t *impair);
+
+/**
+ * Whether or not an impairer does anything at all.
+ */
+bool impair_enabled(impair_t *impair);
+
+/**
+ * Passes a segment through an impairer. Takes ownership of the segment, which
+ * must have been allocated with malloc().
+ *
+ * impair: The impairer.
+ * conn: Connection the segment belongs to. Delayed segments are owned by it on
+ *       the scheduler, so can be cancelled when it goes away.
+ * segment: The segment.
+ * len: Length of the segment, including headers.
+ */
+void impair_segment(impair_t *impair, conn_t *conn, ctcp_segment_t *segment,
+                    size_t len);
+
+/**
+ * Prints impairment statistics on one line.
+ */
+void impair_print_stats(impair_t *impair, FILE *file);
+
+#endif /* CTCP_IMPAIR_H */
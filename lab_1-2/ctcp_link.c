@@ -0,0 +1,404 @@
+#include <math.h>
+
+#include "ctcp.h"
+#include "ctcp_link.h"
+#include "ctcp_utils.h"
+
+/** RED averaging weight and drop probability at the maximum threshold. */
+#define LINK_RED_WEIGHT 0.002
+#define LINK_RED_MAX_P 0.1
+
+#define NS_PER_MS 1000000LL
+
+link_t *link_create(const char *name, link_config_t *config, uint64_t seed,
+                    sched_t *sched, impair_output_fn output, void *ctx) {
+  link_t *link = calloc(sizeof(link_t), 1);
+  link->name = name;
+  link->config = *config;
+  if (link->config.queue <= 0)
+    link->config.queue = LINK_QUEUE;
+  if (link->config.codel_target <= 0)
+    link->config.codel_target = LINK_CODEL_TARGET;
+  if (link->config.codel_interval <= 0)
+    link->config.codel_interval = LINK_CODEL_INTERVAL;
+  prng_seed(&link->prng, seed);
+  link->sched = sched;
+  link->output = output;
+  link->ctx = ctx;
+  link->red_count = -1;
+  link->idle_since = current_time_ns();
+  return link;
+}
+
+void link_destroy(link_t *link) {
+  link_packet_t *pkt = link->head;
+  while (pkt != NULL) {
+    link_packet_t *next = pkt->next;
+    free(pkt->segment);
+    free(pkt);
+    pkt = next;
+  }
+  if (link->sending != NULL) {
+    free(link->sending->segment);
+    free(link->sending);
+  }
+  free(link);
+}
+
+bool link_enabled(link_t *link) {
+  link_config_t *config = &link->config;
+  return config->rate > 0 || config->delay > 0 || config->jitter > 0 ||
+         config->ge_p > 0 || config->ge_loss_good > 0;
+}
+
+/**
+ * Time taken to serialize a segment at the link rate, in nanoseconds.
+ */
+static long long link_tx_time(link_t *link, size_t len) {
+  return (long long) len * 8 * 1000000 / link->config.rate;
+}
+
+/**
+ * Drops a segment on the floor.
+ */
+static void link_drop(link_packet_t *pkt) {
+  if (pkt != NULL) {
+    free(pkt->segment);
+    free(pkt);
+  }
+}
+
+
+////////////////////////////////// PROPAGATION ////////////////////////////////
+
+/**
+ * Passes a segment on once it has arrived at the other end.
+ */
+static void link_arrive(void *arg, bool cancelled) {
+  link_packet_t *pkt = arg;
+  if (cancelled) {
+    link_drop(pkt);
+    return;
+  }
+
+  link_t *link = pkt->link;
+  link->stats.delivered++;
+  link->output(link->ctx, pkt->conn, pkt->segment, pkt->len);
+  free(pkt);
+}
+
+/**
+ * Sends a segment down the wire. It arrives after the propagation delay and
+ * any jitter, but never before the segment sent ahead of it.
+ */
+static void link_propagate(link_t *link, link_packet_t *pkt) {
+  long long now = current_time_ns();
+  long long arrival = now + (long long) (link->config.delay * NS_PER_MS);
+  if (link->config.jitter > 0)
+    arrival += (long long) (prng_double(&link->prng) * link->config.jitter *
+                            NS_PER_MS);
+  if (arrival < link->last_arrival)
+    arrival = link->last_arrival;
+  link->last_arrival = arrival;
+
+  if (arrival <= now)
+    link_arrive(pkt, false);
+  else
+    sched_at(link->sched, arrival, link_arrive, pkt, pkt->conn);
+}
+
+
+///////////////////////////////////// QUEUE ///////////////////////////////////
+
+/**
+ * Takes the segment at the head of the queue.
+ */
+static link_packet_t *link_pop(link_t *link) {
+  link_packet_t *pkt = link->head;
+  if (pkt != NULL) {
+    link->head = pkt->next;
+    if (link->head == NULL)
+      link->tail = NULL;
+    link->length--;
+  }
+  return pkt;
+}
+
+/**
+ * Decides whether RED drops an arriving segment. The average queue length
+ * decays while the queue is idle, as though it had kept sending empty
+ * segments.
+ */
+static bool link_red_drop(link_t *link, long long now) {
+  double min = link->config.queue / 4.0;
+  if (min < 1)
+    min = 1;
+  double max = min * 3;
+
+  if (link->length == 0 && link->sending == NULL) {
+    double idle = (double) (now - link->idle_since) /
+      link_tx_time(link, sizeof(ctcp_segment_t) + MAX_SEG_DATA_SIZE);
+    link->red_avg *= pow(1 - LINK_RED_WEIGHT, idle);
+  }
+  else {
+    link->red_avg += LINK_RED_WEIGHT * (link->length - link->red_avg);
+  }
+
+  if (link->red_avg < min) {
+    link->red_count = -1;
+    return false;
+  }
+  if (link->red_avg >= max) {
+    link->red_count = 0;
+    return true;
+  }
+
+  /* Spread early drops out evenly. */
+  link->red_count++;
+  double pb = LINK_RED_MAX_P * (link->red_avg - min) / (max - min);
+  double pa = link->red_count * pb >= 1 ? 1 : pb / (1 - link->red_count * pb);
+  if (prng_double(&link->prng) < pa) {
+    link->red_count = 0;
+    return true;
+  }
+  return false;
+}
+
+/**
+ * CoDel's control law: drops get closer together the longer the queue stays
+ * above target.
+ */
+static long long link_codel_next(link_t *link, long long t) {
+  return t + (long long) (link->config.codel_interval * NS_PER_MS /
+                          sqrt(link->codel_count));
+}
+
+/**
+ * Takes the segment at the head of the queue, noting whether its sojourn time
+ * has been above target for at least an interval (see RFC 8289).
+ */
+static link_packet_t *link_codel_pop(link_t *link, long long now,
+                                     bool *ok_to_drop) {
+  link_packet_t *pkt = link_pop(link);
+  *ok_to_drop = false;
+  if (pkt == NULL) {
+    link->codel_above = 0;
+    return NULL;
+  }
+
+  long long sojourn = now - pkt->enqueued;
+  if (sojourn < link->config.codel_target * NS_PER_MS || link->length == 0) {
+    link->codel_above = 0;
+  }
+  else if (link->codel_above == 0) {
+    link->codel_above = now + link->config.codel_interval * NS_PER_MS;
+  }
+  else if (now >= link->codel_above) {
+    *ok_to_drop = true;
+  }
+  return pkt;
+}
+
+/**
+ * Takes the next segment to send off the queue under CoDel, dropping from the
+ * head of the queue as needed.
+ */
+static link_packet_t *link_codel_dequeue(link_t *link, long long now) {
+  bool ok_to_drop;
+  link_packet_t *pkt = link_codel_pop(link, now, &ok_to_drop);
+  if (pkt == NULL) {
+    link->codel_dropping = false;
+    return NULL;
+  }
+
+  if (link->codel_dropping) {
+    if (!ok_to_drop)
+      link->codel_dropping = false;
+    while (link->codel_dropping && now >= link->codel_next) {
+      link->stats.aqm_drops++;
+      link_drop(pkt);
+      link->codel_count++;
+      pkt = link_codel_pop(link, now, &ok_to_drop);
+      if (pkt == NULL || !ok_to_drop)
+        link->codel_dropping = false;
+      else
+        link->codel_next = link_codel_next(link, link->codel_next);
+    }
+  }
+  else if (ok_to_drop) {
+    link->stats.aqm_drops++;
+    link_drop(pkt);
+    pkt = link_codel_pop(link, now, &ok_to_drop);
+    link->codel_dropping = true;
+
+    /* Start off near the drop rate that last controlled the queue, if it was
+       recent. */
+    unsigned delta = link->codel_count - link->codel_last;
+    link->codel_count = 1;
+    if (delta > 1 && now - link->codel_next <
+        16 * link->config.codel_interval * NS_PER_MS)
+      link->codel_count = delta;
+    link->codel_next = link_codel_next(link, now);
+    link->codel_last = link->codel_count;
+  }
+  return pkt;
+}
+
+static void link_start(link_t *link);
+
+/**
+ * Called when a segment has been serialized. Sends it down the wire and
+ * starts on the next one.
+ */
+static void link_sent(void *arg, bool cancelled) {
+  link_t *link = arg;
+  if (cancelled)
+    return;
+
+  link_packet_t *pkt = link->sending;
+  link->sending = NULL;
+  if (pkt->segment != NULL)
+    link_propagate(link, pkt);
+  else
+    free(pkt);
+  link_start(link);
+}
+
+/**
+ * Starts serializing the next segment in the queue, if there is one.
+ */
+static void link_start(link_t *link) {
+  long long now = current_time_ns();
+  link_packet_t *pkt = link->config.aqm == LINK_CODEL ?
+    link_codel_dequeue(link, now) : link_pop(link);
+  if (pkt == NULL) {
+    link->idle_since = now;
+    return;
+  }
+
+  long long delay = now - pkt->enqueued;
+  link->stats.serialized++;
+  link->stats.queue_delay += delay;
+  if (delay > link->stats.max_queue_delay)
+    link->stats.max_queue_delay = delay;
+
+  link->sending = pkt;
+  sched_at(link->sched, now + link_tx_time(link, pkt->len), link_sent, link,
+           link);
+}
+
+void link_segment(void *ctx, conn_t *conn, ctcp_segment_t *segment,
+                  size_t len) {
+  link_t *link = ctx;
+  link->stats.segments++;
+  link->stats.bytes += len;
+
+  /* Bursty loss. */
+  link_config_t *config = &link->config;
+  if (config->ge_p > 0 || config->ge_loss_good > 0) {
+    if (link->bad)
+      link->bad = !prng_percent(&link->prng, config->ge_r);
+    else
+      link->bad = prng_percent(&link->prng, config->ge_p);
+    if (prng_percent(&link->prng, link->bad ? config->ge_loss_bad :
+                                              config->ge_loss_good)) {
+      link->stats.lost++;
+      free(segment);
+      return;
+    }
+  }
+
+  link_packet_t *pkt = calloc(sizeof(link_packet_t), 1);
+  pkt->link = link;
+  pkt->conn = conn;
+  pkt->segment = segment;
+  pkt->len = len;
+
+  /* No bottleneck. Straight down the wire. */
+  if (config->rate <= 0) {
+    link_propagate(link, pkt);
+    return;
+  }
+
+  /* Queue it up to be serialized. */
+  long long now = current_time_ns();
+  if (config->aqm == LINK_RED && link_red_drop(link, now)) {
+    link->stats.aqm_drops++;
+    link_drop(pkt);
+    return;
+  }
+  if (link->length >= config->queue) {
+    link->stats.overflows++;
+    link_drop(pkt);
+    return;
+  }
+
+  pkt->enqueued = now;
+  if (link->tail != NULL)
+    link->tail->next = pkt;
+  else
+    link->head = pkt;
+  link->tail = pkt;
+  link->length++;
+  if (link->length > link->stats.max_queue)
+    link->stats.max_queue = link->length;
+
+  if (link->sending == NULL)
+    link_start(link);
+}
+
+void link_cancel(link_t *link, conn_t *conn) {
+  link_packet_t **p = &link->head;
+  link->tail = NULL;
+  while (*p != NULL) {
+    link_packet_t *pkt = *p;
+    if (pkt->conn == conn) {
+      *p = pkt->next;
+      link->length--;
+      link_drop(pkt);
+    }
+    else {
+      link->tail = pkt;
+      p = &pkt->next;
+    }
+  }
+
+  /* Let the segment being serialized finish, but do not deliver it. */
+  if (link->sending != NULL && link->sending->conn == conn) {
+    free(link->sending->segment);
+    link->sending->segment = NULL;
+  }
+}
+
+int link_parse_aqm(const char *name, link_aqm_t *aqm) {
+  if (strcmp(name, "droptail") == 0)
+    *aqm = LINK_DROPTAIL;
+  else if (strcmp(name, "red") == 0)
+    *aqm = LINK_RED;
+  else if (strcmp(name, "codel") == 0)
+    *aqm = LINK_CODEL;
+  else
+    return -1;
+  return 0;
+}
+
+int link_parse_burst(const char *str, link_config_t *config) {
+  config->ge_loss_good = 0;
+  config->ge_loss_bad = 100;
+  if (sscanf(str, "%lf,%lf,%lf,%lf", &config->ge_p, &config->ge_r,
+             &config->ge_loss_good, &config->ge_loss_bad) < 2)
+    return -1;
+  return 0;
+}
+
+void link_print_stats(link_t *link, FILE *file) {
+  link_stats_t *stats = &link->stats;
+  fprintf(file, "[INFO] Link (%s): %llu segments, %llu lost, "
+                "%llu queue overflows, %llu AQM drops, %llu delivered, "
+                "max queue %llu, queue delay %.3f ms avg / %.3f ms max\n",
+          link->name, stats->segments, stats->lost, stats->overflows,
+          stats->aqm_drops, stats->delivered, stats->max_queue,
+          stats->serialized > 0 ?
+            stats->queue_delay / (double) stats->serialized / NS_PER_MS : 0,
+          stats->max_queue_delay / (double) NS_PER_MS);
+}
@@ -0,0 +1,188 @@
+/******************************************************************************
+ * ctcp_link.h
+ * -----------
+ * Bottleneck link emulation. A link serializes segments at a fixed rate out of
+ * a bounded queue, then delivers them after a propagation delay (plus jitter).
+ * The queue is managed with drop-tail, RED or CoDel, and segments may also be
+ * lost in bursts according to a Gilbert-Elliott model. Everything runs off a
+ * scheduler, so a link never blocks.
+ *
+ * A link sits between an impairer and whatever actually puts segments on the
+ * wire, and link_segment() has the same signature as an impairer output:
+ *
+ *     impair -> link_segment() -> link queue -> serialization -> propagation
+ *            -> output
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_LINK_H
+#define CTCP_LINK_H
+
+#include "ctcp_impair.h"
+#include "ctcp_prng.h"
+#include "ctcp_sched.h"
+#include "ctcp_sys.h"
+
+/** Default queue limit, in segments. */
+#define LINK_QUEUE 100
+
+/** Default CoDel target sojourn time and interval, in milliseconds. */
+#define LINK_CODEL_TARGET 5
+#define LINK_CODEL_INTERVAL 100
+
+/** Queue management disciplines. */
+enum link_aqm {
+  LINK_DROPTAIL,            /* Drop arriving segments when the queue is full */
+  LINK_RED,                 /* Random Early Detection */
+  LINK_CODEL                /* Controlled Delay */
+};
+typedef enum link_aqm link_aqm_t;
+
+/** Link settings. */
+struct link_config {
+  long long rate;           /* Rate, in kbit/s (0 for unlimited, no queue) */
+  double delay;             /* Propagation delay, in milliseconds */
+  double jitter;            /* Extra random propagation delay of up to this
+                               many milliseconds. Never reorders */
+  int queue;                /* Queue limit, in segments (0 for LINK_QUEUE) */
+  link_aqm_t aqm;           /* Queue management */
+  double codel_target;      /* CoDel target, in ms (0 for the default) */
+  double codel_interval;    /* CoDel interval, in ms (0 for the default) */
+
+  /* Gilbert-Elliott loss. The link flips between a good and a bad state, and
+     segments are lost with a different probability in each. */
+  double ge_p;              /* Chance of going from good to bad, % */
+  double ge_r;              /* Chance of going from bad to good, % */
+  double ge_loss_good;      /* Loss in the good state, % */
+  double ge_loss_bad;       /* Loss in the bad state, % */
+};
+typedef struct link_config link_config_t;
+
+/** Link statistics. */
+struct link_stats {
+  unsigned long long segments;    /* Segments passed in */
+  unsigned long long bytes;       /* Bytes passed in */
+  unsigned long long lost;        /* Segments lost by Gilbert-Elliott */
+  unsigned long long overflows;   /* Segments dropped with the queue full */
+  unsigned long long aqm_drops;   /* Segments dropped early by RED/CoDel */
+  unsigned long long serialized;  /* Segments taken off the queue and sent */
+  unsigned long long delivered;   /* Segments passed on to the output */
+  unsigned long long max_queue;   /* Most segments ever queued */
+  long long queue_delay;          /* Total time segments spent queued, in ns */
+  long long max_queue_delay;      /* Longest time a segment spent queued */
+};
+typedef struct link_stats link_stats_t;
+
+/** A segment on a link. */
+struct link_packet {
+  struct link_packet *next; /* Next segment in the queue */
+  struct link *link;        /* Link it is on */
+  conn_t *conn;             /* Connection it belongs to */
+  ctcp_segment_t *segment;  /* The segment (NULL if cancelled) */
+  size_t len;               /* Length of the segment */
+  long long enqueued;       /* When it was queued, in ns */
+};
+typedef struct link_packet link_packet_t;
+
+/** An emulated link. */
+struct link {
+  const char *name;         /* Name, used when printing statistics */
+  link_config_t config;     /* Settings */
+  prng_t prng;              /* Random number generator */
+  sched_t *sched;           /* Scheduler to run on */
+  impair_output_fn output;  /* Where segments go once they arrive */
+  void *ctx;                /* Context for output */
+
+  link_packet_t *head;      /* Queue of segments waiting to be serialized */
+  link_packet_t *tail;
+  size_t length;            /* Segments in the queue */
+  link_packet_t *sending;   /* Segment being serialized, if any */
+  long long last_arrival;   /* When the last segment arrives, in ns */
+  bool bad;                 /* Gilbert-Elliott state */
+
+  double red_avg;           /* RED average queue length */
+  int red_count;            /* RED segments since the last early drop */
+  long long idle_since;     /* When the queue went empty, in ns */
+
+  bool codel_dropping;      /* CoDel is in the dropping state */
+  long long codel_above;    /* When sojourn time went above target, in ns
+                               (plus an interval), or 0 */
+  long long codel_next;     /* When CoDel next drops, in ns */
+  unsigned codel_count;     /* CoDel drops in this dropping state */
+  unsigned codel_last;      /* codel_count when it last left dropping */
+
+  link_stats_t stats;       /* Statistics */
+};
+typedef struct link link_t;
+
+
+/**
+ * Creates a link. This must be freed later with link_destroy(), after the
+ * scheduler has been destroyed.
+ *
+ * name: Name of the link (e.g. the direction it carries).
+ * config: Settings.
+ * seed: Seed for the random number generator.
+ * sched: Scheduler to run on.
+ * output: Where segments go once they arrive at the other end.
+ * ctx: Context for output.
+ * returns: The new link.
+ */
+link_t *link_create(const char *name, link_config_t *config, uint64_t seed,
+                    sched_t *sched, impair_output_fn output, void *ctx);
+
+/**
+ * Destroys a link, along with any segments still queued on it.
+ */
+void link_destroy(link_t *link);
+
+/**
+ * Whether or not a link does anything at all.
+ */
+bool link_enabled(link_t *link);
+
+/**
+ * Passes a segment onto a link. Takes ownership of the segment, which must have
+ * been allocated with malloc(). Has the same signature as impair_output_fn, so
+ * a link can be the output of an impairer.
+ *
+ * ctx: The link.
+ * conn: Connection the segment belongs to. Segments in flight are owned by it
+ *       on the scheduler.
+ * segment: The segment.
+ * len: Length of the segment, including headers.
+ */
+void link_segment(void *ctx, conn_t *conn, ctcp_segment_t *segment,
+                  size_t len);
+
+/**
+ * Drops every segment a connection has on a link. Call this along with
+ * sched_cancel() when a connection goes away.
+ */
+void link_cancel(link_t *link, conn_t *conn);
+
+/**
+ * Parses the name of a queue management discipline.
+ *
+ * name: "droptail", "red" or "codel".
+ * aqm: Where to store the discipline.
+ * returns: 0 on success, -1 if the name is not recognized.
+ */
+int link_parse_aqm(const char *name, link_aqm_t *aqm);
+
+/**
+ * Parses Gilbert-Elliott loss settings.
+ *
+ * str: "p,r[,loss_good[,loss_bad]]", all percentages. Loss in the good state
+ *      defaults to 0%, and in the bad state to 100%.
+ * config: Where to store the settings.
+ * returns: 0 on success, -1 if the settings could not be parsed.
+ */
+int link_parse_burst(const char *str, link_config_t *config);
+
+/**
+ * Prints link statistics on one line.
+ */
+void link_print_stats(link_t *link, FILE *file);
+
+#endif /* CTCP_LINK_H */
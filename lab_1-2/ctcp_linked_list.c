@@ -1,3 +1,4 @@
+#include "ctcp_alloc.h"
 #include "ctcp_linked_list.h"
 
 linked_list_t *ll_create() {
@@ -16,14 +17,14 @@ void ll_destroy(linked_list_t *list) {
   ll_node_t *next = NULL;
   while (curr != NULL) {
     next = curr->next;
-    free(curr);
+    tagged_free(ALLOC_LL_NODE, curr, sizeof(ll_node_t));
     curr = next;
   }
   free(list);
 }
 
 ll_node_t *ll_create_node(void *object) {
-  ll_node_t *node = calloc(sizeof(ll_node_t), 1);
+  ll_node_t *node = tagged_calloc(ALLOC_LL_NODE, sizeof(ll_node_t));
   node->next = NULL;
   node->prev = NULL;
   node->object = object;
@@ -111,7 +112,7 @@ void *ll_remove(linked_list_t *list, ll_node_t *node) {
     node->next->prev = node->prev;
 
   /* Free memory. */
-  free(node);
+  tagged_free(ALLOC_LL_NODE, node, sizeof(ll_node_t));
   list->length--;
 
   return object;
@@ -0,0 +1,557 @@
+/******************************************************************************
+ * ctcp_load.c
+ * -----------
+ * Load generator. Opens many cTCP connections to one server from a single
+ * process, each running the same ctcp.c as a normal client, to see how the
+ * server copes as the number of connections grows.
+ *
+ * Connections open at a fixed rate no matter how long earlier ones took to
+ * set up (open loop): the handshake is just another thing the main loop waits
+ * for, so connections that are already open carry on while others are still
+ * being set up. Each one sends a number of fixed-size messages at a fixed
+ * rate, then closes its end. Each connection gets its own Unix socket and
+ * port, which is swapped in as the library's configuration whenever that
+ * connection is handled. Like ctcp_microbench.c, this includes
+ * ctcp_sys_internal.c directly, leaving out its main().
+ *
+ * Prints one line of JSON when all connections are done:
+ *
+ *     ./ctcp_load -c localhost:9999 -p 20000 -n 1000 --arrival-rate 500
+ *
+ * The server should be started with --echo and a large enough --max-clients.
+ *
+ *****************************************************************************/
+
+#define CTCP_NO_MAIN
+#include "ctcp_sys_internal.c"
+#include <math.h>
+#include <sys/resource.h>
+
+#define NS_PER_MS 1000000LL
+#define NS_PER_SEC 1000000000LL
+
+/** One connection made by the load generator. Times are in nanoseconds. */
+typedef struct {
+  struct config endpoint;       /* Socket and port of this end */
+  conn_t *conn;                 /* Connection, once established */
+  conn_t *connecting;           /* Connection, while the SYN-ACK is awaited */
+  int64_t arrival;              /* When the connection was meant to open */
+  int64_t connect_deadline;     /* When to give up waiting for the SYN-ACK */
+  int64_t established;          /* When the handshake finished */
+  int64_t done;                 /* When student code tore it down */
+  int64_t next_message;         /* When the next message is due */
+  int messages;                 /* Messages sent so far */
+  uint64_t output_bytes;        /* Bytes received back */
+  bool opened;                  /* Whether an attempt was made to open it */
+  bool failed;                  /* Whether the handshake failed */
+} load_conn_t;
+
+/** Options. */
+static char *server_host = NULL;
+static int server_port = -1;
+static int first_port = -1;
+static int num_conns = 1;
+static double arrival_rate = 0;
+static int msg_size = 1024;
+static int num_messages = 100;
+static double message_rate = 0;
+static int window = 1;
+static int connect_timeout = 1000;
+static double time_limit = 60;
+
+
+//////////////////////////////// CONNECTIONS ////////////////////////////////
+
+/**
+ * Opens a Unix socket for one end of a connection. Unlike do_config(), this
+ * doesn't wait around to reset old connections.
+ *
+ * endpoint: Configuration to fill in.
+ * port: Port for this end.
+ * returns: 0 on success, -1 otherwise.
+ */
+static int endpoint_open(struct config *endpoint, int port) {
+  memset(endpoint, 0, sizeof(struct config));
+  endpoint->port = port;
+  endpoint->socket = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (endpoint->socket < 0) {
+    fprintf(stderr, "[ERROR] Could not open socket for port %d\n", port);
+    return -1;
+  }
+
+  endpoint->sunaddr.sun_family = AF_UNIX;
+  sprintf(endpoint->sunaddr.sun_path, "/%d", port);
+  unlink(endpoint->sunaddr.sun_path);
+  if (bind(endpoint->socket, (struct sockaddr *) &endpoint->sunaddr,
+           sizeof(endpoint->sunaddr)) < 0) {
+    fprintf(stderr, "[ERROR] Could not bind to port %d\n", port);
+    close(endpoint->socket);
+    endpoint->socket = -1;
+    return -1;
+  }
+  return 0;
+}
+
+static void endpoint_close(struct config *endpoint) {
+  if (endpoint->socket < 0)
+    return;
+  close(endpoint->socket);
+  unlink(endpoint->sunaddr.sun_path);
+  endpoint->socket = -1;
+}
+
+/**
+ * Gives up on a connection whose handshake failed.
+ */
+static void load_conn_fail(load_conn_t *lc) {
+  /* The connection is the only one on its endpoint. */
+  free(lc->connecting);
+  lc->connecting = NULL;
+  lc->endpoint.sconn = NULL;
+  endpoint_close(&lc->endpoint);
+  lc->failed = true;
+}
+
+/**
+ * Starts opening a connection to the server by sending a SYN. The rest of
+ * the handshake is done by load_conn_handshake() when the answer comes in,
+ * so this never waits.
+ *
+ * lc: The connection.
+ * port: Port for this end.
+ * now: The current time.
+ */
+static void load_conn_open(load_conn_t *lc, int port, int64_t now) {
+  lc->opened = true;
+  if (endpoint_open(&lc->endpoint, port) < 0) {
+    lc->failed = true;
+    return;
+  }
+
+  /* Set up the connection as do_config_server() would, but from this end. */
+  config = &lc->endpoint;
+  config->sconn = calloc(sizeof(conn_t), 1);
+  conn_add(config->sconn);
+  conn_setup(config->sconn, LOCALHOST, server_port, true);
+  config->sconn->endpoint = &lc->endpoint;
+  lc->connecting = config->sconn;
+  lc->connect_deadline = now + (int64_t) connect_timeout * NS_PER_MS;
+
+  if (send_syn(config->sconn))
+    load_conn_fail(lc);
+}
+
+/**
+ * Finishes the handshake of a connection once the server has answered its
+ * SYN, and hands the connection to student code. Each connection gets its
+ * own copy of the configuration, with the server's window as its send
+ * window.
+ */
+static void load_conn_handshake(load_conn_t *lc) {
+  char buf[MAX_PACKET_SIZE];
+  config = &lc->endpoint;
+
+  int r;
+  while ((r = recv_filter(config->socket, buf, MAX_PACKET_SIZE, MSG_DONTWAIT,
+                          NULL)) == 0)
+    ;
+  if (r < 0)
+    return;
+
+  conn_t *conn = lc->connecting;
+  tcphdr_t *synack = (tcphdr_t *) (buf + IP_HDR_SIZE);
+  tcp_handshake_reply(conn, synack);
+
+  ctcp_config_t *config_copy = calloc(sizeof(ctcp_config_t), 1);
+  memcpy(config_copy, ctcp_cfg, sizeof(ctcp_config_t));
+  config_copy->send_window = ntohs(synack->window);
+  conn_start(conn, config_copy);
+  ctcp_state_t *state = ctcp_init(conn, config_copy);
+  if (state == NULL) {
+    load_conn_fail(lc);
+    return;
+  }
+
+  conn->state = state;
+  async(config->socket);
+  lc->connecting = NULL;
+  lc->conn = conn;
+  lc->established = current_time_ns();
+  lc->next_message = lc->established;
+}
+
+/**
+ * Gives a connection its next message, if one is due. Without a message rate,
+ * the next one goes as soon as the last has been read by student code. Once
+ * all have been sent, the connection closes its end.
+ *
+ * returns: When the next message is due, or -1 if none are left.
+ */
+static int64_t load_conn_send(load_conn_t *lc, const char *msg, int64_t now) {
+  conn_t *conn = lc->conn;
+  if (conn->in_eof || conn->delete_me)
+    return -1;
+
+  while (lc->messages < num_messages && lc->next_message <= now) {
+    if (message_rate <= 0 && conn->in_queue)
+      return -1;
+    conn_inject(conn, msg, msg_size);
+    lc->messages++;
+    lc->next_message += message_rate > 0 ? NS_PER_SEC / message_rate : 0;
+  }
+
+  if (lc->messages < num_messages)
+    return message_rate > 0 ? lc->next_message : -1;
+  if (!conn->in_queue)
+    conn_inject(conn, NULL, 0);
+  return -1;
+}
+
+/**
+ * Receives all segments waiting on a connection's socket.
+ */
+static void load_conn_receive(load_conn_t *lc) {
+  char buf[MAX_PACKET_SIZE];
+  config = &lc->endpoint;
+
+  while (true) {
+    conn_t *conn = NULL;
+    int len = recv_filter(config->socket, buf, MAX_PACKET_SIZE, 0, &conn);
+    if (len < 0)
+      break;
+    if (len < FULL_HDR_SIZE || conn == NULL || conn->delete_me)
+      continue;
+
+    ctcp_segment_t *segment = convert_to_ctcp(conn, buf, len);
+    len = len - FULL_HDR_SIZE + sizeof(ctcp_segment_t);
+    impair_segment(impair_in, conn, segment, len);
+  }
+}
+
+/**
+ * Cleans up after a connection torn down by student code.
+ */
+static void load_conn_reap(load_conn_t *lc) {
+  lc->done = current_time_ns();
+  lc->output_bytes = lc->conn->stats.output_bytes;
+
+  config = &lc->endpoint;
+  conn_free(lc->conn);
+  lc->conn = NULL;
+  endpoint_close(&lc->endpoint);
+}
+
+
+////////////////////////////////// RESULTS //////////////////////////////////
+
+static int compare_int64(const void *a, const void *b) {
+  int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Gets a percentile of sorted values, by nearest rank.
+ */
+static int64_t percentile(int64_t *values, int n, double p) {
+  if (n == 0)
+    return 0;
+  int rank = (int) ceil(p / 100 * n);
+  return values[rank < 1 ? 0 : rank - 1];
+}
+
+/**
+ * Prints out the results as one line of JSON.
+ */
+static void print_results(load_conn_t *conns, int64_t start, int64_t end) {
+  int64_t *accept = calloc(num_conns, sizeof(int64_t));
+  int64_t *throughput = calloc(num_conns, sizeof(int64_t));
+  int established = 0, completed = 0, aborted = 0, failed = 0, i;
+  uint64_t bytes_sent = 0, bytes_received = 0;
+  double throughput_sum = 0;
+
+  for (i = 0; i < num_conns; i++) {
+    load_conn_t *lc = &conns[i];
+    if (lc->failed) {
+      failed++;
+      continue;
+    }
+    if (!lc->opened)
+      continue;
+    accept[established++] = lc->established - lc->arrival;
+    bytes_sent += (uint64_t) lc->messages * msg_size;
+    bytes_received += lc->output_bytes;
+
+    /* Torn down before everything came back. */
+    uint64_t sent = (uint64_t) num_messages * msg_size;
+    if (lc->done > 0 && lc->output_bytes < sent) {
+      aborted++;
+      continue;
+    }
+
+    /* Throughput of what was sent, over the life of the connection. */
+    if (lc->done > lc->established) {
+      throughput[completed] = sent * 8 * NS_PER_SEC /
+                              (lc->done - lc->established);
+      throughput_sum += throughput[completed];
+      completed++;
+    }
+  }
+  qsort(accept, established, sizeof(int64_t), compare_int64);
+  qsort(throughput, completed, sizeof(int64_t), compare_int64);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("{\"connections\": %d, \"established\": %d, \"failed\": %d, "
+         "\"completed\": %d, \"aborted\": %d, \"size\": %d, \"messages\": %d, "
+         "\"arrival_rate\": %.3f, \"message_rate\": %.3f, \"window\": %d, "
+         "\"accept_p50_us\": %.3f, \"accept_p99_us\": %.3f, "
+         "\"accept_max_us\": %.3f, \"throughput_min_kbps\": %.3f, "
+         "\"throughput_p50_kbps\": %.3f, \"throughput_mean_kbps\": %.3f, "
+         "\"bytes_sent\": %llu, \"bytes_received\": %llu, "
+         "\"elapsed_s\": %.6f, \"cpu_s\": %.6f, \"peak_rss_kb\": %ld}\n",
+         num_conns, established, failed, completed, aborted, msg_size,
+         num_messages, arrival_rate, message_rate, window,
+         percentile(accept, established, 50) / 1e3,
+         percentile(accept, established, 99) / 1e3,
+         percentile(accept, established, 100) / 1e3,
+         completed ? throughput[0] / 1e3 : 0,
+         percentile(throughput, completed, 50) / 1e3,
+         completed ? throughput_sum / completed / 1e3 : 0,
+         (unsigned long long) bytes_sent,
+         (unsigned long long) bytes_received, (end - start) / 1e9,
+         usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6,
+         stats_peak_rss());
+  fflush(stdout);
+  free(accept);
+  free(throughput);
+}
+
+
+///////////////////////////////// MAIN LOOP /////////////////////////////////
+
+/**
+ * Opens connections as they arrive and runs them until they are all done or
+ * the time limit is up.
+ */
+static void load_loop(load_conn_t *conns) {
+  struct pollfd *fds = calloc(num_conns, sizeof(struct pollfd));
+  char *msg = malloc(msg_size);
+  memset(msg, 'x', msg_size);
+
+  int64_t start = current_time_ns();
+  int64_t deadline = start + (int64_t) (time_limit * NS_PER_SEC);
+  int64_t interval = arrival_rate > 0 ? NS_PER_SEC / arrival_rate : 0;
+  int next_arrival = 0, active = 0, i;
+
+  for (i = 0; i < num_conns; i++) {
+    conns[i].arrival = start + i * interval;
+    conns[i].endpoint.socket = -1;
+    fds[i].fd = -1;
+    fds[i].events = POLLIN;
+  }
+
+  while (true) {
+    int64_t now = current_time_ns();
+    if (now >= deadline)
+      break;
+
+    /* Open connections that are due. */
+    while (next_arrival < num_conns && conns[next_arrival].arrival <= now) {
+      load_conn_t *lc = &conns[next_arrival];
+      load_conn_open(lc, first_port + next_arrival, now);
+      if (lc->connecting) {
+        fds[next_arrival].fd = lc->endpoint.socket;
+        active++;
+      }
+      next_arrival++;
+    }
+    if (next_arrival == num_conns && active == 0)
+      break;
+
+    /* Hand out messages and let student code read them. Don't wait around
+       while it is still getting through them. Give up on handshakes that
+       have taken too long. */
+    int64_t wake = next_arrival < num_conns ? conns[next_arrival].arrival :
+                                              deadline;
+    uint64_t reads = injected_reads;
+    for (i = 0; i < next_arrival; i++) {
+      load_conn_t *lc = &conns[i];
+      if (lc->connecting) {
+        if (lc->connect_deadline <= now) {
+          load_conn_fail(lc);
+          fds[i].fd = -1;
+          active--;
+        } else if (lc->connect_deadline < wake) {
+          wake = lc->connect_deadline;
+        }
+        continue;
+      }
+      if (!lc->conn)
+        continue;
+      int64_t due = load_conn_send(lc, msg, now);
+      if (due >= 0 && due < wake)
+        wake = due;
+      if (input_pending(lc->conn) && !lc->conn->delete_me)
+        ctcp_read(lc->conn->state);
+    }
+    bool reading = injected_reads != reads;
+
+    /* Wait for segments, the timer, delayed segments or the next thing due. */
+    long timeout = need_timer_in(&last_timeout, ctcp_cfg->timer);
+    if (reading)
+      timeout = 0;
+    else if ((wake - now) / NS_PER_MS < timeout)
+      timeout = wake > now ? (wake - now) / NS_PER_MS : 0;
+    poll(fds, next_arrival, sched_timeout(loop_sched, timeout, now));
+
+    for (i = 0; i < next_arrival; i++) {
+      if (!(fds[i].revents & POLLIN))
+        continue;
+      if (conns[i].connecting)
+        load_conn_handshake(&conns[i]);
+      if (conns[i].conn)
+        load_conn_receive(&conns[i]);
+      else if (conns[i].failed) {
+        fds[i].fd = -1;
+        active--;
+      }
+    }
+    sched_run(loop_sched, current_time_ns());
+
+    if (need_timer_in(&last_timeout, ctcp_cfg->timer) == 0) {
+      timer_tick = ++timer_calls;
+      ctcp_timer();
+      timer_tick = 0;
+      get_time(&last_timeout);
+    }
+
+    /* Clean up connections student code is done with. */
+    for (i = 0; i < next_arrival; i++) {
+      if (conns[i].conn && conns[i].conn->delete_me) {
+        load_conn_reap(&conns[i]);
+        fds[i].fd = -1;
+        active--;
+      }
+    }
+  }
+
+  print_results(conns, start, current_time_ns());
+
+  /* Connections still going at the time limit. */
+  for (i = 0; i < num_conns; i++)
+    endpoint_close(&conns[i].endpoint);
+  free(fds);
+  free(msg);
+}
+
+static void usage(char *progname) {
+  fprintf(stderr,
+    "\nUsage: %s\n"
+    "   -c server_host:server_port\n"
+    "   -p first_port                Connection i uses first_port + i\n"
+    "   [-n connections]\n"
+    "   [-w window_size]\n"
+    "   [--arrival-rate per_sec]     Connections opened per second (0 for "
+                                     "all at once)\n"
+    "   [--size bytes]               Bytes per message\n"
+    "   [--messages n]               Messages per connection\n"
+    "   [--message-rate per_sec]     Messages per second per connection (0 "
+                                     "for back to back)\n"
+    "   [--connect-timeout ms]\n"
+    "   [--time-limit seconds]\n"
+    "   [--summary]\n\n",
+    progname
+  );
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  char *progname = strrchr(argv[0], '/');
+  progname = progname ? progname + 1 : argv[0];
+
+  struct option o[] = {
+    { "client", required_argument, NULL, 'c' },
+    { "port", required_argument, NULL, 'p' },
+    { "connections", required_argument, NULL, 'n' },
+    { "window", required_argument, NULL, 'w' },
+    { "arrival-rate", required_argument, NULL, 'a' },
+    { "size", required_argument, NULL, 's' },
+    { "messages", required_argument, NULL, 'm' },
+    { "message-rate", required_argument, NULL, 'r' },
+    { "connect-timeout", required_argument, NULL, 'C' },
+    { "time-limit", required_argument, NULL, 'l' },
+    { "summary", no_argument, NULL, 'S' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "c:p:n:w:", o, NULL)) != -1) {
+    switch (opt) {
+    case 'c': server_host = optarg; break;
+    case 'p': first_port = atoi(optarg); break;
+    case 'n': num_conns = atoi(optarg); break;
+    case 'w': window = atoi(optarg); break;
+    case 'a': arrival_rate = atof(optarg); break;
+    case 's': msg_size = atoi(optarg); break;
+    case 'm': num_messages = atoi(optarg); break;
+    case 'r': message_rate = atof(optarg); break;
+    case 'C': connect_timeout = atoi(optarg); break;
+    case 'l': time_limit = atof(optarg); break;
+    case 'S': opt_summary = true; break;
+    default: usage(progname); break;
+    }
+  }
+
+  /* Only local servers, over Unix sockets. */
+  char *port_str = server_host ? strchr(server_host, ':') : NULL;
+  if (port_str) {
+    *port_str = '\0';
+    server_port = atoi(port_str + 1);
+  }
+  if (!server_host || server_port <= 0 || first_port <= 0 || num_conns < 1 ||
+      first_port + num_conns > TCP_MAX_PORT || window < 1 || msg_size < 1 ||
+      num_messages < 0 || connect_timeout < 1)
+    usage(progname);
+  if (ip_from_hostname(server_host) != LOCALHOST) {
+    fprintf(stderr, "[ERROR] Only servers on this machine are supported\n");
+    return 1;
+  }
+
+  /* One socket per connection. */
+  struct rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  if (limit.rlim_cur < (rlim_t) num_conns + 64) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  /* The library as a client, driven from here. */
+  load_mode = true;
+  signal(SIGPIPE, SIG_IGN);
+  srand(time(NULL));
+
+  static ctcp_config_t cfg;
+  ctcp_cfg = &cfg;
+  cfg.recv_window = window * MAX_SEG_DATA_SIZE;
+  cfg.send_window = window * MAX_SEG_DATA_SIZE;
+  cfg.timer = TIMER_INTERVAL;
+  cfg.rt_timeout = RT_INTERVAL;
+
+  impair_config_t none;
+  memset(&none, 0, sizeof(impair_config_t));
+  link_config_t no_link;
+  memset(&no_link, 0, sizeof(link_config_t));
+  loop_sched = sched_create();
+  link_out = link_create("out", &no_link, 0, loop_sched, transmit_segment,
+                         NULL);
+  impair_out = impair_create("out", &none, 0, loop_sched, link_segment,
+                             link_out);
+  impair_in = impair_create("in", &none, 0, loop_sched, receive_segment, NULL);
+  get_time(&last_timeout);
+
+  load_conn_t *conns = calloc(num_conns, sizeof(load_conn_t));
+  load_loop(conns);
+  free(conns);
+  return 0;
+}
@@ -0,0 +1,96 @@
+#include <stdlib.h>
+
+#include "ctcp_cycles.h"
+#include "ctcp_loopprof.h"
+
+/** Names of the phases and hot paths, as printed. */
+static const char *phase_names[NUM_PHASES] = {
+  "poll", "read", "network", "receive", "drain", "timer", "cleanup", "other"
+};
+static const char *path_names[NUM_PATHS] = {
+  "convert_to_ctcp", "convert_to_datagram", "cksum", "alloc"
+};
+
+
+loopprof_t *loopprof_create(void) {
+  loopprof_t *prof = calloc(sizeof(loopprof_t), 1);
+  prof->cycles_per_ns = cycles_per_ns(10);
+  prof->phase = PHASE_OTHER;
+  prof->since = cycles_now();
+  return prof;
+}
+
+enum loop_phase loopprof_switch(loopprof_t *prof, enum loop_phase phase) {
+  enum loop_phase was = prof->phase;
+  if (phase == was)
+    return was;
+
+  uint64_t now = cycles_now();
+  prof->phases[was].cycles += now - prof->since;
+  prof->phases[phase].count++;
+  prof->phase = phase;
+  prof->since = now;
+  return was;
+}
+
+void loopprof_add(loopprof_t *prof, enum loop_path path, uint64_t start) {
+  prof->paths[path].cycles += cycles_now() - start;
+  prof->paths[path].count++;
+}
+
+/**
+ * Prints the slots of a profile, less those of an earlier copy.
+ */
+static void loopprof_print_slots(const char *name, const char **names,
+                                 const loop_slot_t *slots,
+                                 const loop_slot_t *since, int num_slots,
+                                 uint64_t total, uint64_t packets,
+                                 double cycles_per_ns, FILE *file) {
+  fprintf(file, "\"%s\": {", name);
+  int i;
+  for (i = 0; i < num_slots; i++) {
+    uint64_t cycles = slots[i].cycles - (since ? since[i].cycles : 0);
+    uint64_t count = slots[i].count - (since ? since[i].count : 0);
+    fprintf(file, "%s\"%s\": {\"cycles\": %llu, \"ms\": %.3f, "
+            "\"count\": %llu, \"cycles_per_packet\": %.1f",
+            i > 0 ? ", " : "", names[i], (unsigned long long) cycles,
+            cycles / cycles_per_ns / 1e6, (unsigned long long) count,
+            packets > 0 ? (double) cycles / packets : 0);
+    if (total > 0)
+      fprintf(file, ", \"share\": %.4f", (double) cycles / total);
+    fprintf(file, "}");
+  }
+  fprintf(file, "}");
+}
+
+void loopprof_print_json(loopprof_t *prof, const loopprof_t *since,
+                         FILE *file) {
+  /* Bring the phase the loop is in up to date. */
+  uint64_t now = cycles_now();
+  prof->phases[prof->phase].cycles += now - prof->since;
+  prof->since = now;
+
+  uint64_t total = 0;
+  int i;
+  for (i = 0; i < NUM_PHASES; i++)
+    total += prof->phases[i].cycles - (since ? since->phases[i].cycles : 0);
+  uint64_t packets = prof->paths[PATH_TO_CTCP].count +
+                     prof->paths[PATH_TO_DATAGRAM].count;
+  if (since) {
+    packets -= since->paths[PATH_TO_CTCP].count +
+               since->paths[PATH_TO_DATAGRAM].count;
+  }
+
+  fprintf(file, "{\"cycles\": %llu, \"ms\": %.3f, \"cycles_per_ns\": %.3f, "
+          "\"packets\": %llu, ", (unsigned long long) total,
+          total / prof->cycles_per_ns / 1e6, prof->cycles_per_ns,
+          (unsigned long long) packets);
+  loopprof_print_slots("phases", phase_names, prof->phases,
+                       since ? since->phases : NULL, NUM_PHASES, total,
+                       packets, prof->cycles_per_ns, file);
+  fprintf(file, ", ");
+  loopprof_print_slots("paths", path_names, prof->paths,
+                       since ? since->paths : NULL, NUM_PATHS, 0, packets,
+                       prof->cycles_per_ns, file);
+  fprintf(file, "}");
+}
@@ -0,0 +1,108 @@
+/******************************************************************************
+ * ctcp_loopprof.h
+ * ---------------
+ * Where the main loop's time goes (--loop-profile). The loop is always in one
+ * phase (waiting in poll(), reading input, receiving a packet, ...), and each
+ * switch from one to another adds the cycles since the last one to the phase
+ * it was in. Calls made from inside a phase count towards it, so the phases
+ * add up to the whole run.
+ *
+ * Separately, a few hot paths (converting segments to and from datagrams,
+ * checksums and allocating memory) count their calls and the cycles they take
+ * each time. These overlap the phases and each other: the checksums in
+ * convert_to_ctcp() count towards both.
+ *
+ * Cycles come from cycles_now() (see ctcp_cycles.h). Reading it takes a few
+ * ns, so a profiled run is a little slower.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_LOOPPROF_H
+#define CTCP_LOOPPROF_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/** Phases of the main loop. */
+enum loop_phase {
+  PHASE_POLL,                   /* Waiting in poll() */
+  PHASE_READ,                   /* ctcp_read() of stdin, programs or echoed
+                                   input */
+  PHASE_NETWORK,                /* Receiving packets and converting them to
+                                   cTCP segments */
+  PHASE_RECEIVE,                /* ctcp_receive() */
+  PHASE_DRAIN,                  /* Output queues and ctcp_output() */
+  PHASE_TIMER,                  /* ctcp_timer() */
+  PHASE_CLEANUP,                /* delete_all_connections() */
+  PHASE_OTHER,                  /* Everything else, e.g. the control socket
+                                   and segments delayed by impairments */
+  NUM_PHASES
+};
+
+/** Hot paths that are timed. */
+enum loop_path {
+  PATH_TO_CTCP,                 /* convert_to_ctcp() */
+  PATH_TO_DATAGRAM,             /* convert_to_datagram() */
+  PATH_CKSUM,                   /* cksum() and cksum_tcp() */
+  PATH_ALLOC,                   /* Allocating segments and output
+                                   chunks */
+  NUM_PATHS
+};
+
+/** Cycles spent in a phase or hot path, and how often it was entered. */
+typedef struct {
+  uint64_t cycles;
+  uint64_t count;
+} loop_slot_t;
+
+/** Where the main loop's time has gone. */
+struct loopprof {
+  enum loop_phase phase;        /* Phase the loop is in */
+  uint64_t since;               /* When it got there, in cycles */
+  double cycles_per_ns;         /* Rate cycles go by at */
+  loop_slot_t phases[NUM_PHASES];
+  loop_slot_t paths[NUM_PATHS];
+};
+typedef struct loopprof loopprof_t;
+
+
+/**
+ * Starts profiling the main loop, in the PHASE_OTHER phase. Takes about 10ms
+ * to work out how fast cycles go by.
+ *
+ * returns: The profile. Freed with free().
+ */
+loopprof_t *loopprof_create(void);
+
+/**
+ * Moves on to another phase.
+ *
+ * prof: The profile.
+ * phase: Phase the loop is going into.
+ * returns: Phase it was in before, to come back to afterwards.
+ */
+enum loop_phase loopprof_switch(loopprof_t *prof, enum loop_phase phase);
+
+/**
+ * Counts a call to a hot path.
+ *
+ * prof: The profile.
+ * path: The hot path.
+ * start: cycles_now() from just before the call.
+ */
+void loopprof_add(loopprof_t *prof, enum loop_path path, uint64_t start);
+
+/**
+ * Prints where the time has gone as a single JSON object, without a trailing
+ * newline. For each phase and hot path: the cycles spent in it, how often it
+ * was entered, and the cycles per packet (received or sent). Phases also get
+ * their share of the loop's time.
+ *
+ * prof: The profile. The phase the loop is in is brought up to date first.
+ * since: An earlier copy of the profile, to only print what has happened
+ *        since, or NULL for everything.
+ */
+void loopprof_print_json(loopprof_t *prof, const loopprof_t *since,
+                         FILE *file);
+
+#endif /* CTCP_LOOPPROF_H */
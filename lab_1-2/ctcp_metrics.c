@@ -0,0 +1,192 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ctcp_metrics.h"
+
+/** Longest name of a region. */
+#define METRICS_NAME_SIZE 32
+
+struct metrics {
+  metrics_region_t *region;     /* The region */
+  char name[METRICS_NAME_SIZE]; /* Its name */
+};
+
+
+/**
+ * Name of the region of the process on a port.
+ */
+static void metrics_name(char *name, int port) {
+  snprintf(name, METRICS_NAME_SIZE, "/ctcp-%d", port);
+}
+
+/**
+ * Adds to a counter in the region.
+ */
+static void metrics_add(uint64_t *counter, uint64_t value) {
+  __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+/**
+ * Starts writing a slot. Readers retry until metrics_write_end().
+ */
+static void metrics_write_begin(metrics_slot_t *slot) {
+  __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * Finishes writing a slot.
+ */
+static void metrics_write_end(metrics_slot_t *slot) {
+  __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/////////////////////////////////// WRITING ///////////////////////////////////
+
+metrics_t *metrics_open(int port, bool server) {
+  metrics_t *metrics = calloc(sizeof(metrics_t), 1);
+  metrics_name(metrics->name, port);
+
+  int fd = shm_open(metrics->name, O_CREAT | O_TRUNC | O_RDWR, 0644);
+  if (fd < 0 || ftruncate(fd, sizeof(metrics_region_t)) < 0) {
+    fprintf(stderr, "[ERROR] Could not create metrics %s: %s\n",
+            metrics->name, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    free(metrics);
+    return NULL;
+  }
+  void *map = mmap(NULL, sizeof(metrics_region_t), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "[ERROR] Could not map metrics: %s\n", strerror(errno));
+    shm_unlink(metrics->name);
+    free(metrics);
+    return NULL;
+  }
+
+  /* The region starts zeroed. The magic number goes in last, so a reader
+     never sees a header that is only half there. */
+  metrics_region_t *region = map;
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  region->version = METRICS_VERSION;
+  region->size = sizeof(metrics_region_t);
+  region->pid = getpid();
+  region->port = port;
+  region->server = server;
+  region->started = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(region->magic, METRICS_MAGIC, sizeof(METRICS_MAGIC));
+  metrics->region = region;
+  return metrics;
+}
+
+metrics_slot_t *metrics_attach(metrics_t *metrics, uint32_t peer_ip,
+                               uint16_t peer_port, bool unix_socket,
+                               int64_t now) {
+  metrics_region_t *region = metrics->region;
+  metrics_add(&region->global.connections, 1);
+
+  int i;
+  for (i = 0; i < METRICS_SLOTS; i++) {
+    metrics_slot_t *slot = &region->slots[i];
+    if (slot->in_use)
+      continue;
+
+    metrics_write_begin(slot);
+    memset(&slot->conn, 0, sizeof(metrics_conn_t));
+    slot->conn.peer_ip = peer_ip;
+    slot->conn.peer_port = peer_port;
+    slot->conn.unix_socket = unix_socket;
+    slot->conn.start = now;
+    slot->conn.updated = now;
+    slot->in_use = 1;
+    metrics_write_end(slot);
+    return slot;
+  }
+  return NULL;
+}
+
+void metrics_publish(metrics_slot_t *slot, const metrics_conn_t *values) {
+  size_t from = offsetof(metrics_conn_t, updated);
+  metrics_write_begin(slot);
+  memcpy((char *) &slot->conn + from, (const char *) values + from,
+         sizeof(metrics_conn_t) - from);
+  metrics_write_end(slot);
+}
+
+void metrics_detach(metrics_t *metrics, metrics_slot_t *slot) {
+  metrics_global_t *global = &metrics->region->global;
+  metrics_conn_t *conn = &slot->conn;
+  metrics_add(&global->segments_sent, conn->segments_sent);
+  metrics_add(&global->bytes_sent, conn->bytes_sent);
+  metrics_add(&global->retransmits, conn->retransmits);
+  metrics_add(&global->rto_events, conn->rto_events);
+  metrics_add(&global->segments_received, conn->segments_received);
+  metrics_add(&global->bytes_received, conn->bytes_received);
+  metrics_add(&global->dup_acks, conn->dup_acks);
+  metrics_add(&global->output_bytes, conn->output_bytes);
+
+  metrics_write_begin(slot);
+  slot->in_use = 0;
+  metrics_write_end(slot);
+}
+
+void metrics_drop(metrics_t *metrics, enum metrics_drop reason) {
+  metrics_add(&metrics->region->global.drops[reason], 1);
+}
+
+void metrics_close(metrics_t *metrics) {
+  munmap(metrics->region, sizeof(metrics_region_t));
+  shm_unlink(metrics->name);
+  free(metrics);
+}
+
+
+/////////////////////////////////// READING ///////////////////////////////////
+
+const metrics_region_t *metrics_map(int port) {
+  char name[METRICS_NAME_SIZE];
+  metrics_name(name, port);
+
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0)
+    return NULL;
+  void *map = mmap(NULL, sizeof(metrics_region_t), PROT_READ, MAP_SHARED, fd,
+                   0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  const metrics_region_t *region = map;
+  if (memcmp(region->magic, METRICS_MAGIC, sizeof(METRICS_MAGIC)) != 0 ||
+      region->version != METRICS_VERSION ||
+      region->size != sizeof(metrics_region_t)) {
+    munmap(map, sizeof(metrics_region_t));
+    return NULL;
+  }
+  return region;
+}
+
+bool metrics_read(const metrics_slot_t *slot, metrics_conn_t *values) {
+  uint32_t before, after;
+  bool in_use;
+  do {
+    before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    in_use = slot->in_use;
+    memcpy(values, &slot->conn, sizeof(metrics_conn_t));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+  } while ((before & 1) || before != after);
+  return in_use;
+}
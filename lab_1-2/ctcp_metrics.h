@@ -0,0 +1,194 @@
+/******************************************************************************
+ * ctcp_metrics.h
+ * --------------
+ * Live metrics of a running ctcp (--metrics), in shared memory that ctcp_stat
+ * reads. The region is a POSIX shared memory object named after the port
+ * (/ctcp-<port>, so /dev/shm/ctcp-<port> on Linux) and has:
+ *
+ *   - A header saying which process it belongs to.
+ *   - Counters for the whole process: connections opened, packets dropped by
+ *     recv_filter(), and the totals of connections that have ended. Each is
+ *     a 64-bit counter updated atomically, so any thread can add to one.
+ *   - A slot for each open connection, with its counters, RTT, windows and
+ *     output queue. A slot has a cache line to itself for its sequence number,
+ *     and is written under a sequence lock: the number is odd while the slot
+ *     is being written, and goes up by 2 every time.
+ *
+ * Only the main loop writes slots, and it never waits for a reader. A reader
+ * copies a slot out, and copies it again if the sequence number was odd or
+ * changed while it did, without taking a lock or making a system call.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_METRICS_H
+#define CTCP_METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Magic number at the start of the region, and the format version. */
+#define METRICS_MAGIC "CTCPMET"
+#define METRICS_VERSION 1
+
+/** Number of connections that can have a slot at once. */
+#define METRICS_SLOTS 256
+
+/** Size of a cache line. Slots and the global counters are aligned to it. */
+#define METRICS_CACHE_LINE 64
+
+/** Reasons recv_filter() drops a packet. */
+enum metrics_drop {
+  METRICS_DROP_SHORT,           /* Too short to hold the headers */
+  METRICS_DROP_PORT,            /* For some other port */
+  METRICS_DROP_UNKNOWN,         /* From no connection we know of */
+  METRICS_DROPS
+};
+
+/** What is published about a connection. Times are in nanoseconds. */
+struct metrics_conn {
+  uint32_t peer_ip;             /* Other end's IP address (network order) */
+  uint16_t peer_port;           /* Other end's port */
+  uint8_t unix_socket;          /* Whether it is over a Unix socket */
+  uint8_t pad;
+  int64_t start;                /* When the connection was set up */
+  int64_t updated;              /* When this was last published */
+
+  uint64_t segments_sent;       /* Segments passed to conn_send() */
+  uint64_t bytes_sent;          /* Bytes passed to conn_send() */
+  uint64_t retransmits;         /* Data segments that were retransmissions */
+  uint64_t rto_events;          /* ctcp_timer() calls that retransmitted */
+  uint64_t segments_received;   /* Segments passed to ctcp_receive() */
+  uint64_t bytes_received;      /* Bytes passed to ctcp_receive() */
+  uint64_t dup_acks;            /* Duplicate ACKs received */
+  uint64_t output_bytes;        /* Bytes accepted by conn_output() */
+
+  int64_t srtt;                 /* Smoothed RTT, 0 if not sampled yet */
+  int64_t rttvar;               /* RTT variation */
+  uint32_t cwnd;                /* Congestion window reported by student
+                                   code, 0 if none */
+  uint32_t rwnd;                /* Window the other end advertised */
+  uint32_t inflight;            /* Bytes sent and not yet ACKed */
+  uint32_t bufspace;            /* conn_bufspace() */
+  uint32_t out_queue;           /* Bytes waiting in the output queue */
+  uint32_t out_chunks;          /* Chunks in the output queue */
+};
+typedef struct metrics_conn metrics_conn_t;
+
+/** A connection's slot. */
+struct metrics_slot {
+  uint32_t seq;                 /* Sequence number. Odd while being written */
+  uint32_t in_use;              /* Whether a connection has the slot */
+  uint8_t pad[METRICS_CACHE_LINE - 8];
+  metrics_conn_t conn;          /* The connection */
+} __attribute__((aligned(METRICS_CACHE_LINE)));
+typedef struct metrics_slot metrics_slot_t;
+
+/** Counters for the whole process. */
+struct metrics_global {
+  uint64_t connections;         /* Connections opened */
+  uint64_t drops[METRICS_DROPS];/* Packets dropped by recv_filter() */
+
+  /* Totals of connections that have ended. */
+  uint64_t segments_sent;
+  uint64_t bytes_sent;
+  uint64_t retransmits;
+  uint64_t rto_events;
+  uint64_t segments_received;
+  uint64_t bytes_received;
+  uint64_t dup_acks;
+  uint64_t output_bytes;
+} __attribute__((aligned(METRICS_CACHE_LINE)));
+typedef struct metrics_global metrics_global_t;
+
+/** The whole region. */
+struct metrics_region {
+  char magic[8];                /* METRICS_MAGIC */
+  uint32_t version;             /* METRICS_VERSION */
+  uint32_t size;                /* sizeof(metrics_region_t) */
+  int32_t pid;                  /* Process that writes it */
+  uint16_t port;                /* Port it is running on */
+  uint8_t server;               /* Whether it is a server */
+  uint8_t pad;
+  int64_t started;              /* When it started, in nanoseconds */
+  metrics_global_t global;      /* Counters for the whole process */
+  metrics_slot_t slots[METRICS_SLOTS];
+};
+typedef struct metrics_region metrics_region_t;
+
+typedef struct metrics metrics_t;
+
+
+/**
+ * Creates the shared memory region for a process. Replaces any left over
+ * from an earlier process on the same port.
+ *
+ * port: Port the process is running on.
+ * server: Whether it is a server.
+ * returns: The metrics, or NULL if the region could not be created.
+ */
+metrics_t *metrics_open(int port, bool server);
+
+/**
+ * Gives a new connection a slot.
+ *
+ * metrics: The metrics.
+ * peer_ip: Other end's IP address (network order).
+ * peer_port: Other end's port.
+ * unix_socket: Whether it is over a Unix socket.
+ * now: Current time, in nanoseconds.
+ * returns: The slot, or NULL if every slot is taken.
+ */
+metrics_slot_t *metrics_attach(metrics_t *metrics, uint32_t peer_ip,
+                               uint16_t peer_port, bool unix_socket,
+                               int64_t now);
+
+/**
+ * Publishes a connection's metrics. Everything but the other end's address
+ * and the start time is copied from values.
+ *
+ * slot: The connection's slot.
+ * values: The metrics.
+ */
+void metrics_publish(metrics_slot_t *slot, const metrics_conn_t *values);
+
+/**
+ * Frees a connection's slot, adding its counters to the totals.
+ *
+ * metrics: The metrics.
+ * slot: The connection's slot.
+ */
+void metrics_detach(metrics_t *metrics, metrics_slot_t *slot);
+
+/**
+ * Counts a packet dropped by recv_filter(). Safe to call from any thread.
+ *
+ * metrics: The metrics.
+ * reason: Why it was dropped.
+ */
+void metrics_drop(metrics_t *metrics, enum metrics_drop reason);
+
+/**
+ * Removes the region.
+ *
+ * metrics: The metrics. Freed.
+ */
+void metrics_close(metrics_t *metrics);
+
+/**
+ * Maps in another process's region, read-only.
+ *
+ * port: Port the process is running on.
+ * returns: The region, or NULL if there is none (or it is not readable).
+ */
+const metrics_region_t *metrics_map(int port);
+
+/**
+ * Reads a slot consistently, retrying while it is being written.
+ *
+ * slot: The slot.
+ * values: Where to copy the connection's metrics.
+ * returns: Whether a connection has the slot.
+ */
+bool metrics_read(const metrics_slot_t *slot, metrics_conn_t *values);
+
+#endif /* CTCP_METRICS_H */
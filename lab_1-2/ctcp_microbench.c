@@ -0,0 +1,431 @@
+/******************************************************************************
+ * ctcp_microbench.c
+ * -----------------
+ * Microbenchmarks for the library's hot paths: checksums, building and
+ * converting datagrams, the linked list, conn_bufspace(), log_segment() and
+ * trace_segment().
+ * Most of these live in ctcp_sys_internal.[ch], which can only be built into
+ * one program, so this file includes ctcp_sys_internal.c directly, leaving
+ * out its main().
+ *
+ * Each benchmark is run over a list of sizes (payload bytes, or the number of
+ * list nodes or queued chunks) and prints one line of JSON with the time and
+ * cycles per operation, bytes per cycle where that makes sense, and how many
+ * allocations each operation makes (see ctcp_alloc.h):
+ *
+ *     ./ctcp_microbench --sizes 64,512,1440 --filter cksum
+ *
+ *****************************************************************************/
+
+#define CTCP_NO_MAIN
+#include "ctcp_sys_internal.c"
+#include "ctcp_cycles.h"
+#include "ctcp_linked_list.h"
+
+/** Maximum number of values in a comma-separated parameter list. */
+#define MAX_LIST 64
+
+/** Default payload sizes, and numbers of list nodes and queued chunks. */
+static const int default_sizes[] = { 0, 64, 256, 512, 1024, MAX_SEG_DATA_SIZE };
+static const int default_depths[] = { 1, 16, 256, 4096 };
+
+/** Keeps the compiler from optimizing away results. */
+static volatile uintptr_t sink;
+
+/** Options. */
+static double target_ms = 20;
+static int repeats = 5;
+static double cpns = 1;
+
+/** Common state set up for a benchmark. */
+typedef struct {
+  int size;                     /* Payload bytes, nodes or chunks */
+  conn_t conn;                  /* Other end of the connection */
+  char *datagram;               /* Raw IP packet with a size-byte payload */
+  ctcp_segment_t *segment;      /* cTCP segment with a size-byte payload */
+  uint16_t th_sum;              /* Checksum in datagram */
+  linked_list_t *list;          /* List of size nodes */
+  int log_fd;                   /* /dev/null */
+  trace_t *trace;               /* Trace written to /dev/null */
+} bench_state_t;
+
+/** A benchmark. run() does iters operations. */
+typedef struct {
+  const char *name;
+  bool sized_by_bytes;          /* Whether size is payload bytes */
+  void (*run)(bench_state_t *state, uint64_t iters);
+  uint64_t batch;               /* Most operations run() may do at once, or
+                                   0 for no limit */
+  void (*settle)(bench_state_t *state);
+                                /* Called, untimed, after each batch */
+} bench_t;
+
+
+////////////////////////////////// BENCHMARKS /////////////////////////////////
+
+static void run_cksum(bench_state_t *state, uint64_t iters) {
+  uint64_t i;
+  for (i = 0; i < iters; i++)
+    sink += cksum(state->segment->data, state->size);
+}
+
+static void run_cksum_tcp(bench_state_t *state, uint64_t iters) {
+  uint64_t i;
+  for (i = 0; i < iters; i++)
+    sink += cksum_tcp((iphdr_t *) state->datagram, state->size);
+}
+
+static void run_create_datagram(bench_state_t *state, uint64_t iters) {
+  uint64_t i;
+  for (i = 0; i < iters; i++) {
+    char *datagram = create_datagram(config->ip_addr, state->conn.ip_addr,
+                                     TCP_HDR_SIZE + state->size);
+    sink += (uintptr_t) datagram;
+    tagged_free(ALLOC_CREATE_DATAGRAM, datagram, FULL_HDR_SIZE + state->size);
+  }
+}
+
+static void run_convert_to_ctcp(bench_state_t *state, uint64_t iters) {
+  tcphdr_t *tcp_hdr = (tcphdr_t *) (state->datagram + IP_HDR_SIZE);
+  uint64_t i;
+  for (i = 0; i < iters; i++) {
+    /* convert_to_ctcp() zeroes the checksum. */
+    tcp_hdr->th_sum = state->th_sum;
+    ctcp_segment_t *segment = convert_to_ctcp(&state->conn, state->datagram,
+                                              FULL_HDR_SIZE + state->size);
+    sink += segment->cksum;
+    tagged_free(ALLOC_CONVERT_TO_CTCP, segment, ntohs(segment->len));
+  }
+}
+
+static void run_convert_to_datagram(bench_state_t *state, uint64_t iters) {
+  uint64_t i;
+  for (i = 0; i < iters; i++) {
+    char *datagram = convert_to_datagram(&state->conn, state->segment,
+                                         sizeof(ctcp_segment_t) + state->size);
+    sink += (uintptr_t) datagram;
+    tagged_free(ALLOC_CREATE_DATAGRAM, datagram, FULL_HDR_SIZE + state->size);
+  }
+}
+
+static void run_log_segment(bench_state_t *state, uint64_t iters) {
+  uint64_t i;
+  for (i = 0; i < iters; i++) {
+    log_segment(state->log_fd, config->ip_addr, config->port, &state->conn,
+                state->segment, sizeof(ctcp_segment_t) + state->size, true,
+                true);
+  }
+}
+
+/* Capturing as much data as a trace record holds. Run in batches that fit
+   in the ring, so every record is committed rather than dropped. */
+static void run_trace_segment(bench_state_t *state, uint64_t iters) {
+  uint64_t i;
+  for (i = 0; i < iters; i++) {
+    trace_segment(state->trace, config->ip_addr, config->port, &state->conn,
+                  state->segment, sizeof(ctcp_segment_t) + state->size, true,
+                  true);
+  }
+}
+
+static void settle_trace_segment(bench_state_t *state) {
+  trace_drain(state->trace);
+}
+
+/* Adding to the back and taking off the front of a list of size nodes. */
+static void run_ll_add_remove(bench_state_t *state, uint64_t iters) {
+  uint64_t i;
+  for (i = 0; i < iters; i++) {
+    ll_add(state->list, state);
+    sink += (uintptr_t) ll_remove(state->list, ll_front(state->list));
+  }
+}
+
+/* Adding to the front and taking off the back. */
+static void run_ll_add_front(bench_state_t *state, uint64_t iters) {
+  uint64_t i;
+  for (i = 0; i < iters; i++) {
+    ll_add_front(state->list, state);
+    sink += (uintptr_t) ll_remove(state->list, ll_back(state->list));
+  }
+}
+
+/* Looking for an object at the back of a list of size nodes. */
+static void run_ll_find(bench_state_t *state, uint64_t iters) {
+  void *last = ll_back(state->list)->object;
+  uint64_t i;
+  for (i = 0; i < iters; i++)
+    sink += (uintptr_t) ll_find(state->list, last);
+}
+
+static void run_ll_length(bench_state_t *state, uint64_t iters) {
+  uint64_t i;
+  for (i = 0; i < iters; i++)
+    sink += ll_length(state->list);
+}
+
+/* With size chunks in the output queue. */
+static void run_conn_bufspace(bench_state_t *state, uint64_t iters) {
+  uint64_t i;
+  for (i = 0; i < iters; i++)
+    sink += conn_bufspace(&state->conn);
+}
+
+static const bench_t benchmarks[] = {
+  { "cksum", true, run_cksum },
+  { "cksum_tcp", true, run_cksum_tcp },
+  { "create_datagram", true, run_create_datagram },
+  { "convert_to_ctcp", true, run_convert_to_ctcp },
+  { "convert_to_datagram", true, run_convert_to_datagram },
+  { "log_segment", true, run_log_segment },
+  { "trace_segment", true, run_trace_segment, TRACE_RING_SIZE / 2,
+    settle_trace_segment },
+  { "ll_add_remove", false, run_ll_add_remove },
+  { "ll_add_front", false, run_ll_add_front },
+  { "ll_find", false, run_ll_find },
+  { "ll_length", false, run_ll_length },
+  { "conn_bufspace", false, run_conn_bufspace },
+};
+
+
+//////////////////////////////////// SETUP ////////////////////////////////////
+
+/**
+ * Sets up everything a benchmark might need, for a given size.
+ */
+static void state_setup(bench_state_t *state, int size) {
+  memset(state, 0, sizeof(bench_state_t));
+  state->size = size;
+  conn_setup(&state->conn, LOCALHOST, 10000, true);
+  state->conn.their_init_seqno = rand();
+
+  /* A segment with random data, and the datagram it turns into. */
+  state->segment = calloc(sizeof(ctcp_segment_t) + size, 1);
+  state->segment->seqno = htonl(1);
+  state->segment->ackno = htonl(1);
+  state->segment->len = htons(sizeof(ctcp_segment_t) + size);
+  state->segment->flags = TH_ACK;
+  state->segment->window = htons(MAX_SEG_DATA_SIZE);
+  int i;
+  for (i = 0; i < size; i++)
+    state->segment->data[i] = rand();
+  state->segment->cksum = cksum(state->segment, sizeof(ctcp_segment_t) + size);
+  state->datagram = convert_to_datagram(&state->conn, state->segment,
+                                        sizeof(ctcp_segment_t) + size);
+  state->th_sum = ((tcphdr_t *) (state->datagram + IP_HDR_SIZE))->th_sum;
+
+  /* A list of size nodes, and size one-byte chunks waiting to be output. */
+  state->list = ll_create();
+  for (i = 0; i < size; i++) {
+    ll_add(state->list, state->segment->data + i);
+
+    chunk_t *chunk = calloc(offsetof(chunk_t, buf[1]), 1);
+    chunk->size = 1;
+    chunk->next = state->conn.out_queue;
+    state->conn.out_queue = chunk;
+  }
+
+  state->log_fd = open("/dev/null", O_WRONLY);
+  state->trace = trace_open("/dev/null", TRACE_PAYLOAD_MAX);
+}
+
+static void state_teardown(bench_state_t *state) {
+  chunk_t *chunk, *next_chunk;
+  for (chunk = state->conn.out_queue; chunk; chunk = next_chunk) {
+    next_chunk = chunk->next;
+    free(chunk);
+  }
+  ll_destroy(state->list);
+  free(state->segment);
+  tagged_free(ALLOC_CREATE_DATAGRAM, state->datagram,
+              FULL_HDR_SIZE + state->size);
+  close(state->log_fd);
+  trace_close(state->trace);
+}
+
+
+//////////////////////////////////// RUNNING //////////////////////////////////
+
+/**
+ * Does iters operations of a benchmark, split into batches if it has a limit,
+ * and times them.
+ *
+ * cycles: Set to the cycles the operations took.
+ * returns: Nanoseconds they took, leaving out settling between batches.
+ */
+static uint64_t run_timed(const bench_t *bench, bench_state_t *state,
+                          uint64_t iters, uint64_t *cycles) {
+  uint64_t ns = 0;
+  *cycles = 0;
+  while (iters > 0) {
+    uint64_t n = bench->batch && iters > bench->batch ? bench->batch : iters;
+    uint64_t start_ns = cycles_clock_ns(), start = cycles_now();
+    bench->run(state, n);
+    *cycles += cycles_now() - start;
+    ns += cycles_clock_ns() - start_ns;
+    if (bench->settle)
+      bench->settle(state);
+    iters -= n;
+  }
+  return ns;
+}
+
+/**
+ * Runs a benchmark for one size and prints out the results. The number of
+ * operations per run is picked so that a run takes about target_ms, and the
+ * fastest of the runs is reported.
+ */
+static void measure(const bench_t *bench, int size) {
+  bench_state_t state;
+  state_setup(&state, size);
+
+  /* Only lists that aren't empty can be searched. */
+  if (bench->run == run_ll_find && size == 0) {
+    state_teardown(&state);
+    return;
+  }
+
+  /* Work out how many operations fit in a run, warming up as it goes. */
+  uint64_t iters = 1, cycles;
+  while (true) {
+    uint64_t elapsed = run_timed(bench, &state, iters, &cycles);
+    if (elapsed >= target_ms * 1e6 / 10 || iters >= (1ULL << 40))
+      break;
+    iters *= 2;
+  }
+  iters *= 10;
+
+  double best_ns = -1, best_cycles = -1;
+  uint64_t allocs = alloc_total();
+  int i;
+  for (i = 0; i < repeats; i++) {
+    uint64_t ns = run_timed(bench, &state, iters, &cycles);
+    if (best_ns < 0 || ns < best_ns) {
+      best_ns = ns;
+      best_cycles = cycles;
+    }
+  }
+  allocs = alloc_total() - allocs;
+  state_teardown(&state);
+
+  /* Without a cycle counter, cycles are nanoseconds scaled by cycles_per_ns(),
+     which is 1. */
+  double ns_per_op = best_ns / iters;
+  double cycles_per_op = HAVE_CYCLE_COUNTER ? best_cycles / iters :
+                                              ns_per_op * cpns;
+  printf("{\"bench\": \"%s\", \"size\": %d, \"iterations\": %llu, "
+         "\"ns_per_op\": %.3f, \"cycles_per_op\": %.2f, ",
+         bench->name, size, (unsigned long long) iters, ns_per_op,
+         cycles_per_op);
+  if (bench->sized_by_bytes && size > 0)
+    printf("\"bytes_per_cycle\": %.4f, ", size / cycles_per_op);
+  else
+    printf("\"bytes_per_cycle\": null, ");
+
+  /* Allocations on the data path per operation (see ctcp_alloc.h). */
+#ifndef CTCP_NO_ALLOC_STATS
+  printf("\"allocs_per_op\": %.3f}\n", (double) allocs / iters / repeats);
+#else
+  printf("\"allocs_per_op\": null}\n");
+#endif
+  fflush(stdout);
+}
+
+/**
+ * Parses a comma-separated list of numbers.
+ *
+ * str: The list.
+ * values: Array to store the values in. Must have room for MAX_LIST values.
+ * returns: Number of values parsed.
+ */
+static int parse_list(char *str, int *values) {
+  int n = 0;
+  char *tok;
+  while ((tok = strsep(&str, ",")) != NULL && n < MAX_LIST) {
+    if (*tok)
+      values[n++] = atoi(tok);
+  }
+  return n;
+}
+
+static void usage(char *progname) {
+  fprintf(stderr,
+    "\nUsage: %s\n"
+    "   [--sizes bytes,...]          Payload sizes\n"
+    "   [--depths count,...]         List lengths and output queue depths\n"
+    "   [--filter name]              Only run benchmarks with this in their "
+                                     "name\n"
+    "   [--time ms]                  Roughly how long each run takes\n"
+    "   [--repeat n]                 Runs of each, keeping the fastest\n\n",
+    progname
+  );
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  char *progname = strrchr(argv[0], '/');
+  progname = progname ? progname + 1 : argv[0];
+
+  int sizes[MAX_LIST], depths[MAX_LIST];
+  int num_sizes = sizeof(default_sizes) / sizeof(int);
+  int num_depths = sizeof(default_depths) / sizeof(int);
+  memcpy(sizes, default_sizes, sizeof(default_sizes));
+  memcpy(depths, default_depths, sizeof(default_depths));
+  char *filter = NULL;
+
+  struct option o[] = {
+    { "sizes", required_argument, NULL, 's' },
+    { "depths", required_argument, NULL, 'd' },
+    { "filter", required_argument, NULL, 'f' },
+    { "time", required_argument, NULL, 't' },
+    { "repeat", required_argument, NULL, 'r' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", o, NULL)) != -1) {
+    switch (opt) {
+    case 's': num_sizes = parse_list(optarg, sizes); break;
+    case 'd': num_depths = parse_list(optarg, depths); break;
+    case 'f': filter = optarg; break;
+    case 't': target_ms = atof(optarg); break;
+    case 'r': repeats = atoi(optarg); break;
+    default: usage(progname); break;
+    }
+  }
+  if (target_ms <= 0 || repeats < 1)
+    usage(progname);
+  int i, j;
+  for (i = 0; i < num_sizes; i++) {
+    if (sizes[i] < 0 || sizes[i] > MAX_SEG_DATA_SIZE)
+      usage(progname);
+  }
+  for (i = 0; i < num_depths; i++) {
+    if (depths[i] < 0)
+      usage(progname);
+  }
+
+  /* Just enough of the library to build and convert datagrams. */
+  struct config cc;
+  memset(&cc, 0, sizeof(struct config));
+  config = &cc;
+  config->ip_addr = LOCALHOST;
+  config->port = 9999;
+  srand(144);
+
+  cpns = cycles_per_ns(100);
+  fprintf(stderr, "[INFO] %.3f cycles/ns (%s)\n", cpns,
+          HAVE_CYCLE_COUNTER ? "time-stamp counter" : "no cycle counter");
+
+  for (i = 0; i < (int) (sizeof(benchmarks) / sizeof(bench_t)); i++) {
+    const bench_t *bench = &benchmarks[i];
+    if (filter && !strstr(bench->name, filter))
+      continue;
+
+    int *values = bench->sized_by_bytes ? sizes : depths;
+    int num_values = bench->sized_by_bytes ? num_sizes : num_depths;
+    for (j = 0; j < num_values; j++)
+      measure(bench, values[j]);
+  }
+  return 0;
+}
@@ -0,0 +1,238 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "ctcp_pcap.h"
+
+/** Block types, option codes and values from the pcapng specification. */
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER 0x1A2B3C4D
+#define PCAPNG_OPT_END 0
+#define PCAPNG_SHB_USERAPPL 4
+#define PCAPNG_IF_NAME 2
+#define PCAPNG_IF_DESCRIPTION 3
+#define PCAPNG_IF_TSRESOL 9
+#define PCAPNG_EPB_FLAGS 2
+#define PCAPNG_INBOUND 1
+#define PCAPNG_OUTBOUND 2
+#define LINKTYPE_RAW 101
+
+/** Rounds up to a multiple of 4, which blocks and options are padded to. */
+#define PAD4(len) (((len) + 3) & ~3)
+
+struct pcapng {
+  int fd;                       /* The file */
+  uint8_t *map;                 /* Chunk of the file mapped in, or NULL */
+  off_t map_off;                /* Where in the file the chunk starts */
+  size_t pos;                   /* Where in the chunk to write next */
+  int snaplen;                  /* Most bytes to capture per packet */
+  int interfaces;               /* Number of interfaces added */
+  long page;                    /* Page size */
+};
+
+
+//////////////////////////////////// FILE /////////////////////////////////////
+
+/**
+ * Maps in a chunk of the file, growing the file to fit.
+ *
+ * off: Where in the file the chunk starts. A multiple of the page size.
+ * returns: 0 on success, -1 otherwise (and nothing more is captured).
+ */
+static int pcapng_map(pcapng_t *pcap, off_t off) {
+  pcap->map = NULL;
+  if (ftruncate(pcap->fd, off + PCAP_CHUNK) < 0) {
+    fprintf(stderr, "[ERROR] Could not grow capture: %s\n", strerror(errno));
+    return -1;
+  }
+  void *map = mmap(NULL, PCAP_CHUNK, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   pcap->fd, off);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "[ERROR] Could not map capture: %s\n", strerror(errno));
+    return -1;
+  }
+  pcap->map = map;
+  pcap->map_off = off;
+  return 0;
+}
+
+/**
+ * Takes the space for a block, mapping in the next chunk of the file if it
+ * does not fit in this one.
+ *
+ * len: Length of the block.
+ * returns: Where to write the block, or NULL if the file could not be mapped.
+ */
+static uint8_t *pcapng_reserve(pcapng_t *pcap, size_t len) {
+  if (pcap->map == NULL)
+    return NULL;
+
+  if (pcap->pos + len > PCAP_CHUNK) {
+    /* Map again from the page the next block starts in. */
+    off_t end = pcap->map_off + pcap->pos;
+    off_t off = end & ~((off_t) pcap->page - 1);
+    munmap(pcap->map, PCAP_CHUNK);
+    if (pcapng_map(pcap, off) < 0)
+      return NULL;
+    pcap->pos = end - off;
+  }
+
+  uint8_t *block = pcap->map + pcap->pos;
+  pcap->pos += len;
+  return block;
+}
+
+
+/////////////////////////////////// BLOCKS ////////////////////////////////////
+
+/**
+ * Space an option takes up, including its code and length.
+ */
+static size_t option_size(size_t len) {
+  return 4 + PAD4(len);
+}
+
+/**
+ * Writes out a 32-bit value.
+ *
+ * returns: Where to write next.
+ */
+static uint8_t *put32(uint8_t *p, uint32_t value) {
+  memcpy(p, &value, 4);
+  return p + 4;
+}
+
+/**
+ * Writes out an option, padded with zeros.
+ *
+ * returns: Where to write next.
+ */
+static uint8_t *put_option(uint8_t *p, uint16_t code, const void *value,
+                           uint16_t len) {
+  memcpy(p, &code, 2);
+  memcpy(p + 2, &len, 2);
+  memcpy(p + 4, value, len);
+  memset(p + 4 + len, 0, PAD4(len) - len);
+  return p + option_size(len);
+}
+
+/**
+ * Starts a block.
+ *
+ * returns: Where to write the block's body.
+ */
+static uint8_t *block_start(uint8_t *p, uint32_t type, uint32_t len) {
+  p = put32(p, type);
+  return put32(p, len);
+}
+
+/**
+ * Ends a block's options and the block.
+ */
+static void block_end(uint8_t *p, uint32_t len) {
+  p = put32(p, PCAPNG_OPT_END);
+  put32(p, len);
+}
+
+
+//////////////////////////////////// PCAPNG ///////////////////////////////////
+
+pcapng_t *pcapng_open(const char *path, int snaplen) {
+  int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "[ERROR] Could not create capture %s: %s\n", path,
+            strerror(errno));
+    return NULL;
+  }
+
+  pcapng_t *pcap = calloc(sizeof(pcapng_t), 1);
+  pcap->fd = fd;
+  pcap->snaplen = snaplen > 0 && snaplen < PCAP_SNAPLEN ? snaplen :
+                                                          PCAP_SNAPLEN;
+  pcap->page = sysconf(_SC_PAGESIZE);
+  if (pcapng_map(pcap, 0) < 0) {
+    close(fd);
+    free(pcap);
+    return NULL;
+  }
+
+  /* Section header. The length of the section is not known. */
+  static const char appl[] = "ctcp";
+  uint32_t len = 28 + option_size(sizeof(appl) - 1) + 4;
+  uint8_t *p = block_start(pcapng_reserve(pcap, len), PCAPNG_SHB, len);
+  p = put32(p, PCAPNG_BYTE_ORDER);
+  uint16_t version[2] = { 1, 0 };
+  memcpy(p, version, 4);
+  int64_t section_len = -1;
+  memcpy(p + 4, &section_len, 8);
+  p = put_option(p + 12, PCAPNG_SHB_USERAPPL, appl, sizeof(appl) - 1);
+  block_end(p, len);
+  return pcap;
+}
+
+int pcapng_interface(pcapng_t *pcap, const char *name,
+                     const char *description) {
+  /* Timestamps are in nanoseconds (10^-9 seconds). */
+  uint8_t tsresol = 9;
+  uint16_t name_len = strlen(name);
+  uint16_t desc_len = description ? strlen(description) : 0;
+
+  uint32_t len = 20 + option_size(name_len) + option_size(1) + 4;
+  if (description)
+    len += option_size(desc_len);
+  uint8_t *p = pcapng_reserve(pcap, len);
+  if (p == NULL)
+    return -1;
+
+  p = block_start(p, PCAPNG_IDB, len);
+  uint16_t linktype[2] = { LINKTYPE_RAW, 0 };
+  memcpy(p, linktype, 4);
+  p = put32(p + 4, pcap->snaplen);
+  p = put_option(p, PCAPNG_IF_NAME, name, name_len);
+  if (description)
+    p = put_option(p, PCAPNG_IF_DESCRIPTION, description, desc_len);
+  p = put_option(p, PCAPNG_IF_TSRESOL, &tsresol, 1);
+  block_end(p, len);
+  return pcap->interfaces++;
+}
+
+void pcapng_packet(pcapng_t *pcap, int interface, int64_t now,
+                   const void *packet, size_t len, bool outbound) {
+  if (interface < 0)
+    return;
+  uint32_t caplen = len < pcap->snaplen ? len : pcap->snaplen;
+  uint32_t block_len = 28 + PAD4(caplen) + option_size(4) + 8;
+  uint8_t *p = pcapng_reserve(pcap, block_len);
+  if (p == NULL)
+    return;
+
+  p = block_start(p, PCAPNG_EPB, block_len);
+  p = put32(p, interface);
+  p = put32(p, (uint64_t) now >> 32);
+  p = put32(p, (uint32_t) now);
+  p = put32(p, caplen);
+  p = put32(p, len);
+  memcpy(p, packet, caplen);
+  memset(p + caplen, 0, PAD4(caplen) - caplen);
+  p += PAD4(caplen);
+
+  uint32_t flags = outbound ? PCAPNG_OUTBOUND : PCAPNG_INBOUND;
+  p = put_option(p, PCAPNG_EPB_FLAGS, &flags, 4);
+  block_end(p, block_len);
+}
+
+void pcapng_close(pcapng_t *pcap) {
+  if (pcap->map != NULL) {
+    munmap(pcap->map, PCAP_CHUNK);
+    if (ftruncate(pcap->fd, pcap->map_off + pcap->pos) < 0)
+      fprintf(stderr, "[ERROR] Could not truncate capture\n");
+  }
+  close(pcap->fd);
+  free(pcap);
+}
@@ -0,0 +1,75 @@
+/******************************************************************************
+ * ctcp_pcap.h
+ * -----------
+ * Writes the datagrams a host sends and receives to a pcapng file (--pcap),
+ * which Wireshark, tcpdump -r and tshark can all read. Every datagram is a
+ * raw IPv4 packet (LINKTYPE_RAW), with a timestamp in nanoseconds and a flag
+ * saying whether it was sent or received.
+ *
+ * The file is written through a memory mapping, a chunk at a time. Capturing
+ * a packet is a copy into the mapping; the kernel writes the pages out in the
+ * background. The only system calls are when a chunk fills up and the next
+ * one is mapped in.
+ *
+ * If the program does not exit cleanly, the file may end in zeros after the
+ * last packet.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_PCAP_H
+#define CTCP_PCAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Default and largest number of bytes captured per packet. */
+#define PCAP_SNAPLEN 65535
+
+/** Size of each chunk of the file mapped in at once. */
+#define PCAP_CHUNK (4 * 1024 * 1024)
+
+typedef struct pcapng pcapng_t;
+
+
+/**
+ * Creates a pcapng file and writes its section header.
+ *
+ * path: File to write to. Truncated if it already exists.
+ * snaplen: Most bytes to capture per packet. 0 for PCAP_SNAPLEN.
+ * returns: The file, or NULL if it could not be created.
+ */
+pcapng_t *pcapng_open(const char *path, int snaplen);
+
+/**
+ * Adds an interface to capture packets on.
+ *
+ * pcap: The file.
+ * name: Short name of the interface.
+ * description: Longer description of the interface, or NULL.
+ * returns: The interface's ID, for pcapng_packet(), or -1 on error.
+ */
+int pcapng_interface(pcapng_t *pcap, const char *name,
+                     const char *description);
+
+/**
+ * Captures a packet.
+ *
+ * pcap: The file.
+ * interface: ID of the interface it went through.
+ * now: When, in nanoseconds since the epoch.
+ * packet: The raw IP packet.
+ * len: Length of the packet. Only the first snaplen bytes are kept.
+ * outbound: Whether the packet was sent (else received).
+ */
+void pcapng_packet(pcapng_t *pcap, int interface, int64_t now,
+                   const void *packet, size_t len, bool outbound);
+
+/**
+ * Cuts the file down to what has been written and closes it.
+ *
+ * pcap: The file. Freed.
+ */
+void pcapng_close(pcapng_t *pcap);
+
+#endif /* CTCP_PCAP_H */
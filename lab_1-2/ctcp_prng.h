@@ -0,0 +1,60 @@
+/******************************************************************************
+ * ctcp_prng.h
+ * -----------
+ * Small, fast, seedable pseudo-random number generator (SplitMix64). Unlike
+ * rand(), each generator has its own state, so separate users of randomness
+ * (e.g. each direction of a simulated link) do not disturb each other and
+ * runs are reproducible from a seed.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_PRNG_H
+#define CTCP_PRNG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/** Generator state. */
+typedef struct {
+  uint64_t state;
+} prng_t;
+
+/**
+ * Seeds a generator.
+ */
+static inline void prng_seed(prng_t *prng, uint64_t seed) {
+  prng->state = seed;
+}
+
+/**
+ * Returns the next 64 random bits.
+ */
+static inline uint64_t prng_next(prng_t *prng) {
+  uint64_t z = (prng->state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/**
+ * Returns a random number in [0, n). Returns 0 if n is 0.
+ */
+static inline uint32_t prng_below(prng_t *prng, uint32_t n) {
+  return (uint32_t) (((prng_next(prng) >> 32) * n) >> 32);
+}
+
+/**
+ * Returns a random number in [0, 1).
+ */
+static inline double prng_double(prng_t *prng) {
+  return (prng_next(prng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Returns true with the given probability, given as a percentage.
+ */
+static inline bool prng_percent(prng_t *prng, double percent) {
+  return percent > 0 && prng_double(prng) * 100 < percent;
+}
+
+#endif /* CTCP_PRNG_H */
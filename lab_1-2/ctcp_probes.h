@@ -0,0 +1,112 @@
+/******************************************************************************
+ * ctcp_probes.h
+ * -------------
+ * USDT (SystemTap-style) static probes. Each probe is a single nop in the code
+ * and a note in the binary's .note.stapsdt section saying where the nop is and
+ * where to find its arguments. Nothing else happens unless a tracer such as
+ * bpftrace or perf attaches to it, so they can stay in a release build:
+ *
+ *     sudo bpftrace -e 'usdt:./ctcp:ctcp:retransmit { @[arg1] = count(); }'
+ *
+ * <sys/sdt.h> (from systemtap-sdt-dev) is used if it is installed. Otherwise,
+ * on x86-64, the notes are written out here in the same format. Elsewhere, or
+ * when built with -DCTCP_NO_PROBES, the probes compile to nothing.
+ *
+ * Arguments are all passed as 64-bit signed integers. The probes are listed
+ * in the README.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_PROBES_H
+#define CTCP_PROBES_H
+
+#include <stdint.h>
+
+#if !defined(CTCP_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define CTCP_SDT_H
+#endif
+#endif
+
+#if defined(CTCP_NO_PROBES)
+
+#define CTCP_PROBE1(name, a) do {} while (0)
+#define CTCP_PROBE3(name, a, b, c) do {} while (0)
+#define CTCP_PROBE5(name, a, b, c, d, e) do {} while (0)
+#define CTCP_PROBE6(name, a, b, c, d, e, f) do {} while (0)
+
+#elif defined(CTCP_SDT_H)
+
+#include <sys/sdt.h>
+
+#define CTCP_PROBE1(name, a) \
+  DTRACE_PROBE1(ctcp, name, (int64_t) (a))
+#define CTCP_PROBE3(name, a, b, c) \
+  DTRACE_PROBE3(ctcp, name, (int64_t) (a), (int64_t) (b), (int64_t) (c))
+#define CTCP_PROBE5(name, a, b, c, d, e) \
+  DTRACE_PROBE5(ctcp, name, (int64_t) (a), (int64_t) (b), (int64_t) (c), \
+                (int64_t) (d), (int64_t) (e))
+#define CTCP_PROBE6(name, a, b, c, d, e, f) \
+  DTRACE_PROBE6(ctcp, name, (int64_t) (a), (int64_t) (b), (int64_t) (c), \
+                (int64_t) (d), (int64_t) (e), (int64_t) (f))
+
+#elif defined(__x86_64__) && defined(__GNUC__)
+
+/* A note in the stapsdt format: the address of the nop, the base it is
+   relative to, no semaphore, then the provider, the probe's name and where
+   its arguments are ("-8@%rdi" for a signed 8-byte value in %rdi, etc.). The
+   compiler fills in the %0, %1, ... in args. */
+#define CTCP_SDT_NOTE(name, args)                                            \
+  "990: nop\n"                                                               \
+  ".pushsection .note.stapsdt,\"?\",\"note\"\n"                              \
+  ".balign 4\n"                                                              \
+  ".4byte 992f-991f, 994f-993f, 3\n"                                         \
+  "991: .asciz \"stapsdt\"\n"                                                \
+  "992: .balign 4\n"                                                         \
+  "993: .8byte 990b\n"                                                       \
+  ".8byte _.stapsdt.base\n"                                                  \
+  ".8byte 0\n"                                                               \
+  ".asciz \"ctcp\"\n"                                                        \
+  ".asciz \"" #name "\"\n"                                                   \
+  ".asciz \"" args "\"\n"                                                    \
+  "994: .balign 4\n"                                                         \
+  ".popsection\n"                                                            \
+  ".ifndef _.stapsdt.base\n"                                                 \
+  ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"    \
+  ".weak _.stapsdt.base\n"                                                   \
+  ".hidden _.stapsdt.base\n"                                                 \
+  "_.stapsdt.base: .space 1\n"                                               \
+  ".size _.stapsdt.base, 1\n"                                                \
+  ".popsection\n"                                                            \
+  ".endif\n"
+
+/** Lets an argument be in a register, memory or a constant. */
+#define CTCP_SDT_ARG(a) "nor" ((int64_t) (a))
+
+#define CTCP_PROBE1(name, a)                                                 \
+  __asm__ __volatile__ (CTCP_SDT_NOTE(name, "-8@%0") :: CTCP_SDT_ARG(a))
+#define CTCP_PROBE3(name, a, b, c)                                           \
+  __asm__ __volatile__ (CTCP_SDT_NOTE(name, "-8@%0 -8@%1 -8@%2") ::          \
+                        CTCP_SDT_ARG(a), CTCP_SDT_ARG(b), CTCP_SDT_ARG(c))
+#define CTCP_PROBE5(name, a, b, c, d, e)                                     \
+  __asm__ __volatile__ (CTCP_SDT_NOTE(name,                                  \
+                                      "-8@%0 -8@%1 -8@%2 -8@%3 -8@%4") ::    \
+                        CTCP_SDT_ARG(a), CTCP_SDT_ARG(b), CTCP_SDT_ARG(c),   \
+                        CTCP_SDT_ARG(d), CTCP_SDT_ARG(e))
+#define CTCP_PROBE6(name, a, b, c, d, e, f)                                  \
+  __asm__ __volatile__ (CTCP_SDT_NOTE(name,                                  \
+                                      "-8@%0 -8@%1 -8@%2 -8@%3 -8@%4 -8@%5") \
+                        :: CTCP_SDT_ARG(a), CTCP_SDT_ARG(b),                 \
+                        CTCP_SDT_ARG(c), CTCP_SDT_ARG(d), CTCP_SDT_ARG(e),   \
+                        CTCP_SDT_ARG(f))
+
+#else
+
+#define CTCP_PROBE1(name, a) do {} while (0)
+#define CTCP_PROBE3(name, a, b, c) do {} while (0)
+#define CTCP_PROBE5(name, a, b, c, d, e) do {} while (0)
+#define CTCP_PROBE6(name, a, b, c, d, e, f) do {} while (0)
+
+#endif
+
+#endif /* CTCP_PROBES_H */
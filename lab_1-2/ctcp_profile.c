@@ -0,0 +1,233 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ctcp_profile.h"
+
+/** Longest line in a profiles file. */
+#define PROFILE_LINE 512
+
+
+/**
+ * Strips spaces off both ends of a string, in place.
+ */
+static char *profile_strip(char *s) {
+  while (isspace((unsigned char) *s))
+    s++;
+  char *end = s + strlen(s);
+  while (end > s && isspace((unsigned char) end[-1]))
+    *--end = '\0';
+  return s;
+}
+
+/**
+ * Reads a list of ports and port ranges.
+ *
+ * list: The list. Split up in place.
+ * ports: Where to put them.
+ * num_ports: Where to put how many there are.
+ * returns: 0 on success, -1 if one is not a port or range.
+ */
+static int profile_ports(char *list, profile_ports_t *ports, int *num_ports) {
+  char *save = NULL;
+  char *word;
+  for (word = strtok_r(list, " \t,", &save); word;
+       word = strtok_r(NULL, " \t,", &save)) {
+    profile_ports_t range;
+    char end;
+    int n = sscanf(word, "%d-%d%c", &range.low, &range.high, &end);
+    if (n == 1)
+      range.high = range.low;
+    else if (n != 2)
+      return -1;
+    if (range.low < 0 || range.high < range.low || range.high > 65535 ||
+        *num_ports == PROFILE_MATCHES)
+      return -1;
+    ports[(*num_ports)++] = range;
+  }
+  return 0;
+}
+
+/**
+ * Reads a list of programs.
+ */
+static int profile_programs(char *list, profile_t *profile) {
+  char *save = NULL;
+  char *word;
+  for (word = strtok_r(list, " \t,", &save); word;
+       word = strtok_r(NULL, " \t,", &save)) {
+    if (strlen(word) >= PROFILE_NAME || profile->num_programs ==
+                                        PROFILE_MATCHES)
+      return -1;
+    strcpy(profile->programs[profile->num_programs++], word);
+  }
+  return 0;
+}
+
+/**
+ * Whether a port is in a list of ports and port ranges.
+ */
+static bool profile_port_in(int port, profile_ports_t *ports, int num_ports) {
+  int i;
+  for (i = 0; i < num_ports; i++) {
+    if (port >= ports[i].low && port <= ports[i].high)
+      return true;
+  }
+  return false;
+}
+
+
+profile_t *profiles_load(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "[ERROR] Could not open profiles %s\n", path);
+    return NULL;
+  }
+
+  profile_t *profiles = NULL;
+  profile_t **tail = &profiles;
+  profile_t *profile = NULL;
+  char buf[PROFILE_LINE];
+  const char *error = NULL;
+  int line = 0;
+
+  while (error == NULL && fgets(buf, sizeof(buf), file)) {
+    line++;
+    char *comment = strchr(buf, '#');
+    if (comment)
+      *comment = '\0';
+    char *s = profile_strip(buf);
+    if (*s == '\0')
+      continue;
+
+    /* Start of a profile. */
+    if (*s == '[') {
+      char *end = strchr(s, ']');
+      if (end == NULL || end[1] != '\0') {
+        error = "expected [name]";
+        break;
+      }
+      *end = '\0';
+      char *name = profile_strip(s + 1);
+      if (*name == '\0' || strlen(name) >= PROFILE_NAME) {
+        error = "bad profile name";
+        break;
+      }
+      if (profile_find(profiles, name)) {
+        error = "profile already defined";
+        break;
+      }
+      profile = calloc(sizeof(profile_t), 1);
+      strcpy(profile->name, name);
+      *tail = profile;
+      tail = &profile->next;
+      continue;
+    }
+
+    /* A setting, or what the profile matches. */
+    char *equals = strchr(s, '=');
+    if (equals == NULL) {
+      error = "expected key = value";
+      break;
+    }
+    if (profile == NULL) {
+      error = "setting before the first [profile]";
+      break;
+    }
+    *equals = '\0';
+    char *key = profile_strip(s);
+    char *value = profile_strip(equals + 1);
+
+    if (strcmp(key, "ports") == 0) {
+      if (profile_ports(value, profile->ports, &profile->num_ports) < 0)
+        error = "bad ports";
+    }
+    else if (strcmp(key, "peer_ports") == 0) {
+      if (profile_ports(value, profile->peer_ports,
+                        &profile->num_peer_ports) < 0)
+        error = "bad peer_ports";
+    }
+    else if (strcmp(key, "programs") == 0) {
+      if (profile_programs(value, profile) < 0)
+        error = "bad programs";
+    }
+    else if (strlen(key) >= PROFILE_NAME || strlen(value) >= PROFILE_NAME ||
+             *key == '\0' || *value == '\0') {
+      error = "bad setting";
+    }
+    else if (profile->num_settings == PROFILE_SETTINGS) {
+      error = "too many settings";
+    }
+    else {
+      profile_setting_t *setting = &profile->settings[profile->num_settings++];
+      strcpy(setting->key, key);
+      strcpy(setting->value, value);
+      setting->line = line;
+    }
+  }
+  fclose(file);
+
+  if (error == NULL && profiles == NULL) {
+    fprintf(stderr, "[ERROR] No profiles in %s\n", path);
+    return NULL;
+  }
+  if (error) {
+    fprintf(stderr, "[ERROR] %s:%d: %s\n", path, line, error);
+    profiles_free(profiles);
+    return NULL;
+  }
+  return profiles;
+}
+
+profile_t *profile_find(profile_t *profiles, const char *name) {
+  profile_t *profile;
+  for (profile = profiles; profile; profile = profile->next) {
+    if (strcmp(profile->name, name) == 0)
+      return profile;
+  }
+  return NULL;
+}
+
+profile_t *profile_match(profile_t *profiles, int port, int peer_port,
+                         const char *program) {
+  /* Match on the program's name, not where it is. */
+  const char *name = NULL;
+  if (program) {
+    name = strrchr(program, '/');
+    name = name ? name + 1 : program;
+  }
+
+  profile_t *profile;
+  for (profile = profiles; profile; profile = profile->next) {
+    if (profile->num_ports == 0 && profile->num_peer_ports == 0 &&
+        profile->num_programs == 0)
+      continue;
+    if (profile->num_ports &&
+        !profile_port_in(port, profile->ports, profile->num_ports))
+      continue;
+    if (profile->num_peer_ports &&
+        !profile_port_in(peer_port, profile->peer_ports,
+                         profile->num_peer_ports))
+      continue;
+
+    if (profile->num_programs) {
+      int i;
+      bool found = false;
+      for (i = 0; name && i < profile->num_programs; i++)
+        found = found || strcmp(name, profile->programs[i]) == 0;
+      if (!found)
+        continue;
+    }
+    return profile;
+  }
+  return NULL;
+}
+
+void profiles_free(profile_t *profiles) {
+  while (profiles) {
+    profile_t *next = profiles->next;
+    free(profiles);
+    profiles = next;
+  }
+}
@@ -0,0 +1,114 @@
+/******************************************************************************
+ * ctcp_profile.h
+ * --------------
+ * Named profiles of connection settings, read from a file (--profiles). A
+ * profile starts with its name in brackets, and has one setting per line:
+ *
+ *     # Interactive sessions.
+ *     [low-latency]
+ *     ports = 9000-9099
+ *     programs = sh bash
+ *     nodelay = 1
+ *     rto_min = 20
+ *     busy_poll = 1
+ *
+ * Settings are the ones the control socket can change (see --control in the
+ * README). This file only reads them in; ctcp checks them once everything is
+ * read. A server gives a new connection the first
+ * profile that matches it, by:
+ *
+ *   ports        The server's port.
+ *   peer_ports   The client's port.
+ *   programs     The program the server runs (without its directory).
+ *
+ * Each is a list separated by spaces or commas. Ports can be ranges, like
+ * 9000-9099. A profile matches if everything it lists does, and a profile that
+ * lists none of them is only used when asked for by name (--profile).
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_PROFILE_H
+#define CTCP_PROFILE_H
+
+#include <stdbool.h>
+
+/** Longest name of a profile, program, setting or value. */
+#define PROFILE_NAME 32
+
+/** Most settings, and most ports or programs of each kind, in a profile. */
+#define PROFILE_SETTINGS 32
+#define PROFILE_MATCHES 16
+
+/** A setting. */
+struct profile_setting {
+  char key[PROFILE_NAME];
+  char value[PROFILE_NAME];
+  int line;                     /* Line it is on, for errors */
+};
+typedef struct profile_setting profile_setting_t;
+
+/** A range of ports. */
+struct profile_ports {
+  int low;
+  int high;
+};
+typedef struct profile_ports profile_ports_t;
+
+/** A profile. */
+struct profile {
+  char name[PROFILE_NAME];
+  profile_setting_t settings[PROFILE_SETTINGS];
+  int num_settings;
+
+  /* Which connections a server gives it. */
+  profile_ports_t ports[PROFILE_MATCHES];
+  int num_ports;
+  profile_ports_t peer_ports[PROFILE_MATCHES];
+  int num_peer_ports;
+  char programs[PROFILE_MATCHES][PROFILE_NAME];
+  int num_programs;
+
+  struct profile *next;         /* Next profile in the file */
+};
+typedef struct profile profile_t;
+
+
+/**
+ * Reads in profiles.
+ *
+ * path: File to read.
+ * returns: The profiles, in the order they are in the file, or NULL if the
+ *          file could not be read, has a line that makes no sense, or has no
+ *          profiles.
+ */
+profile_t *profiles_load(const char *path);
+
+/**
+ * Finds a profile by name.
+ *
+ * profiles: The profiles.
+ * name: Its name.
+ * returns: The profile, or NULL if there is none by that name.
+ */
+profile_t *profile_find(profile_t *profiles, const char *name);
+
+/**
+ * Finds the first profile that matches a connection to a server.
+ *
+ * profiles: The profiles.
+ * port: The server's port.
+ * peer_port: The client's port.
+ * program: Program the server runs, or NULL if none.
+ * returns: The profile, or NULL if none matches.
+ */
+profile_t *profile_match(profile_t *profiles, int port, int peer_port,
+                         const char *program);
+
+/**
+ * Frees profiles.
+ *
+ * profiles: The profiles.
+ */
+void profiles_free(profile_t *profiles);
+
+#endif /* CTCP_PROFILE_H */
@@ -0,0 +1,88 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ctcp_record.h"
+
+struct record {
+  FILE *file;                   /* The file */
+  char *buffer;                 /* Buffer it is written through */
+  record_event_t read;          /* Last ctcp_read() call, not written yet */
+  bool reading;                 /* Whether there is one */
+};
+
+
+/**
+ * Writes out an event, and its data if there is any. Pending ctcp_read()
+ * events have none, and are written with NULL.
+ */
+static void record_write(record_t *rec, record_event_t *event,
+                         const void *data) {
+  fwrite(event, sizeof(record_event_t), 1, rec->file);
+  if (data != NULL && event->len > 0)
+    fwrite(data, event->len, 1, rec->file);
+}
+
+
+record_t *record_open(const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    fprintf(stderr, "[ERROR] Could not create recording %s: %s\n", path,
+            strerror(errno));
+    return NULL;
+  }
+
+  record_t *rec = calloc(sizeof(record_t), 1);
+  rec->file = file;
+  rec->buffer = malloc(RECORD_BUFFER);
+  setvbuf(file, rec->buffer, _IOFBF, RECORD_BUFFER);
+
+  record_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, RECORD_MAGIC, sizeof(RECORD_MAGIC));
+  header.version = RECORD_VERSION;
+  header.event_size = sizeof(record_event_t);
+  fwrite(&header, sizeof(header), 1, file);
+  return rec;
+}
+
+void record_event(record_t *rec, uint32_t conn, enum record_type type,
+                  int32_t value, const void *data, uint16_t len, int64_t now) {
+  /* A ctcp_read() call followed straight away by another one did nothing,
+     and is left out. */
+  if (rec->reading) {
+    if (type == RECORD_READ && conn == rec->read.conn) {
+      rec->read.time = now;
+      rec->read.value++;
+      return;
+    }
+    record_write(rec, &rec->read, NULL);
+    rec->reading = false;
+  }
+
+  record_event_t event;
+  memset(&event, 0, sizeof(event));
+  event.time = now;
+  event.conn = conn;
+  event.type = type;
+  event.len = data ? len : 0;
+  event.value = value;
+
+  if (type == RECORD_READ) {
+    rec->read = event;
+    rec->reading = true;
+    return;
+  }
+  record_write(rec, &event, data);
+}
+
+void record_close(record_t *rec) {
+  if (rec->reading)
+    record_write(rec, &rec->read, NULL);
+  if (fclose(rec->file) != 0)
+    fprintf(stderr, "[ERROR] Could not write recording\n");
+  free(rec->buffer);
+  free(rec);
+}
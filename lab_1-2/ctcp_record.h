@@ -0,0 +1,124 @@
+/******************************************************************************
+ * ctcp_record.h
+ * -------------
+ * Recording of everything student code sees on a live run (--record), so that
+ * ctcp_replay can run ctcp.c through exactly the same thing again, offline.
+ *
+ * A recording is a record_header_t followed by events, each a record_event_t
+ * and then len bytes of data. There are three kinds of event:
+ *
+ *   - Calls into student code: ctcp_init(), ctcp_receive() (with the
+ *     segment), ctcp_read(), ctcp_output() and ctcp_timer(). ctcp_replay
+ *     makes the same calls, at the same (virtual) times.
+ *   - What the outside world did while student code was running: data
+ *     conn_input() handed out, bytes conn_output() got written out straight
+ *     away, and the segments conn_send() sent. These come after the call they
+ *     happened in. ctcp_replay hands out the same input and output space, and
+ *     checks that the same segments get sent.
+ *   - Settings changed through the control socket (see --control) in between
+ *     calls, so that conn_tunables() returns the same thing.
+ *
+ * The main loop calls ctcp_read() whenever there is input, even if student
+ * code has no room to send it, so there can be long runs of ctcp_read() calls
+ * that do nothing. Only the last call of such a run is recorded.
+ *
+ * Events are written through a large stdio buffer. Nothing else is left out,
+ * so recording a busy connection costs more than tracing it (see
+ * ctcp_trace.h).
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_RECORD_H
+#define CTCP_RECORD_H
+
+#include <stdint.h>
+
+/** Magic number at the start of a recording, and the format version. */
+#define RECORD_MAGIC "CTCPREC"
+#define RECORD_VERSION 1
+
+/** Size of the buffer events are written through. */
+#define RECORD_BUFFER (1024 * 1024)
+
+/** Kinds of event. */
+enum record_type {
+  /* Calls into student code. */
+  RECORD_INIT = 1,              /* ctcp_init(). Data is the ctcp_config_t */
+  RECORD_RECEIVE,               /* ctcp_receive(). Data is the segment */
+  RECORD_READ,                  /* ctcp_read(). value is the number of calls
+                                   just before it that were left out */
+  RECORD_OUTPUT,                /* Output was written out, then ctcp_output()
+                                   was called. value is the bytes written */
+  RECORD_TIMER,                 /* ctcp_timer(). For every connection */
+
+  /* What happened while student code was running. */
+  RECORD_INPUT,                 /* conn_input() returned value. Data is what
+                                   it read */
+  RECORD_WRITE,                 /* conn_output() wrote value bytes out straight
+                                   away */
+  RECORD_SEND,                  /* conn_send(). Data is the segment */
+
+  /* What happened between calls. */
+  RECORD_TUNE                   /* Settings were changed through the control
+                                   socket. value is the new version number.
+                                   Data is the ctcp_tunables_t. Also comes
+                                   straight after RECORD_INIT, with the
+                                   settings the connection starts with */
+};
+
+/** Whether an event is a call into student code. */
+#define RECORD_IS_CALL(type) ((type) <= RECORD_TIMER)
+
+/** An event. Followed by len bytes of data. */
+struct record_event {
+  int64_t time;                 /* When, in nanoseconds */
+  uint32_t conn;                /* Connection, numbered from 1 in the order
+                                   they were set up. 0 for ctcp_timer() */
+  uint16_t type;                /* enum record_type */
+  uint16_t len;                 /* Bytes of data that follow */
+  int32_t value;                /* Depends on the type */
+  uint32_t pad;
+};
+typedef struct record_event record_event_t;
+
+/** Start of a recording. */
+struct record_header {
+  char magic[8];                /* RECORD_MAGIC */
+  uint32_t version;             /* RECORD_VERSION */
+  uint32_t event_size;          /* sizeof(record_event_t) */
+};
+typedef struct record_header record_header_t;
+
+typedef struct record record_t;
+
+
+/**
+ * Creates a recording.
+ *
+ * path: File to write to. Truncated if it already exists.
+ * returns: The recording, or NULL if the file could not be created.
+ */
+record_t *record_open(const char *path);
+
+/**
+ * Records an event.
+ *
+ * rec: The recording.
+ * conn: Connection the event is for, 0 if none.
+ * type: Kind of event.
+ * value: Depends on the type.
+ * data: Data that goes with the event, or NULL.
+ * len: Length of the data.
+ * now: Current time, in nanoseconds.
+ */
+void record_event(record_t *rec, uint32_t conn, enum record_type type,
+                  int32_t value, const void *data, uint16_t len, int64_t now);
+
+/**
+ * Writes out the rest of the recording and closes it.
+ *
+ * rec: The recording. Freed.
+ */
+void record_close(record_t *rec);
+
+#endif /* CTCP_RECORD_H */
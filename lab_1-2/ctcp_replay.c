@@ -0,0 +1,634 @@
+/******************************************************************************
+ * ctcp_replay.c
+ * -------------
+ * Replays a recording made with ctcp --record (see ctcp_record.h) against
+ * ctcp.c, offline. Links against ctcp.c like the simulator does, and provides
+ * its own conn_*() functions. Every ctcp_init(), ctcp_receive(), ctcp_read(),
+ * ctcp_output() and ctcp_timer() call from the live run is made again, in
+ * order, with the same segments and input, the same output space, and the
+ * clock reading what it did at the time. Nothing ever sleeps.
+ *
+ * By default the segments ctcp.c sends are checked against the ones it sent
+ * on the live run, so a change to ctcp.c that changes its behavior shows up as
+ * the first point the two runs differ:
+ *
+ *     ./ctcp -c localhost:9999 -p 12345 --record incident.rec < input
+ *     ./ctcp_replay incident.rec
+ *
+ * With --fast, nothing is checked and the replay can be run many times over,
+ * for profiling the code paths the live run went through:
+ *
+ *     perf record ./ctcp_replay --fast --repeat 1000 incident.rec
+ *
+ * One line of JSON is printed with the results: how many calls of each kind
+ * were made and how long they took, how the segments sent compare with the
+ * recording, a hash of the output, and the statistics of each connection.
+ *
+ * A replay only goes the same way as the live run as long as ctcp.c does the
+ * same thing. Once it sends something else, the other end would have answered
+ * differently, but the replay carries on with what was recorded.
+ *
+ *****************************************************************************/
+
+#include "ctcp.h"
+#include "ctcp_linked_list.h"
+#include "ctcp_record.h"
+#include "ctcp_stats.h"
+#include "ctcp_sys.h"
+#include "ctcp_utils.h"
+
+/** Output space per connection. Same as MAX_BUF_SPACE in the library. */
+#define REPLAY_BUF_SPACE 8192
+
+/** Names of the calls into student code, indexed by enum record_type. */
+static const char *call_names[RECORD_TIMER + 1] = {
+  NULL, "init", "receive", "read", "output", "timer"
+};
+
+/** An event from the recording, and the data that goes with it. */
+struct replay_event {
+  record_event_t event;     /* The event */
+  const char *data;         /* Its data, in the recording */
+};
+typedef struct replay_event replay_event_t;
+
+/** Replayed connection. */
+struct conn {
+  uint32_t id;              /* Number in the recording */
+  ctcp_state_t *state;      /* Connection state */
+  bool delete_me;           /* conn_remove() was called */
+
+  linked_list_t *input;     /* Input events handed over but not read yet */
+  size_t input_used;        /* Bytes of the first one already read */
+  bool input_eof;           /* EOF handed over */
+  bool read_eof;            /* EOF handed out by conn_input() */
+
+  long long output_bytes;   /* Bytes accepted by conn_output() */
+  long long written;        /* Bytes of that written out */
+  long long credit;         /* Bytes the live run got written out, and this
+                               one has not yet */
+  bool wrote_eof;           /* EOF written by conn_output() */
+
+  linked_list_t *expected;  /* Segments sent on the live run, not yet sent
+                               on this one */
+
+  ctcp_stats_t stats;       /* Statistics */
+  uint32_t cwnd;            /* Last congestion window reported */
+  ctcp_tunables_t tunables; /* Settings, as changed on the live run */
+  uint32_t tunables_version;
+};
+
+/** The recording. */
+static char *recording;
+static replay_event_t *events;
+static long long num_events;
+
+/** Options. */
+static bool check = true;     /* Whether to check the segments sent */
+static int repeat = 1;        /* Number of passes */
+
+/** State of the current pass. */
+static bool checking;         /* Whether the segments sent are being checked.
+                                 Only on the first pass */
+static conn_t **conns;        /* Connections, by number (0 is unused) */
+static uint32_t num_conns;
+static long long replay_now;  /* Time of the call being replayed */
+static replay_event_t *current;
+static uint64_t timer_tick;   /* Which ctcp_timer() call is running, 0 if
+                                 none */
+static int expecting;         /* Segments expected from the current call */
+static uint64_t output_hash;  /* FNV-1a hash of the output of every
+                                 connection, in order */
+
+/** Results, over every pass. */
+static uint64_t calls[RECORD_TIMER + 1];
+static uint64_t call_ns[RECORD_TIMER + 1];
+static uint64_t reads_left_out;  /* ctcp_read() calls left out of the
+                                    recording */
+
+/** How the segments sent compare with the recording, on the first pass. */
+static long long sends_recorded;
+static long long sends_matched;
+static long long sends_different;
+static long long sends_unexpected;
+static long long sends_missing;
+static long long diverged_event = -1;
+static long long diverged_time;
+static uint32_t diverged_conn;
+static const char *diverged_reason;
+
+
+///////////////////////////////////// CLOCK ////////////////////////////////////
+
+/**
+ * Time source for current_time(). Returns the time of the call being
+ * replayed.
+ */
+static long long replay_time() {
+  return replay_now;
+}
+
+/**
+ * Monotonic wall-clock time, in nanoseconds. Used to time the calls.
+ */
+static long long wall_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+/////////////////////////////////// RECORDING //////////////////////////////////
+
+/**
+ * Reads in a recording.
+ *
+ * path: The recording.
+ * returns: 0 on success, -1 otherwise.
+ */
+static int load(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "[ERROR] Could not open %s\n", path);
+    return -1;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  recording = malloc(size > 0 ? size : 1);
+  if (size < (long) sizeof(record_header_t) ||
+      fread(recording, size, 1, file) != 1) {
+    fprintf(stderr, "[ERROR] %s is not a recording\n", path);
+    fclose(file);
+    return -1;
+  }
+  fclose(file);
+
+  record_header_t header;
+  memcpy(&header, recording, sizeof(header));
+  if (memcmp(header.magic, RECORD_MAGIC, sizeof(RECORD_MAGIC)) != 0) {
+    fprintf(stderr, "[ERROR] %s is not a recording\n", path);
+    return -1;
+  }
+  if (header.version != RECORD_VERSION ||
+      header.event_size != sizeof(record_event_t)) {
+    fprintf(stderr, "[ERROR] %s is version %u of the format, not %d\n", path,
+            header.version, RECORD_VERSION);
+    return -1;
+  }
+
+  /* Events are copied out, since their data leaves them unaligned. */
+  long long max_events = 0;
+  long pos = sizeof(header);
+  while (pos + (long) sizeof(record_event_t) <= size) {
+    if (num_events == max_events) {
+      max_events = max_events ? max_events * 2 : 1024;
+      events = realloc(events, max_events * sizeof(replay_event_t));
+    }
+    replay_event_t *e = &events[num_events];
+    memcpy(&e->event, recording + pos, sizeof(record_event_t));
+    pos += sizeof(record_event_t);
+    if (pos + e->event.len > size)
+      break;
+    e->data = recording + pos;
+    pos += e->event.len;
+    num_events++;
+  }
+  if (pos != size)
+    fprintf(stderr, "[INFO] %s ends part way through an event\n", path);
+  return 0;
+}
+
+
+///////////////////////////////// CONNECTIONS /////////////////////////////////
+
+/**
+ * Finds a connection by its number in the recording.
+ *
+ * returns: The connection, or NULL if it has not been set up.
+ */
+static conn_t *find_conn(uint32_t id) {
+  return id > 0 && id <= num_conns ? conns[id] : NULL;
+}
+
+/**
+ * Creates a connection for a ctcp_init() call, before the call is made.
+ */
+static conn_t *create_conn(uint32_t id) {
+  if (id > num_conns) {
+    conns = realloc(conns, (id + 1) * sizeof(conn_t *));
+    memset(conns + num_conns + 1, 0, (id - num_conns) * sizeof(conn_t *));
+    num_conns = id;
+  }
+  conn_t *conn = calloc(sizeof(conn_t), 1);
+  conn->id = id;
+  conn->input = ll_create();
+  conn->expected = ll_create();
+  conns[id] = conn;
+  return conn;
+}
+
+/**
+ * Frees every connection, tearing down whatever ctcp.c did not.
+ */
+static void free_conns() {
+  uint32_t i;
+  for (i = 1; i <= num_conns; i++) {
+    conn_t *conn = conns[i];
+    if (conn == NULL)
+      continue;
+    if (conn->state && !conn->delete_me)
+      ctcp_destroy(conn->state);
+    ll_destroy(conn->input);
+    ll_destroy(conn->expected);
+    free(conn);
+  }
+  free(conns);
+  conns = NULL;
+  num_conns = 0;
+}
+
+/**
+ * Notes the first point the replay differs from the recording.
+ */
+static void diverge(conn_t *conn, const char *reason) {
+  if (diverged_event >= 0)
+    return;
+  diverged_event = current - events;
+  diverged_time = replay_now;
+  diverged_conn = conn->id;
+  diverged_reason = reason;
+}
+
+
+//////////////////////////////////// REPLAY ///////////////////////////////////
+
+/**
+ * Hands over something that happened while a call was running on the live
+ * run, before the call is replayed: input becomes readable, output space
+ * frees up, and segments sent are expected to be sent again.
+ */
+static void hand_over(replay_event_t *e) {
+  conn_t *conn = find_conn(e->event.conn);
+  if (conn == NULL)
+    return;
+
+  switch (e->event.type) {
+  case RECORD_INPUT:
+    if (e->event.value < 0)
+      conn->input_eof = true;
+    else
+      ll_add(conn->input, e);
+    break;
+  case RECORD_WRITE:
+    conn->credit += e->event.value;
+    break;
+  case RECORD_SEND:
+    if (checking) {
+      ll_add(conn->expected, e);
+      expecting++;
+    }
+    break;
+  case RECORD_TUNE:
+    memcpy(&conn->tunables, e->data, e->event.len < sizeof(ctcp_tunables_t) ?
+                                     e->event.len : sizeof(ctcp_tunables_t));
+    conn->tunables_version = e->event.value;
+    break;
+  }
+}
+
+/**
+ * Writes out as much queued output as the live run got written out.
+ */
+static void flush(conn_t *conn) {
+  long long n = conn->output_bytes - conn->written;
+  if (n > conn->credit)
+    n = conn->credit;
+  conn->written += n;
+  conn->credit -= n;
+}
+
+/**
+ * Makes a call into student code.
+ */
+static void call(replay_event_t *e) {
+  conn_t *conn = find_conn(e->event.conn);
+  int type = e->event.type;
+  if (type != RECORD_TIMER && (conn == NULL || conn->delete_me))
+    return;
+
+  long long start = wall_ns();
+  switch (type) {
+  case RECORD_INIT: {
+    ctcp_config_t *cfg = calloc(sizeof(ctcp_config_t), 1);
+    memcpy(cfg, e->data, e->event.len < sizeof(ctcp_config_t) ?
+                         e->event.len : sizeof(ctcp_config_t));
+    conn->tunables.timer = cfg->timer;
+    conn->tunables.rt_timeout = cfg->rt_timeout;
+    conn->tunables.send_window = cfg->send_window;
+    conn->tunables.recv_window = cfg->recv_window;
+    conn->state = ctcp_init(conn, cfg);
+    if (conn->state == NULL)
+      conn->delete_me = true;
+    break;
+  }
+  case RECORD_RECEIVE: {
+    ctcp_segment_t *segment = malloc(e->event.len);
+    memcpy(segment, e->data, e->event.len);
+    stats_received(&conn->stats, segment, e->event.len, true, replay_now);
+    ctcp_receive(conn->state, segment, e->event.len);
+    break;
+  }
+  case RECORD_READ:
+    reads_left_out += e->event.value;
+    ctcp_read(conn->state);
+    break;
+  case RECORD_OUTPUT:
+    conn->credit += e->event.value;
+    flush(conn);
+    ctcp_output(conn->state);
+    break;
+  case RECORD_TIMER:
+    timer_tick++;
+    ctcp_timer();
+    timer_tick = 0;
+    break;
+  }
+  calls[type]++;
+  call_ns[type] += wall_ns() - start;
+}
+
+/**
+ * Counts the segments the live run sent during the last call that this one
+ * did not.
+ */
+static void check_missing() {
+  uint32_t i;
+  if (expecting == 0)
+    return;
+  expecting = 0;
+  for (i = 1; i <= num_conns; i++) {
+    conn_t *conn = conns[i];
+    ll_node_t *node;
+    while (conn && (node = ll_front(conn->expected))) {
+      ll_remove(conn->expected, node);
+      sends_missing++;
+      diverge(conn, "segment not sent");
+    }
+  }
+}
+
+/**
+ * Replays the whole recording once. The connections are left for the results;
+ * free_conns() tears them down.
+ */
+static void replay_pass() {
+  long long i = 0;
+  timer_tick = 0;
+  output_hash = 14695981039346656037ULL;
+
+  while (i < num_events) {
+    replay_event_t *e = &events[i++];
+    if (!RECORD_IS_CALL(e->event.type)) {
+      hand_over(e);
+      continue;
+    }
+
+    current = e;
+    replay_now = e->event.time;
+    if (e->event.type == RECORD_INIT && find_conn(e->event.conn) == NULL) {
+      create_conn(e->event.conn);
+      /* Settings it starts with, for ctcp_init() to see. */
+      if (i < num_events && events[i].event.type == RECORD_TUNE &&
+          events[i].event.conn == e->event.conn)
+        hand_over(&events[i++]);
+    }
+    /* Settings changed after the call are handed over before the next one. */
+    while (i < num_events && !RECORD_IS_CALL(events[i].event.type) &&
+           events[i].event.type != RECORD_TUNE) {
+      if (events[i].event.type == RECORD_SEND && checking)
+        sends_recorded++;
+      hand_over(&events[i++]);
+    }
+    call(e);
+    check_missing();
+  }
+}
+
+
+/////////////////////////////// LIBRARY FUNCTIONS /////////////////////////////
+
+int conn_input(conn_t *conn, void *buf, size_t len) {
+  if (conn->read_eof)
+    return -1;
+
+  size_t r = 0;
+  ll_node_t *node;
+  while (r < len && (node = ll_front(conn->input))) {
+    replay_event_t *e = node->object;
+    size_t n = e->event.value - conn->input_used;
+    if (n > len - r)
+      n = len - r;
+    memcpy((char *) buf + r, e->data + conn->input_used, n);
+    conn->input_used += n;
+    r += n;
+
+    if (conn->input_used == (size_t) e->event.value) {
+      ll_remove(conn->input, node);
+      conn->input_used = 0;
+    }
+  }
+  if (r > 0)
+    return r;
+
+  if (conn->input_eof) {
+    conn->read_eof = true;
+    return -1;
+  }
+  return 0;
+}
+
+int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) {
+  if (conn == NULL || segment == NULL)
+    return -1;
+
+  stats_sent(&conn->stats, segment, len, replay_now, timer_tick);
+  if (!checking)
+    return len;
+
+  /* Compare with the next segment sent on the live run. */
+  ll_node_t *node = ll_front(conn->expected);
+  if (node == NULL) {
+    sends_unexpected++;
+    diverge(conn, "extra segment sent");
+    return len;
+  }
+  replay_event_t *e = ll_remove(conn->expected, node);
+  expecting--;
+  if (e->event.len != len || memcmp(e->data, segment, len) != 0) {
+    sends_different++;
+    diverge(conn, "different segment sent");
+  }
+  else {
+    sends_matched++;
+  }
+  return len;
+}
+
+int conn_output(conn_t *conn, const char *buf, size_t len) {
+  if (conn->wrote_eof)
+    return 0;
+
+  /* Writing EOF. */
+  if (len == 0) {
+    conn->wrote_eof = true;
+    return 0;
+  }
+  if (conn_bufspace(conn) == 0)
+    return 0;
+
+  size_t i;
+  for (i = 0; i < len; i++)
+    output_hash = (output_hash ^ (uint8_t) buf[i]) * 1099511628211ULL;
+  conn->output_bytes += len;
+  stats_output(&conn->stats, len);
+  flush(conn);
+  return len;
+}
+
+size_t conn_bufspace(conn_t *conn) {
+  long long queued = conn->output_bytes - conn->written;
+  return queued >= REPLAY_BUF_SPACE ? 0 : REPLAY_BUF_SPACE - queued;
+}
+
+void conn_report_cwnd(conn_t *conn, uint32_t cwnd) {
+  conn->cwnd = cwnd;
+  stats_cwnd(&conn->stats, cwnd, replay_now);
+}
+
+uint32_t conn_tunables(conn_t *conn, ctcp_tunables_t *tunables) {
+  *tunables = conn->tunables;
+  return conn->tunables_version;
+}
+
+void conn_remove(conn_t *conn) {
+  conn->delete_me = true;
+}
+
+void end_client() {
+}
+
+
+//////////////////////////////////// RESULTS //////////////////////////////////
+
+/**
+ * Prints the results as one line of JSON. The statistics of each connection
+ * are from the last pass.
+ *
+ * path: The recording.
+ * wall: Wall-clock time all the passes took, in seconds.
+ */
+static void print_results(const char *path, double wall) {
+  double recorded = num_events > 0 ?
+    (events[num_events - 1].event.time - events[0].event.time) / 1e9 : 0;
+  int type;
+  uint32_t i;
+
+  printf("{\"recording\": \"%s\", \"events\": %lld, \"connections\": %u, "
+         "\"recorded_s\": %.6f, \"passes\": %d, \"wall_s\": %.6f, "
+         "\"speedup\": %.1f, \"calls\": {",
+         path, num_events, num_conns, recorded, repeat, wall,
+         wall > 0 ? recorded * repeat / wall : 0);
+  for (type = RECORD_INIT; type <= RECORD_TIMER; type++) {
+    printf("%s\"%s\": {\"count\": %llu, \"avg_ns\": %.1f}",
+           type > RECORD_INIT ? ", " : "", call_names[type],
+           (unsigned long long) calls[type] / repeat,
+           calls[type] > 0 ? (double) call_ns[type] / calls[type] : 0);
+  }
+  printf("}, \"reads_left_out\": %llu, \"checked\": %s",
+         (unsigned long long) reads_left_out / repeat,
+         check ? "true" : "false");
+  if (check) {
+    printf(", \"identical\": %s, \"segments\": {\"recorded\": %lld, "
+           "\"matched\": %lld, \"different\": %lld, \"extra\": %lld, "
+           "\"missing\": %lld}, \"diverged\": ",
+           diverged_event < 0 ? "true" : "false", sends_recorded,
+           sends_matched, sends_different, sends_unexpected, sends_missing);
+    if (diverged_event < 0) {
+      printf("null");
+    }
+    else {
+      printf("{\"event\": %lld, \"time_s\": %.6f, \"conn\": %u, "
+             "\"reason\": \"%s\"}", diverged_event,
+             (diverged_time - events[0].event.time) / 1e9, diverged_conn,
+             diverged_reason);
+    }
+  }
+  printf(", \"output_hash\": \"%016llx\", \"per_connection\": [",
+         (unsigned long long) output_hash);
+  for (i = 1; i <= num_conns; i++) {
+    conn_t *conn = conns[i];
+    if (conn == NULL)
+      continue;
+    printf("%s{\"conn\": %u, \"output_bytes\": %lld, \"stats\": ",
+           i > 1 ? ", " : "", i, conn->output_bytes);
+    stats_limit_update(&conn->stats, replay_now);
+    stats_print_json(&conn->stats, stdout);
+    printf("}");
+  }
+  printf("]}\n");
+}
+
+
+///////////////////////////////////// MAIN ////////////////////////////////////
+
+static void usage(char *progname) {
+  fprintf(stderr,
+    "\nUsage: %s [--fast] [--repeat passes] recording\n"
+    "   [--fast]             Don't check the segments sent, for profiling\n"
+    "   [--repeat passes]    Replay the recording this many times over\n\n",
+    progname
+  );
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  char *progname = strrchr(argv[0], '/');
+  progname = progname ? progname + 1 : argv[0];
+
+  struct option o[] = {
+    { "fast", no_argument, NULL, 'f' },
+    { "repeat", required_argument, NULL, 'n' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "fn:", o, NULL)) != -1) {
+    switch (opt) {
+    case 'f': check = false; break;
+    case 'n': repeat = atoi(optarg); break;
+    default: usage(progname); break;
+    }
+  }
+  if (optind != argc - 1 || repeat < 1)
+    usage(progname);
+
+  char *path = argv[optind];
+  if (load(path) < 0)
+    return 1;
+
+  /* The clock reads whatever it did on the live run. */
+  set_time_source(replay_time);
+
+  /* Only the first pass is checked. */
+  long long start = wall_ns();
+  int pass;
+  for (pass = 0; pass < repeat; pass++) {
+    checking = check && pass == 0;
+    if (pass > 0)
+      free_conns();
+    replay_pass();
+  }
+  print_results(path, (wall_ns() - start) / 1e9);
+  return 0;
+}
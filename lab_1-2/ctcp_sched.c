@@ -0,0 +1,163 @@
+#include "ctcp_sched.h"
+
+/** Initial number of callbacks a scheduler has room for. */
+#define SCHED_INITIAL_CAPACITY 64
+
+/**
+ * Whether or not item a is due before item b.
+ */
+static bool sched_before(sched_item_t *a, sched_item_t *b) {
+  if (a->when != b->when)
+    return a->when < b->when;
+  return a->order < b->order;
+}
+
+static void sched_swap(sched_t *sched, size_t i, size_t j) {
+  sched_item_t tmp = sched->heap[i];
+  sched->heap[i] = sched->heap[j];
+  sched->heap[j] = tmp;
+}
+
+static void sched_sift_up(sched_t *sched, size_t i) {
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+    if (!sched_before(&sched->heap[i], &sched->heap[parent]))
+      break;
+    sched_swap(sched, i, parent);
+    i = parent;
+  }
+}
+
+static void sched_sift_down(sched_t *sched, size_t i) {
+  while (true) {
+    size_t smallest = i;
+    size_t left = 2 * i + 1;
+    size_t right = 2 * i + 2;
+
+    if (left < sched->length &&
+        sched_before(&sched->heap[left], &sched->heap[smallest]))
+      smallest = left;
+    if (right < sched->length &&
+        sched_before(&sched->heap[right], &sched->heap[smallest]))
+      smallest = right;
+    if (smallest == i)
+      break;
+
+    sched_swap(sched, i, smallest);
+    i = smallest;
+  }
+}
+
+/**
+ * Removes the earliest callback from the heap and returns it.
+ */
+static sched_item_t sched_pop(sched_t *sched) {
+  sched_item_t item = sched->heap[0];
+  sched->length--;
+  if (sched->length > 0) {
+    sched->heap[0] = sched->heap[sched->length];
+    sched_sift_down(sched, 0);
+  }
+  return item;
+}
+
+sched_t *sched_create() {
+  sched_t *sched = calloc(sizeof(sched_t), 1);
+  sched->capacity = SCHED_INITIAL_CAPACITY;
+  sched->heap = calloc(sizeof(sched_item_t), sched->capacity);
+  return sched;
+}
+
+void sched_destroy(sched_t *sched) {
+  if (sched == NULL)
+    return;
+
+  while (sched->length > 0) {
+    sched_item_t item = sched_pop(sched);
+    item.fn(item.arg, true);
+  }
+  free(sched->heap);
+  free(sched);
+}
+
+void sched_at(sched_t *sched, long long when, sched_fn fn, void *arg,
+              void *owner) {
+  /* Grow the heap if needed. */
+  if (sched->length == sched->capacity) {
+    sched->capacity *= 2;
+    sched->heap = realloc(sched->heap, sizeof(sched_item_t) * sched->capacity);
+  }
+
+  sched_item_t *item = &sched->heap[sched->length];
+  item->when = when;
+  item->order = sched->order++;
+  item->fn = fn;
+  item->arg = arg;
+  item->owner = owner;
+  sched_sift_up(sched, sched->length++);
+}
+
+long long sched_next(sched_t *sched) {
+  return sched->length > 0 ? sched->heap[0].when : -1;
+}
+
+bool sched_step(sched_t *sched) {
+  if (sched->length == 0)
+    return false;
+
+  sched_item_t item = sched_pop(sched);
+  item.fn(item.arg, false);
+  return true;
+}
+
+int sched_run(sched_t *sched, long long now) {
+  int n = 0;
+  while (sched->length > 0 && sched->heap[0].when <= now) {
+    sched_step(sched);
+    n++;
+  }
+  return n;
+}
+
+void sched_cancel(sched_t *sched, void *owner) {
+  size_t i, kept = 0;
+
+  /* Compact the heap in place, keeping callbacks with a different owner at
+     the front and moving the cancelled ones to the back. */
+  for (i = 0; i < sched->length; i++) {
+    if (sched->heap[i].owner != owner) {
+      sched_item_t item = sched->heap[kept];
+      sched->heap[kept++] = sched->heap[i];
+      sched->heap[i] = item;
+    }
+  }
+  size_t num_cancelled = sched->length - kept;
+  sched->length = kept;
+  if (num_cancelled == 0)
+    return;
+
+  /* Callbacks are only called once the heap is consistent again, and may
+     schedule more callbacks over the back of it, so copy them out first. */
+  sched_item_t *cancelled = malloc(sizeof(sched_item_t) * num_cancelled);
+  memcpy(cancelled, sched->heap + kept, sizeof(sched_item_t) * num_cancelled);
+
+  /* Rebuild the heap. */
+  for (i = sched->length / 2; i > 0; i--)
+    sched_sift_down(sched, i - 1);
+
+  for (i = 0; i < num_cancelled; i++)
+    cancelled[i].fn(cancelled[i].arg, true);
+  free(cancelled);
+}
+
+long sched_timeout(sched_t *sched, long limit, long long now) {
+  long long next = sched_next(sched);
+  if (next < 0)
+    return limit;
+  if (next <= now)
+    return 0;
+
+  /* Round up so poll() does not wake up just before the callback is due. */
+  long long ms = (next - now + 999999) / 1000000;
+  return ms < limit ? (long) ms : limit;
+}
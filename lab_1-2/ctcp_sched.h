@@ -0,0 +1,102 @@
+/******************************************************************************
+ * ctcp_sched.h
+ * ------------
+ * Scheduler for timed callbacks. Callbacks are kept in a min-heap ordered by
+ * when they are due. Callbacks due at the same time run in the order they were
+ * scheduled, so a run driven off a virtual clock is fully deterministic.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_SCHED_H
+#define CTCP_SCHED_H
+
+#include "ctcp_sys.h"
+
+/**
+ * Scheduled callback. Called with cancelled set to false when it is due, or
+ * with cancelled set to true if it is removed via sched_cancel() or
+ * sched_destroy() before then (so that it can free its argument).
+ */
+typedef void (*sched_fn)(void *arg, bool cancelled);
+
+/** A scheduled callback. */
+struct sched_item {
+  long long when;           /* When it is due, in nanoseconds */
+  unsigned long long order; /* Insertion order, breaks ties in when */
+  sched_fn fn;              /* Callback */
+  void *arg;                /* Argument to the callback */
+  void *owner;              /* Owner, used to cancel a group of callbacks */
+};
+typedef struct sched_item sched_item_t;
+
+/** A scheduler. */
+struct sched {
+  sched_item_t *heap;       /* Min-heap of scheduled callbacks */
+  size_t length;            /* Number of scheduled callbacks */
+  size_t capacity;          /* Allocated size of the heap */
+  unsigned long long order; /* Insertion counter */
+};
+typedef struct sched sched_t;
+
+
+/**
+ * Creates a new scheduler. This must be freed later with sched_destroy().
+ */
+sched_t *sched_create();
+
+/**
+ * Destroys a scheduler. Any callbacks still pending are called as cancelled.
+ */
+void sched_destroy(sched_t *sched);
+
+/**
+ * Schedules a callback.
+ *
+ * sched: The scheduler.
+ * when: When the callback is due, in nanoseconds (see current_time_ns()).
+ * fn: The callback.
+ * arg: Argument to pass to the callback.
+ * owner: Owner of the callback (e.g. a conn_t), or NULL.
+ */
+void sched_at(sched_t *sched, long long when, sched_fn fn, void *arg,
+              void *owner);
+
+/**
+ * Returns when the earliest callback is due, in nanoseconds, or -1 if nothing
+ * is scheduled.
+ */
+long long sched_next(sched_t *sched);
+
+/**
+ * Runs the earliest callback, if there is one.
+ *
+ * returns: Whether or not a callback was run.
+ */
+bool sched_step(sched_t *sched);
+
+/**
+ * Runs all callbacks due at or before the given time. Callbacks scheduled
+ * while running are also run if they are due.
+ *
+ * sched: The scheduler.
+ * now: The current time, in nanoseconds.
+ * returns: The number of callbacks run.
+ */
+int sched_run(sched_t *sched, long long now);
+
+/**
+ * Cancels all callbacks with the given owner.
+ */
+void sched_cancel(sched_t *sched, void *owner);
+
+/**
+ * Returns the number of milliseconds until the earliest callback is due,
+ * capped at limit. Suitable as a poll() timeout.
+ *
+ * sched: The scheduler.
+ * limit: Maximum number of milliseconds to return.
+ * now: The current time, in nanoseconds.
+ */
+long sched_timeout(sched_t *sched, long limit, long long now);
+
+#endif /* CTCP_SCHED_H */
@@ -0,0 +1,1083 @@
+/******************************************************************************
+ * ctcp_sim.c
+ * ----------
+ * Deterministic discrete-event simulator for cTCP. Links against the same
+ * ctcp.c as the real binary, but instead of sockets, STDIN and STDOUT it
+ * provides its own conn_*() functions and runs everything off an event queue
+ * on a virtual clock. Nothing ever sleeps, so a transfer that takes minutes in
+ * real time finishes in well under a second, and the same seed always gives
+ * the same result.
+ *
+ * Each run transfers a fixed number of bytes from a sender to a receiver and
+ * prints one line of JSON with the results. Segments go through the same
+ * impairment and link emulation as in the real binary, with a link in each
+ * direction. Window size, drop rate, latency and seed all take comma-separated
+ * lists, and every combination is run:
+ *
+ *     ./ctcp_sim --bytes 1G -w 1,2,4,8 --drop 0,1,5 --latency 50 --seed 1,2,3
+ *
+ * With --flows, several flows instead share a single link in each direction,
+ * starting one after another. The results then show how they share the
+ * bottleneck: throughput of each flow over time, Jain's fairness index, how
+ * long the flows took to converge on a fair share, and the queue occupancy of
+ * the bottleneck. Each flow can have its own window and retransmission
+ * timeout:
+ *
+ *     ./ctcp_sim --flows 4 --stagger 2000 --flow-window 8,8,16,32 --rate 2000
+ *
+ *****************************************************************************/
+
+#include "ctcp.h"
+#include "ctcp_impair.h"
+#include "ctcp_link.h"
+#include "ctcp_linked_list.h"
+#include "ctcp_sched.h"
+#include "ctcp_stats.h"
+#include "ctcp_sys.h"
+#include "ctcp_utils.h"
+
+/** Output space per connection. Same as MAX_BUF_SPACE in the library. */
+#define SIM_BUF_SPACE 8192
+
+/** Maximum number of values in a comma-separated parameter list. */
+#define MAX_LIST 64
+
+/** Defaults for multi-flow runs: time between flow starts, sampling interval
+    of the throughput and queue occupancy, and the fairness index flows must
+    keep to count as converged. */
+#define FLOW_STAGGER 1000
+#define FLOW_INTERVAL 500
+#define FLOW_FAIR_THRESHOLD 0.95
+
+/** Virtual time allowed for teardown after all data has been delivered. */
+#define LINGER_NS (10 * 1000000000LL)
+
+#define NS_PER_MS 1000000LL
+#define NS_PER_SEC 1000000000LL
+
+/** Parameters of a single simulated run. */
+struct scenario {
+  long long bytes;          /* Bytes to transfer */
+  int window;               /* Window size, in multiples of MAX_SEG_DATA_SIZE */
+  impair_config_t impair;   /* Segment drop, corruption, delay and
+                               duplication, in both directions */
+  link_config_t link;       /* Link in each direction. The propagation delay
+                               is the one-way latency */
+  uint64_t seed;            /* Seed for all randomness in the run */
+  int timer;                /* How often ctcp_timer() is called, in ms */
+  int rt_timeout;           /* Retransmission timeout, in ms */
+  long long drain_rate;     /* Rate output is drained, in bytes/s (0 for
+                               instantly) */
+  long long time_limit;     /* Virtual time limit, in seconds */
+
+  /* Multi-flow runs. */
+  int flows;                /* Flows sharing the link (0 for a single-flow
+                               run) */
+  int stagger;              /* Time between flow starts, in ms */
+  int interval;             /* Sampling interval, in ms */
+  double fair_threshold;    /* Fairness index that counts as converged */
+  double *flow_windows;     /* Window of each flow, cycled through (NULL for
+                               the window of the run) */
+  int num_flow_windows;
+  double *flow_rt_timeouts; /* Retransmission timeout of each flow, cycled
+                               through (NULL for the one of the run) */
+  int num_flow_rt_timeouts;
+};
+typedef struct scenario scenario_t;
+
+/** Simulated connection endpoint. */
+struct conn {
+  ctcp_state_t *state;      /* Connection state */
+  struct conn *peer;        /* Endpoint at the other end */
+  struct flow *flow;        /* Flow this endpoint is part of */
+  bool is_sender;           /* Whether this end sends the data */
+  impair_t *impair;         /* Impairment of segments sent by this end */
+  link_t *link;             /* Link segments sent by this end go over */
+
+  long long input_read;     /* Bytes handed out by conn_input() */
+  bool read_eof;            /* EOF handed out by conn_input() */
+
+  long long output_bytes;   /* Bytes accepted by conn_output() */
+  long long out_queued;     /* Bytes waiting to be drained */
+  long long drain_due;      /* Bytes the scheduled drain takes away */
+  bool draining;            /* Whether a drain is scheduled */
+  bool wrote_eof;           /* EOF written by conn_output() */
+  bool delete_me;           /* conn_remove() was called */
+
+  ctcp_stats_t stats;       /* Statistics */
+  uint32_t cwnd;            /* Last congestion window reported */
+};
+
+/** A read of the sender's input, timed until all of it is delivered. */
+struct input_read {
+  long long end;            /* Bytes read, up to the end of this read */
+  long long time;           /* When it was read, in ns */
+};
+
+/** A sender and receiver pair. */
+struct flow {
+  conn_t ends[2];           /* Sender, then receiver */
+  linked_list_t *reads;     /* Reads not yet delivered in full, oldest
+                               first */
+  int window;               /* Window size, in multiples of MAX_SEG_DATA_SIZE */
+  int rt_timeout;           /* Retransmission timeout, in ms */
+  bool started;             /* Whether the connection has been set up */
+  long long start;          /* When the flow started, in ns */
+  long long finish;         /* When the receiver wrote EOF, in ns (-1 if not
+                               yet) */
+  long long mismatches;     /* Output bytes that differed from the input */
+
+  long long sampled;        /* Bytes delivered at the last sample */
+  long long shared_start;   /* Bytes delivered when the last flow started */
+  long long shared_end;     /* Bytes delivered when the first flow finished */
+  double *throughput;       /* Throughput in each sampling interval, in
+                               Mbit/s */
+};
+typedef struct flow flow_t;
+
+/** Names of the queue management disciplines, for the results. */
+static const char *aqm_names[] = { "droptail", "red", "codel" };
+
+/** State of the current run. */
+static scenario_t sim;
+static sched_t *sched;
+static long long sim_now;
+static uint64_t timer_calls;  /* ctcp_timer() calls so far */
+static uint64_t timer_tick;   /* Which call is running, 0 if none */
+static flow_t *flows;
+static int num_flows;
+static link_t *links[2];      /* Forward and reverse links, shared by every
+                                 flow */
+static impair_t *impairs[2];  /* Impairment in each direction */
+
+/** Samples taken in a multi-flow run. */
+static int num_samples;
+static int max_samples;
+static double *queue_samples; /* Forward queue length at each sample */
+static long long shared_from; /* When every flow was running, in ns */
+static long long shared_until;/* When the first flow finished, in ns (-1 if
+                                 none has yet) */
+
+
+//////////////////////////////// VIRTUAL CLOCK ////////////////////////////////
+
+/**
+ * Time source for current_time(). Returns the virtual time.
+ */
+static long long sim_time() {
+  return sim_now;
+}
+
+/**
+ * Wall-clock time, in seconds. Used only to report how fast the run was.
+ */
+static double wall_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Runs the earliest event, advancing the virtual clock to when it is due.
+ */
+static bool sim_step() {
+  long long next = sched_next(sched);
+  if (next < 0)
+    return false;
+  if (next > sim_now)
+    sim_now = next;
+  return sched_step(sched);
+}
+
+
+//////////////////////////////////// DATA /////////////////////////////////////
+
+/**
+ * Fills a buffer with the transferred stream starting at the given offset. The
+ * stream is derived from the seed so the receiver can check its output without
+ * keeping a copy of the input.
+ */
+static void pattern_fill(char *buf, long long offset, size_t len) {
+  size_t i = 0;
+  while (i < len) {
+    long long off = offset + i;
+    uint64_t z = (sim.seed + (off >> 3)) * 0x9e3779b97f4a7c15ULL;
+    int b;
+    z ^= z >> 29;
+    for (b = off & 7; b < 8 && i < len; b++, i++)
+      buf[i] = (char) (z >> (b * 8));
+  }
+}
+
+/**
+ * Calls ctcp_read() on every endpoint that has input waiting, the same way the
+ * library does when STDIN is readable. The sender has input until it has
+ * handed out an EOF. The receiver has no data but reads an EOF once it has
+ * written one, so that it closes after its peer.
+ */
+static void sim_poke() {
+  int f, i;
+  for (f = 0; f < num_flows; f++) {
+    if (!flows[f].started)
+      continue;
+    for (i = 0; i < 2; i++) {
+      conn_t *conn = &flows[f].ends[i];
+      if (conn->delete_me || conn->read_eof)
+        continue;
+      if (conn->is_sender || conn->wrote_eof)
+        ctcp_read(conn->state);
+    }
+  }
+}
+
+
+/////////////////////////////////// NETWORK ///////////////////////////////////
+
+/**
+ * Delivers a segment to the other end, once it has made it through the
+ * sender's impairment and across the link.
+ */
+static void deliver(void *ctx, conn_t *conn, ctcp_segment_t *segment,
+                    size_t len) {
+  if (conn->peer->delete_me) {
+    free(segment);
+    return;
+  }
+  stats_received(&conn->peer->stats, segment, len, true, sim_now);
+  ctcp_receive(conn->peer->state, segment, len);
+  sim_poke();
+}
+
+static void drain(void *arg, bool cancelled);
+
+/**
+ * Schedules the bytes waiting in an endpoint's output queue to be drained at
+ * the configured rate.
+ */
+static void drain_schedule(conn_t *conn) {
+  conn->draining = true;
+  conn->drain_due = conn->out_queued;
+  sched_at(sched, sim_now + conn->drain_due * NS_PER_SEC / sim.drain_rate,
+           drain, conn, conn);
+}
+
+/**
+ * Drains what was in the output queue of an endpoint when the drain was
+ * scheduled, and lets it output more. Anything queued since is drained
+ * next.
+ */
+static void drain(void *arg, bool cancelled) {
+  conn_t *conn = arg;
+  if (cancelled)
+    return;
+
+  conn->out_queued -= conn->drain_due;
+  conn->draining = false;
+  if (conn->out_queued > 0)
+    drain_schedule(conn);
+  stats_output_stall(&conn->stats, conn_bufspace(conn) < MAX_SEG_DATA_SIZE,
+                     sim_now);
+  if (!conn->delete_me)
+    ctcp_output(conn->state);
+}
+
+/**
+ * Calls ctcp_timer() periodically for as long as the run lasts.
+ */
+static void timer(void *arg, bool cancelled) {
+  if (cancelled)
+    return;
+
+  timer_tick = ++timer_calls;
+  ctcp_timer();
+  timer_tick = 0;
+  sim_poke();
+  sched_at(sched, sim_now + sim.timer * NS_PER_MS, timer, NULL, NULL);
+}
+
+
+//////////////////////////////////// FLOWS ////////////////////////////////////
+
+/**
+ * Creates a cTCP configuration for a new connection. Freed by ctcp.c.
+ */
+static ctcp_config_t *make_config(flow_t *flow) {
+  ctcp_config_t *cfg = calloc(sizeof(ctcp_config_t), 1);
+  cfg->recv_window = flow->window * MAX_SEG_DATA_SIZE;
+  cfg->send_window = flow->window * MAX_SEG_DATA_SIZE;
+  cfg->timer = sim.timer;
+  cfg->rt_timeout = flow->rt_timeout;
+  return cfg;
+}
+
+/**
+ * Sets up both ends of a flow. In a multi-flow run this is scheduled for when
+ * the flow is due to start, and the last flow to start begins the period in
+ * which every flow shares the link.
+ */
+static void flow_start(void *arg, bool cancelled) {
+  flow_t *flow = arg;
+  int i;
+  if (cancelled)
+    return;
+
+  flow->started = true;
+  flow->start = sim_now;
+  for (i = 0; i < 2; i++)
+    flow->ends[i].state = ctcp_init(&flow->ends[i], make_config(flow));
+
+  if (sim.flows > 0 && flow == &flows[num_flows - 1] && shared_until < 0) {
+    shared_from = sim_now;
+    for (i = 0; i < num_flows; i++)
+      flows[i].shared_start = flows[i].ends[1].output_bytes;
+  }
+  sim_poke();
+}
+
+/**
+ * Ends the period in which every flow shares the link, once the first flow
+ * finishes (or the run ends). If some flow had not started yet, there never
+ * was such a period.
+ */
+static void flows_shared_end() {
+  int i;
+  shared_until = sim_now;
+  for (i = 0; i < num_flows; i++)
+    flows[i].shared_end = flows[i].ends[1].output_bytes;
+}
+
+/**
+ * Samples the throughput of every flow and the occupancy of the forward
+ * queue, every sampling interval until every flow has finished.
+ */
+static void flows_sample(void *arg, bool cancelled) {
+  int i;
+  bool finished = true;
+  if (cancelled)
+    return;
+
+  if (num_samples == max_samples) {
+    max_samples = max_samples ? max_samples * 2 : 64;
+    queue_samples = realloc(queue_samples, max_samples * sizeof(double));
+    for (i = 0; i < num_flows; i++)
+      flows[i].throughput = realloc(flows[i].throughput,
+                                    max_samples * sizeof(double));
+  }
+  for (i = 0; i < num_flows; i++) {
+    flow_t *flow = &flows[i];
+    long long output = flow->ends[1].output_bytes;
+    flow->throughput[num_samples] = (output - flow->sampled) * 8 /
+                                    (sim.interval * 1e3);
+    flow->sampled = output;
+    finished = finished && flow->finish >= 0;
+  }
+  queue_samples[num_samples++] = links[0]->length;
+
+  if (!finished)
+    sched_at(sched, sim_now + sim.interval * NS_PER_MS, flows_sample, NULL,
+             NULL);
+}
+
+/**
+ * Jain's fairness index, (sum x)^2 / (n * sum x^2). 1 when every value is the
+ * same, down to 1/n when one has everything.
+ *
+ * values: The values, e.g. throughput of each flow.
+ * n: Number of values.
+ * returns: The index, or -1 if there are no values.
+ */
+static double jain_index(double *values, int n) {
+  double sum = 0, squares = 0;
+  int i;
+  for (i = 0; i < n; i++) {
+    sum += values[i];
+    squares += values[i] * values[i];
+  }
+  if (n == 0)
+    return -1;
+  return squares > 0 ? sum * sum / (n * squares) : 1;
+}
+
+/**
+ * Jain's fairness index of a sampling interval, over the flows that were
+ * running for all of it.
+ *
+ * sample: Index of the interval.
+ * returns: The index, or -1 if no flow was running for all of it.
+ */
+static double sample_jain(int sample) {
+  long long from = sample * sim.interval * NS_PER_MS;
+  long long until = from + sim.interval * NS_PER_MS;
+  double values[num_flows];
+  int i, n = 0;
+  for (i = 0; i < num_flows; i++) {
+    flow_t *flow = &flows[i];
+    if (flow->started && flow->start <= from &&
+        (flow->finish < 0 || flow->finish >= until))
+      values[n++] = flow->throughput[sample];
+  }
+  return jain_index(values, n);
+}
+
+
+/////////////////////////////// LIBRARY FUNCTIONS /////////////////////////////
+
+int conn_input(conn_t *conn, void *buf, size_t len) {
+  if (conn->read_eof)
+    return -1;
+
+  /* Receiver has no data. It reads EOF once the sender has closed. */
+  if (!conn->is_sender) {
+    if (!conn->wrote_eof)
+      return 0;
+    conn->read_eof = true;
+    return -1;
+  }
+
+  long long left = sim.bytes - conn->input_read;
+  if (left == 0) {
+    conn->read_eof = true;
+    return -1;
+  }
+
+  size_t n = left < (long long) len ? (size_t) left : len;
+  pattern_fill(buf, conn->input_read, n);
+  conn->input_read += n;
+
+  struct input_read *read = malloc(sizeof(struct input_read));
+  read->end = conn->input_read;
+  read->time = sim_now;
+  ll_add(conn->flow->reads, read);
+  return n;
+}
+
+int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) {
+  if (conn == NULL || segment == NULL)
+    return -1;
+
+  stats_sent(&conn->stats, segment, len, sim_now, timer_tick);
+
+  ctcp_segment_t *segment_copy = malloc(len);
+  memcpy(segment_copy, segment, len);
+  impair_segment(conn->impair, conn, segment_copy, len);
+  return len;
+}
+
+int conn_output(conn_t *conn, const char *buf, size_t len) {
+  if (conn->wrote_eof)
+    return 0;
+
+  /* Writing EOF. */
+  if (len == 0) {
+    conn->wrote_eof = true;
+    conn->flow->finish = sim_now;
+    if (sim.flows > 0 && shared_until < 0)
+      flows_shared_end();
+    return 0;
+  }
+
+  /* Only as much as there is room for. */
+  size_t space = conn_bufspace(conn);
+  size_t n = len < space ? len : space;
+  char expected[SIM_BUF_SPACE];
+  pattern_fill(expected, conn->output_bytes, n);
+  if (memcmp(buf, expected, n) != 0) {
+    size_t i;
+    for (i = 0; i < n; i++)
+      conn->flow->mismatches += buf[i] != expected[i];
+  }
+  conn->output_bytes += n;
+  stats_output(&conn->stats, n);
+
+  /* Time the reads that have now been delivered in full. */
+  ll_node_t *node;
+  while ((node = ll_front(conn->flow->reads)) &&
+         ((struct input_read *) node->object)->end <= conn->output_bytes) {
+    struct input_read *read = ll_remove(conn->flow->reads, node);
+    hist_record(&conn->stats.delivery_hist, sim_now - read->time);
+    free(read);
+  }
+
+  /* Queue it up to be drained at the configured rate. */
+  if (sim.drain_rate > 0) {
+    conn->out_queued += n;
+    if (!conn->draining)
+      drain_schedule(conn);
+  }
+  stats_output_stall(&conn->stats, conn_bufspace(conn) < MAX_SEG_DATA_SIZE,
+                     sim_now);
+  return n;
+}
+
+size_t conn_bufspace(conn_t *conn) {
+  return conn->out_queued >= SIM_BUF_SPACE ? 0 :
+         SIM_BUF_SPACE - conn->out_queued;
+}
+
+void conn_report_cwnd(conn_t *conn, uint32_t cwnd) {
+  conn->cwnd = cwnd;
+  stats_cwnd(&conn->stats, cwnd, sim_now);
+}
+
+uint32_t conn_tunables(conn_t *conn, ctcp_tunables_t *tunables) {
+  /* There is no control socket, so they never change. */
+  memset(tunables, 0, sizeof(ctcp_tunables_t));
+  tunables->timer = sim.timer;
+  tunables->rt_timeout = conn->flow->rt_timeout;
+  tunables->send_window = conn->flow->window * MAX_SEG_DATA_SIZE;
+  tunables->recv_window = conn->flow->window * MAX_SEG_DATA_SIZE;
+  return 0;
+}
+
+void conn_remove(conn_t *conn) {
+  conn->delete_me = true;
+}
+
+void end_client() {
+}
+
+
+////////////////////////////////// SIMULATION /////////////////////////////////
+
+/**
+ * Whether or not a flow is over: either both ends have torn down, or the data
+ * has been delivered and teardown has had long enough.
+ */
+static bool flow_done(flow_t *flow) {
+  if (!flow->started)
+    return false;
+  if (flow->ends[0].delete_me && flow->ends[1].delete_me)
+    return true;
+  return flow->finish >= 0 && sim_now > flow->finish + LINGER_NS;
+}
+
+/**
+ * Whether or not the run is over, meaning every flow is.
+ */
+static bool sim_done() {
+  int i;
+  for (i = 0; i < num_flows; i++) {
+    if (!flow_done(&flows[i]))
+      return false;
+  }
+  return true;
+}
+
+/**
+ * Prints a number as JSON, or null if it is negative (unknown).
+ */
+static void print_or_null(const char *format, double value) {
+  if (value < 0)
+    printf("null");
+  else
+    printf(format, value);
+}
+
+/**
+ * Prints the results of a single-flow run as JSON.
+ *
+ * wall: Wall-clock time the run took, in seconds.
+ * events: Number of events run.
+ */
+static void print_run(double wall, long long events) {
+  conn_t *sender = &flows[0].ends[0];
+  conn_t *receiver = &flows[0].ends[1];
+  bool completed = receiver->wrote_eof && receiver->output_bytes == sim.bytes;
+  double elapsed = (completed ? flows[0].finish : sim_now) / 1e9;
+  long long min_segments = (sim.bytes + MAX_SEG_DATA_SIZE - 1) /
+                           MAX_SEG_DATA_SIZE;
+  int i;
+  printf("{\"seed\": %llu, \"window\": %d, \"bytes\": %lld, \"drop\": %d, "
+         "\"corrupt\": %d, \"delay\": %d, \"duplicate\": %d, "
+         "\"latency_ms\": %g, \"rate_kbps\": %lld, \"jitter_ms\": %g, "
+         "\"queue\": %d, \"aqm\": \"%s\", \"timer_ms\": %d, "
+         "\"rt_timeout_ms\": %d, "
+         "\"completed\": %s, \"verified\": %s, \"delivered\": %lld, "
+         "\"virtual_s\": %.6f, \"wall_s\": %.6f, \"speedup\": %.1f, "
+         "\"goodput_mbps\": %.3f, \"segments_sent\": %lld, "
+         "\"min_segments\": %lld, \"ack_segments\": %lld, "
+         "\"retransmits\": %llu, \"retx_ratio\": %.6f, \"events\": %lld, "
+         "\"peak_rss_kb\": %ld, \"impairment\": {",
+         (unsigned long long) sim.seed, sim.window, sim.bytes,
+         sim.impair.drop, sim.impair.corrupt, sim.impair.delay,
+         sim.impair.duplicate, sim.link.delay, sim.link.rate, sim.link.jitter,
+         links[0]->config.queue, aqm_names[sim.link.aqm], sim.timer,
+         sim.rt_timeout,
+         completed ? "true" : "false",
+         completed && flows[0].mismatches == 0 ? "true" : "false",
+         receiver->output_bytes, elapsed, wall,
+         wall > 0 ? elapsed / wall : 0,
+         elapsed > 0 ? receiver->output_bytes * 8 / elapsed / 1e6 : 0,
+         (long long) sender->stats.segments_sent, min_segments,
+         (long long) receiver->stats.segments_sent,
+         (unsigned long long) sender->stats.retransmits,
+         sender->stats.data_segments_sent > 0 ? (double)
+           sender->stats.retransmits / sender->stats.data_segments_sent : 0,
+         events, stats_peak_rss());
+  for (i = 0; i < 2; i++) {
+    impair_stats_t *stats = &impairs[i]->stats;
+    printf("%s\"%s\": {\"segments\": %llu, \"dropped\": %llu, "
+           "\"corrupted\": %llu, \"delayed\": %llu, \"duplicated\": %llu}",
+           i ? ", " : "", impairs[i]->name, stats->segments,
+           stats->dropped, stats->corrupted, stats->delayed,
+           stats->duplicated);
+  }
+  printf("}, \"link\": {");
+  for (i = 0; i < 2; i++) {
+    link_stats_t *stats = &links[i]->stats;
+    printf("%s\"%s\": {\"segments\": %llu, \"lost\": %llu, "
+           "\"overflows\": %llu, \"aqm_drops\": %llu, \"max_queue\": %llu, "
+           "\"avg_queue_delay_ms\": %.3f, \"max_queue_delay_ms\": %.3f}",
+           i ? ", " : "", links[i]->name, stats->segments,
+           stats->lost, stats->overflows, stats->aqm_drops, stats->max_queue,
+           stats->serialized > 0 ?
+             stats->queue_delay / (double) stats->serialized / NS_PER_MS : 0,
+           stats->max_queue_delay / (double) NS_PER_MS);
+  }
+  printf("}, \"sender\": ");
+  stats_limit_update(&sender->stats, sim_now);
+  stats_limit_update(&receiver->stats, sim_now);
+  stats_print_json(&sender->stats, stdout);
+  printf(", \"receiver\": ");
+  stats_print_json(&receiver->stats, stdout);
+  printf("}\n");
+}
+
+/**
+ * Prints the results of a multi-flow run as JSON. Fairness is measured over
+ * the period in which every flow was running: from when the last one started
+ * to when the first one finished. The flows have converged once the fairness
+ * index of every sampling interval in that period stays at or above the
+ * threshold.
+ *
+ * wall: Wall-clock time the run took, in seconds.
+ * events: Number of events run.
+ */
+static void print_flows(double wall, long long events) {
+  long long interval = sim.interval * NS_PER_MS;
+  double shared[num_flows];
+  bool completed = true, verified = true;
+  int i, k;
+
+  /* Fairness over the whole shared period. */
+  double jain = -1, shared_s = -1;
+  if (shared_from >= 0) {
+    if (shared_until < 0)
+      flows_shared_end();
+    shared_s = (shared_until - shared_from) / 1e9;
+    for (i = 0; i < num_flows; i++)
+      shared[i] = shared_s > 0 ? (flows[i].shared_end -
+                                  flows[i].shared_start) * 8 / shared_s / 1e6
+                               : 0;
+    if (shared_s > 0)
+      jain = jain_index(shared, num_flows);
+  }
+
+  /* Convergence, from the last interval in the shared period that was below
+     the threshold. */
+  double convergence_s = -1;
+  int first = -1, last = -1, last_unfair = -1;
+  for (k = 0; shared_from >= 0 && k < num_samples; k++) {
+    if (k * interval < shared_from || (k + 1) * interval > shared_until)
+      continue;
+    if (first < 0)
+      first = k;
+    last = k;
+    if (sample_jain(k) < sim.fair_threshold)
+      last_unfair = k;
+  }
+  if (first >= 0 && last_unfair != last)
+    convergence_s = ((last_unfair >= 0 ? last_unfair + 1 : first) * interval -
+                     shared_from) / 1e9;
+
+  double queue_avg = 0;
+  for (k = 0; k < num_samples; k++)
+    queue_avg += queue_samples[k];
+  queue_avg = num_samples > 0 ? queue_avg / num_samples : 0;
+
+  for (i = 0; i < num_flows; i++) {
+    conn_t *receiver = &flows[i].ends[1];
+    bool done = receiver->wrote_eof && receiver->output_bytes == sim.bytes;
+    completed = completed && done;
+    verified = verified && done && flows[i].mismatches == 0;
+  }
+
+  link_stats_t *stats = &links[0]->stats;
+  printf("{\"seed\": %llu, \"flows\": %d, \"stagger_ms\": %d, "
+         "\"interval_ms\": %d, \"bytes\": %lld, \"drop\": %d, "
+         "\"latency_ms\": %g, \"rate_kbps\": %lld, \"jitter_ms\": %g, "
+         "\"queue\": %d, \"aqm\": \"%s\", \"timer_ms\": %d, "
+         "\"completed\": %s, \"verified\": %s, \"virtual_s\": %.6f, "
+         "\"wall_s\": %.6f, \"events\": %lld, \"peak_rss_kb\": %ld, "
+         "\"shared_s\": ",
+         (unsigned long long) sim.seed, num_flows, sim.stagger, sim.interval,
+         sim.bytes, sim.impair.drop, sim.link.delay, sim.link.rate,
+         sim.link.jitter, links[0]->config.queue, aqm_names[sim.link.aqm],
+         sim.timer, completed ? "true" : "false",
+         verified ? "true" : "false", sim_now / 1e9, wall, events,
+         stats_peak_rss());
+  print_or_null("%.6f", shared_s);
+  printf(", \"jain\": ");
+  print_or_null("%.4f", jain);
+  printf(", \"fair_threshold\": %g, \"convergence_s\": ", sim.fair_threshold);
+  print_or_null("%.6f", convergence_s);
+  printf(", \"queue_avg\": %.2f, \"queue_max\": %llu, "
+         "\"avg_queue_delay_ms\": %.3f, \"max_queue_delay_ms\": %.3f, "
+         "\"overflows\": %llu, \"aqm_drops\": %llu, ",
+         queue_avg, stats->max_queue,
+         stats->serialized > 0 ?
+           stats->queue_delay / (double) stats->serialized / NS_PER_MS : 0,
+         stats->max_queue_delay / (double) NS_PER_MS, stats->overflows,
+         stats->aqm_drops);
+
+  /* Latency over every flow: RTTs seen by the senders, delivery and output
+     stalls by the receivers. */
+  hist_t *hists = calloc(3, sizeof(hist_t));
+  for (i = 0; i < num_flows; i++) {
+    hist_merge(&hists[0], &flows[i].ends[0].stats.rtt_hist);
+    hist_merge(&hists[1], &flows[i].ends[1].stats.delivery_hist);
+    hist_merge(&hists[2], &flows[i].ends[1].stats.stall_hist);
+  }
+  printf("\"rtt_hist\": ");
+  hist_print_json(&hists[0], stdout);
+  printf(", \"delivery_hist\": ");
+  hist_print_json(&hists[1], stdout);
+  printf(", \"stall_hist\": ");
+  hist_print_json(&hists[2], stdout);
+  printf(", \"per_flow\": [");
+  free(hists);
+
+  for (i = 0; i < num_flows; i++) {
+    flow_t *flow = &flows[i];
+    ctcp_stats_t *sender = &flow->ends[0].stats;
+    long long delivered = flow->ends[1].output_bytes;
+    double active = flow->started ? ((flow->finish >= 0 ? flow->finish :
+                                      sim_now) - flow->start) / 1e9 : 0;
+    printf("%s{\"flow\": %d, \"window\": %d, \"rt_timeout_ms\": %d, "
+           "\"start_s\": ", i ? ", " : "", i, flow->window,
+           flow->rt_timeout);
+    print_or_null("%.6f", flow->started ? flow->start / 1e9 : -1);
+    printf(", \"finish_s\": ");
+    print_or_null("%.6f", flow->finish / 1e9);
+    printf(", \"delivered\": %lld, \"goodput_mbps\": %.3f, "
+           "\"shared_mbps\": ", delivered,
+           active > 0 ? delivered * 8 / active / 1e6 : 0);
+    print_or_null("%.3f", shared_s > 0 ? shared[i] : -1);
+    printf(", \"retransmits\": %llu, \"retx_ratio\": %.6f, "
+           "\"sender_limited_ms\": ",
+           (unsigned long long) sender->retransmits,
+           sender->data_segments_sent > 0 ? (double) sender->retransmits /
+             sender->data_segments_sent : 0);
+    stats_limit_update(sender, sim_now);
+    stats_print_limits_json(sender, stdout);
+    printf("}");
+  }
+
+  /* Time series, one value per sampling interval. */
+  printf("], \"throughput_mbps\": [");
+  for (i = 0; i < num_flows; i++) {
+    printf("%s[", i ? ", " : "");
+    for (k = 0; k < num_samples; k++)
+      printf("%s%.3f", k ? ", " : "", flows[i].throughput[k]);
+    printf("]");
+  }
+  printf("], \"jain_series\": [");
+  for (k = 0; k < num_samples; k++) {
+    printf("%s", k ? ", " : "");
+    print_or_null("%.4f", sample_jain(k));
+  }
+  printf("], \"queue_series\": [");
+  for (k = 0; k < num_samples; k++)
+    printf("%s%g", k ? ", " : "", queue_samples[k]);
+  printf("]}\n");
+}
+
+/**
+ * Runs one scenario and prints the results as JSON.
+ */
+static void run(scenario_t *scenario) {
+  sim = *scenario;
+  sim_now = 0;
+  srand(sim.seed);
+  sched = sched_create();
+  num_samples = max_samples = 0;
+  queue_samples = NULL;
+  shared_from = shared_until = -1;
+
+  /* Every flow goes over the same link in each direction. */
+  links[0] = link_create("forward", &sim.link, sim.seed + 1, sched, deliver,
+                         NULL);
+  links[1] = link_create("reverse", &sim.link, ~sim.seed - 1, sched, deliver,
+                         NULL);
+  impairs[0] = impair_create("forward", &sim.impair, sim.seed, sched,
+                             link_segment, links[0]);
+  impairs[1] = impair_create("reverse", &sim.impair, ~sim.seed, sched,
+                             link_segment, links[1]);
+
+  num_flows = sim.flows > 0 ? sim.flows : 1;
+  flows = calloc(sizeof(flow_t), num_flows);
+  int f, i;
+  for (f = 0; f < num_flows; f++) {
+    flow_t *flow = &flows[f];
+    flow->finish = -1;
+    flow->reads = ll_create();
+    flow->window = sim.flow_windows ?
+      (int) sim.flow_windows[f % sim.num_flow_windows] : sim.window;
+    flow->rt_timeout = sim.flow_rt_timeouts ?
+      (int) sim.flow_rt_timeouts[f % sim.num_flow_rt_timeouts] :
+      sim.rt_timeout;
+    for (i = 0; i < 2; i++) {
+      flow->ends[i].flow = flow;
+      flow->ends[i].peer = &flow->ends[1 - i];
+      flow->ends[i].link = links[i];
+      flow->ends[i].impair = impairs[i];
+    }
+    flow->ends[0].is_sender = true;
+  }
+
+  /* Run until done or out of time. The first flow starts right away, and the
+     rest one after another. */
+  double wall_start = wall_time();
+  sched_at(sched, sim.timer * NS_PER_MS, timer, NULL, NULL);
+  if (sim.flows > 0) {
+    sched_at(sched, sim.interval * NS_PER_MS, flows_sample, NULL, NULL);
+    for (f = 1; f < num_flows; f++)
+      sched_at(sched, f * sim.stagger * NS_PER_MS, flow_start, &flows[f],
+               NULL);
+  }
+  flow_start(&flows[0], false);
+  long long events = 0;
+  while (!sim_done() && sim_now <= sim.time_limit * NS_PER_SEC &&
+         sim_step()) {
+    events++;
+  }
+  double wall = wall_time() - wall_start;
+
+  /* Tear down whatever ctcp.c did not. */
+  for (f = 0; f < num_flows; f++) {
+    for (i = 0; i < 2; i++) {
+      if (flows[f].started && !flows[f].ends[i].delete_me)
+        ctcp_destroy(flows[f].ends[i].state);
+    }
+  }
+  sched_destroy(sched);
+
+  if (sim.flows > 0)
+    print_flows(wall, events);
+  else
+    print_run(wall, events);
+  fflush(stdout);
+
+  for (i = 0; i < 2; i++) {
+    impair_destroy(impairs[i]);
+    link_destroy(links[i]);
+  }
+  for (f = 0; f < num_flows; f++) {
+    ll_node_t *node;
+    while ((node = ll_front(flows[f].reads)))
+      free(ll_remove(flows[f].reads, node));
+    ll_destroy(flows[f].reads);
+    free(flows[f].throughput);
+  }
+  free(flows);
+  free(queue_samples);
+}
+
+
+//////////////////////////////////// MAIN /////////////////////////////////////
+
+/**
+ * Parses a size with an optional K, M or G suffix (powers of 1024).
+ */
+static long long parse_size(const char *str) {
+  char *end;
+  double size = strtod(str, &end);
+  switch (*end) {
+  case 'k': case 'K': size *= 1024; break;
+  case 'm': case 'M': size *= 1024 * 1024; break;
+  case 'g': case 'G': size *= 1024 * 1024 * 1024; break;
+  }
+  return (long long) size;
+}
+
+/**
+ * Parses a comma-separated list of numbers.
+ *
+ * str: The list.
+ * values: Array to store the values in. Must have room for MAX_LIST values.
+ * returns: Number of values parsed.
+ */
+static int parse_list(char *str, double *values) {
+  int n = 0;
+  char *tok;
+  while ((tok = strsep(&str, ",")) != NULL && n < MAX_LIST) {
+    if (*tok)
+      values[n++] = atof(tok);
+  }
+  return n;
+}
+
+/**
+ * Parses a comma-separated list of seeds. Seeds are 64-bit, so unlike
+ * parse_list() this keeps every digit.
+ *
+ * str: The list.
+ * values: Array to store the seeds in. Must have room for MAX_LIST values.
+ * returns: Number of seeds parsed.
+ */
+static int parse_seeds(char *str, uint64_t *values) {
+  int n = 0;
+  char *tok;
+  while ((tok = strsep(&str, ",")) != NULL && n < MAX_LIST) {
+    if (*tok)
+      values[n++] = strtoull(tok, NULL, 0);
+  }
+  return n;
+}
+
+static void usage(char *progname) {
+  fprintf(stderr,
+    "\nUsage: %s\n"
+    "   [--bytes size]               Bytes to transfer (K, M, G suffixes)\n"
+    "   [-w window_size,...]\n"
+    "   [--drop drop_percent,...]\n"
+    "   [--corrupt corrupt_percent]\n"
+    "   [--delay delay_percent]\n"
+    "   [--duplicate duplicate_percent]\n"
+    "   [--latency one_way_ms,...]  Propagation delay of each link\n"
+    "   [--rate kbit_per_sec]        Link rate (0 for unlimited)\n"
+    "   [--jitter ms]\n"
+    "   [--queue segments]\n"
+    "   [--aqm droptail|red|codel]\n"
+    "   [--burst-loss p,r[,loss_good[,loss_bad]]]\n"
+    "   [--seed seed,...]\n"
+    "   [--timer ms]\n"
+    "   [--rt-timeout ms]\n"
+    "   [--drain-rate bytes_per_sec] Output drain rate (0 for instantly)\n"
+    "   [--time-limit seconds]       Virtual time limit per run\n"
+    "   [--flows count]              Flows sharing the link\n"
+    "   [--stagger ms]               Time between flow starts\n"
+    "   [--flow-window window_size,...]  Window of each flow\n"
+    "   [--flow-rt-timeout ms,...]   Retransmission timeout of each flow\n"
+    "   [--interval ms]              Throughput and queue sampling interval\n"
+    "   [--fair-threshold index]     Fairness index that counts as "
+                                     "converged\n\n",
+    progname
+  );
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  char *progname = strrchr(argv[0], '/');
+  progname = progname ? progname + 1 : argv[0];
+
+  /* Defaults match the real binary. */
+  scenario_t base;
+  memset(&base, 0, sizeof(scenario_t));
+  base.bytes = 1024 * 1024;
+  base.timer = 40;
+  base.rt_timeout = 200;
+  base.time_limit = 600;
+  base.stagger = FLOW_STAGGER;
+  base.interval = FLOW_INTERVAL;
+  base.fair_threshold = FLOW_FAIR_THRESHOLD;
+
+  double windows[MAX_LIST] = { 1 }, drops[MAX_LIST] = { 0 };
+  double latencies[MAX_LIST] = { 10 };
+  uint64_t seeds[MAX_LIST] = { 144 };
+  double flow_windows[MAX_LIST], flow_rt_timeouts[MAX_LIST];
+  int num_windows = 1, num_drops = 1, num_latencies = 1, num_seeds = 1;
+
+  struct option o[] = {
+    { "bytes", required_argument, NULL, 'b' },
+    { "window", required_argument, NULL, 'w' },
+    { "drop", required_argument, NULL, 'r' },
+    { "corrupt", required_argument, NULL, 't' },
+    { "delay", required_argument, NULL, 'y' },
+    { "duplicate", required_argument, NULL, 'q' },
+    { "latency", required_argument, NULL, 'L' },
+    { "seed", required_argument, NULL, 'e' },
+    { "rate", required_argument, NULL, 'B' },
+    { "jitter", required_argument, NULL, 'J' },
+    { "queue", required_argument, NULL, 'U' },
+    { "aqm", required_argument, NULL, 'A' },
+    { "burst-loss", required_argument, NULL, 'G' },
+    { "timer", required_argument, NULL, 'T' },
+    { "rt-timeout", required_argument, NULL, 'R' },
+    { "drain-rate", required_argument, NULL, 'D' },
+    { "time-limit", required_argument, NULL, 'l' },
+    { "flows", required_argument, NULL, 'F' },
+    { "stagger", required_argument, NULL, 'S' },
+    { "flow-window", required_argument, NULL, 'W' },
+    { "flow-rt-timeout", required_argument, NULL, 'O' },
+    { "interval", required_argument, NULL, 'I' },
+    { "fair-threshold", required_argument, NULL, 'H' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "b:w:", o, NULL)) != -1) {
+    switch (opt) {
+    case 'b': base.bytes = parse_size(optarg); break;
+    case 'w': num_windows = parse_list(optarg, windows); break;
+    case 'r': num_drops = parse_list(optarg, drops); break;
+    case 't': base.impair.corrupt = atoi(optarg); break;
+    case 'y': base.impair.delay = atoi(optarg); break;
+    case 'q': base.impair.duplicate = atoi(optarg); break;
+    case 'L': num_latencies = parse_list(optarg, latencies); break;
+    case 'e': num_seeds = parse_seeds(optarg, seeds); break;
+    case 'B': base.link.rate = atoll(optarg); break;
+    case 'J': base.link.jitter = atof(optarg); break;
+    case 'U': base.link.queue = atoi(optarg); break;
+    case 'A':
+      if (link_parse_aqm(optarg, &base.link.aqm) < 0)
+        usage(progname);
+      break;
+    case 'G':
+      if (link_parse_burst(optarg, &base.link) < 0)
+        usage(progname);
+      break;
+    case 'T': base.timer = atoi(optarg); break;
+    case 'R': base.rt_timeout = atoi(optarg); break;
+    case 'D': base.drain_rate = parse_size(optarg); break;
+    case 'l': base.time_limit = atoll(optarg); break;
+    case 'F': base.flows = atoi(optarg); break;
+    case 'S': base.stagger = atoi(optarg); break;
+    case 'W':
+      base.num_flow_windows = parse_list(optarg, flow_windows);
+      base.flow_windows = flow_windows;
+      break;
+    case 'O':
+      base.num_flow_rt_timeouts = parse_list(optarg, flow_rt_timeouts);
+      base.flow_rt_timeouts = flow_rt_timeouts;
+      break;
+    case 'I': base.interval = atoi(optarg); break;
+    case 'H': base.fair_threshold = atof(optarg); break;
+    default: usage(progname); break;
+    }
+  }
+  if (num_windows < 1 || num_drops < 1 || num_latencies < 1 ||
+      num_seeds < 1 || base.timer <= 0 || base.bytes < 0 ||
+      base.flows < 0 || base.stagger < 0 || base.interval <= 0 ||
+      (base.flow_windows && base.num_flow_windows < 1) ||
+      (base.flow_rt_timeouts && base.num_flow_rt_timeouts < 1))
+    usage(progname);
+
+  /* Run the virtual clock instead of the wall clock. */
+  set_time_source(sim_time);
+
+  /* Run every combination. */
+  int w, d, l, s;
+  for (w = 0; w < num_windows; w++)
+  for (d = 0; d < num_drops; d++)
+  for (l = 0; l < num_latencies; l++)
+  for (s = 0; s < num_seeds; s++) {
+    scenario_t scenario = base;
+    scenario.window = (int) windows[w];
+    scenario.impair.drop = (int) drops[d];
+    scenario.link.delay = latencies[l];
+    scenario.seed = seeds[s];
+    run(&scenario);
+  }
+  return 0;
+}
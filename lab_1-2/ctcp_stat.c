@@ -0,0 +1,318 @@
+/******************************************************************************
+ * ctcp_stat.c
+ * -----------
+ * Shows the live metrics of running ctcp processes started with --metrics
+ * (see ctcp_metrics.h):
+ *
+ *     ./ctcp_stat                   Every process with metrics
+ *     ./ctcp_stat 9999 12345        The processes on ports 9999 and 12345
+ *     ./ctcp_stat -i 1              Every second, with rates
+ *     ./ctcp_stat --json            As JSON
+ *
+ * Reading the metrics takes no locks and no system calls once a region is
+ * mapped in, so it never holds up the process being watched.
+ *
+ *****************************************************************************/
+
+#include <dirent.h>
+#include <errno.h>
+
+#include "ctcp_utils.h"
+#include "ctcp_metrics.h"
+
+/** Most processes shown at once. */
+#define STAT_MAX_REGIONS 64
+
+/** Where POSIX shared memory objects show up on Linux. */
+#define STAT_SHM_DIR "/dev/shm"
+
+/** A process being watched. */
+typedef struct {
+  int port;                     /* Port it is running on */
+  const metrics_region_t *region;
+  metrics_conn_t last[METRICS_SLOTS];
+                                /* Slots when they were last shown */
+  bool seen[METRICS_SLOTS];     /* Whether last[] has a connection */
+} watched_t;
+
+static watched_t watched[STAT_MAX_REGIONS];
+static int num_watched = 0;
+
+/** Seconds between updates (-i), or 0 to show the metrics once. */
+static double opt_interval = 0;
+
+/** Whether to print JSON (--json). */
+static bool opt_json = false;
+
+
+/**
+ * Starts watching the process on a port.
+ *
+ * port: Port it is running on.
+ * quiet: Whether to say nothing if it has no metrics.
+ */
+static void watch(int port, bool quiet) {
+  if (num_watched == STAT_MAX_REGIONS)
+    return;
+  const metrics_region_t *region = metrics_map(port);
+  if (region == NULL) {
+    if (!quiet)
+      fprintf(stderr, "[ERROR] No metrics for port %d\n", port);
+    return;
+  }
+  watched_t *w = &watched[num_watched++];
+  memset(w, 0, sizeof(watched_t));
+  w->port = port;
+  w->region = region;
+}
+
+/**
+ * Starts watching every process that has metrics.
+ */
+static void watch_all() {
+  DIR *dir = opendir(STAT_SHM_DIR);
+  if (dir == NULL)
+    return;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    int port;
+    char end;
+    if (sscanf(entry->d_name, "ctcp-%d%c", &port, &end) == 1)
+      watch(port, true);
+  }
+  closedir(dir);
+}
+
+/**
+ * Formats the other end of a connection.
+ */
+static void peer_name(metrics_conn_t *conn, char *name, size_t size) {
+  char ip[INET_ADDRSTRLEN] = "localhost";
+  if (!conn->unix_socket)
+    inet_ntop(AF_INET, &conn->peer_ip, ip, INET_ADDRSTRLEN);
+  snprintf(name, size, "%s:%d", ip, conn->peer_port);
+}
+
+/**
+ * Whether the process a region belongs to is still running.
+ */
+static bool is_alive(const metrics_region_t *region) {
+  return kill(region->pid, 0) == 0 || errno == EPERM;
+}
+
+/**
+ * Rate at which a counter went up since it was last shown, per second.
+ */
+static double rate(uint64_t now, uint64_t then, int64_t elapsed) {
+  return elapsed > 0 ? (now - then) * 1e9 / elapsed : 0;
+}
+
+
+//////////////////////////////////// TABLE ////////////////////////////////////
+
+/**
+ * Prints a process's metrics as a table.
+ *
+ * w: The process.
+ * now: Current time, in nanoseconds.
+ */
+static void print_table(watched_t *w, int64_t now) {
+  const metrics_region_t *region = w->region;
+  const metrics_global_t *global = &region->global;
+  bool alive = is_alive(region);
+
+  printf("port %d, %s, pid %d%s, up %.1fs, %llu connections, "
+         "dropped %llu short %llu port %llu unknown\n",
+         region->port, region->server ? "server" : "client", region->pid,
+         alive ? "" : " (exited)", (now - region->started) / 1e9,
+         (unsigned long long) global->connections,
+         (unsigned long long) global->drops[METRICS_DROP_SHORT],
+         (unsigned long long) global->drops[METRICS_DROP_PORT],
+         (unsigned long long) global->drops[METRICS_DROP_UNKNOWN]);
+  printf("  %-21s %7s %10s %10s %6s %5s %6s %8s %8s %7s %7s %7s %7s %7s",
+         "Peer", "Age", "Sent", "Received", "Rexmit", "RTOs", "DupACK",
+         "SRTT ms", "RTTVAR", "cwnd", "rwnd", "Flight", "Bufspc", "OutQ");
+  if (opt_interval > 0)
+    printf(" %10s %10s", "Send/s", "Recv/s");
+  printf("\n");
+
+  int i;
+  for (i = 0; i < METRICS_SLOTS; i++) {
+    metrics_conn_t conn;
+    if (!metrics_read(&region->slots[i], &conn)) {
+      w->seen[i] = false;
+      continue;
+    }
+
+    char peer[INET_ADDRSTRLEN + 8];
+    peer_name(&conn, peer, sizeof(peer));
+    printf("  %-21s %6.1fs %10llu %10llu %6llu %5llu %6llu %8.3f %8.3f "
+           "%7u %7u %7u %7u %7u",
+           peer, (now - conn.start) / 1e9,
+           (unsigned long long) conn.bytes_sent,
+           (unsigned long long) conn.bytes_received,
+           (unsigned long long) conn.retransmits,
+           (unsigned long long) conn.rto_events,
+           (unsigned long long) conn.dup_acks,
+           conn.srtt / 1e6, conn.rttvar / 1e6, conn.cwnd, conn.rwnd,
+           conn.inflight, conn.bufspace, conn.out_queue);
+
+    /* Rates, if this is the same connection as last time. */
+    if (opt_interval > 0) {
+      metrics_conn_t *last = &w->last[i];
+      if (w->seen[i] && last->start == conn.start) {
+        int64_t elapsed = conn.updated - last->updated;
+        printf(" %10.0f %10.0f",
+               rate(conn.bytes_sent, last->bytes_sent, elapsed),
+               rate(conn.bytes_received, last->bytes_received, elapsed));
+      }
+      else {
+        printf(" %10s %10s", "-", "-");
+      }
+    }
+    printf("\n");
+    w->last[i] = conn;
+    w->seen[i] = true;
+  }
+
+  printf("  ended: sent %llu bytes in %llu segments, received %llu bytes in "
+         "%llu segments, %llu retransmits, %llu RTOs, %llu dup ACKs\n\n",
+         (unsigned long long) global->bytes_sent,
+         (unsigned long long) global->segments_sent,
+         (unsigned long long) global->bytes_received,
+         (unsigned long long) global->segments_received,
+         (unsigned long long) global->retransmits,
+         (unsigned long long) global->rto_events,
+         (unsigned long long) global->dup_acks);
+}
+
+
+///////////////////////////////////// JSON /////////////////////////////////////
+
+/**
+ * Prints a process's metrics as a JSON object.
+ *
+ * w: The process.
+ * now: Current time, in nanoseconds.
+ */
+static void print_json(watched_t *w, int64_t now) {
+  const metrics_region_t *region = w->region;
+  const metrics_global_t *global = &region->global;
+  bool alive = is_alive(region);
+
+  printf("{\"port\": %d, \"server\": %s, \"pid\": %d, \"alive\": %s, "
+         "\"uptime_ns\": %lld, \"connections\": %llu, ",
+         region->port, region->server ? "true" : "false", region->pid,
+         alive ? "true" : "false", (long long) (now - region->started),
+         (unsigned long long) global->connections);
+  printf("\"drops\": {\"short\": %llu, \"port\": %llu, \"unknown\": %llu}, ",
+         (unsigned long long) global->drops[METRICS_DROP_SHORT],
+         (unsigned long long) global->drops[METRICS_DROP_PORT],
+         (unsigned long long) global->drops[METRICS_DROP_UNKNOWN]);
+  printf("\"ended\": {\"segments_sent\": %llu, \"bytes_sent\": %llu, "
+         "\"retransmits\": %llu, \"rto_events\": %llu, "
+         "\"segments_received\": %llu, \"bytes_received\": %llu, "
+         "\"dup_acks\": %llu, \"output_bytes\": %llu}, \"connections_open\": [",
+         (unsigned long long) global->segments_sent,
+         (unsigned long long) global->bytes_sent,
+         (unsigned long long) global->retransmits,
+         (unsigned long long) global->rto_events,
+         (unsigned long long) global->segments_received,
+         (unsigned long long) global->bytes_received,
+         (unsigned long long) global->dup_acks,
+         (unsigned long long) global->output_bytes);
+
+  int i;
+  bool first = true;
+  for (i = 0; i < METRICS_SLOTS; i++) {
+    metrics_conn_t conn;
+    if (!metrics_read(&region->slots[i], &conn))
+      continue;
+
+    char peer[INET_ADDRSTRLEN + 8];
+    peer_name(&conn, peer, sizeof(peer));
+    printf("%s\n  {\"peer\": \"%s\", \"age_ns\": %lld, "
+           "\"segments_sent\": %llu, \"bytes_sent\": %llu, "
+           "\"retransmits\": %llu, \"rto_events\": %llu, "
+           "\"segments_received\": %llu, \"bytes_received\": %llu, "
+           "\"dup_acks\": %llu, \"output_bytes\": %llu, "
+           "\"srtt_ns\": %lld, \"rttvar_ns\": %lld, \"cwnd\": %u, "
+           "\"rwnd\": %u, \"inflight\": %u, \"bufspace\": %u, "
+           "\"out_queue\": %u, \"out_chunks\": %u}",
+           first ? "" : ",", peer, (long long) (now - conn.start),
+           (unsigned long long) conn.segments_sent,
+           (unsigned long long) conn.bytes_sent,
+           (unsigned long long) conn.retransmits,
+           (unsigned long long) conn.rto_events,
+           (unsigned long long) conn.segments_received,
+           (unsigned long long) conn.bytes_received,
+           (unsigned long long) conn.dup_acks,
+           (unsigned long long) conn.output_bytes,
+           (long long) conn.srtt, (long long) conn.rttvar, conn.cwnd,
+           conn.rwnd, conn.inflight, conn.bufspace, conn.out_queue,
+           conn.out_chunks);
+    first = false;
+  }
+  printf("]}\n");
+}
+
+
+static void usage(char *program) {
+  fprintf(stderr,
+    "\nUsage: %s [-i seconds] [--json] [port ...]\n\n"
+    "With no ports, shows every process started with --metrics.\n\n",
+    program);
+}
+
+int main(int argc, char *argv[]) {
+  static struct option long_options[] = {
+    { "interval", required_argument, NULL, 'i' },
+    { "json", no_argument, NULL, 'j' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "i:j", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'i':
+      opt_interval = atof(optarg);
+      break;
+    case 'j':
+      opt_json = true;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (optind == argc) {
+    watch_all();
+    if (num_watched == 0) {
+      fprintf(stderr, "[ERROR] No ctcp processes have metrics. Start them "
+                      "with --metrics\n");
+      return 1;
+    }
+  }
+  for (; optind < argc; optind++)
+    watch(atoi(argv[optind]), false);
+  if (num_watched == 0)
+    return 1;
+
+  while (true) {
+    int64_t now = current_time_ns();
+    int i;
+    for (i = 0; i < num_watched; i++) {
+      if (opt_json)
+        print_json(&watched[i], now);
+      else
+        print_table(&watched[i], now);
+    }
+    fflush(stdout);
+
+    if (opt_interval <= 0)
+      break;
+    usleep(opt_interval * 1000000);
+  }
+  return 0;
+}
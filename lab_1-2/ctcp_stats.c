@@ -0,0 +1,279 @@
+#include "ctcp_stats.h"
+#include "ctcp_utils.h"
+
+/** Sequence number comparisons that survive wrapping around. */
+#define SEQ_LT(a, b) ((int32_t) ((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t) ((a) - (b)) <= 0)
+
+/** Names of the limits, as printed. */
+static const char *limit_names[NUM_LIMITS] = {
+  "rto", "bufspace", "rwnd", "cwnd", "busy", "app"
+};
+
+/**
+ * Marks a connection as active.
+ */
+static void stats_touch(ctcp_stats_t *stats, int64_t now) {
+  if (stats->segments_sent == 0 && stats->segments_received == 0)
+    stats->start = now;
+  stats->last = now;
+}
+
+/**
+ * Folds a new RTT sample into the smoothed RTT (see RFC 6298).
+ */
+static void stats_rtt_sample(ctcp_stats_t *stats, int64_t rtt) {
+  if (stats->rtt_samples == 0) {
+    stats->srtt = rtt;
+    stats->rttvar = rtt / 2;
+    stats->min_rtt = stats->max_rtt = rtt;
+  }
+  else {
+    int64_t err = stats->srtt > rtt ? stats->srtt - rtt : rtt - stats->srtt;
+    stats->rttvar += (err - stats->rttvar) / 4;
+    stats->srtt += (rtt - stats->srtt) / 8;
+    if (rtt < stats->min_rtt)
+      stats->min_rtt = rtt;
+    if (rtt > stats->max_rtt)
+      stats->max_rtt = rtt;
+  }
+  stats->rtt_samples++;
+  hist_record(&stats->rtt_hist, rtt);
+}
+
+/**
+ * Works out what a connection is limited by, besides timeouts.
+ */
+static enum stats_limit stats_limit_now(ctcp_stats_t *stats) {
+  uint32_t inflight = stats->seq_valid ? stats->snd_max - stats->snd_una : 0;
+  if (stats->stall_start != 0)
+    return LIMIT_BUFSPACE;
+  if (inflight == 0)
+    return LIMIT_APP;
+  if (stats->segments_received > 0 && inflight >= stats->peer_window)
+    return LIMIT_RWND;
+  if (stats->cwnd > 0 && inflight >= stats->cwnd)
+    return LIMIT_CWND;
+  return LIMIT_BUSY;
+}
+
+/**
+ * Starts being limited by something else.
+ *
+ * stats: Statistics of the connection.
+ * limit: What it is limited by.
+ * when: When it started being limited by it. No earlier than limit_start.
+ */
+static void stats_limit_switch(ctcp_stats_t *stats, enum stats_limit limit,
+                               int64_t when) {
+  stats->limited[stats->limit] += when - stats->limit_start;
+  stats->limit = limit;
+  stats->limit_start = when;
+}
+
+void stats_limit_update(ctcp_stats_t *stats, int64_t now) {
+  if (!stats->limit_valid) {
+    stats->limit_valid = true;
+    stats->limit = stats_limit_now(stats);
+    stats->limit_start = now;
+    return;
+  }
+  stats_limit_switch(stats, stats_limit_now(stats), now);
+}
+
+void stats_sent(ctcp_stats_t *stats, ctcp_segment_t *segment, size_t len,
+                int64_t now, uint64_t timer_tick) {
+  stats_touch(stats, now);
+  stats->segments_sent++;
+  stats->bytes_sent += len;
+
+  /* Pure ACK. */
+  size_t data_len = len - sizeof(ctcp_segment_t);
+  bool fin = (segment->flags & TH_FIN) != 0;
+  if (data_len == 0 && !fin) {
+    stats->acks_sent++;
+    stats_limit_update(stats, now);
+    return;
+  }
+
+  uint32_t seq = ntohl(segment->seqno);
+  uint32_t end = seq + data_len + (fin ? 1 : 0);
+  stats->data_segments_sent++;
+  stats->data_bytes_sent += data_len;
+  if (!stats->seq_valid) {
+    stats->seq_valid = true;
+    stats->snd_una = stats->snd_max = seq;
+    stats->una_time = now;
+  }
+
+  /* New data. Time it, if nothing else is being timed. Nothing was in flight
+     before, so the ACKs were not late yet. */
+  if (SEQ_LT(stats->snd_max, end)) {
+    if (stats->snd_max == stats->snd_una)
+      stats->una_time = now;
+    stats->snd_max = end;
+    if (!stats->rtt_timing) {
+      stats->rtt_timing = true;
+      stats->rtt_end = end;
+      stats->rtt_start = now;
+    }
+    stats_limit_update(stats, now);
+    return;
+  }
+
+  /* Retransmission. Its ACK would be ambiguous, so stop timing it. */
+  stats->retransmits++;
+  stats->retransmitted_bytes += data_len;
+  if (stats->rtt_timing && SEQ_LT(seq, stats->rtt_end))
+    stats->rtt_timing = false;
+  if (timer_tick != 0) {
+    stats->rto_retransmits++;
+    if (timer_tick != stats->rto_tick) {
+      stats->rto_tick = timer_tick;
+      stats->rto_events++;
+
+      /* Since the ACKs last moved forward, it was waiting for this. */
+      if (stats->limit_valid) {
+        stats_limit_switch(stats, LIMIT_RTO,
+                           stats->una_time > stats->limit_start ?
+                           stats->una_time : stats->limit_start);
+      }
+    }
+  }
+  stats_limit_update(stats, now);
+}
+
+void stats_received(ctcp_stats_t *stats, ctcp_segment_t *segment, size_t len,
+                    bool verify, int64_t now) {
+  stats_touch(stats, now);
+  stats->segments_received++;
+  stats->bytes_received += len;
+
+  /* Only go by segments student code would accept. */
+  bool valid = ntohs(segment->len) == len;
+  if (valid && verify) {
+    uint16_t sum = segment->cksum;
+    segment->cksum = 0;
+    valid = cksum(segment, len) == sum;
+    segment->cksum = sum;
+  }
+  if (!valid) {
+    stats->corrupt_received++;
+    stats_limit_update(stats, now);
+    return;
+  }
+
+  uint32_t ackno = ntohl(segment->ackno);
+  if ((segment->flags & TH_ACK) && stats->seq_valid) {
+    /* New data ACKed. Ends the RTT sample if it covers the timed segment. */
+    if (SEQ_LT(stats->snd_una, ackno) && SEQ_LEQ(ackno, stats->snd_max)) {
+      stats->snd_una = ackno;
+      stats->una_time = now;
+      if (stats->rtt_timing && SEQ_LEQ(stats->rtt_end, ackno)) {
+        stats->rtt_timing = false;
+        stats_rtt_sample(stats, now - stats->rtt_start);
+      }
+    }
+    /* Duplicate ACK. */
+    else if (ackno == stats->snd_una && stats->snd_una != stats->snd_max &&
+             len == sizeof(ctcp_segment_t) && !(segment->flags & TH_FIN) &&
+             ntohs(segment->window) == stats->peer_window) {
+      stats->dup_acks++;
+    }
+  }
+  stats->peer_window = ntohs(segment->window);
+  stats_limit_update(stats, now);
+}
+
+void stats_output(ctcp_stats_t *stats, size_t len) {
+  stats->output_bytes += len;
+}
+
+void stats_output_stall(ctcp_stats_t *stats, bool stalled, int64_t now) {
+  if (stalled && stats->stall_start == 0) {
+    stats->stall_start = now;
+  }
+  else if (!stalled && stats->stall_start != 0) {
+    hist_record(&stats->stall_hist, now - stats->stall_start);
+    stats->stall_start = 0;
+  }
+  if (stats->limit_valid)
+    stats_limit_update(stats, now);
+}
+
+void stats_cwnd(ctcp_stats_t *stats, uint32_t cwnd, int64_t now) {
+  stats->cwnd = cwnd;
+  if (stats->limit_valid)
+    stats_limit_update(stats, now);
+}
+
+void stats_print_json(ctcp_stats_t *stats, FILE *file) {
+  fprintf(file, "{\"segments_sent\": %llu, \"bytes_sent\": %llu, "
+                "\"data_segments_sent\": %llu, \"data_bytes_sent\": %llu, "
+                "\"retransmits\": %llu, \"retransmitted_bytes\": %llu, "
+                "\"retx_ratio\": %.6f, \"rto_retransmits\": %llu, "
+                "\"rto_events\": %llu, \"acks_sent\": %llu, "
+                "\"segments_received\": %llu, \"bytes_received\": %llu, "
+                "\"corrupt_received\": %llu, \"dup_acks\": %llu, "
+                "\"output_bytes\": %llu, \"rtt_samples\": %llu, "
+                "\"srtt_ms\": %.3f, \"rttvar_ms\": %.3f, "
+                "\"min_rtt_ms\": %.3f, \"max_rtt_ms\": %.3f, "
+                "\"peer_window\": %u, \"duration_s\": %.6f, ",
+          (unsigned long long) stats->segments_sent,
+          (unsigned long long) stats->bytes_sent,
+          (unsigned long long) stats->data_segments_sent,
+          (unsigned long long) stats->data_bytes_sent,
+          (unsigned long long) stats->retransmits,
+          (unsigned long long) stats->retransmitted_bytes,
+          stats->data_segments_sent > 0 ?
+            (double) stats->retransmits / stats->data_segments_sent : 0,
+          (unsigned long long) stats->rto_retransmits,
+          (unsigned long long) stats->rto_events,
+          (unsigned long long) stats->acks_sent,
+          (unsigned long long) stats->segments_received,
+          (unsigned long long) stats->bytes_received,
+          (unsigned long long) stats->corrupt_received,
+          (unsigned long long) stats->dup_acks,
+          (unsigned long long) stats->output_bytes,
+          (unsigned long long) stats->rtt_samples,
+          stats->srtt / 1e6, stats->rttvar / 1e6,
+          stats->min_rtt / 1e6, stats->max_rtt / 1e6,
+          stats->peer_window, (stats->last - stats->start) / 1e9);
+  fprintf(file, "\"limited_ms\": ");
+  stats_print_limits_json(stats, file);
+  fprintf(file, ", \"rtt_hist\": ");
+  hist_print_json(&stats->rtt_hist, file);
+  fprintf(file, ", \"delivery_hist\": ");
+  hist_print_json(&stats->delivery_hist, file);
+  fprintf(file, ", \"stall_hist\": ");
+  hist_print_json(&stats->stall_hist, file);
+  fprintf(file, "}");
+}
+
+void stats_print_limits_json(ctcp_stats_t *stats, FILE *file) {
+  fprintf(file, "{");
+  int i;
+  for (i = 0; i < NUM_LIMITS; i++) {
+    fprintf(file, "%s\"%s\": %.3f", i > 0 ? ", " : "", limit_names[i],
+            stats->limited[i] / 1e6);
+  }
+  fprintf(file, "}");
+}
+
+const char *stats_limit_name(enum stats_limit limit) {
+  return limit_names[limit];
+}
+
+long stats_peak_rss() {
+  char line[128];
+  long rss = -1;
+  FILE *status = fopen("/proc/self/status", "r");
+  if (status == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), status) != NULL) {
+    if (strncmp(line, "VmHWM:", 6) == 0)
+      rss = atol(line + 6);
+  }
+  fclose(status);
+  return rss;
+}
@@ -0,0 +1,186 @@
+/******************************************************************************
+ * ctcp_stats.h
+ * ------------
+ * Per-connection statistics, inferred by watching the segments going in and
+ * out of a connection. Nothing here relies on student code keeping count, so
+ * it works with any cTCP implementation:
+ *
+ *   - A data segment (or FIN) is a retransmission if it does not go beyond the
+ *     highest sequence number sent so far. It was sent because of a timeout if
+ *     it was sent from inside ctcp_timer().
+ *   - RTT is timed on one segment at a time, and never on a segment that has
+ *     been retransmitted (Karn's algorithm). SRTT and RTTVAR are smoothed as in
+ *     RFC 6298.
+ *   - A duplicate ACK is a pure ACK that does not move the ACK number or
+ *     window while data is outstanding (RFC 5681).
+ *   - An output stall lasts from when a connection has no room to output a
+ *     full segment (see conn_bufspace()) until it has room again.
+ *   - At any time, a connection is limited by one thing (see enum
+ *     stats_limit), like the chronographs in Linux's tcp_info. Time spent
+ *     waiting for a timeout is only known once the timeout retransmits: the
+ *     time since the ACKs last moved forward is then moved over to it.
+ *
+ * RTT samples and output stalls also go in histograms (see ctcp_hist.h), as
+ * does the time from input on the other end to output on this one, where both
+ * ends can be seen (ctcp_sim).
+ *
+ * The statistics are plain old data with fixed-size fields, so they can be
+ * copied around or put in shared memory as they are.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_STATS_H
+#define CTCP_STATS_H
+
+#include "ctcp_hist.h"
+#include "ctcp_sys.h"
+
+/** What a connection is limited by, from most to least pressing. */
+enum stats_limit {
+  LIMIT_RTO,                    /* Waiting for a timeout to retransmit */
+  LIMIT_BUFSPACE,               /* Output stalled (see stall_start) */
+  LIMIT_RWND,                   /* Window advertised by the other end full */
+  LIMIT_CWND,                   /* Congestion window reported full */
+  LIMIT_BUSY,                   /* Sending, with room to send more */
+  LIMIT_APP,                    /* Nothing in flight: waiting for input */
+  NUM_LIMITS
+};
+
+/** Statistics for one connection. Times are in nanoseconds. */
+struct ctcp_stats {
+  int64_t start;                /* First segment sent or received */
+  int64_t last;                 /* Last segment sent or received */
+
+  uint64_t segments_sent;       /* Segments passed to conn_send() */
+  uint64_t bytes_sent;          /* Bytes passed to conn_send(), with headers */
+  uint64_t data_segments_sent;  /* Segments sent with data or a FIN */
+  uint64_t data_bytes_sent;     /* Data bytes sent, retransmissions included */
+  uint64_t retransmits;         /* Data segments that were retransmissions */
+  uint64_t retransmitted_bytes; /* Data bytes that were retransmissions */
+  uint64_t rto_retransmits;     /* Retransmissions sent from ctcp_timer() */
+  uint64_t rto_events;          /* ctcp_timer() calls that retransmitted */
+  uint64_t acks_sent;           /* Segments sent with no data or FIN */
+
+  uint64_t segments_received;   /* Segments passed to ctcp_receive() */
+  uint64_t bytes_received;      /* Bytes passed to ctcp_receive() */
+  uint64_t corrupt_received;    /* Segments with a bad length or checksum */
+  uint64_t dup_acks;            /* Duplicate ACKs received */
+  uint64_t output_bytes;        /* Bytes accepted by conn_output() */
+
+  uint64_t rtt_samples;         /* Number of RTT samples */
+  int64_t srtt;                 /* Smoothed RTT */
+  int64_t rttvar;               /* RTT variation */
+  int64_t min_rtt;              /* Smallest RTT sample */
+  int64_t max_rtt;              /* Largest RTT sample */
+
+  uint32_t snd_una;             /* Highest ACK number received */
+  uint32_t snd_max;             /* Highest sequence number sent, plus one */
+  uint32_t peer_window;         /* Last window advertised by the peer */
+  uint32_t rtt_end;             /* ACK number that ends the RTT sample */
+  int64_t rtt_start;            /* When the timed segment was sent */
+  uint64_t rto_tick;            /* Last ctcp_timer() call that retransmitted */
+  uint8_t seq_valid;            /* Whether snd_una and snd_max are set */
+  uint8_t rtt_timing;           /* Whether a segment is being timed */
+  uint8_t limit;                /* What it is limited by (enum stats_limit) */
+  uint8_t limit_valid;          /* Whether limit and limit_start are set */
+  uint8_t pad[4];
+  int64_t stall_start;          /* When output stalled, 0 if it is not */
+  int64_t una_time;             /* When the ACKs last moved forward */
+  uint32_t cwnd;                /* Congestion window reported, 0 if none */
+  uint32_t pad2;
+  int64_t limit_start;          /* When it started being limited by it */
+  int64_t limited[NUM_LIMITS];  /* Time spent limited by each */
+
+  hist_t rtt_hist;              /* RTT samples */
+  hist_t delivery_hist;         /* Time from input on the other end to output
+                                   on this one. Empty unless the library can
+                                   see both ends */
+  hist_t stall_hist;            /* How long output stalls lasted */
+};
+typedef struct ctcp_stats ctcp_stats_t;
+
+
+/**
+ * Records a segment sent by a connection.
+ *
+ * stats: Statistics of the connection.
+ * segment: The segment, in network-byte order.
+ * len: Length of the segment, including headers.
+ * now: Current time, in nanoseconds.
+ * timer_tick: Which ctcp_timer() call this was sent from (counting from 1), or
+ *             0 if it was not sent from ctcp_timer().
+ */
+void stats_sent(ctcp_stats_t *stats, ctcp_segment_t *segment, size_t len,
+                int64_t now, uint64_t timer_tick);
+
+/**
+ * Records a segment received by a connection. Must be called before the
+ * segment is passed to ctcp_receive(), which may free or modify it.
+ *
+ * stats: Statistics of the connection.
+ * segment: The segment, in network-byte order.
+ * len: Length of the segment, including headers.
+ * verify: Whether to check the segment's checksum, so that corrupted ones are
+ *         counted as such and left out of the rest. Costs a pass over the
+ *         segment, so only worth it when the statistics are shown. Without
+ *         it, every segment counts as valid.
+ * now: Current time, in nanoseconds.
+ */
+void stats_received(ctcp_stats_t *stats, ctcp_segment_t *segment, size_t len,
+                    bool verify, int64_t now);
+
+/**
+ * Records data accepted by conn_output().
+ */
+void stats_output(ctcp_stats_t *stats, size_t len);
+
+/**
+ * Records whether a connection's output is stalled. Call whenever its output
+ * space may have changed.
+ *
+ * stats: Statistics of the connection.
+ * stalled: Whether it has no room to output a full segment.
+ * now: Current time, in nanoseconds.
+ */
+void stats_output_stall(ctcp_stats_t *stats, bool stalled, int64_t now);
+
+/**
+ * Records the congestion window reported by student code.
+ *
+ * stats: Statistics of the connection.
+ * cwnd: The congestion window, in bytes.
+ * now: Current time, in nanoseconds.
+ */
+void stats_cwnd(ctcp_stats_t *stats, uint32_t cwnd, int64_t now);
+
+/**
+ * Brings the time spent limited by what the connection is limited by now up
+ * to date. Call before looking at limited[], e.g. before printing.
+ */
+void stats_limit_update(ctcp_stats_t *stats, int64_t now);
+
+/**
+ * Prints statistics as a single JSON object, without a trailing newline. The
+ * histograms are printed by hist_print_json(), and the time spent limited by
+ * each thing as limited_ms.
+ */
+void stats_print_json(ctcp_stats_t *stats, FILE *file);
+
+/**
+ * Prints the time spent limited by each thing, in ms, as a JSON object named
+ * after them (rto, bufspace, rwnd, cwnd, busy and app).
+ */
+void stats_print_limits_json(ctcp_stats_t *stats, FILE *file);
+
+/**
+ * Returns the name of a limit, as printed.
+ */
+const char *stats_limit_name(enum stats_limit limit);
+
+/**
+ * Returns the peak memory use of this process, in KB, or -1 if it is not
+ * known. Read from /proc, since getrusage() also counts whatever exec'd it.
+ */
+long stats_peak_rss();
+
+#endif /* CTCP_STATS_H */
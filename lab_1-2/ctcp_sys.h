@@ -121,6 +121,52 @@ int conn_output(conn_t *conn, const char *buf, size_t len);
  */
 size_t conn_bufspace(conn_t *conn);
 
+/**
+ * Optionally call on this whenever your congestion window changes, so that it
+ * shows up in the timeline (see --timeline in the README). Does nothing
+ * otherwise.
+ *
+ * conn: The connection object.
+ * cwnd: The congestion window, in bytes.
+ */
+void conn_report_cwnd(conn_t *conn, uint32_t cwnd);
+
+/**
+ * Settings that can be changed while cTCP is running, through its control
+ * socket (see --control in the README). They start out as the ones in the
+ * ctcp_config_t the connection was set up with, and those of its profile.
+ */
+typedef struct {
+  int timer;             /* How often ctcp_timer() is called, in ms */
+  int rt_timeout;        /* Retransmission timeout, in ms */
+  int rto_min;           /* Smallest retransmission timeout, in ms, if yours
+                            adapts. 0 for no limit */
+  int rto_max;           /* Largest retransmission timeout, in ms. 0 for no
+                            limit */
+  uint16_t send_window;  /* Send window size, in bytes */
+  uint16_t recv_window;  /* Receive window size, in bytes */
+  char cc[16];           /* Congestion control to use, if you have more than
+                            one. Empty for your default */
+  uint8_t nodelay;       /* Whether to send small segments straight away,
+                            rather than wait to fill them up */
+  uint8_t delayed_ack;   /* Whether to hold back ACKs for a while, in case
+                            more segments arrive to ACK at once */
+  char profile[32];      /* Profile the connection was given (see --profile
+                            in the README). Empty if none */
+} ctcp_tunables_t;
+
+/**
+ * Optionally call on this (e.g. from ctcp_timer()) to pick up settings that
+ * were changed while cTCP was running. Nothing changes them unless the control
+ * socket is used.
+ *
+ * conn: The connection object.
+ * tunables: Where to copy the settings.
+ * returns: A number that goes up every time the settings change, so you can
+ *          tell whether they did since you last looked.
+ */
+uint32_t conn_tunables(conn_t *conn, ctcp_tunables_t *tunables);
+
 /**
  * Used to remove a connection object. This is already called on in the starter
  * code in ctcp_destroy(), so you do not need to add calls to it.
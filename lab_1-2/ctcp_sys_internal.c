@@ -17,6 +17,19 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "ctcp_control.h"
+#include "ctcp_cycles.h"
+#include "ctcp_impair.h"
+#include "ctcp_link.h"
+#include "ctcp_loopprof.h"
+#include "ctcp_metrics.h"
+#include "ctcp_pcap.h"
+#include "ctcp_probes.h"
+#include "ctcp_profile.h"
+#include "ctcp_record.h"
+#include "ctcp_stats.h"
+#include "ctcp_sched.h"
+#include "ctcp_timeline.h"
 #include "ctcp_sys_internal.h"
 #include "ctcp_sys.h"
 
@@ -55,19 +68,131 @@ static bool unix_socket = true;
 /** Whether or not the server runs a program. */
 static bool run_program = false;
 
-/** Options for unreliable communications. */
+/** Whether or not the server echoes whatever it receives back to the client,
+    without running a program. */
+static bool echo_mode = false;
+
+/** Whether or not connections are driven by the load generator (see
+    ctcp_load.c). Input only comes from conn_inject(), and output is thrown
+    away. */
+static bool load_mode = false;
+
+/** Number of times conn_input() has read injected input or its EOF. Tells
+    the main loop whether student code is still getting through it. */
+static uint64_t injected_reads = 0;
+
+/** Most clients the server takes at once. */
+static int max_clients = MAX_NUM_CLIENTS;
+
+#ifndef CTCP_NO_MAIN
+/** Options for unreliable communications, for segments sent and received. */
 static int seed = 144;
-static int opt_drop = false;
-static int opt_corrupt = false;
-static int opt_delay = false;
-static int opt_duplicate = false;
+static impair_config_t opt_impair_out;
+static impair_config_t opt_impair_in;
+
+/** Options for the emulated link segments are sent over. */
+static link_config_t opt_link;
+
+/** Whether or not to trace segments (--logging), and how many bytes of each
+    one's data to keep (--log-payload). */
+static bool opt_logging = false;
+static int opt_log_payload = 0;
+
+/** File to capture datagrams to (--pcap), and how many bytes of each one to
+    keep (--pcap-snaplen). */
+static char *opt_pcap = NULL;
+static int opt_pcap_snaplen = 0;
+
+/** File to write the timeline to (--timeline). */
+static char *opt_timeline = NULL;
+
+/** File to record what student code sees to (--record). */
+static char *opt_record = NULL;
+
+/** Whether or not to publish metrics in shared memory (--metrics). */
+static bool opt_metrics = false;
+
+/** Where to create the control socket (--control). */
+static char *opt_control = NULL;
+
+/** File to read profiles from (--profiles), and the profile every connection
+    gets (--profile). */
+static char *opt_profiles = NULL;
+static char *opt_profile = NULL;
+
+/** How often to report where the main loop's time goes, in seconds
+    (--loop-profile). 0 for only at the end, and -1 to not profile it. */
+static double opt_loop_profile = -1;
+#endif
+
+/** Impairment of segments sent and received. For tester, we only do the
+    unreliability once, deterministically. */
+static impair_t *impair_out;
+static impair_t *impair_in;
+
+/** Emulated bottleneck link between the outgoing impairment and the wire. */
+static link_t *link_out;
+
+/** Callbacks to run at some later time (e.g. sending delayed segments). Run
+    from the main loop. */
+static sched_t *loop_sched;
 
-/** For tester, we only do the unreliability once, deterministically. This is
-    set to true once it has occurred. */
-static bool tester_did_unreliable = false;
+/** Whether or not to print out statistics for each connection as it ends. */
+static bool opt_summary = false;
 
-/** Log file. */
-int log_file = -1;
+/** Number of ctcp_timer() calls so far, and which one is running (0 if none).
+    Used to tell retransmissions caused by timeouts apart. */
+static uint64_t timer_calls = 0;
+static uint64_t timer_tick = 0;
+
+/** Result of the last segment put on the wire. Returned by conn_send(). */
+static int last_transmit = 0;
+
+/** Binary trace of the segments sent and received (--logging), or NULL. */
+static trace_t *trace = NULL;
+
+/** Capture of the datagrams sent and received (--pcap), or NULL. Each
+    transport gets its own interface in the capture, indexed by unix_socket,
+    which is added the first time it is used. */
+static pcapng_t *pcap = NULL;
+static int pcap_interfaces[2] = { -1, -1 };
+
+/** Timeline of each connection's windows and stalls (--timeline), or NULL. */
+static timeline_t *timeline = NULL;
+
+/** Recording of what student code sees, for ctcp_replay (--record), or NULL.
+    Connections are numbered in the recording in the order they are set up. */
+static record_t *recording = NULL;
+static uint32_t recorded_conns = 0;
+
+/** Metrics in shared memory, for ctcp_stat (--metrics), or NULL. */
+static metrics_t *metrics = NULL;
+
+/** Control socket (--control), or NULL. */
+static control_t *control = NULL;
+
+/** Whether received segments are checked for corruption for the statistics
+    (see stats_received()). Only when something shows them. */
+static bool stats_verify = false;
+
+/** Settings new connections start out with, besides those in ctcp_cfg.
+    Changed through the control socket, and by --profile. */
+static conn_settings_t default_settings = { .max_bufspace = MAX_BUF_SPACE };
+
+/** Profiles (--profiles), or NULL. */
+static profile_t *profiles = NULL;
+
+/** Where the main loop's time goes (--loop-profile), or NULL. Reported every
+    loop_interval ns, if that is not 0, with loop_last holding the profile
+    as it was at the last report. */
+static loopprof_t *loopprof = NULL;
+static int64_t loop_interval = 0;
+static int64_t loop_report_at = 0;
+static loopprof_t loop_last;
+
+/** Number of connections with busy_poll on. The main loop does not sleep
+    while there are any. */
+static int busy_polling = 0;
 
 /** Port number of a new connection if a client just connected. Used to avoid
     logging ACK segments in response to a SYN+ACK. */
@@ -78,14 +203,21 @@ static int new_connection = 0;
  *    0    STDIN
  *    1    STDOUT
  *    2    Network
- *    3... Program STDOUT/STDERR (if running as server)
+ *    3    Control socket (--control)
+ *    4    Control socket client
+ *    5... Program STDOUT/STDERR (if running as server)
  */
 static struct pollfd *events;
 
 /** When the last timer timeout occurred. */
 static struct timespec last_timeout;
 
-/** Number of clients connected. MAX_NUM_CLIENTS can be connected. */
+/** Set when SIGTERM arrives. The main loop then exits through exit(), so that
+    anything registered with atexit() (such as writing out profiles in an
+    instrumented build) still runs. */
+static volatile sig_atomic_t terminated = 0;
+
+/** Number of clients connected. max_clients can be connected. */
 static int num_connected = 0;
 
 /** Main thread and thread for sending rests. */
@@ -107,6 +239,405 @@ conn_t *get_connections() {
   else         return config->sconn;
 }
 
+/**
+ * Moves the main loop on to another phase, if --loop-profile is on.
+ *
+ * phase: Phase it is going into.
+ * returns: Phase it was in, to come back to afterwards.
+ */
+static inline enum loop_phase phase_enter(enum loop_phase phase) {
+  return loopprof ? loopprof_switch(loopprof, phase) : phase;
+}
+
+/**
+ * Starts timing a hot path, if --loop-profile is on. path_end() counts it.
+ */
+static inline uint64_t path_start(void) {
+  return loopprof ? cycles_now() : 0;
+}
+
+static inline void path_end(enum loop_path path, uint64_t start) {
+  if (loopprof)
+    loopprof_add(loopprof, path, start);
+}
+
+/**
+ * tagged_calloc(), tagged_malloc(), cksum() and cksum_tcp() on the hot paths,
+ * timed if --loop-profile is on.
+ */
+static void *timed_calloc(enum alloc_site site, size_t size) {
+  uint64_t start = path_start();
+  void *ptr = tagged_calloc(site, size);
+  path_end(PATH_ALLOC, start);
+  return ptr;
+}
+
+static void *timed_malloc(enum alloc_site site, size_t size) {
+  uint64_t start = path_start();
+  void *ptr = tagged_malloc(site, size);
+  path_end(PATH_ALLOC, start);
+  return ptr;
+}
+
+static uint16_t timed_cksum(const void *data, uint16_t len) {
+  uint64_t start = path_start();
+  uint16_t sum = cksum(data, len);
+  path_end(PATH_CKSUM, start);
+  return sum;
+}
+
+static uint16_t timed_cksum_tcp(iphdr_t *packet, uint16_t len) {
+  uint64_t start = path_start();
+  uint16_t sum = cksum_tcp(packet, len);
+  path_end(PATH_CKSUM, start);
+  return sum;
+}
+
+/** Longest name of a connection (see conn_name()). */
+#define CONN_NAME_SIZE (INET_ADDRSTRLEN + 16)
+
+/**
+ * Names a connection after the other end, e.g. "localhost:12345".
+ *
+ * conn: The connection.
+ * name: Where to put the name. CONN_NAME_SIZE bytes.
+ */
+static void conn_name(conn_t *conn, char *name) {
+  char ip[INET_ADDRSTRLEN] = LOCALHOST_STR;
+  if (!unix_socket)
+    inet_ntop(AF_INET, &conn->ip_addr, ip, INET_ADDRSTRLEN);
+  snprintf(name, CONN_NAME_SIZE, "%s:%d", ip, conn->port);
+}
+
+/**
+ * Brings a connection's counters and stalls in the timeline up to date, if
+ * --timeline is on.
+ *
+ * conn: The connection.
+ */
+static void timeline_update(conn_t *conn) {
+  if (timeline == NULL)
+    return;
+
+  /* Name the connection after the other end. */
+  if (conn->track.id == 0) {
+    char name[CONN_NAME_SIZE];
+    conn_name(conn, name);
+    timeline_start(timeline, &conn->track, name);
+  }
+
+  int64_t now = current_time_ns();
+  ctcp_stats_t *stats = &conn->stats;
+  int32_t inflight = stats->snd_max - stats->snd_una;
+  if (!stats->seq_valid || inflight < 0)
+    inflight = 0;
+  size_t bufspace = conn_bufspace(conn);
+
+  if (conn->cwnd > 0)
+    timeline_counter(timeline, &conn->track, TIMELINE_CWND, conn->cwnd, now);
+  timeline_counter(timeline, &conn->track, TIMELINE_INFLIGHT, inflight, now);
+  if (stats->rtt_samples > 0)
+    timeline_counter(timeline, &conn->track, TIMELINE_SRTT, stats->srtt, now);
+  if (stats->segments_received > 0) {
+    timeline_counter(timeline, &conn->track, TIMELINE_RWND,
+                     stats->peer_window, now);
+  }
+  timeline_counter(timeline, &conn->track, TIMELINE_BUFSPACE, bufspace, now);
+
+  /* Stalled on the window once the other end has advertised one. */
+  timeline_stall(timeline, &conn->track, TIMELINE_WINDOW_STALL,
+                 stats->segments_received > 0 &&
+                 (uint32_t) inflight >= stats->peer_window, now);
+  timeline_stall(timeline, &conn->track, TIMELINE_OUTPUT_FULL, bufspace == 0,
+                 now);
+}
+
+/**
+ * Takes a snapshot of a connection's counters, RTT, windows and output queue.
+ *
+ * conn: The connection.
+ * values: Where to put them.
+ */
+static void conn_snapshot(conn_t *conn, metrics_conn_t *values) {
+  ctcp_stats_t *stats = &conn->stats;
+  memset(values, 0, sizeof(metrics_conn_t));
+  values->peer_ip = conn->ip_addr;
+  values->peer_port = conn->port;
+  values->unix_socket = unix_socket;
+  values->start = stats->start;
+  values->updated = current_time_ns();
+  values->segments_sent = stats->segments_sent;
+  values->bytes_sent = stats->bytes_sent;
+  values->retransmits = stats->retransmits;
+  values->rto_events = stats->rto_events;
+  values->segments_received = stats->segments_received;
+  values->bytes_received = stats->bytes_received;
+  values->dup_acks = stats->dup_acks;
+  values->output_bytes = stats->output_bytes;
+  values->srtt = stats->rtt_samples > 0 ? stats->srtt : 0;
+  values->rttvar = stats->rtt_samples > 0 ? stats->rttvar : 0;
+  values->cwnd = conn->cwnd;
+  values->rwnd = stats->peer_window;
+  values->inflight = stats->seq_valid &&
+                     (int32_t) (stats->snd_max - stats->snd_una) > 0 ?
+                     stats->snd_max - stats->snd_una : 0;
+  values->bufspace = conn_bufspace(conn);
+
+  chunk_t *chunk;
+  values->out_queue = values->out_chunks = 0;
+  for (chunk = conn->out_queue; chunk; chunk = chunk->next) {
+    values->out_queue += chunk->size - chunk->used;
+    values->out_chunks++;
+  }
+}
+
+/**
+ * Publishes a connection's metrics, if --metrics is on.
+ *
+ * conn: The connection.
+ */
+static void metrics_update(conn_t *conn) {
+  if (metrics == NULL || conn->metrics_slot == NULL)
+    return;
+
+  metrics_conn_t values;
+  conn_snapshot(conn, &values);
+  metrics_publish(conn->metrics_slot, &values);
+}
+
+/**
+ * Brings the timeline and metrics of a connection up to date, after something
+ * about it changed.
+ *
+ * conn: The connection.
+ */
+static void conn_updated(conn_t *conn) {
+  timeline_update(conn);
+  metrics_update(conn);
+}
+
+/**
+ * Records an event for ctcp_replay, if --record is on.
+ *
+ * conn: Connection the event is for, or NULL for ctcp_timer().
+ * type: Kind of event.
+ * value: Depends on the type (see ctcp_record.h).
+ * data: Data that goes with the event, or NULL.
+ * len: Length of the data.
+ */
+static void record(conn_t *conn, enum record_type type, int32_t value,
+                   const void *data, size_t len) {
+  if (recording) {
+    record_event(recording, conn ? conn->record_id : 0, type, value, data,
+                 len, current_time_ns());
+  }
+}
+
+/** Settings that can be changed through the control socket, or given by a
+    profile (see ctcp_profile.h). */
+enum setting {
+  SETTING_TIMER,                /* ctcp_timer() interval, in ms. Global only */
+  SETTING_RTO,                  /* Retransmission timeout, in ms */
+  SETTING_RTO_MIN,              /* Bounds on the retransmission timeout */
+  SETTING_RTO_MAX,
+  SETTING_WINDOW,               /* Send and receive windows, in segments */
+  SETTING_SWND,                 /* Send window, in bytes */
+  SETTING_RWND,                 /* Receive window, in bytes. Also clamps the
+                                   window advertised */
+  SETTING_PACING,               /* Pacing rate, in kbit/s */
+  SETTING_BUFSPACE,             /* Output space, in bytes */
+  SETTING_CC,                   /* Congestion control */
+  SETTING_NODELAY,              /* Send small segments straight away. 0 or 1 */
+  SETTING_DELAYED_ACK,          /* Hold back ACKs. 0 or 1 */
+  SETTING_BUSY_POLL,            /* Poll without sleeping while the connection
+                                   is open. 0 or 1 */
+  SETTINGS
+};
+
+static const char *setting_names[SETTINGS] = {
+  "timer", "rto", "rto_min", "rto_max", "window", "swnd", "rwnd", "pacing",
+  "bufspace", "cc", "nodelay", "delayed_ack", "busy_poll"
+};
+
+/**
+ * Reads a setting and checks its value.
+ *
+ * name: Name of the setting.
+ * text: Its value.
+ * setting: Where to put which setting it is.
+ * value: Where to put its value, for all but SETTING_CC.
+ * cc: Where to put the congestion control, for SETTING_CC.
+ * returns: NULL if the setting is fine, otherwise what is wrong with it.
+ */
+static const char *parse_setting(const char *name, const char *text,
+                                 enum setting *setting, long *value,
+                                 const char **cc) {
+  int i;
+  for (i = 0; i < SETTINGS; i++) {
+    if (strcmp(name, setting_names[i]) == 0)
+      break;
+  }
+  if (i == SETTINGS)
+    return "unknown setting";
+  *setting = i;
+  *value = 0;
+  *cc = text;
+
+  if (i == SETTING_CC) {
+    if (strlen(text) >= sizeof(((ctcp_tunables_t *) 0)->cc))
+      return "congestion control name too long";
+    if (strcmp(text, "default") == 0)
+      *cc = "";
+    return NULL;
+  }
+
+  char *end;
+  *value = strtol(text, &end, 10);
+  if (*end != '\0' || *value < 0)
+    return "value must be a number, 0 or more";
+  if ((i == SETTING_SWND || i == SETTING_RWND) && *value > UINT16_MAX)
+    return "windows can be at most 65535 bytes";
+  if (i == SETTING_WINDOW && *value > UINT16_MAX / MAX_SEG_DATA_SIZE)
+    return "window can be at most 45 segments";
+  if ((i == SETTING_NODELAY || i == SETTING_DELAYED_ACK ||
+       i == SETTING_BUSY_POLL) && *value > 1)
+    return "value must be 0 or 1";
+  if (*value == 0 && (i == SETTING_TIMER || i == SETTING_RTO ||
+                      i == SETTING_WINDOW || i == SETTING_SWND ||
+                      i == SETTING_RWND || i == SETTING_BUFSPACE))
+    return "value must be more than 0";
+  return NULL;
+}
+
+/**
+ * Changes a setting.
+ *
+ * settings: Settings to change.
+ * setting: Which one.
+ * value: New value, for all but SETTING_CC.
+ * cc: New congestion control, for SETTING_CC.
+ */
+static void change_setting(conn_settings_t *settings, enum setting setting,
+                           long value, const char *cc) {
+  ctcp_tunables_t *tunables = &settings->tunables;
+  switch (setting) {
+  case SETTING_TIMER:       tunables->timer = value; break;
+  case SETTING_RTO:         tunables->rt_timeout = value; break;
+  case SETTING_RTO_MIN:     tunables->rto_min = value; break;
+  case SETTING_RTO_MAX:     tunables->rto_max = value; break;
+  case SETTING_SWND:        tunables->send_window = value; break;
+  case SETTING_NODELAY:     tunables->nodelay = value; break;
+  case SETTING_DELAYED_ACK: tunables->delayed_ack = value; break;
+  case SETTING_WINDOW:
+    value *= MAX_SEG_DATA_SIZE;
+    tunables->send_window = value;
+    /* Falls through. */
+  case SETTING_RWND:
+    tunables->recv_window = value;
+    settings->window_clamp = value;
+    break;
+  case SETTING_CC:
+    snprintf(tunables->cc, sizeof(tunables->cc), "%s", cc);
+    break;
+
+  /* Not seen by student code. */
+  case SETTING_PACING:      settings->pacing_rate = value; return;
+  case SETTING_BUFSPACE:    settings->max_bufspace = value; return;
+  case SETTING_BUSY_POLL:   settings->busy_poll = value; return;
+  default:                  return;
+  }
+  settings->version++;
+}
+
+/**
+ * Changes the part of a setting that connections are set up with. The send
+ * window is left alone, as it comes from the other end (see conn_start()).
+ *
+ * cfg: Configuration to change.
+ * setting: Which setting.
+ * value: New value.
+ */
+static void change_config(ctcp_config_t *cfg, enum setting setting,
+                          long value) {
+  if (setting == SETTING_TIMER)
+    cfg->timer = value;
+  else if (setting == SETTING_RTO)
+    cfg->rt_timeout = value;
+  else if (setting == SETTING_WINDOW)
+    cfg->recv_window = value * MAX_SEG_DATA_SIZE;
+  else if (setting == SETTING_RWND)
+    cfg->recv_window = value;
+}
+
+/**
+ * Gives settings those of a profile. The profile was checked when it was read
+ * in (see load_profiles()).
+ *
+ * profile: The profile.
+ * settings: Settings to change.
+ * cfg: Configuration that goes with them.
+ */
+static void profile_apply(profile_t *profile, conn_settings_t *settings,
+                          ctcp_config_t *cfg) {
+  int i;
+  for (i = 0; i < profile->num_settings; i++) {
+    enum setting setting;
+    long value;
+    const char *cc;
+    parse_setting(profile->settings[i].key, profile->settings[i].value,
+                  &setting, &value, &cc);
+    change_setting(settings, setting, value, cc);
+    change_config(cfg, setting, value);
+  }
+  snprintf(settings->tunables.profile, sizeof(settings->tunables.profile),
+           "%s", profile->name);
+}
+
+/**
+ * Gets a new connection ready to be handed to student code. Gives it the
+ * default settings and, on a server, those of the first profile that matches
+ * it. Numbers it in the recording and records the call to ctcp_init() and the
+ * settings it starts with, if --record is on, and gives it a slot in the
+ * metrics, if --metrics is on.
+ *
+ * conn: The connection.
+ * cfg: Configuration it is about to be set up with. Changed by its profile,
+ *      and the send window is lowered to the one in its settings, if there is
+ *      one.
+ */
+static void conn_start(conn_t *conn, ctcp_config_t *cfg) {
+  conn->settings = default_settings;
+  if (profiles && SERVER) {
+    profile_t *profile = profile_match(profiles, config->port, conn->port,
+                                       run_program ? config->program : NULL);
+    if (profile)
+      profile_apply(profile, &conn->settings, cfg);
+  }
+  conn->settings.version = 0;
+  if (conn->settings.busy_poll)
+    busy_polling++;
+  CTCP_PROBE3(conn_init, conn, conn->ip_addr, conn->port);
+
+  ctcp_tunables_t *tunables = &conn->settings.tunables;
+  if (tunables->send_window && tunables->send_window < cfg->send_window)
+    cfg->send_window = tunables->send_window;
+  tunables->timer = cfg->timer;
+  tunables->rt_timeout = cfg->rt_timeout;
+  tunables->send_window = cfg->send_window;
+  tunables->recv_window = cfg->recv_window;
+
+  if (recording) {
+    conn->record_id = ++recorded_conns;
+    record(conn, RECORD_INIT, 0, cfg, sizeof(ctcp_config_t));
+    record(conn, RECORD_TUNE, 0, tunables, sizeof(ctcp_tunables_t));
+  }
+  if (metrics) {
+    conn->metrics_slot = metrics_attach(metrics, conn->ip_addr,
+                                        conn->port, unix_socket,
+                                        current_time_ns());
+  }
+}
+
 /**
  * Set up the configuration for this host:
  *   - Create raw socket to communicate.
@@ -292,7 +823,8 @@ char *create_tcp_seg(conn_t *dst, uint8_t flags, char *data, uint16_t len) {
 
   uint16_t window = 0;
   if (!(flags & TH_RST))
-    window = htons(ctcp_cfg->recv_window);
+    window = htons(dst->settings.tunables.recv_window ?
+                   dst->settings.tunables.recv_window : ctcp_cfg->recv_window);
 
   /* TCP header. */
   tcp_hdr->th_sport = htons(config->port);
@@ -324,6 +856,7 @@ char *create_tcp_seg(conn_t *dst, uint8_t flags, char *data, uint16_t len) {
  * returns: A cTCP segment.
  */
 ctcp_segment_t *convert_to_ctcp(conn_t *src, char *datagram, int actual_len) {
+  uint64_t start = path_start();
   iphdr_t *ip_hdr = (iphdr_t *) datagram;
   tcphdr_t *tcp_hdr = (tcphdr_t *) (datagram + IP_HDR_SIZE);
   char *payload = (char *)((uint8_t *) tcp_hdr + TCP_HDR_SIZE);
@@ -331,7 +864,7 @@ ctcp_segment_t *convert_to_ctcp(conn_t *src, char *datagram, int actual_len) {
   /* Get actual lengths and allocate cTCP segment of correct size. */
   uint16_t data_len = ntohs(ip_hdr->tot_len) - FULL_HDR_SIZE;
   uint16_t len = data_len + sizeof(ctcp_segment_t);
-  ctcp_segment_t *segment = calloc(len, 1);
+  ctcp_segment_t *segment = timed_calloc(ALLOC_CONVERT_TO_CTCP, len);
 
   /* Set fields of cTCP segment. Convert sequence numbers to relative
      sequence numbers. */
@@ -343,7 +876,7 @@ ctcp_segment_t *convert_to_ctcp(conn_t *src, char *datagram, int actual_len) {
   segment->cksum = 0;
   if (data_len > 0)
     memcpy(segment->data, payload, data_len);
-  segment->cksum = cksum(segment, len);
+  segment->cksum = timed_cksum(segment, len);
 
   /* Find the difference in the given TCP checksum and the correct one. This
      difference is the same difference that should be added to the cTCP one.
@@ -351,8 +884,9 @@ ctcp_segment_t *convert_to_ctcp(conn_t *src, char *datagram, int actual_len) {
      the student (see convert_to_datagram). */
   uint16_t sum = tcp_hdr->th_sum;
   tcp_hdr->th_sum = 0;
-  uint16_t correct_sum = cksum_tcp(ip_hdr, data_len);
+  uint16_t correct_sum = timed_cksum_tcp(ip_hdr, data_len);
   segment->cksum += (correct_sum - sum);
+  path_end(PATH_TO_CTCP, start);
   return segment;
 }
 
@@ -366,6 +900,8 @@ ctcp_segment_t *convert_to_ctcp(conn_t *src, char *datagram, int actual_len) {
  * returns: A raw IP packet, NULL if it has an incorrect checksum.
  */
 char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment, int len) {
+  uint64_t start = path_start();
+
   /* Create IP packet with TCP payload. */
   uint16_t tcp_pkt_len = len - sizeof(ctcp_segment_t) + TCP_HDR_SIZE;
   char *datagram = create_datagram(config->ip_addr, dst->ip_addr, tcp_pkt_len);
@@ -399,16 +935,53 @@ char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment, int len) {
      incorrect TCP checksum. */
   uint16_t sum = segment->cksum;
   segment->cksum = 0;
-  uint16_t correct_sum = cksum(segment, len);
+  uint16_t correct_sum = timed_cksum(segment, len);
   segment->cksum = sum;
 
   /* TCP checksum. Add on the difference between the correct checksum and the
      student's checksum. */
-  tcp_hdr->th_sum = cksum_tcp(ip_hdr, data_len);
+  tcp_hdr->th_sum = timed_cksum_tcp(ip_hdr, data_len);
   tcp_hdr->th_sum += (correct_sum - sum);
+  path_end(PATH_TO_DATAGRAM, start);
   return datagram;
 }
 
+/**
+ * Captures a datagram sent or received, if --pcap is on.
+ *
+ * datagram: The raw IP packet.
+ * len: Length of the packet.
+ * outbound: Whether it is being sent (else it was received).
+ */
+static void capture_datagram(const void *datagram, size_t len, bool outbound) {
+  if (pcap == NULL)
+    return;
+
+  int *interface = &pcap_interfaces[unix_socket];
+  if (*interface < 0) {
+    char description[64];
+    snprintf(description, sizeof(description), "cTCP port %d over %s",
+             config->port, unix_socket ? "a Unix socket" : "raw IP");
+    *interface = pcapng_interface(pcap, unix_socket ? "unix" : "ip",
+                                  description);
+  }
+  pcapng_packet(pcap, *interface, current_time_ns(), datagram, len, outbound);
+}
+
+/**
+ * Counts a packet dropped by recv_filter(), if --metrics is on, and fires the
+ * drop probe.
+ *
+ * reason: Why it was dropped.
+ * port: Port it came from, 0 if it is too short to tell.
+ * len: Its length.
+ */
+static void filter_drop(enum metrics_drop reason, int port, int len) {
+  if (metrics)
+    metrics_drop(metrics, reason);
+  CTCP_PROBE3(drop, reason, port, len);
+}
+
 /**
  * Naive filtering. Host might receive many unwanted packets or leftover
  * packets from a previous session. We drop these packets.
@@ -427,15 +1000,20 @@ int recv_filter(int sockfd, void *buf, size_t len, int flags, conn_t **rconn) {
   int r = recv(sockfd, buf, len, flags);
   if (r < 0)
     return -1;
+  capture_datagram(buf, r, false);
 
-  if (r < FULL_HDR_SIZE)
+  if (r < FULL_HDR_SIZE) {
+    filter_drop(METRICS_DROP_SHORT, 0, r);
     return 0;
+  }
 
   /* Is this packet to us? If not, ignore it. */
   iphdr_t *ip_hdr = (iphdr_t *) buf;
   tcphdr_t *tcp_hdr = (tcphdr_t *) (buf + IP_HDR_SIZE);
-  if (tcp_hdr->th_dport != htons(config->port))
+  if (tcp_hdr->th_dport != htons(config->port)) {
+    filter_drop(METRICS_DROP_PORT, ntohs(tcp_hdr->th_sport), r);
     return 0;
+  }
 
   /* A RST packet. End connection. */
   if (tcp_hdr->th_flags & TH_RST) {
@@ -465,6 +1043,7 @@ int recv_filter(int sockfd, void *buf, size_t len, int flags, conn_t **rconn) {
     conn = conn->next;
   }
 
+  filter_drop(METRICS_DROP_UNKNOWN, ntohs(tcp_hdr->th_sport), r);
   return 0;
 }
 
@@ -493,6 +1072,7 @@ int send_pkt(conn_t *dst, int sockfd, const void *buf, size_t len, int flags) {
     size = sizeof(dst->saddr);
   }
 
+  capture_datagram(buf, len, true);
   return sendto(config->socket, buf, len, flags, addr, size);
 }
 
@@ -524,7 +1104,7 @@ void *send_resets(void *args) {
     int s = sendto(config->socket, rst, FULL_HDR_SIZE, 0,
                    (struct sockaddr *) &conn.saddr, sizeof(conn.saddr));
     memset(buf, 0, MAX_PACKET_SIZE);
-    free(rst);
+    tagged_free(ALLOC_CREATE_DATAGRAM, rst, FULL_HDR_SIZE);
 
     /* Could not send resets. Give up. */
     if (s < 0)
@@ -550,7 +1130,7 @@ void *send_resets(void *args) {
 int send_tcp_conn_seg(conn_t *dst, int flags) {
   char *tcp_pkt = create_tcp_seg(dst, flags, NULL, 0);
   int r = send_pkt(dst, config->socket, tcp_pkt, FULL_HDR_SIZE, 0);
-  free(tcp_pkt);
+  tagged_free(ALLOC_CREATE_DATAGRAM, tcp_pkt, FULL_HDR_SIZE);
 
   if (r < 0) {
     fprintf(stderr, "[ERROR] Could not connect\n");
@@ -584,7 +1164,7 @@ void conn_add(conn_t *conn) {
   conn_t *conn_list = get_connections();
 
   if (conn != conn_list) {
-    conn->prev = &conn_list;
+    conn->prev = SERVER ? &config->connections : &config->sconn;
     conn->next = conn_list;
 
     if (conn_list)
@@ -609,11 +1189,34 @@ size_t conn_bufspace(conn_t *conn) {
   chunk_t *chunk;
   size_t used = 0;
 
-  /* Count up how much output space already used. */
-  for (chunk = conn->out_queue; chunk; chunk = chunk->next) {
+  /* Count up how much output space already used. Echoed output waits in the
+     input queue instead. */
+  for (chunk = echo_mode ? conn->in_queue : conn->out_queue; chunk;
+       chunk = chunk->next) {
     used += (chunk->size - chunk->used);
   }
-  return used > MAX_BUF_SPACE ? 0 : MAX_BUF_SPACE - used;
+  size_t max = conn->settings.max_bufspace;
+  return used > max ? 0 : max - used;
+}
+
+/**
+ * Records whether a connection has room to output a full segment, for its
+ * output stall histogram.
+ *
+ * conn: The connection.
+ */
+static void conn_stall_update(conn_t *conn) {
+  size_t segment = conn->settings.max_bufspace < MAX_SEG_DATA_SIZE ?
+                   conn->settings.max_bufspace : MAX_SEG_DATA_SIZE;
+  size_t bufspace = conn_bufspace(conn);
+  int64_t now = current_time_ns();
+  int64_t start = conn->stats.stall_start;
+  stats_output_stall(&conn->stats, bufspace < segment, now);
+
+  if (start == 0 && conn->stats.stall_start != 0)
+    CTCP_PROBE3(output_stall, conn, conn->port, bufspace);
+  else if (start != 0 && conn->stats.stall_start == 0)
+    CTCP_PROBE3(output_resume, conn, conn->port, now - start);
 }
 
 /**
@@ -625,6 +1228,7 @@ void conn_drain(conn_t *conn) {
   chunk_t *chunk;
   int w;
   bool outputted = false;
+  size_t written = 0;
   events[STDOUT_FILENO].events &= ~POLLOUT;
 
   /* Already wrote an error, can't write anymore. */
@@ -646,6 +1250,7 @@ void conn_drain(conn_t *conn) {
       break;
     }
     outputted = true;
+    written += w;
     chunk->used += w;
 
     /* Could not complete one chunk. Stop after this. */
@@ -658,7 +1263,7 @@ void conn_drain(conn_t *conn) {
     /* Update pointers. */
     if (!conn->out_queue)
       conn->out_queue_tail = &conn->out_queue;
-    free(chunk);
+    tagged_free(ALLOC_CONN_OUTPUT, chunk, offsetof(chunk_t, buf[chunk->size]));
   }
 
   /* Error in outputting if already wrote EOF but still stuff in the output
@@ -667,6 +1272,11 @@ void conn_drain(conn_t *conn) {
     conn->wrote_err = true;
 
   /* Output queue has space. Call student code. */
+  if (outputted) {
+    conn_stall_update(conn);
+    conn_updated(conn);
+    record(conn, RECORD_OUTPUT, written, NULL, 0);
+  }
   if (outputted && !conn->delete_me)
     ctcp_output(conn->state);
 }
@@ -677,11 +1287,40 @@ void conn_drain(conn_t *conn) {
  * conn: The conn_t to free.
  */
 void conn_free(conn_t *conn) {
+  CTCP_PROBE3(conn_destroy, conn, conn->ip_addr, conn->port);
+
+  /* Drop delayed segments to or from this connection. */
+  sched_cancel(loop_sched, conn);
+  link_cancel(link_out, conn);
+
+  if (timeline)
+    timeline_end(timeline, &conn->track, current_time_ns());
+  if (conn->metrics_slot) {
+    metrics_update(conn);
+    metrics_detach(metrics, conn->metrics_slot);
+  }
+  if (conn->settings.busy_poll)
+    busy_polling--;
+
+  /* Statistics, as one line of JSON. A stall ends with the connection. */
+  stats_output_stall(&conn->stats, false, current_time_ns());
+  if (opt_summary) {
+    fprintf(stderr, "[STATS] ");
+    stats_print_json(&conn->stats, stderr);
+    fprintf(stderr, "\n");
+  }
+
   /* Free up chunks. */
   chunk_t *chunk, *next_chunk;
   for (chunk = conn->out_queue; chunk; chunk = next_chunk) {
     next_chunk = chunk->next;
-    free(chunk);
+    tagged_free(ALLOC_CONN_OUTPUT, chunk,
+                offsetof(chunk_t, buf[chunk->size]));
+  }
+  for (chunk = conn->in_queue; chunk; chunk = next_chunk) {
+    next_chunk = chunk->next;
+    tagged_free(ALLOC_CONN_INJECT, chunk,
+                offsetof(chunk_t, buf[chunk->size]));
   }
 
   /* Adjust pointers. */
@@ -697,12 +1336,29 @@ void conn_free(conn_t *conn) {
       config->sconn = NULL;
   }
 
-  /* Close pipes to program, if it's running. */
+  /* Close pipes to program, if it's running. Its polling slot goes to
+     whichever program has the last one. */
   if (run_program) {
     close(conn->stdin);
     close(conn->stdout);
+
+    struct pollfd *last = &events[NUM_POLL + num_connected - 1];
+    if (conn->poll_fd != last) {
+      conn_t *other;
+      *conn->poll_fd = *last;
+      for (other = get_connections(); other; other = other->next) {
+        if (other->poll_fd == last)
+          other->poll_fd = conn->poll_fd;
+      }
+    }
+  }
+  if (SERVER) {
+    num_connected--;
+    tagged_free(ALLOC_NEW_CONNECTION, conn, sizeof(conn_t));
+  }
+  else {
+    free(conn);
   }
-  free(conn);
 }
 
 /**
@@ -730,6 +1386,46 @@ int conn_input(conn_t *conn, void *buf, size_t len) { ASSERT_CONN;
     return -1;
   }
 
+  /* Input injected by the library comes first. */
+  if (conn->in_queue) {
+    r = 0;
+    while (conn->in_queue && (size_t) r < len) {
+      chunk_t *chunk = conn->in_queue;
+      size_t n = chunk->size - chunk->used;
+      if (n > len - r)
+        n = len - r;
+      memcpy((char *) buf + r, chunk->buf + chunk->used, n);
+      chunk->used += n;
+      r += n;
+
+      if (chunk->used == chunk->size) {
+        conn->in_queue = chunk->next;
+        if (!conn->in_queue)
+          conn->in_queue_last = NULL;
+        tagged_free(ALLOC_CONN_INJECT, chunk,
+                    offsetof(chunk_t, buf[chunk->size]));
+      }
+    }
+    injected_reads++;
+    record(conn, RECORD_INPUT, r, buf, r);
+    /* Echoed output waits here, so this makes space for more. */
+    if (echo_mode)
+      conn_stall_update(conn);
+    return r;
+  }
+
+  /* EOF queued up after the input. */
+  if (conn->in_eof) {
+    injected_reads++;
+    conn->read_eof = true;
+    record(conn, RECORD_INPUT, -1, NULL, 0);
+    return -1;
+  }
+
+  /* Nothing else to read if all input is injected. */
+  if (echo_mode || load_mode)
+    return 0;
+
   /* Read from the appropriate place (STOUT of the associated program). */
   if (run_program)
     r = read(conn->stdout, buf, len);
@@ -750,6 +1446,7 @@ int conn_input(conn_t *conn, void *buf, size_t len) { ASSERT_CONN;
   if (r == 0 || (r < 0 && errno != EAGAIN) ||
       ((test_debug_on || lab5_mode) && r > 0 && ((char *) buf)[0] == 0x1a)) {
     conn->read_eof = true;
+    record(conn, RECORD_INPUT, -1, NULL, 0);
     return -1;
   }
   /* No input. */
@@ -757,9 +1454,42 @@ int conn_input(conn_t *conn, void *buf, size_t len) { ASSERT_CONN;
     r = 0;
   }
 
+  if (r > 0)
+    record(conn, RECORD_INPUT, r, buf, r);
   return r;
 }
 
+/**
+ * Queues up data to be read by conn_input(), ahead of anything on STDIN. The
+ * main loop calls ctcp_read() for as long as there is some left. If called
+ * with a length of 0, an EOF is queued up after the data.
+ *
+ * conn: The connection object.
+ * buf: The data.
+ * len: Length of the data.
+ */
+void conn_inject(conn_t *conn, const char *buf, size_t len) {
+  if (len == 0) {
+    conn->in_eof = true;
+    return;
+  }
+
+  chunk_t *chunk = timed_calloc(ALLOC_CONN_INJECT,
+                                offsetof(chunk_t, buf[len]));
+  chunk->next = NULL;
+  chunk->size = len;
+  chunk->used = 0;
+  memcpy(chunk->buf, buf, len);
+
+  /* chunk_t is packed, so this keeps the last chunk rather than a pointer
+     to its next field. */
+  if (conn->in_queue_last)
+    conn->in_queue_last->next = chunk;
+  else
+    conn->in_queue = chunk;
+  conn->in_queue_last = chunk;
+}
+
 /**
  * Schedules a connection object for removal.
  *
@@ -775,6 +1505,111 @@ void conn_remove(conn_t *conn) {
   }
 }
 
+/**
+ * Puts a cTCP segment on the wire. Called once the segment has made it through
+ * the outgoing impairment and the emulated link. Frees the segment.
+ *
+ * ctx: Unused.
+ * conn: Connection object.
+ * segment: Pointer to cTCP segment to send.
+ * len: Length of the segment (including the cTCP header and data).
+ */
+void transmit_segment(void *ctx, conn_t *conn, ctcp_segment_t *segment,
+                      size_t len) {
+  uint16_t data_len = len - sizeof(ctcp_segment_t);
+  uint16_t total_len = FULL_HDR_SIZE + data_len;
+
+  /* Send from the connection's own endpoint, if it has one. */
+  struct config *saved_config = config;
+  if (conn->endpoint)
+    config = conn->endpoint;
+
+  if (trace) {
+    trace_segment(trace, config->ip_addr, config->port, conn, segment, len,
+                  true, unix_socket);
+  }
+  if (test_debug_on) {
+    log_segment(STDERR_FILENO, config->ip_addr, config->port, conn, segment,
+                len, true, unix_socket);
+  }
+
+  /* Convert from a cTCP segment to a real one and finally send the segment. */
+  char *pkt = convert_to_datagram(conn, segment, len);
+  int n = send_pkt(conn, config->socket, pkt, total_len, 0);
+  if (DEBUG) {
+    fprintf(stderr, "[DEBUG] Sent segment\n");
+    print_hdr_ctcp(segment);
+  }
+  tagged_free(ALLOC_CREATE_DATAGRAM, pkt, total_len);
+  free(segment);
+
+  /* Number of bytes sent. Need to subtract some because the return value is
+     actually the size of the TCP segment instead of the cTCP segment. */
+  if (n >= (long int)TCP_HDR_SIZE)
+    n -= (TCP_HDR_SIZE + IP_HDR_SIZE - sizeof(ctcp_segment_t));
+  last_transmit = n;
+  config = saved_config;
+}
+
+/**
+ * Passes a received cTCP segment to student code. Called once the segment has
+ * made it through the incoming impairment.
+ *
+ * ctx: Unused.
+ * conn: Connection object of the sender.
+ * segment: The cTCP segment. Freed by student code.
+ * len: Length of the segment (including the cTCP header and data).
+ */
+void receive_segment(void *ctx, conn_t *conn, ctcp_segment_t *segment,
+                     size_t len) {
+  if (conn->delete_me) {
+    free(segment);
+    return;
+  }
+
+  if (trace) {
+    trace_segment(trace, config->ip_addr, config->port, conn, segment, len,
+                  false, unix_socket);
+  }
+  if (test_debug_on) {
+    log_segment(STDERR_FILENO, config->ip_addr, config->port, conn,
+                segment, len, false, unix_socket);
+  }
+  stats_received(&conn->stats, segment, len, stats_verify, current_time_ns());
+  record(conn, RECORD_RECEIVE, 0, segment, len);
+  CTCP_PROBE6(receive, conn, conn->port, ntohl(segment->seqno),
+              ntohl(segment->ackno), len, ntohl(segment->flags));
+  enum loop_phase phase = phase_enter(PHASE_RECEIVE);
+  ctcp_receive(conn->state, segment, len);
+  phase_enter(phase);
+
+  /* Published once student code has dealt with it, so that it is not one
+     event behind. */
+  conn_updated(conn);
+}
+
+/** A segment held back by pacing. */
+typedef struct {
+  conn_t *conn;
+  ctcp_segment_t *segment;
+  size_t len;
+} paced_t;
+
+/**
+ * Sends a segment held back by pacing on its way, once it is due.
+ */
+static void pace_release(void *arg, bool cancelled) {
+  paced_t *paced = arg;
+  if (cancelled) {
+    tagged_free(ALLOC_CONN_SEND, paced->segment, paced->len);
+  }
+  else {
+    tagged_release(ALLOC_CONN_SEND, paced->len);
+    impair_segment(impair_out, paced->conn, paced->segment, paced->len);
+  }
+  tagged_free(ALLOC_CONN_SEND, paced, sizeof(paced_t));
+}
+
 /**
  * Sends a cTCP segment to a destination associated with the provided
  * connection object.
@@ -793,111 +1628,70 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
     return -1;
   }
 
-  /* Make a copy of the segment first. */
-  ctcp_segment_t *segment_copy = calloc(len, 1);
-  memcpy(segment_copy, segment, len);
-
-  /* Fork process off in order to do unreliability. Keep track of whether we
-     are forked or not. */
-  int fork_level = 0;
-  bool am_i_forked = 0;
-
-  /* Segment drop. Don't send the segment. */
-  if ((test_debug_on && !tester_did_unreliable && opt_drop) ||
-      (!test_debug_on && rand_percent(fork_level) < opt_drop)) {
-    tester_did_unreliable = true;
+  record(conn, RECORD_SEND, 0, segment, len);
 
-    if (DEBUG) {
-      fprintf(stderr, "[DEBUG] Dropping segment\n");
-      print_hdr_ctcp(segment_copy);
-    }
-    free(segment_copy);
-    return len;
+  uint64_t retransmits = conn->stats.retransmits;
+  uint64_t rto_events = conn->stats.rto_events;
+  stats_sent(&conn->stats, segment, len, current_time_ns(), timer_tick);
+  CTCP_PROBE6(send, conn, conn->port, ntohl(segment->seqno),
+              ntohl(segment->ackno), len, ntohl(segment->flags));
+  if (conn->stats.retransmits != retransmits) {
+    CTCP_PROBE5(retransmit, conn, conn->port, ntohl(segment->seqno),
+                len - sizeof(ctcp_segment_t), timer_tick);
   }
 
-  /* Segment duplication. Fork another process to send the other segment. */
-  if ((test_debug_on && !tester_did_unreliable && opt_duplicate) ||
-      (!test_debug_on && rand_percent(fork_level) < opt_duplicate)) {
-    tester_did_unreliable = true;
-
-    if (DEBUG) {
-      fprintf(stderr, "[DEBUG] Duplicating segment\n");
-      print_hdr_ctcp(segment_copy);
+  /* Timeline and metrics. Retransmissions are marked on the timeline, as is
+     the first one sent from each ctcp_timer() call (the timeout). */
+  conn_updated(conn);
+  if (timeline) {
+    if (conn->stats.rto_events != rto_events) {
+      timeline_instant(timeline, &conn->track, "rto", ntohl(segment->seqno),
+                       len - sizeof(ctcp_segment_t), current_time_ns());
     }
-    if (fork() == 0) {
-      am_i_forked = 1;
-      fork_level++;
+    if (conn->stats.retransmits != retransmits) {
+      timeline_instant(timeline, &conn->track, "retransmit",
+                       ntohl(segment->seqno), len - sizeof(ctcp_segment_t),
+                       current_time_ns());
     }
   }
 
-  /* Segment delay. Fork another process to delay the segment, and kill the
-     current one. */
-  if ((test_debug_on && !tester_did_unreliable && opt_delay) ||
-       (!test_debug_on && rand_percent(fork_level) < opt_delay)) {
-    tester_did_unreliable = true;
+  /* Make a copy of the segment first. */
+  ctcp_segment_t *segment_copy = timed_malloc(ALLOC_CONN_SEND, len);
+  memcpy(segment_copy, segment, len);
 
-    if (DEBUG) {
-      fprintf(stderr, "[DEBUG] Delaying segment\n");
-      print_hdr_ctcp(segment_copy);
-    }
-    /* Forked process. Sleep for a bit. */
-    if (fork() == 0) {
-      am_i_forked = 1;
-      fork_level++;
-      sleep(rand() % 5);
-    }
-    /* Original process. */
-    else {
-      free(segment_copy);
-      return len;
-    }
+  /* Advertise no more than the window it is clamped to. */
+  uint16_t clamp = conn->settings.window_clamp;
+  if (clamp && ntohs(segment_copy->window) > clamp) {
+    segment_copy->window = htons(clamp);
+    segment_copy->cksum = 0;
+    segment_copy->cksum = timed_cksum(segment_copy, len);
   }
 
-  /* Segment corruption. Flip bits in the segment after the TCP flags (to avoid
-     corrupting the flags, which may cause problems). */
-  bool do_corrupt = rand_percent(fork_level) < opt_corrupt;
-  uint16_t data_length = len - sizeof(ctcp_segment_t) + sizeof(uint32_t);
-  uint16_t rand_bit = rand() % (data_length * 8 - 1) +
-                      (sizeof(ctcp_segment_t) - sizeof(uint32_t)) * 8;
-
-  if ((test_debug_on && !tester_did_unreliable && opt_corrupt) ||
-      (!test_debug_on && do_corrupt)) {
-    tester_did_unreliable = true;
-
-    if (DEBUG) {
-      fprintf(stderr, "[DEBUG] Corrupting segment\n");
-      print_hdr_ctcp(segment_copy);
+  /* Pacing. Segments go out no faster than the pacing rate, in the order they
+     were sent, and anything held back is sent from the main loop once it is
+     due. */
+  if (conn->settings.pacing_rate > 0) {
+    int64_t now = current_time_ns();
+    int64_t when = conn->pace_next > now ? conn->pace_next : now;
+    conn->pace_next = when + (int64_t) len * 8 * 1000000 /
+                             conn->settings.pacing_rate;
+    if (when > now) {
+      paced_t *paced = timed_calloc(ALLOC_CONN_SEND, sizeof(paced_t));
+      paced->conn = conn;
+      paced->segment = segment_copy;
+      paced->len = len;
+      sched_at(loop_sched, when, pace_release, paced, conn);
+      return len;
     }
-    flipbit(segment_copy, rand_bit);
   }
 
-  uint16_t data_len = len - sizeof(ctcp_segment_t);
-  uint16_t total_len = FULL_HDR_SIZE + data_len;
-
-  if (log_file != -1 || test_debug_on) {
-    log_segment(log_file, config->ip_addr, config->port, conn, segment_copy,
-                len, true, unix_socket);
-  }
-
-  /* Convert from a cTCP segment to a real one and finally send the segment. */
-  char *pkt = convert_to_datagram(conn, segment_copy, len);
-  int n = send_pkt(conn, config->socket, pkt, total_len, 0);
-  if (DEBUG) {
-    fprintf(stderr, "[DEBUG] Sent segment\n");
-    print_hdr_ctcp(segment_copy);
-  }
-  free(pkt);
-  free(segment_copy);
-
-  /* Kill forked process. */
-  if (am_i_forked)
-    exit(0);
-
-  /* Return number of bytes sent. Need to subtract some because the return value
-     is actually the size of the TCP segment instead of the cTCP segment. */
-  if (n >= (long int)TCP_HDR_SIZE)
-    return n - (TCP_HDR_SIZE + IP_HDR_SIZE - sizeof(ctcp_segment_t));
-  return n;
+  /* Unreliability. The segment may be dropped, corrupted, duplicated or held
+     back for a while, then has to make it across the emulated link. Whatever
+     is left of it ends up in transmit_segment(), now or once it is due. */
+  last_transmit = len;
+  tagged_release(ALLOC_CONN_SEND, len);
+  impair_segment(impair_out, conn, segment_copy, len);
+  return last_transmit;
 }
 
 /**
@@ -914,9 +1708,11 @@ int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
   if (conn->wrote_eof)
     return 0;
 
-  /* Writing EOF. */
+  /* Writing EOF. When echoing, the EOF goes back too. */
   if (len == 0) {
     conn->wrote_eof = true;
+    if (echo_mode)
+      conn_inject(conn, NULL, 0);
     return 0;
   }
 
@@ -926,6 +1722,24 @@ int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
     return -1;
   }
 
+  /* Echoing. Send it straight back. */
+  if (echo_mode) {
+    if (!conn_bufspace(conn))
+      return 0;
+    conn_inject(conn, buf, len);
+    stats_output(&conn->stats, len);
+    record(conn, RECORD_WRITE, len, NULL, 0);
+    conn_stall_update(conn);
+    return len;
+  }
+
+  /* Driven by the load generator. Nobody reads the output. */
+  if (load_mode) {
+    stats_output(&conn->stats, len);
+    record(conn, RECORD_WRITE, len, NULL, 0);
+    return len;
+  }
+
   int left = len;
   int w = 0;
 
@@ -953,12 +1767,14 @@ int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
     else {
       buf += w;
       left -= w;
+      record(conn, RECORD_WRITE, w, NULL, 0);
     }
   }
 
   /* Put the rest in an output queue. */
   if (left > 0) {
-    chunk_t *chunk = calloc(offsetof(chunk_t, buf[left]), 1);
+    chunk_t *chunk = timed_calloc(ALLOC_CONN_OUTPUT,
+                                  offsetof(chunk_t, buf[left]));
     chunk->next = NULL;
     chunk->size = left;
     chunk->used = 0;
@@ -976,9 +1792,65 @@ int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
     else
       events[STDOUT_FILENO].events |= POLLOUT;
   }
+  stats_output(&conn->stats, len);
+  conn_stall_update(conn);
+  conn_updated(conn);
   return len;
 }
 
+/**
+ * Records the congestion window student code is using, for the timeline.
+ *
+ * conn: The connection object.
+ * cwnd: The congestion window, in bytes.
+ */
+void conn_report_cwnd(conn_t *conn, uint32_t cwnd) {
+  conn->cwnd = cwnd;
+  stats_cwnd(&conn->stats, cwnd, current_time_ns());
+  conn_updated(conn);
+}
+
+/**
+ * Hands student code the connection's current settings, as changed through the
+ * control socket.
+ *
+ * conn: The connection object.
+ * tunables: Where to copy the settings.
+ * returns: How many times they have changed.
+ */
+uint32_t conn_tunables(conn_t *conn, ctcp_tunables_t *tunables) {
+  *tunables = conn->settings.tunables;
+  return conn->settings.version;
+}
+
+/**
+ * [Client-only]
+ * Finishes a handshake once the server has answered the SYN: takes its
+ * sequence numbers and, for a SYN-ACK, sends the final ACK.
+ *
+ * conn: The connection object.
+ * synack: TCP header of the server's answer.
+ */
+void tcp_handshake_reply(conn_t *conn, tcphdr_t *synack) { ASSERT_CLIENT_ONLY;
+  /* If an ACK is received instead of a SYN-ACK, continue previous
+     connection. Get sequence numbers from previous connection. */
+  if ((synack->th_flags & TH_SYN) == 0) {
+    conn->init_seqno = ntohl(synack->th_ack) - 1;
+    conn->their_init_seqno = ntohl(synack->th_seq) - 1;
+
+    conn->next_seqno = conn->init_seqno + 1;
+    conn->ackno = ntohl(synack->th_seq);
+  }
+
+  /* Otherwise, set new acknowledgement number and send ACK response */
+  else {
+    conn->next_seqno++;
+    conn->their_init_seqno = ntohl(synack->th_seq);
+    conn->ackno = ntohl(synack->th_seq) + 1;
+    send_ack(conn);
+  }
+}
+
 /**
  * [Client-only]
  * TCP handshake with server. This includes the SYN, SYN-ACK, and ACK segments.
@@ -1003,24 +1875,7 @@ conn_t *tcp_handshake(void) { ASSERT_CLIENT_ONLY;
   /* Set window size for the other host. */
   ctcp_cfg->send_window = ntohs(synack->window);
 
-  /* If an ACK is received instead of a SYN-ACK, continue previous
-     connection. Get sequence numbers from previous connection. */
-  if ((synack->th_flags & TH_SYN) == 0) {
-    config->sconn->init_seqno = ntohl(synack->th_ack) - 1;
-    config->sconn->their_init_seqno = ntohl(synack->th_seq) - 1;
-
-    config->sconn->next_seqno = config->sconn->init_seqno + 1;
-    config->sconn->ackno = ntohl(synack->th_seq);
-  }
-
-  /* Otherwise, set new acknowledgement number and send ACK response */
-  else {
-    config->sconn->next_seqno++;
-    config->sconn->their_init_seqno = ntohl(synack->th_seq);
-    config->sconn->ackno = ntohl(synack->th_seq) + 1;
-    send_ack(config->sconn);
-  }
-
+  tcp_handshake_reply(config->sconn, synack);
   return config->sconn;
 }
 
@@ -1034,9 +1889,9 @@ conn_t *tcp_handshake(void) { ASSERT_CLIENT_ONLY;
  */
 conn_t *tcp_new_connection(char *pkt) { ASSERT_SERVER_ONLY;
   /* Ignore if too many clients are connected. */
-  if (num_connected >= MAX_NUM_CLIENTS) {
+  if (num_connected >= max_clients) {
     fprintf(stderr, "[ERROR] Maximum number of clients (%d) reached\n",
-            MAX_NUM_CLIENTS);
+            max_clients);
     return NULL;
   }
   num_connected++;
@@ -1045,22 +1900,26 @@ conn_t *tcp_new_connection(char *pkt) { ASSERT_SERVER_ONLY;
   tcphdr_t *syn = (tcphdr_t *) (pkt + IP_HDR_SIZE);
 
   /* Set up connection details and add to list of connections. */
-  conn_t *conn = calloc(sizeof(conn_t), 1);
+  conn_t *conn = tagged_calloc(ALLOC_NEW_CONNECTION, sizeof(conn_t));
   conn_setup(conn, ntohl(ip_hdr->saddr), ntohs(syn->th_sport), unix_socket);
   conn->their_init_seqno = ntohl(syn->th_seq);
   conn->ackno = conn->their_init_seqno + 1;
   conn_add(conn);
 
-  /* Send a SYN-ACK to the client. */
-  send_synack(conn);
-
-  /* Get window size of the client. */
+  /* Get window size of the client. The connection gets its settings before
+     the SYN-ACK, which advertises its receive window. */
   ctcp_cfg->send_window = ntohs(syn->window);
-  ctcp_config_t *config_copy = calloc(sizeof(ctcp_config_t), 1);
+  ctcp_config_t *config_copy = tagged_calloc(ALLOC_NEW_CONNECTION,
+                                             sizeof(ctcp_config_t));
   memcpy(config_copy, ctcp_cfg, sizeof(ctcp_config_t));
+  conn_start(conn, config_copy);
+
+  /* Send a SYN-ACK to the client. */
+  send_synack(conn);
 
-  /* Student code. */
+  /* Student code. It frees the configuration. */
   ctcp_state_t *state = ctcp_init(conn, config_copy);
+  tagged_release(ALLOC_NEW_CONNECTION, sizeof(ctcp_config_t));
   conn->state = state;
 
   fprintf(stderr, "[INFO] Client connected\n");
@@ -1133,6 +1992,33 @@ void delete_all_connections() {
   }
 }
 
+/**
+ * Whether there is injected input for ctcp_read() to pick up, including an
+ * EOF.
+ *
+ * conn: The connection object.
+ */
+bool input_pending(conn_t *conn) {
+  return conn->in_queue || (conn->in_eof && !conn->read_eof);
+}
+
+/**
+ * Prints where the main loop's time has gone since the last report, if the
+ * next one is due. Checked on each timer tick when --loop-profile asked for
+ * one every so often.
+ */
+static void report_loop(void) {
+  int64_t now = current_time_ns();
+  if (now < loop_report_at)
+    return;
+
+  fprintf(stderr, "[LOOP] ");
+  loopprof_print_json(loopprof, &loop_last, stderr);
+  fprintf(stderr, "\n");
+  loop_last = *loopprof;
+  loop_report_at = now + loop_interval;
+}
+
 /**
  * Main loop. Handles the following:
  *   - Input from STDIN.
@@ -1143,23 +2029,45 @@ void delete_all_connections() {
 void do_loop() {
   char buf[MAX_PACKET_SIZE];
   conn_t *conn = NULL;
+  bool reading = false;
 
   while (true) {
+    if (terminated)
+      exit(128 + SIGTERM);
+
     memset(buf, 0, MAX_PACKET_SIZE);
+    long timeout = need_timer_in(&last_timeout, ctcp_cfg->timer);
+
+    /* Don't wait if student code is getting through echoed input, or a
+       connection is busy polling. */
+    if (reading || busy_polling > 0)
+      timeout = 0;
+    if (control)
+      control_poll(control, &events[CONTROL_POLL]);
+    phase_enter(PHASE_POLL);
     poll(events, NUM_POLL + num_connected,
-         need_timer_in(&last_timeout, ctcp_cfg->timer));
+         sched_timeout(loop_sched, timeout, current_time_ns()));
+    phase_enter(PHASE_OTHER);
+
+    /* Commands from the control socket. */
+    if (control)
+      control_handle(control, &events[CONTROL_POLL]);
 
     /* Input from stdin. Server will only send to most-recently connected
        client. */
     if (!run_program && events[STDIN_FILENO].revents & POLLIN) {
       conn = get_connections();
 
-      if (conn != NULL)
+      if (conn != NULL) {
+        phase_enter(PHASE_READ);
+        record(conn, RECORD_READ, 0, NULL, 0);
         ctcp_read(conn->state);
+      }
     }
 
     /* See if we can output more. */
     if (events[STDOUT_FILENO].revents & (POLLOUT | POLLHUP | POLLERR)) {
+      phase_enter(PHASE_DRAIN);
       for (conn = get_connections(); conn; conn = conn->next) {
         conn_drain(conn);
       }
@@ -1171,6 +2079,8 @@ void do_loop() {
       conn = get_connections();
       while (conn != NULL) {
         if (conn->poll_fd->revents & POLLIN) {
+          phase_enter(PHASE_READ);
+          record(conn, RECORD_READ, 0, NULL, 0);
           ctcp_read(conn->state);
         }
         conn = conn->next;
@@ -1180,6 +2090,7 @@ void do_loop() {
     /* Receive packet on socket from other hosts. Ignore packets if they are
        not large enough or not for us. */
     if (events[2].revents & POLLIN) {
+      phase_enter(PHASE_NETWORK);
       conn = NULL;
       int len = recv_filter(config->socket, buf, MAX_PACKET_SIZE, 0, &conn);
       if (len >= FULL_HDR_SIZE) {
@@ -1196,14 +2107,11 @@ void do_loop() {
               (segment->flags & TH_ACK) &&
               ntohl(segment->seqno) == 1 && ntohl(segment->ackno) == 1) {
             new_connection = 0;
-            free(segment);
+            tagged_free(ALLOC_CONVERT_TO_CTCP, segment, ntohs(segment->len));
           }
           else {
-            if (log_file != -1 || test_debug_on) {
-              log_segment(log_file, config->ip_addr, config->port, conn,
-                          segment, len, false, unix_socket);
-            }
-            ctcp_receive(conn->state, segment, len);
+            tagged_release(ALLOC_CONVERT_TO_CTCP, ntohs(segment->len));
+            impair_segment(impair_in, conn, segment, len);
           }
         }
 
@@ -1219,17 +2127,60 @@ void do_loop() {
       }
     }
 
+    /* Send or receive delayed segments that are due. */
+    phase_enter(PHASE_OTHER);
+    sched_run(loop_sched, current_time_ns());
+
+    /* Echo output back. Reading it frees up output space, so let student code
+       output more. */
+    uint64_t reads = injected_reads;
+    if (echo_mode) {
+      for (conn = get_connections(); conn; conn = conn->next) {
+        if (input_pending(conn) && !conn->delete_me) {
+          phase_enter(PHASE_READ);
+          record(conn, RECORD_READ, 0, NULL, 0);
+          ctcp_read(conn->state);
+          if (!conn->delete_me) {
+            phase_enter(PHASE_DRAIN);
+            record(conn, RECORD_OUTPUT, 0, NULL, 0);
+            ctcp_output(conn->state);
+          }
+        }
+      }
+    }
+    reading = injected_reads != reads;
+
     /* Check if timer is up. */
     if (need_timer_in(&last_timeout, ctcp_cfg->timer) == 0) {
+      phase_enter(PHASE_TIMER);
+      timer_tick = ++timer_calls;
+      record(NULL, RECORD_TIMER, 0, NULL, 0);
+      CTCP_PROBE1(timer, timer_tick);
       ctcp_timer();
+      timer_tick = 0;
       get_time(&last_timeout);
+      if (timeline || metrics) {
+        for (conn = get_connections(); conn; conn = conn->next)
+          conn_updated(conn);
+      }
+      if (loopprof && loop_interval > 0)
+        report_loop();
     }
 
     /* Delete connections if needed. */
+    phase_enter(PHASE_CLEANUP);
     delete_all_connections();
+    phase_enter(PHASE_OTHER);
   }
 }
 
+/**
+ * SIGTERM handler. Leaves it to the main loop to exit.
+ */
+static void on_terminate(int signum) {
+  terminated = 1;
+}
+
 /**
  * Setup config for polling.
  */
@@ -1246,20 +2197,40 @@ void setup_poll() {
   stdout->events = POLLOUT | POLLERR;
   async(STDOUT_FILENO);
 
+  /* Echoing servers don't use stdin or stdout. */
+  if (echo_mode)
+    stdin->fd = stdout->fd = -1;
+
   /* Poll for segments from the server. */
   struct pollfd *socket = &events[2];
   socket->fd = config->socket;
   socket->events = POLLIN | POLLHUP | POLLERR;
   async(config->socket);
 
+  /* The control socket sets up its own, if there is one. */
+  events[CONTROL_POLL].fd = events[CONTROL_POLL + 1].fd = -1;
+
   /* Used to detect if a network service has closed. */
   signal(SIGPIPE, SIG_IGN);
+  signal(SIGTERM, on_terminate);
 }
 
 /**
  * Library teardown for a client.
  */
 void end_client() {
+  /* The load generator cleans up after its own connections. */
+  if (load_mode)
+    return;
+
+  /* Unreliability statistics. */
+  if (impair_enabled(impair_out) || impair_enabled(impair_in)) {
+    impair_print_stats(impair_out, stderr);
+    impair_print_stats(impair_in, stderr);
+  }
+  if (link_enabled(link_out))
+    link_print_stats(link_out, stderr);
+
   /* Make sure this is a client. */
   if (SERVER) {
     fprintf(stderr, "[INFO] Client disconnected\n");
@@ -1272,6 +2243,10 @@ void end_client() {
   exit(EXIT_SUCCESS);
 }
 
+/* Left out when this file is built into another program (see
+   ctcp_microbench.c). */
+#ifndef CTCP_NO_MAIN
+
 /**
  * Start a client.
  *
@@ -1286,6 +2261,7 @@ int start_client(char *server, char *port) {
   conn_t *conn = tcp_handshake();
   ctcp_config_t *config_copy = calloc(sizeof(ctcp_config_t), 1);
   memcpy(config_copy, ctcp_cfg, sizeof(ctcp_config_t));
+  conn_start(conn, config_copy);
   ctcp_state_t *state = ctcp_init(conn, config_copy);
   if (state == NULL) {
     fprintf(stderr, "[ERROR] Could not connect to server!\n");
@@ -1324,6 +2300,482 @@ int start_server(char *port, int argc, char *argv[]) {
   return 0;
 }
 
+//////////////////////////////// CONTROL SOCKET ///////////////////////////////
+
+/** A per-connection metric in the Prometheus output. */
+struct prometheus_metric {
+  const char *name;
+  const char *type;
+  const char *help;
+  size_t offset;                /* Where it is in a metrics_conn_t */
+  char kind;                    /* 'c' for a 64-bit count, 't' for a time in
+                                   ns, 'u' for a 32-bit value */
+};
+
+static const struct prometheus_metric prometheus_metrics[] = {
+  { "ctcp_segments_sent_total", "counter", "Segments sent",
+    offsetof(metrics_conn_t, segments_sent), 'c' },
+  { "ctcp_bytes_sent_total", "counter", "Bytes sent, with headers",
+    offsetof(metrics_conn_t, bytes_sent), 'c' },
+  { "ctcp_retransmits_total", "counter", "Data segments retransmitted",
+    offsetof(metrics_conn_t, retransmits), 'c' },
+  { "ctcp_rto_events_total", "counter", "Retransmission timeouts",
+    offsetof(metrics_conn_t, rto_events), 'c' },
+  { "ctcp_segments_received_total", "counter", "Segments received",
+    offsetof(metrics_conn_t, segments_received), 'c' },
+  { "ctcp_bytes_received_total", "counter", "Bytes received, with headers",
+    offsetof(metrics_conn_t, bytes_received), 'c' },
+  { "ctcp_dup_acks_total", "counter", "Duplicate ACKs received",
+    offsetof(metrics_conn_t, dup_acks), 'c' },
+  { "ctcp_output_bytes_total", "counter", "Bytes output",
+    offsetof(metrics_conn_t, output_bytes), 'c' },
+  { "ctcp_srtt_seconds", "gauge", "Smoothed round-trip time",
+    offsetof(metrics_conn_t, srtt), 't' },
+  { "ctcp_rttvar_seconds", "gauge", "Round-trip time variation",
+    offsetof(metrics_conn_t, rttvar), 't' },
+  { "ctcp_cwnd_bytes", "gauge", "Congestion window reported",
+    offsetof(metrics_conn_t, cwnd), 'u' },
+  { "ctcp_rwnd_bytes", "gauge", "Window advertised by the other end",
+    offsetof(metrics_conn_t, rwnd), 'u' },
+  { "ctcp_inflight_bytes", "gauge", "Bytes sent and not yet acknowledged",
+    offsetof(metrics_conn_t, inflight), 'u' },
+  { "ctcp_bufspace_bytes", "gauge", "Output space left",
+    offsetof(metrics_conn_t, bufspace), 'u' },
+  { "ctcp_output_queue_bytes", "gauge", "Bytes waiting to be output",
+    offsetof(metrics_conn_t, out_queue), 'u' },
+};
+
+/**
+ * Finds a connection by the name of the other end (see conn_name()), or just
+ * its port.
+ *
+ * which: Name or port.
+ * returns: The connection, or NULL if there is none.
+ */
+static conn_t *control_find_conn(const char *which) {
+  conn_t *conn;
+  for (conn = get_connections(); conn; conn = conn->next) {
+    char name[CONN_NAME_SIZE];
+    conn_name(conn, name);
+    if (strcmp(which, name) == 0 || strcmp(which, strchr(name, ':') + 1) == 0)
+      return conn;
+  }
+  return NULL;
+}
+
+/**
+ * Changes a setting of a connection, and records it if student code can see
+ * the change.
+ */
+static void change_conn_setting(conn_t *conn, enum setting setting,
+                                long value, const char *cc) {
+  uint32_t version = conn->settings.version;
+  bool busy_poll = conn->settings.busy_poll;
+  change_setting(&conn->settings, setting, value, cc);
+  busy_polling += conn->settings.busy_poll - busy_poll;
+  if (conn->settings.version != version) {
+    record(conn, RECORD_TUNE, conn->settings.version,
+           &conn->settings.tunables, sizeof(ctcp_tunables_t));
+  }
+
+  /* More output space may have opened up. */
+  if (setting == SETTING_BUFSPACE) {
+    conn_drain(conn);
+    conn_stall_update(conn);
+  }
+  conn_updated(conn);
+}
+
+/**
+ * set <setting> <value> [connection]. Without a connection, changes the
+ * setting for every connection, and for new ones.
+ */
+static const char *control_set(int argc, char *argv[]) {
+  if (argc < 3 || argc > 4)
+    return "usage: set <setting> <value> [connection]";
+
+  enum setting setting;
+  long value;
+  const char *cc;
+  const char *error = parse_setting(argv[1], argv[2], &setting, &value, &cc);
+  if (error)
+    return error;
+
+  /* Just one connection. */
+  conn_t *conn;
+  if (argc == 4) {
+    if (setting == SETTING_TIMER)
+      return "timer can only be set for every connection";
+    if ((conn = control_find_conn(argv[3])) == NULL)
+      return "no such connection";
+    change_conn_setting(conn, setting, value, cc);
+    return NULL;
+  }
+
+  /* Every connection. New ones get the timer, retransmission timeout and
+     receive window through their configuration. */
+  change_setting(&default_settings, setting, value, cc);
+  change_config(ctcp_cfg, setting, value);
+  for (conn = get_connections(); conn; conn = conn->next)
+    change_conn_setting(conn, setting, value, cc);
+  return NULL;
+}
+
+/**
+ * Prints a setting.
+ */
+static void print_setting(FILE *reply, const char *name, long value) {
+  fprintf(reply, "%s:%ld ", name, value);
+}
+
+/**
+ * Prints how long a connection has spent limited by each thing, and what
+ * share of its life that is, the way ss -ti prints busy and rwnd_limited.
+ */
+static void print_limits(FILE *reply, ctcp_stats_t *stats) {
+  if (!stats->limit_valid)
+    return;
+  stats_limit_update(stats, current_time_ns());
+
+  int64_t total = 0;
+  int i;
+  for (i = 0; i < NUM_LIMITS; i++)
+    total += stats->limited[i];
+  fprintf(reply, "limited_by:%s ", stats_limit_name(stats->limit));
+  for (i = 0; i < NUM_LIMITS; i++) {
+    if (stats->limited[i] == 0)
+      continue;
+    fprintf(reply, "%s_limited:%lldms(%.1f%%) ", stats_limit_name(i),
+            (long long) (stats->limited[i] / 1000000),
+            total > 0 ? 100.0 * stats->limited[i] / total : 0);
+  }
+}
+
+/**
+ * list [connection]. Prints connections the way ss -ti does.
+ */
+static const char *control_list(int argc, char *argv[], FILE *reply) {
+  conn_t *only = NULL;
+  if (argc > 2)
+    return "usage: list [connection]";
+  if (argc == 2 && (only = control_find_conn(argv[1])) == NULL)
+    return "no such connection";
+
+  conn_t *conn;
+  for (conn = get_connections(); conn; conn = conn->next) {
+    if (only && conn != only)
+      continue;
+
+    char name[CONN_NAME_SIZE];
+    metrics_conn_t values;
+    conn_name(conn, name);
+    conn_snapshot(conn, &values);
+    conn_settings_t *settings = &conn->settings;
+    ctcp_tunables_t *tunables = &settings->tunables;
+    ctcp_stats_t *stats = &conn->stats;
+
+    fprintf(reply, "%s%s\n\t cc:%s ", name, conn->delete_me ? " closing" : "",
+            tunables->cc[0] ? tunables->cc : "default");
+    if (tunables->profile[0])
+      fprintf(reply, "profile:%s ", tunables->profile);
+    print_setting(reply, "rto", tunables->rt_timeout);
+    print_setting(reply, "rto_min", tunables->rto_min);
+    print_setting(reply, "rto_max", tunables->rto_max);
+    print_setting(reply, "timer", tunables->timer);
+    if (stats->rtt_samples > 0) {
+      fprintf(reply, "rtt:%.3f/%.3f min_rtt:%.3f ", values.srtt / 1e6,
+              values.rttvar / 1e6, stats->min_rtt / 1e6);
+    }
+    if (values.cwnd > 0)
+      print_setting(reply, "cwnd", values.cwnd);
+    print_setting(reply, "swnd", tunables->send_window);
+    print_setting(reply, "rwnd", tunables->recv_window);
+    print_setting(reply, "peer_window", values.rwnd);
+    print_setting(reply, "window_clamp", settings->window_clamp);
+    if (settings->pacing_rate > 0)
+      fprintf(reply, "pacing_rate:%ukbps ", settings->pacing_rate);
+    if (tunables->nodelay)
+      fprintf(reply, "nodelay ");
+    if (tunables->delayed_ack)
+      fprintf(reply, "delayed_ack ");
+    if (settings->busy_poll)
+      fprintf(reply, "busy_poll ");
+    print_limits(reply, stats);
+    fprintf(reply, "bytes_sent:%llu bytes_retrans:%llu bytes_received:%llu "
+            "segs_out:%llu segs_in:%llu retrans:%llu rto_events:%llu "
+            "dup_acks:%llu unacked:%u bufspace:%u/%zu outq:%u version:%u\n",
+            (unsigned long long) stats->data_bytes_sent,
+            (unsigned long long) stats->retransmitted_bytes,
+            (unsigned long long) stats->bytes_received,
+            (unsigned long long) stats->segments_sent,
+            (unsigned long long) stats->segments_received,
+            (unsigned long long) stats->retransmits,
+            (unsigned long long) stats->rto_events,
+            (unsigned long long) stats->dup_acks, values.inflight,
+            values.bufspace, settings->max_bufspace, values.out_queue,
+            settings->version);
+  }
+  return NULL;
+}
+
+/**
+ * settings. Prints the settings new connections start out with.
+ */
+static void control_settings(FILE *reply) {
+  conn_settings_t *settings = &default_settings;
+  fprintf(reply, "timer %d\nrto %d\nrto_min %d\nrto_max %d\n",
+          ctcp_cfg->timer, ctcp_cfg->rt_timeout, settings->tunables.rto_min,
+          settings->tunables.rto_max);
+  fprintf(reply, "swnd %u\nrwnd %u\npacing %u\nbufspace %zu\ncc %s\n",
+          settings->tunables.send_window, ctcp_cfg->recv_window,
+          settings->pacing_rate, settings->max_bufspace,
+          settings->tunables.cc[0] ? settings->tunables.cc : "default");
+  fprintf(reply, "nodelay %d\ndelayed_ack %d\nbusy_poll %d\n",
+          settings->tunables.nodelay, settings->tunables.delayed_ack,
+          settings->busy_poll);
+  if (settings->tunables.profile[0])
+    fprintf(reply, "profile %s\n", settings->tunables.profile);
+}
+
+/**
+ * prometheus. Prints every connection's metrics in the Prometheus text
+ * exposition format.
+ */
+static void control_prometheus(FILE *reply) {
+  int num_conns = 0;
+  conn_t *conn;
+  for (conn = get_connections(); conn; conn = conn->next)
+    num_conns++;
+  fprintf(reply, "# HELP ctcp_connections Open connections\n"
+                 "# TYPE ctcp_connections gauge\n"
+                 "ctcp_connections %d\n", num_conns);
+
+  size_t i;
+  for (i = 0; i < sizeof(prometheus_metrics) /
+                  sizeof(prometheus_metrics[0]); i++) {
+    const struct prometheus_metric *metric = &prometheus_metrics[i];
+    fprintf(reply, "# HELP %s %s\n# TYPE %s %s\n", metric->name, metric->help,
+            metric->name, metric->type);
+
+    for (conn = get_connections(); conn; conn = conn->next) {
+      char name[CONN_NAME_SIZE];
+      metrics_conn_t values;
+      conn_name(conn, name);
+      conn_snapshot(conn, &values);
+
+      const char *field = (const char *) &values + metric->offset;
+      fprintf(reply, "%s{peer=\"%s\"} ", metric->name, name);
+      if (metric->kind == 'c')
+        fprintf(reply, "%llu\n", *(unsigned long long *) field);
+      else if (metric->kind == 't')
+        fprintf(reply, "%.9f\n", *(int64_t *) field / 1e9);
+      else
+        fprintf(reply, "%u\n", *(uint32_t *) field);
+    }
+  }
+}
+
+/**
+ * hist [connection]. Prints the RTT, delivery and output stall histograms of
+ * one connection, or of every connection merged, as JSON.
+ */
+static const char *control_hist(int argc, char *argv[], FILE *reply) {
+  conn_t *only = NULL;
+  if (argc > 2)
+    return "usage: hist [connection]";
+  if (argc == 2 && (only = control_find_conn(argv[1])) == NULL)
+    return "no such connection";
+
+  hist_t *hists = calloc(3, sizeof(hist_t));
+  int connections = 0;
+  conn_t *conn;
+  for (conn = get_connections(); conn; conn = conn->next) {
+    if (only && conn != only)
+      continue;
+    hist_merge(&hists[0], &conn->stats.rtt_hist);
+    hist_merge(&hists[1], &conn->stats.delivery_hist);
+    hist_merge(&hists[2], &conn->stats.stall_hist);
+    connections++;
+  }
+
+  fprintf(reply, "{\"connections\": %d, \"rtt\": ", connections);
+  hist_print_json(&hists[0], reply);
+  fprintf(reply, ", \"delivery\": ");
+  hist_print_json(&hists[1], reply);
+  fprintf(reply, ", \"stall\": ");
+  hist_print_json(&hists[2], reply);
+  fprintf(reply, "}\n");
+  free(hists);
+  return NULL;
+}
+
+/**
+ * Runs a command from the control socket (see ctcp_control.h).
+ */
+static const char *control_command(void *ctx, int argc, char *argv[],
+                                   FILE *reply) {
+  if (strcmp(argv[0], "list") == 0)
+    return control_list(argc, argv, reply);
+  if (strcmp(argv[0], "set") == 0)
+    return control_set(argc, argv);
+  if (strcmp(argv[0], "settings") == 0) {
+    control_settings(reply);
+    return NULL;
+  }
+  if (strcmp(argv[0], "prometheus") == 0) {
+    control_prometheus(reply);
+    return NULL;
+  }
+  if (strcmp(argv[0], "hist") == 0)
+    return control_hist(argc, argv, reply);
+  if (strcmp(argv[0], "alloc") == 0) {
+    alloc_print_json(reply);
+    fprintf(reply, "\n");
+    return NULL;
+  }
+  if (strcmp(argv[0], "loop") == 0) {
+    if (loopprof == NULL)
+      return "not profiling the main loop (see --loop-profile)";
+    loopprof_print_json(loopprof, NULL, reply);
+    fprintf(reply, "\n");
+    return NULL;
+  }
+  if (strcmp(argv[0], "help") == 0) {
+    fprintf(reply,
+      "list [connection]              Connections, like ss -ti\n"
+      "settings                       Settings new connections get\n"
+      "set <setting> <value> [conn]   Changes a setting, for one connection\n"
+      "                               or for all of them and new ones\n"
+      "prometheus                     Metrics in Prometheus text format\n"
+      "hist [connection]              Latency histograms, as JSON, merged\n"
+      "                               over every connection\n"
+      "alloc                          Allocations on the data path, as JSON\n"
+      "loop                           Where the main loop's time has gone,\n"
+      "                               as JSON (with --loop-profile)\n"
+      "quit                           Hangs up\n"
+      "Settings: timer rto rto_min rto_max (ms), swnd rwnd bufspace\n"
+      "(bytes), window (segments, both ways), pacing (kbit/s, 0 for\n"
+      "none), cc (name, or default), nodelay delayed_ack busy_poll (0/1)\n");
+    return NULL;
+  }
+  return "unknown command, try help";
+}
+
+/**
+ * Writes out the rest of the trace. Registered with atexit(), since the client
+ * and server exit from the main loop.
+ */
+static void close_trace() {
+  trace_close(trace);
+  trace = NULL;
+}
+
+/**
+ * Finishes off the capture. Registered with atexit(), like close_trace().
+ */
+static void close_pcap() {
+  pcapng_close(pcap);
+  pcap = NULL;
+}
+
+/**
+ * Finishes off the timeline. Registered with atexit(), like close_trace().
+ */
+static void close_timeline() {
+  timeline_close(timeline);
+  timeline = NULL;
+}
+
+/**
+ * Writes out the rest of the recording. Registered with atexit(), like
+ * close_trace().
+ */
+static void close_recording() {
+  record_close(recording);
+  recording = NULL;
+}
+
+/**
+ * Removes the metrics. Registered with atexit(), like close_trace().
+ */
+static void close_metrics() {
+  metrics_close(metrics);
+  metrics = NULL;
+}
+
+/**
+ * Removes the control socket. Registered with atexit(), like close_trace().
+ */
+static void close_control() {
+  control_close(control);
+  control = NULL;
+}
+
+/**
+ * Prints the allocations made on the data path over the whole run (see
+ * ctcp_alloc.h). Registered with atexit() for --summary.
+ */
+static void print_allocs() {
+  fprintf(stderr, "[ALLOC] ");
+  alloc_print_json(stderr);
+  fprintf(stderr, "\n");
+}
+
+/**
+ * Prints where the main loop's time went over the whole run, and stops
+ * profiling it. Registered with atexit(), like close_trace().
+ */
+static void close_loopprof() {
+  fprintf(stderr, "[LOOP TOTAL] ");
+  loopprof_print_json(loopprof, NULL, stderr);
+  fprintf(stderr, "\n");
+  free(loopprof);
+  loopprof = NULL;
+}
+
+/**
+ * Reads in profiles and checks their settings.
+ *
+ * path: File to read them from (--profiles).
+ * returns: 0 on success, -1 if they could not be read or a setting is wrong.
+ */
+static int load_profiles(const char *path) {
+  profiles = profiles_load(path);
+  if (profiles == NULL)
+    return -1;
+
+  profile_t *profile;
+  for (profile = profiles; profile; profile = profile->next) {
+    bool matches = profile->num_ports || profile->num_peer_ports ||
+                   profile->num_programs;
+    int i;
+    for (i = 0; i < profile->num_settings; i++) {
+      profile_setting_t *s = &profile->settings[i];
+      enum setting setting;
+      long value;
+      const char *cc;
+      const char *error = parse_setting(s->key, s->value, &setting, &value,
+                                        &cc);
+      if (error == NULL && setting == SETTING_TIMER && matches)
+        error = "timer is global, so only --profile can set it";
+      if (error) {
+        fprintf(stderr, "[ERROR] %s:%d: %s: %s\n", path, s->line, s->key,
+                error);
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * Frees the profiles. Registered with atexit(), like close_trace().
+ */
+static void close_profiles() {
+  profiles_free(profiles);
+  profiles = NULL;
+}
+
 /**
  * Prints out a usage message.
  *
@@ -1342,6 +2794,30 @@ static void usage(char *progname) {
     "   [--corrupt corrupt_percent]\n"
     "   [--delay delay_percent]\n"
     "   [--duplicate duplicate_percent]\n"
+    "   [--in-drop drop_percent]\n"
+    "   [--in-corrupt corrupt_percent]\n"
+    "   [--in-delay delay_percent]\n"
+    "   [--in-duplicate duplicate_percent]\n"
+    "   [--rate kbit_per_sec]\n"
+    "   [--prop-delay ms]\n"
+    "   [--jitter ms]\n"
+    "   [--queue segments]\n"
+    "   [--aqm droptail|red|codel]\n"
+    "   [--burst-loss p,r[,loss_good[,loss_bad]]]\n"
+    "   [--summary]\n"
+    "   [-l | --logging]\n"
+    "   [--log-payload bytes]\n"
+    "   [--pcap file]\n"
+    "   [--pcap-snaplen bytes]\n"
+    "   [--timeline file]\n"
+    "   [--record file]\n"
+    "   [--metrics]\n"
+    "   [--control socket_path]\n"
+    "   [--profiles file]\n"
+    "   [--profile name]\n"
+    "   [--loop-profile seconds]\n"
+    "   [--echo]                    [server only]\n"
+    "   [--max-clients n]           [server only]\n"
     "   [-- program arg1 arg2 ...]\n\n",
     progname
   );
@@ -1379,7 +2855,30 @@ int main(int argc , char *argv[]) {
     { "corrupt", required_argument, NULL, 't' },
     { "delay", required_argument, NULL, 'y' },
     { "duplicate", required_argument, NULL, 'q' },
+    { "in-drop", required_argument, NULL, 'R' },
+    { "in-corrupt", required_argument, NULL, 'T' },
+    { "in-delay", required_argument, NULL, 'Y' },
+    { "in-duplicate", required_argument, NULL, 'Q' },
+    { "rate", required_argument, NULL, 'B' },
+    { "prop-delay", required_argument, NULL, 'P' },
+    { "jitter", required_argument, NULL, 'J' },
+    { "queue", required_argument, NULL, 'U' },
+    { "aqm", required_argument, NULL, 'A' },
+    { "burst-loss", required_argument, NULL, 'G' },
+    { "summary", no_argument, NULL, 'S' },
+    { "echo", no_argument, NULL, 'E' },
+    { "max-clients", required_argument, NULL, 'M' },
     { "logging", no_argument, NULL, 'l' },
+    { "log-payload", required_argument, NULL, 'L' },
+    { "pcap", required_argument, NULL, 'C' },
+    { "pcap-snaplen", required_argument, NULL, 'N' },
+    { "timeline", required_argument, NULL, 'I' },
+    { "record", required_argument, NULL, 'O' },
+    { "metrics", no_argument, NULL, 'X' },
+    { "control", required_argument, NULL, 'K' },
+    { "profiles", required_argument, NULL, 'H' },
+    { "profile", required_argument, NULL, 'F' },
+    { "loop-profile", required_argument, NULL, 'V' },
     { "lab5", no_argument, NULL, 'f' },
     { NULL, 0, NULL, 0 }
   };
@@ -1416,23 +2915,108 @@ int main(int argc , char *argv[]) {
       break;
     /* Segment drop. */
     case 'r':
-      opt_drop = atoi(optarg);
+      opt_impair_out.drop = atoi(optarg);
       break;
     /* Segment corruption. */
     case 't':
-      opt_corrupt = atoi(optarg);
+      opt_impair_out.corrupt = atoi(optarg);
       break;
     /* Segment delay. */
     case 'y':
-      opt_delay = atoi(optarg);
+      opt_impair_out.delay = atoi(optarg);
       break;
     /* Segment duplicate. */
     case 'q':
-      opt_duplicate = atoi(optarg);
+      opt_impair_out.duplicate = atoi(optarg);
+      break;
+    /* Same, for received segments. */
+    case 'R':
+      opt_impair_in.drop = atoi(optarg);
+      break;
+    case 'T':
+      opt_impair_in.corrupt = atoi(optarg);
+      break;
+    case 'Y':
+      opt_impair_in.delay = atoi(optarg);
+      break;
+    case 'Q':
+      opt_impair_in.duplicate = atoi(optarg);
+      break;
+    /* Emulated link. */
+    case 'B':
+      opt_link.rate = atoll(optarg);
+      break;
+    case 'P':
+      opt_link.delay = atof(optarg);
+      break;
+    case 'J':
+      opt_link.jitter = atof(optarg);
+      break;
+    case 'U':
+      opt_link.queue = atoi(optarg);
+      break;
+    case 'A':
+      if (link_parse_aqm(optarg, &opt_link.aqm) < 0)
+        usage(progname);
+      break;
+    case 'G':
+      if (link_parse_burst(optarg, &opt_link) < 0)
+        usage(progname);
+      break;
+    /* Print statistics for each connection as it ends. */
+    case 'S':
+      opt_summary = true;
+      break;
+    /* Server echoes everything back to the client. */
+    case 'E':
+      echo_mode = true;
+      break;
+    /* Most clients at once. */
+    case 'M':
+      max_clients = atoi(optarg);
       break;
     /* Turn logging on. */
     case 'l':
-      log_file = 0;
+      opt_logging = true;
+      break;
+    case 'L':
+      opt_log_payload = atoi(optarg);
+      break;
+    /* Capture datagrams. */
+    case 'C':
+      opt_pcap = optarg;
+      break;
+    case 'N':
+      opt_pcap_snaplen = atoi(optarg);
+      break;
+    /* Timeline of each connection. */
+    case 'I':
+      opt_timeline = optarg;
+      break;
+    /* Recording for ctcp_replay. */
+    case 'O':
+      opt_record = optarg;
+      break;
+    /* Metrics in shared memory. */
+    case 'X':
+      opt_metrics = true;
+      break;
+    /* Control socket. */
+    case 'K':
+      opt_control = optarg;
+      break;
+    /* Profiles, and the one every connection gets. */
+    case 'H':
+      opt_profiles = optarg;
+      break;
+    case 'F':
+      opt_profile = optarg;
+      break;
+    /* Where the main loop's time goes. */
+    case 'V':
+      opt_loop_profile = atof(optarg);
+      if (opt_loop_profile < 0)
+        usage(progname);
       break;
     /* Turn logging data off for tester. */
     case 'z':
@@ -1451,22 +3035,86 @@ int main(int argc , char *argv[]) {
   /* Seed RNG. */
   srand(seed);
 
+  /* Set up unreliability. Each direction and the link get their own random
+     numbers. */
+  loop_sched = sched_create();
+  link_out = link_create("out", &opt_link, seed + 1, loop_sched,
+                         transmit_segment, NULL);
+  impair_out = impair_create("out", &opt_impair_out, seed, loop_sched,
+                             link_segment, link_out);
+  impair_in = impair_create("in", &opt_impair_in, ~(uint64_t) seed, loop_sched,
+                            receive_segment, NULL);
+  impair_out->once = impair_in->once = test_debug_on;
+  impair_out->debug = impair_in->debug = DEBUG;
+
   /* Validate arguments. */
   if ((is_client && is_server) || (!is_client && !is_server) || port <= 0) {
     usage(progname);
   }
+  /* Echoing replaces both STDIN/STDOUT and running a program. */
+  if (echo_mode && (is_client || argc - optind > 0)) {
+    usage(progname);
+  }
+  if (max_clients < 1) {
+    usage(progname);
+  }
 
-  /* Construct log file if logging is turned on. Don't create a file if not
-     logging data, since that is only used for testing purposes. */
-  if (log_file == 0) {
+  /* Start the trace if logging is turned on. It is written out by another
+     thread, and finished off when the program exits. */
+  if (opt_logging) {
     struct timeval tv;
     gettimeofday(&tv, NULL);
-    char log_filename[40];
-    memset(log_filename, 0, 40);
-    snprintf(log_filename, sizeof(log_filename), "%d-%d.csv", (int) tv.tv_sec,
-             port);
-    log_file = open(log_filename, O_CREAT | O_TRUNC | O_WRONLY, 0666);
-    write_log_header(log_file);
+    char trace_filename[40];
+    snprintf(trace_filename, sizeof(trace_filename), "%d-%d.trace",
+             (int) tv.tv_sec, port);
+    trace = trace_open(trace_filename, opt_log_payload);
+    if (trace == NULL)
+      return 1;
+    atexit(close_trace);
+  }
+  if (opt_pcap) {
+    pcap = pcapng_open(opt_pcap, opt_pcap_snaplen);
+    if (pcap == NULL)
+      return 1;
+    atexit(close_pcap);
+  }
+  if (opt_timeline) {
+    timeline = timeline_open(opt_timeline);
+    if (timeline == NULL)
+      return 1;
+    atexit(close_timeline);
+  }
+  if (opt_record) {
+    recording = record_open(opt_record);
+    if (recording == NULL)
+      return 1;
+    atexit(close_recording);
+  }
+  if (opt_metrics) {
+    metrics = metrics_open(port, is_server);
+    if (metrics == NULL)
+      return 1;
+    atexit(close_metrics);
+  }
+  if (opt_control) {
+    control = control_open(opt_control, control_command, NULL);
+    if (control == NULL)
+      return 1;
+    atexit(close_control);
+  }
+  if (opt_profiles) {
+    if (load_profiles(opt_profiles) < 0)
+      return 1;
+    atexit(close_profiles);
+  }
+  if (opt_summary)
+    atexit(print_allocs);
+  stats_verify = opt_summary || timeline || metrics || control;
+  if (opt_loop_profile >= 0) {
+    loopprof = loopprof_create();
+    loop_interval = opt_loop_profile * 1e9;
+    loop_report_at = current_time_ns() + loop_interval;
+    atexit(close_loopprof);
   }
 
   /* Global configuration. */
@@ -1481,10 +3129,19 @@ int main(int argc , char *argv[]) {
   cfg.timer = TIMER_INTERVAL;
   cfg.rt_timeout = RT_INTERVAL;
 
+  /* Profile every connection gets. A server can give some connections
+     another one on top. */
+  if (opt_profile) {
+    profile_t *profile = profile_find(profiles, opt_profile);
+    if (profile == NULL) {
+      fprintf(stderr, "[ERROR] No profile %s (see --profiles)\n", opt_profile);
+      return 1;
+    }
+    profile_apply(profile, &default_settings, &cfg);
+  }
+
   /* Used for polling later. */
-  struct pollfd _events[NUM_POLL + MAX_NUM_CLIENTS];
-  memset(_events, 0, sizeof(struct pollfd) * (NUM_POLL + MAX_NUM_CLIENTS));
-  events = _events;
+  events = calloc(NUM_POLL + max_clients, sizeof(struct pollfd));
 
   /* Start client/server. */
   if (is_client) {
@@ -1502,3 +3159,5 @@ int main(int argc , char *argv[]) {
   }
   return 0;
 }
+
+#endif /* CTCP_NO_MAIN */
@@ -10,7 +10,12 @@
 #define CTCP_SYS_INTERNAL_H
 
 #include "ctcp.h"
+#include "ctcp_alloc.h"
+#include "ctcp_metrics.h"
+#include "ctcp_stats.h"
 #include "ctcp_sys.h"
+#include "ctcp_timeline.h"
+#include "ctcp_trace.h"
 #include "ctcp_utils.h"
 
 #define DEFAULT_PORT 80
@@ -21,11 +26,16 @@
 /** Localhost IP address in_addr_t. */
 #define LOCALHOST 16777343
 
-/** Maximum number of clients that can connect to the server. */
+/** Default maximum number of clients that can connect to the server at once
+    (see --max-clients). */
 #define MAX_NUM_CLIENTS 10
 
-/** Default number of things to poll (stdin, stdout, socket). */
-#define NUM_POLL 3
+/** Default number of things to poll (stdin, stdout, socket, and the control
+    socket and its client). */
+#define NUM_POLL 5
+
+/** Where the control socket's pollfds start (see ctcp_control.h). */
+#define CONTROL_POLL 3
 
 /** Polling interval in milliseconds. */
 #define POLL_INTERVAL 20
@@ -134,9 +144,6 @@ void *send_resets(void *args);
 
 /////////////////////////////////// SEGMENTS //////////////////////////////////
 
-/** Salt used for rand_percent(). */
-#define SALT (0x14400)
-
 typedef struct iphdr iphdr_t;
 typedef struct tcphdr tcphdr_t;
 
@@ -192,7 +199,8 @@ uint16_t cksum_tcp(iphdr_t *packet, uint16_t len) {
   tcphdr_t *tcp_hdr = (tcphdr_t *) ((uint8_t *) packet + IP_HDR_SIZE);
 
   /* Construct pseudoheader. */
-  tcp_pseudoheader_t *phdr = calloc(TCP_PSEUDOHDR_SIZE + len, 1);
+  tcp_pseudoheader_t *phdr = tagged_calloc(ALLOC_CKSUM_TCP,
+                                           TCP_PSEUDOHDR_SIZE + len);
   phdr->src_addr = packet->saddr;
   phdr->dst_addr = packet->daddr;
   phdr->protocol = IPPROTO_TCP;
@@ -201,7 +209,7 @@ uint16_t cksum_tcp(iphdr_t *packet, uint16_t len) {
   /* Append TCP segment and compute checksum. */
   memcpy(&(phdr->tcp_hdr), tcp_hdr, TCP_HDR_SIZE + len);
   uint16_t result = cksum(phdr, len + TCP_PSEUDOHDR_SIZE);
-  free(phdr);
+  tagged_free(ALLOC_CKSUM_TCP, phdr, TCP_PSEUDOHDR_SIZE + len);
   return result;
 }
 
@@ -216,7 +224,7 @@ uint16_t cksum_tcp(iphdr_t *packet, uint16_t len) {
  */
 char *create_datagram(in_addr_t src_ip, in_addr_t dst_ip, uint16_t len) {
   uint16_t total_len = IP_HDR_SIZE + len;
-  char *datagram = calloc(total_len, 1);
+  char *datagram = tagged_calloc(ALLOC_CREATE_DATAGRAM, total_len);
   iphdr_t *ip_hdr = (iphdr_t *) datagram;
 
   /* IP header. */
@@ -237,34 +245,28 @@ char *create_datagram(in_addr_t src_ip, in_addr_t dst_ip, uint16_t len) {
   return datagram;
 }
 
-/**
- * Flips a bit in a segment.
- *
- * segment: The segment.
- * bit: The bit to flip.
- */
-void flipbit(const void *segment, size_t bit) {
-  char *data = ((char *) segment);
-  unsigned int mask = 1 << (bit % 8);
-  data[bit / 8] ^= mask;
-}
-
-/**
- * Returns a random percentage between 0 and 100.
- *
- * level: The fork level (used in computing the random value).
- * returns: A random percentage.
- */
-int rand_percent(int level) {
-  return (rand() + (level * SALT)) % 100;
-}
-
 
 ////////////////////////// ADDRESSES AND CONNECTIONS //////////////////////////
 
 /** Ethernet interface prefix to determine the client's own IP address. */
 #define ETH_INTERFACE "eth"
 
+/**
+ * Settings of a connection that can be changed through the control socket
+ * (--control), or given by a profile (--profiles).
+ */
+struct conn_settings {
+  ctcp_tunables_t tunables;    /* Handed to student code by conn_tunables() */
+  uint32_t version;            /* Goes up whenever the tunables change */
+  uint16_t window_clamp;       /* Largest window to advertise, 0 for none */
+  uint32_t pacing_rate;        /* Rate to pace segments sent at, in kbit/s.
+                                  0 for no pacing */
+  size_t max_bufspace;         /* Output space (see conn_bufspace()) */
+  bool busy_poll;              /* Whether the main loop polls without
+                                  sleeping while the connection is open */
+};
+typedef struct conn_settings conn_settings_t;
+
 /** Connection details for a host connected to the current host. */
 struct conn {
   in_addr_t ip_addr;           /* IP address */
@@ -291,6 +293,22 @@ struct conn {
 
   chunk_t *out_queue;          /* Queue for output to STDOUT */
   chunk_t **out_queue_tail;    /* End of the output queue */
+  chunk_t *in_queue;           /* Queue of input injected by the library (e.g.
+                                  echoed output), read before STDIN */
+  chunk_t *in_queue_last;      /* Last chunk of the input queue */
+  bool in_eof;                 /* EOF queued up after the input queue */
+
+  struct config *endpoint;     /* Where to send from, if not the global
+                                  configuration (see ctcp_load.c) */
+
+  ctcp_stats_t stats;          /* Statistics */
+  uint32_t cwnd;               /* Last congestion window reported by
+                                  conn_report_cwnd(), 0 if none */
+  timeline_track_t track;      /* Where it is in the timeline */
+  uint32_t record_id;          /* Number in the recording (--record) */
+  metrics_slot_t *metrics_slot;/* Slot in the metrics (--metrics), or NULL */
+  conn_settings_t settings;    /* Settings (see --control) */
+  int64_t pace_next;           /* When pacing lets the next segment go */
 
   struct conn *next;           /* Linked list of connections */
   struct conn **prev;
@@ -318,6 +336,7 @@ void conn_setup(conn_t *conn, in_addr_t ip_addr, int port, bool unix_socket) {
   /* Set up IP address and port. */
   conn->ip_addr = ip_addr;
   conn->port = port;
+  conn->settings.max_bufspace = MAX_BUF_SPACE;
 
   /* Socket address. Could be a Unix socket. */
   if (unix_socket) {
@@ -531,6 +550,60 @@ void log_segment(int file, in_addr_t ip_addr, int port, conn_t *conn,
   }
 }
 
+/**
+ * Adds a segment sent or received to a binary trace (see ctcp_trace.h). This
+ * is what --logging does; unlike log_segment(), it formats nothing and never
+ * blocks, copying at most trace_payload() bytes of data.
+ *
+ * trace: Trace to add to.
+ * ip_addr: The logger's IP address.
+ * port: The logger's port.
+ * conn: The other's connection details.
+ * segment: Segment to log.
+ * len: Length of the segment, including headers.
+ * is_sent_segment: Whether or not this is logging a segment sent by the logger.
+ * is_unix_socket: Whether or not the connection is via a Unix socket.
+ */
+void trace_segment(trace_t *trace, in_addr_t ip_addr, int port, conn_t *conn,
+                   ctcp_segment_t *segment, uint16_t len, bool is_sent_segment,
+                   bool is_unix_socket) {
+  trace_record_t *rec = trace_begin(trace);
+  if (rec == NULL)
+    return;
+
+  rec->time = current_time_ns();
+  rec->kind = (is_sent_segment ? TRACE_SENT : 0) |
+              (is_unix_socket ? TRACE_UNIX : 0);
+  if (is_sent_segment) {
+    rec->src_ip = ip_addr;
+    rec->src_port = port;
+    rec->dst_ip = conn->ip_addr;
+    rec->dst_port = conn->port;
+  }
+  else {
+    rec->src_ip = conn->ip_addr;
+    rec->src_port = conn->port;
+    rec->dst_ip = ip_addr;
+    rec->dst_port = port;
+  }
+  rec->seqno = ntohl(segment->seqno);
+  rec->ackno = ntohl(segment->ackno);
+  rec->flags = segment->flags;
+  rec->len = ntohs(segment->len);
+  rec->window = ntohs(segment->window);
+  rec->cksum = segment->cksum;
+
+  /* Data, up to the capture limit. */
+  int data_len = len > sizeof(ctcp_segment_t) ?
+                 len - sizeof(ctcp_segment_t) : 0;
+  if (data_len > trace_payload(trace))
+    data_len = trace_payload(trace);
+  rec->data_len = data_len;
+  memcpy(rec->data, segment->data, data_len);
+
+  trace_commit(trace);
+}
+
 /**
  * Write out the headers to the log file.
  *
@@ -0,0 +1,148 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ctcp_timeline.h"
+#include "ctcp_utils.h"
+
+/** Names of the counters, and of the unit each one is shown in. */
+static const char *counter_names[TIMELINE_COUNTERS] = {
+  "cwnd", "inflight", "srtt", "rwnd", "bufspace"
+};
+static const char *counter_units[TIMELINE_COUNTERS] = {
+  "bytes", "bytes", "ms", "bytes", "bytes"
+};
+
+/** Names of the stalls. Each kind goes on its own thread of the connection,
+    after the thread for instant events. */
+static const char *stall_names[TIMELINE_STALLS] = {
+  "window_stall", "output_full"
+};
+
+struct timeline {
+  FILE *file;                   /* The file */
+  char *buffer;                 /* Buffer it is written through */
+  int64_t start;                /* Time 0 of the trace, in nanoseconds */
+  int tracks;                   /* Number of tracks started */
+  bool empty;                   /* Whether no events have been written yet */
+};
+
+
+/**
+ * Starts the next event, separating it from the last one.
+ */
+static FILE *timeline_event(timeline_t *timeline) {
+  if (!timeline->empty)
+    fputs(",\n", timeline->file);
+  timeline->empty = false;
+  return timeline->file;
+}
+
+/**
+ * Converts a time to microseconds since the start of the trace.
+ */
+static double timeline_ts(timeline_t *timeline, int64_t now) {
+  return (now - timeline->start) / 1000.0;
+}
+
+timeline_t *timeline_open(const char *path) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "[ERROR] Could not create timeline %s: %s\n", path,
+            strerror(errno));
+    return NULL;
+  }
+
+  timeline_t *timeline = calloc(sizeof(timeline_t), 1);
+  timeline->file = file;
+  timeline->buffer = malloc(TIMELINE_BUFFER);
+  setvbuf(file, timeline->buffer, _IOFBF, TIMELINE_BUFFER);
+  timeline->start = current_time_ns();
+  timeline->empty = true;
+  fputs("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n", file);
+  return timeline;
+}
+
+void timeline_start(timeline_t *timeline, timeline_track_t *track,
+                    const char *name) {
+  if (track->id != 0)
+    return;
+  track->id = ++timeline->tracks;
+
+  fprintf(timeline_event(timeline),
+          "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+          "\"args\": {\"name\": \"%s\"}}", track->id, name);
+  fprintf(timeline_event(timeline),
+          "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, "
+          "\"tid\": 0, \"args\": {\"name\": \"events\"}}", track->id);
+  int i;
+  for (i = 0; i < TIMELINE_STALLS; i++) {
+    fprintf(timeline_event(timeline),
+            "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, "
+            "\"tid\": %d, \"args\": {\"name\": \"%s\"}}", track->id, i + 1,
+            stall_names[i]);
+  }
+}
+
+void timeline_counter(timeline_t *timeline, timeline_track_t *track,
+                      enum timeline_counter counter, int64_t value,
+                      int64_t now) {
+  if (track->written[counter] && track->values[counter] == value)
+    return;
+  track->written[counter] = true;
+  track->values[counter] = value;
+
+  FILE *file = timeline_event(timeline);
+  fprintf(file, "{\"name\": \"%s\", \"ph\": \"C\", \"ts\": %.3f, "
+          "\"pid\": %d, \"args\": {\"%s\": ", counter_names[counter],
+          timeline_ts(timeline, now), track->id, counter_units[counter]);
+  if (counter == TIMELINE_SRTT)
+    fprintf(file, "%.3f}}", value / 1e6);
+  else
+    fprintf(file, "%lld}}", (long long) value);
+}
+
+void timeline_instant(timeline_t *timeline, timeline_track_t *track,
+                      const char *name, uint32_t seqno, uint32_t len,
+                      int64_t now) {
+  fprintf(timeline_event(timeline),
+          "{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3f, "
+          "\"pid\": %d, \"tid\": 0, \"args\": {\"seqno\": %u, \"len\": %u}}",
+          name, timeline_ts(timeline, now), track->id, seqno, len);
+}
+
+void timeline_stall(timeline_t *timeline, timeline_track_t *track,
+                    enum timeline_stall stall, bool stalled, int64_t now) {
+  int64_t start = track->stall_start[stall];
+  if (stalled) {
+    if (start == 0)
+      track->stall_start[stall] = now;
+    return;
+  }
+  if (start == 0)
+    return;
+
+  track->stall_start[stall] = 0;
+  fprintf(timeline_event(timeline),
+          "{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+          "\"pid\": %d, \"tid\": %d}", stall_names[stall],
+          timeline_ts(timeline, start), (now - start) / 1000.0, track->id,
+          stall + 1);
+}
+
+void timeline_end(timeline_t *timeline, timeline_track_t *track, int64_t now) {
+  if (track->id == 0)
+    return;
+  int i;
+  for (i = 0; i < TIMELINE_STALLS; i++)
+    timeline_stall(timeline, track, i, false, now);
+}
+
+void timeline_close(timeline_t *timeline) {
+  fputs("\n]}\n", timeline->file);
+  if (fclose(timeline->file) != 0)
+    fprintf(stderr, "[ERROR] Could not write timeline\n");
+  free(timeline->buffer);
+  free(timeline);
+}
@@ -0,0 +1,136 @@
+/******************************************************************************
+ * ctcp_timeline.h
+ * ---------------
+ * Per-connection timeline of a run (--timeline), written as Chrome Trace Event
+ * JSON, which Perfetto (ui.perfetto.dev) and chrome://tracing can load. Each
+ * connection shows up as its own process, with:
+ *
+ *   - Counters: the congestion window (if student code reports it with
+ *     conn_report_cwnd()), bytes in flight, the smoothed RTT, the window the
+ *     other end advertised and conn_bufspace(). A counter is only written
+ *     when it changes.
+ *   - Instant events: retransmissions, and retransmission timeouts.
+ *   - Stalls, as slices: when the bytes in flight fill the advertised window,
+ *     and when the output buffer is full.
+ *
+ * Events are written through a large stdio buffer as they happen.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_TIMELINE_H
+#define CTCP_TIMELINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Size of the buffer events are written through. */
+#define TIMELINE_BUFFER (1024 * 1024)
+
+/** Counters kept for each connection. */
+enum timeline_counter {
+  TIMELINE_CWND,
+  TIMELINE_INFLIGHT,
+  TIMELINE_SRTT,
+  TIMELINE_RWND,
+  TIMELINE_BUFSPACE,
+  TIMELINE_COUNTERS
+};
+
+/** Kinds of stall. */
+enum timeline_stall {
+  TIMELINE_WINDOW_STALL,
+  TIMELINE_OUTPUT_FULL,
+  TIMELINE_STALLS
+};
+
+/** What the timeline knows about a connection. Zeroed when the connection is
+    created. */
+struct timeline_track {
+  int id;                       /* Process ID in the trace, 0 if not started */
+  int64_t values[TIMELINE_COUNTERS];
+                                /* Last value written of each counter */
+  bool written[TIMELINE_COUNTERS];
+                                /* Whether each counter has been written */
+  int64_t stall_start[TIMELINE_STALLS];
+                                /* When each stall started, 0 if not stalled */
+};
+typedef struct timeline_track timeline_track_t;
+
+typedef struct timeline timeline_t;
+
+
+/**
+ * Creates a timeline file.
+ *
+ * path: File to write to. Truncated if it already exists.
+ * returns: The timeline, or NULL if the file could not be created.
+ */
+timeline_t *timeline_open(const char *path);
+
+/**
+ * Starts a connection's track, if it has not been started yet.
+ *
+ * timeline: The timeline.
+ * track: The connection's track.
+ * name: Name to show for the connection.
+ */
+void timeline_start(timeline_t *timeline, timeline_track_t *track,
+                    const char *name);
+
+/**
+ * Sets a counter, writing it out if it changed.
+ *
+ * timeline: The timeline.
+ * track: The connection's track.
+ * counter: Which counter.
+ * value: Its new value. Times are in nanoseconds.
+ * now: Current time, in nanoseconds.
+ */
+void timeline_counter(timeline_t *timeline, timeline_track_t *track,
+                      enum timeline_counter counter, int64_t value,
+                      int64_t now);
+
+/**
+ * Writes out an instant event about a segment.
+ *
+ * timeline: The timeline.
+ * track: The connection's track.
+ * name: Name of the event.
+ * seqno: Sequence number of the segment.
+ * len: Data bytes in the segment.
+ * now: Current time, in nanoseconds.
+ */
+void timeline_instant(timeline_t *timeline, timeline_track_t *track,
+                      const char *name, uint32_t seqno, uint32_t len,
+                      int64_t now);
+
+/**
+ * Records whether a connection is stalled. A stall is written out as a slice
+ * once it is over.
+ *
+ * timeline: The timeline.
+ * track: The connection's track.
+ * stall: Kind of stall.
+ * stalled: Whether the connection is stalled now.
+ * now: Current time, in nanoseconds.
+ */
+void timeline_stall(timeline_t *timeline, timeline_track_t *track,
+                    enum timeline_stall stall, bool stalled, int64_t now);
+
+/**
+ * Ends a connection's track, finishing off any stalls.
+ *
+ * timeline: The timeline.
+ * track: The connection's track.
+ * now: Current time, in nanoseconds.
+ */
+void timeline_end(timeline_t *timeline, timeline_track_t *track, int64_t now);
+
+/**
+ * Finishes off the file and closes it.
+ *
+ * timeline: The timeline. Freed.
+ */
+void timeline_close(timeline_t *timeline);
+
+#endif /* CTCP_TIMELINE_H */
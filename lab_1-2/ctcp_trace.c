@@ -0,0 +1,273 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ctcp_trace.h"
+
+#define TRACE_RING_MASK (TRACE_RING_SIZE - 1)
+#define CACHE_LINE 64
+
+/** The producer and the consumer each keep to their own cache line, so that
+    filling in records doesn't keep taking the line away from the writer. */
+struct trace {
+  /* Main loop */
+  uint64_t head __attribute__((aligned(CACHE_LINE)));
+                                /* Next record to fill in */
+  uint64_t tail_seen;           /* tail when the main loop last looked */
+  uint64_t dropped;             /* Records dropped because the ring was full */
+  int payload;                  /* Most payload bytes to capture */
+
+  /* Writer thread */
+  uint64_t tail __attribute__((aligned(CACHE_LINE)));
+                                /* Next record to write out */
+  uint64_t written;             /* Records written out */
+  bool failed;                  /* Whether a write has failed */
+  int sleeping;                 /* Whether the writer is waiting on wake */
+
+  /* Shared, and never written while the trace is running. */
+  int fd __attribute__((aligned(CACHE_LINE)));
+  int stopping;                 /* Set by trace_close() */
+  trace_record_t *ring;         /* TRACE_RING_SIZE records */
+  pthread_t thread;
+  pthread_mutex_t lock;         /* Held around waiting on wake */
+  pthread_cond_t wake;          /* Wakes up the writer thread */
+};
+
+
+//////////////////////////////////// WRITER ////////////////////////////////////
+
+/**
+ * Writes all of a buffer, carrying on after partial writes.
+ *
+ * returns: 0 on success, -1 otherwise.
+ */
+static int write_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/**
+ * Writes out the records up to head, at most two write() calls' worth (the
+ * ring may wrap around).
+ */
+static void trace_flush(trace_t *trace, uint64_t head) {
+  while (trace->tail != head) {
+    uint64_t start = trace->tail & TRACE_RING_MASK;
+    uint64_t n = head - trace->tail;
+    if (n > TRACE_RING_SIZE - start)
+      n = TRACE_RING_SIZE - start;
+
+    /* Once a write has failed, records are thrown away as they come in. */
+    if (!trace->failed && write_all(trace->fd, trace->ring + start,
+                                    n * sizeof(trace_record_t)) < 0) {
+      fprintf(stderr, "[ERROR] Could not write trace: %s\n", strerror(errno));
+      trace->failed = true;
+    }
+    if (!trace->failed)
+      trace->written += n;
+
+    /* Only now can the main loop reuse the records. */
+    __atomic_store_n(&trace->tail, trace->tail + n, __ATOMIC_RELEASE);
+  }
+}
+
+/**
+ * Writer thread. Writes out records as they come in, sleeping for up to
+ * TRACE_FLUSH_INTERVAL when there are none.
+ */
+static void *trace_writer(void *arg) {
+  trace_t *trace = arg;
+  while (true) {
+    /* Check for stopping first, so the last records committed before
+       trace_close() are still written out. */
+    int stopping = __atomic_load_n(&trace->stopping, __ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+    if (head != trace->tail) {
+      trace_flush(trace, head);
+      continue;
+    }
+    if (stopping)
+      break;
+
+    /* The main loop only wakes the writer up if it is sleeping. A record
+       committed just as it goes to sleep may not wake it, which only delays
+       writing until the timeout. */
+    struct timespec until;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_nsec += TRACE_FLUSH_INTERVAL * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&trace->lock);
+    __atomic_store_n(&trace->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&trace->head, __ATOMIC_SEQ_CST) == trace->tail &&
+        !__atomic_load_n(&trace->stopping, __ATOMIC_ACQUIRE))
+      pthread_cond_timedwait(&trace->wake, &trace->lock, &until);
+    __atomic_store_n(&trace->sleeping, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&trace->lock);
+  }
+  return NULL;
+}
+
+/**
+ * Wakes up the writer thread.
+ */
+static void trace_wake(trace_t *trace) {
+  pthread_mutex_lock(&trace->lock);
+  pthread_cond_signal(&trace->wake);
+  pthread_mutex_unlock(&trace->lock);
+}
+
+
+///////////////////////////////////// TRACE ////////////////////////////////////
+
+/**
+ * Fills in the header of a trace file, with no records yet.
+ */
+static void trace_header_init(trace_header_t *header, int payload) {
+  memset(header, 0, sizeof(trace_header_t));
+  memcpy(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+  header->version = TRACE_VERSION;
+  header->record_size = sizeof(trace_record_t);
+  header->payload = payload;
+}
+
+trace_t *trace_open(const char *path, int payload) {
+  int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "[ERROR] Could not create trace %s: %s\n", path,
+            strerror(errno));
+    return NULL;
+  }
+
+  if (payload < 0)
+    payload = 0;
+  if (payload > TRACE_PAYLOAD_MAX)
+    payload = TRACE_PAYLOAD_MAX;
+
+  trace_header_t header;
+  trace_header_init(&header, payload);
+  if (write_all(fd, &header, sizeof(header)) < 0) {
+    fprintf(stderr, "[ERROR] Could not write trace %s: %s\n", path,
+            strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  trace_t *trace;
+  if (posix_memalign((void **) &trace, CACHE_LINE, sizeof(trace_t)) != 0) {
+    close(fd);
+    return NULL;
+  }
+  memset(trace, 0, sizeof(trace_t));
+  if (posix_memalign((void **) &trace->ring, CACHE_LINE,
+                     TRACE_RING_SIZE * sizeof(trace_record_t)) != 0) {
+    close(fd);
+    free(trace);
+    return NULL;
+  }
+  trace->fd = fd;
+  trace->payload = payload;
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&trace->wake, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&trace->lock, NULL);
+
+  /* Leave signals (such as SIGTERM) to the main loop. */
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_create(&trace->thread, NULL, trace_writer, trace);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return trace;
+}
+
+trace_record_t *trace_begin(trace_t *trace) {
+  uint64_t head = trace->head;
+
+  /* Only look at where the writer is when the ring seems to be full. */
+  if (head - trace->tail_seen >= TRACE_RING_SIZE) {
+    trace->tail_seen = __atomic_load_n(&trace->tail, __ATOMIC_ACQUIRE);
+    if (head - trace->tail_seen >= TRACE_RING_SIZE) {
+      trace->dropped++;
+      return NULL;
+    }
+  }
+  return &trace->ring[head & TRACE_RING_MASK];
+}
+
+void trace_commit(trace_t *trace) {
+  uint64_t head = trace->head + 1;
+  __atomic_store_n(&trace->head, head, __ATOMIC_RELEASE);
+
+  /* Wake the writer up early if it is asleep and the ring is getting full.
+     This is the only time the main loop makes a system call. */
+  if (head - trace->tail_seen >= TRACE_RING_SIZE / 2) {
+    trace->tail_seen = __atomic_load_n(&trace->tail, __ATOMIC_ACQUIRE);
+    if (head - trace->tail_seen >= TRACE_RING_SIZE / 2 &&
+        __atomic_load_n(&trace->sleeping, __ATOMIC_RELAXED))
+      trace_wake(trace);
+  }
+}
+
+int trace_payload(trace_t *trace) {
+  return trace->payload;
+}
+
+void trace_drain(trace_t *trace) {
+  uint64_t head = trace->head;
+  struct timespec pause = { 0, 50000 };
+  while (__atomic_load_n(&trace->tail, __ATOMIC_ACQUIRE) != head) {
+    /* A wake-up can be missed just as the writer goes to sleep, so keep
+       waking it until it is done. */
+    if (__atomic_load_n(&trace->sleeping, __ATOMIC_RELAXED))
+      trace_wake(trace);
+    nanosleep(&pause, NULL);
+  }
+  trace->tail_seen = head;
+}
+
+void trace_close(trace_t *trace) {
+  __atomic_store_n(&trace->stopping, 1, __ATOMIC_RELEASE);
+  trace_wake(trace);
+  pthread_join(trace->thread, NULL);
+
+  /* Fill in the counts. */
+  trace_header_t header;
+  trace_header_init(&header, trace->payload);
+  header.records = trace->written;
+  header.dropped = trace->dropped;
+  if (pwrite(trace->fd, &header, sizeof(header), 0) != sizeof(header))
+    fprintf(stderr, "[ERROR] Could not write trace header\n");
+  if (trace->dropped > 0) {
+    fprintf(stderr, "[ERROR] Trace dropped %llu segments\n",
+            (unsigned long long) trace->dropped);
+  }
+
+  close(trace->fd);
+  pthread_mutex_destroy(&trace->lock);
+  pthread_cond_destroy(&trace->wake);
+  free(trace->ring);
+  free(trace);
+}
@@ -0,0 +1,134 @@
+/******************************************************************************
+ * ctcp_trace.h
+ * ------------
+ * Binary trace of the segments a host sends and receives (--logging). Each
+ * segment becomes one fixed-size record in a lock-free ring. A background
+ * thread writes the ring out to the trace file, so the main loop never blocks
+ * on the disk or formats text.
+ *
+ * The ring has a single producer (the main loop) and a single consumer (the
+ * writer thread). Records are filled in place:
+ *
+ *     trace_record_t *rec = trace_begin(trace);
+ *     if (rec) {
+ *       ...fill in rec...
+ *       trace_commit(trace);
+ *     }
+ *
+ * trace_begin() returns NULL when the ring is full, and the record is counted
+ * as dropped rather than waiting for the writer to catch up.
+ *
+ * A trace file is a trace_header_t followed by records. ctcp_trace2csv turns
+ * one into the same columns as the old CSV log.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_TRACE_H
+#define CTCP_TRACE_H
+
+#include <stdint.h>
+
+/** Magic number at the start of a trace file, and the format version. */
+#define TRACE_MAGIC "CTCPTRC"
+#define TRACE_VERSION 1
+
+/** Most payload bytes a record can hold. Makes a record two cache lines. */
+#define TRACE_PAYLOAD_MAX 80
+
+/** Number of records in the ring. Must be a power of two. */
+#define TRACE_RING_SIZE 8192
+
+/** How often the writer thread wakes up to flush the ring, in milliseconds.
+    It is also woken whenever the ring gets half full. */
+#define TRACE_FLUSH_INTERVAL 10
+
+/** Bits in trace_record_t.kind. */
+#define TRACE_SENT 0x1          /* Sent by this host (else received) */
+#define TRACE_UNIX 0x2          /* Over a Unix socket (addresses are unused) */
+
+/** A segment. Fields are in host-byte order, except for the IP addresses, the
+    flags and the checksum, which are kept as they were in the segment. */
+struct trace_record {
+  int64_t time;                 /* When, in nanoseconds */
+  uint32_t src_ip;              /* Source IP address (network-byte order) */
+  uint32_t dst_ip;              /* Destination IP (network-byte order) */
+  uint16_t src_port;            /* Source port */
+  uint16_t dst_port;            /* Destination port */
+  uint32_t seqno;               /* Sequence number */
+  uint32_t ackno;               /* Acknowledgement number */
+  uint32_t flags;               /* TCP flags (as in the segment) */
+  uint16_t len;                 /* Segment length, including headers */
+  uint16_t window;              /* Window */
+  uint16_t cksum;               /* Checksum (as in the segment) */
+  uint16_t data_len;            /* Payload bytes captured in data */
+  uint8_t kind;                 /* TRACE_SENT and TRACE_UNIX */
+  uint8_t pad[7];
+  uint8_t data[TRACE_PAYLOAD_MAX];
+};
+typedef struct trace_record trace_record_t;
+
+/** Start of a trace file. records and dropped are filled in when the trace is
+    closed, so they are 0 if the program did not exit cleanly. */
+struct trace_header {
+  char magic[8];                /* TRACE_MAGIC */
+  uint32_t version;             /* TRACE_VERSION */
+  uint32_t record_size;         /* sizeof(trace_record_t) */
+  uint32_t payload;             /* Most payload bytes captured per segment */
+  uint32_t pad;
+  uint64_t records;             /* Records written */
+  uint64_t dropped;             /* Records dropped because the ring was full */
+};
+typedef struct trace_header trace_header_t;
+
+typedef struct trace trace_t;
+
+
+/**
+ * Creates a trace file and starts the thread that writes to it.
+ *
+ * path: File to write to. Truncated if it already exists.
+ * payload: Most payload bytes to capture per segment (0 for none). Capped at
+ *          TRACE_PAYLOAD_MAX.
+ * returns: The trace, or NULL if the file could not be created.
+ */
+trace_t *trace_open(const char *path, int payload);
+
+/**
+ * Takes the next free record in the ring. Only to be called from one thread.
+ *
+ * trace: The trace.
+ * returns: The record to fill in, or NULL if the ring is full.
+ */
+trace_record_t *trace_begin(trace_t *trace);
+
+/**
+ * Hands the record from trace_begin() over to the writer thread.
+ *
+ * trace: The trace.
+ */
+void trace_commit(trace_t *trace);
+
+/**
+ * Returns the most payload bytes to capture per segment.
+ *
+ * trace: The trace.
+ */
+int trace_payload(trace_t *trace);
+
+/**
+ * Waits for the writer thread to write out every record committed so far.
+ * Only to be called from the thread that commits records.
+ *
+ * trace: The trace.
+ */
+void trace_drain(trace_t *trace);
+
+/**
+ * Writes out whatever is left in the ring, stops the writer thread and
+ * closes the file.
+ *
+ * trace: The trace. Freed.
+ */
+void trace_close(trace_t *trace);
+
+#endif /* CTCP_TRACE_H */
@@ -0,0 +1,113 @@
+/******************************************************************************
+ * ctcp_trace2csv.c
+ * ----------------
+ * Converts a binary trace written by ctcp --logging (see ctcp_trace.h) into a
+ * tab-separated log, with the same columns log_segment() writes:
+ *
+ *     ./ctcp_trace2csv 1445000000-9999.trace > 1445000000-9999.csv
+ *
+ * The Data column only has as much of each segment's data as was captured
+ * (see --log-payload), and is empty if none was.
+ *
+ *****************************************************************************/
+
+#include "ctcp_sys_internal.h"
+#include "ctcp_trace.h"
+
+/** Records read at once. */
+#define READ_RECORDS 256
+
+/**
+ * Writes out a record as one line of the log.
+ *
+ * rec: The record.
+ * out: Where to write it.
+ */
+static void print_record(trace_record_t *rec, FILE *out) {
+  fprintf(out, "%ld\t", (long) (rec->time / 1000000));
+
+  /* Source and destination. Just "localhost" for Unix sockets. */
+  if (rec->kind & TRACE_UNIX) {
+    fprintf(out, ADDR_FORMAT_STR, LOCALHOST_STR, rec->src_port, LOCALHOST_STR,
+            rec->dst_port);
+  }
+  else {
+    char src_ip[INET_ADDRSTRLEN];
+    char dst_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &rec->src_ip, src_ip, INET_ADDRSTRLEN);
+    inet_ntop(AF_INET, &rec->dst_ip, dst_ip, INET_ADDRSTRLEN);
+    fprintf(out, ADDR_FORMAT_STR, src_ip, rec->src_port, dst_ip,
+            rec->dst_port);
+  }
+
+  fprintf(out, "%d\t%d\t%d\t", (int) rec->seqno, (int) rec->ackno, rec->len);
+  if (rec->flags & TH_SYN)
+    fputs("SYN ", out);
+  if (rec->flags & TH_ACK)
+    fputs("ACK ", out);
+  if (rec->flags & TH_FIN)
+    fputs("FIN ", out);
+  fprintf(out, "\t%d\t0x%x\t", rec->window, rec->cksum);
+
+  int i;
+  for (i = 0; i < rec->data_len && i < TRACE_PAYLOAD_MAX; i++)
+    fprintf(out, "%02x ", rec->data[i]);
+  fputc('\n', out);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "\nUsage: %s trace [csv_file]\n\n", argv[0]);
+    return 1;
+  }
+
+  FILE *in = fopen(argv[1], "rb");
+  if (in == NULL) {
+    fprintf(stderr, "[ERROR] Could not open %s\n", argv[1]);
+    return 1;
+  }
+  FILE *out = stdout;
+  if (argc == 3 && (out = fopen(argv[2], "w")) == NULL) {
+    fprintf(stderr, "[ERROR] Could not create %s\n", argv[2]);
+    return 1;
+  }
+
+  trace_header_t header;
+  if (fread(&header, sizeof(header), 1, in) != 1 ||
+      memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+    fprintf(stderr, "[ERROR] %s is not a trace\n", argv[1]);
+    return 1;
+  }
+  if (header.version != TRACE_VERSION ||
+      header.record_size != sizeof(trace_record_t)) {
+    fprintf(stderr, "[ERROR] %s is version %u of the trace format, not %d\n",
+            argv[1], header.version, TRACE_VERSION);
+    return 1;
+  }
+
+  /* Read to the end rather than trusting the header's count, which is 0 if
+     the program did not exit cleanly. */
+  fputs(LOG_HEADERS, out);
+  static trace_record_t recs[READ_RECORDS];
+  uint64_t records = 0;
+  size_t n;
+  while ((n = fread(recs, sizeof(trace_record_t), READ_RECORDS, in)) > 0) {
+    size_t i;
+    for (i = 0; i < n; i++)
+      print_record(&recs[i], out);
+    records += n;
+  }
+
+  if (header.dropped > 0) {
+    fprintf(stderr, "[INFO] %llu segments, %llu more dropped while tracing\n",
+            (unsigned long long) records,
+            (unsigned long long) header.dropped);
+  }
+  fclose(in);
+  if (fclose(out) != 0) {
+    fprintf(stderr, "[ERROR] Could not write %s\n", argc == 3 ? argv[2] :
+                                                    "output");
+    return 1;
+  }
+  return 0;
+}
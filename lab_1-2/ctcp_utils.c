@@ -16,10 +16,28 @@ uint16_t cksum(const void *_data, uint16_t len) {
   return sum ? sum : 0xffff;
 }
 
+/** Clock override installed by set_time_source(), NULL for the wall clock. */
+static long long (*time_source)(void) = NULL;
+
 long current_time() {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+  return current_time_ns() / 1000000;
+}
+
+long long current_time_us() {
+  return current_time_ns() / 1000;
+}
+
+long long current_time_ns() {
+  if (time_source)
+    return time_source();
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void set_time_source(long long (*now_ns)(void)) {
+  time_source = now_ns;
 }
 
 void print_hdr_ctcp(ctcp_segment_t *segment) {
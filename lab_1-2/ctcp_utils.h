@@ -27,6 +27,22 @@ uint16_t cksum(const void *_data, uint16_t len);
  */
 long current_time();
 
+/**
+ * Gets the current time in microseconds and nanoseconds. These read the same
+ * clock as current_time(), just at a finer resolution.
+ */
+long long current_time_us();
+long long current_time_ns();
+
+/**
+ * Replaces the clock read by current_time() and friends. The simulator uses
+ * this to run cTCP on a virtual clock. You can ignore this.
+ *
+ * now_ns: Function returning the current time in nanoseconds, or NULL to go
+ *         back to the wall clock.
+ */
+void set_time_source(long long (*now_ns)(void));
+
 /**
  * Prints out the headers of a cTCP segment. Expects the segment to come in
  * network-byte order. All fields are converted and printed out in host order,
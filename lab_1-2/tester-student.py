@@ -1,11 +1,15 @@
 #!/usr/bin/env python
 
 import argparse
+import filecmp
+import json
 import os
 import random
 import signal
 import subprocess
+import shutil
 import sys
+import tempfile
 import time
 import traceback
 
@@ -39,6 +43,47 @@ DEBUG_STOP = "###stop###"
 run_lab2 = False
 # Whether or not the sliding window test passed.
 sliding_window_passed = False
+# Whether or not to run the performance tests, and their budget overrides and
+# where to write their results.
+run_perf = False
+perf_budgets = {}
+perf_output = None
+
+# Performance test settings. Each unreliability flag is applied at
+# PERF_PERCENT percent, and every size is transferred with each of them.
+PERF_SIZES = ["1M", "16M"]
+PERF_FLAGS = ["", "-t", "-r", "-y", "-q"]
+PERF_PERCENT = 5
+PERF_WINDOW = 8
+
+# Names of the unreliability flags, used in test names and budgets.
+PERF_FLAG_NAMES = {
+  "": "clean",
+  "-t": "corrupt",
+  "-r": "drop",
+  "-y": "delay",
+  "-q": "duplicate",
+}
+
+# Budgets for each performance test: the lowest throughput allowed, in Mbit/s,
+# and the highest ratio of data segments that may be retransmissions. Keyed by
+# unreliability flag name. A budgets file (--perf-budgets) can override these,
+# by flag name or for a single test as "<size>/<flag name>", e.g.
+#   {"drop": {"min_mbps": 2.0}, "16M/clean": {"max_retx_ratio": 0}}
+PERF_BUDGETS = {
+  "clean": {"min_mbps": 0.5, "max_retx_ratio": 0.01},
+  "corrupt": {"min_mbps": 0.1, "max_retx_ratio": 0.5},
+  "drop": {"min_mbps": 0.1, "max_retx_ratio": 0.5},
+  "delay": {"min_mbps": 0.1, "max_retx_ratio": 0.5},
+  "duplicate": {"min_mbps": 0.1, "max_retx_ratio": 0.05},
+}
+
+# Seconds allowed on top of the time a transfer takes at the throughput floor,
+# for setup and teardown.
+PERF_SLACK = 10
+
+# Statistics printed by the library with --summary.
+STATS_PREFIX = "[STATS] "
 
 ############################ HELPERS FOR SUBPROCESS  ###########################
 
@@ -683,6 +728,149 @@ TESTS = [
    "(Lab 2 Only): Checks to see if sliding window is being used.\n")
 ]
 
+########################### PERFORMANCE TESTS  ################################
+
+def parse_size(size):
+  """
+  Function: parse_size
+  --------------------
+  Parses a size with an optional K, M or G suffix (powers of 1024).
+  """
+  units = {"K": 1024, "M": 1024 ** 2, "G": 1024 ** 3}
+  size = size.upper()
+  if size and size[-1] in units:
+    return int(float(size[:-1]) * units[size[-1]])
+  return int(size)
+
+
+def perf_budget(budgets, size, flag):
+  """
+  Function: perf_budget
+  ---------------------
+  Gets the budget of a performance test: the defaults for its flag, then any
+  override for the flag, then any override for the test itself.
+  """
+  name = PERF_FLAG_NAMES[flag]
+  budget = dict(PERF_BUDGETS[name])
+  budget.update(budgets.get(name, {}))
+  budget.update(budgets.get("%s/%s" % (size, name), {}))
+  return budget
+
+
+def perf_input(workdir, size):
+  """
+  Function: perf_input
+  --------------------
+  Makes a file of random data to transfer, or reuses one already made.
+  """
+  path = os.path.join(workdir, "input-%d" % size)
+  if not os.path.exists(path):
+    with open(path, "wb") as f:
+      left = size
+      while left > 0:
+        chunk = min(left, 1024 * 1024)
+        f.write(os.urandom(chunk))
+        left -= chunk
+  return path
+
+
+def perf_transfer(workdir, size, flag, budget):
+  """
+  Function: perf_transfer
+  -----------------------
+  Transfers a file from student/client to student/server, with the
+  unreliability flag on the client, and times it. Gives up once the transfer
+  can no longer meet the throughput floor.
+
+  returns: The results, with the throughput, segments sent against the
+           minimum needed, and whether or not they are within budget.
+  """
+  nbytes = parse_size(size)
+  infile = perf_input(workdir, nbytes)
+  outfile = os.path.join(workdir, "output")
+  client_err = os.path.join(workdir, "client.err")
+  client_port, server_port = choose_ports()
+  flags = ["-w", str(PERF_WINDOW)]
+  client_flags = flags + ["--summary"]
+  if flag:
+    client_flags += [flag, str(PERF_PERCENT)]
+
+  # No -z here, so that logging does not slow the transfer down.
+  with open(os.devnull, "rb") as inp, open(outfile, "wb") as out, \
+       open(os.devnull, "wb") as err:
+    server = Popen([CTCP_BINARY, "-s", "-p", server_port] + flags, stdin=inp,
+                   stdout=out, stderr=err)
+  time.sleep(0.5)
+  limit = nbytes * 8 / (budget["min_mbps"] * 1e6) + PERF_SLACK
+  with open(infile, "rb") as inp, open(os.devnull, "wb") as out, \
+       open(client_err, "w") as err:
+    start = time.time()
+    client = Popen([CTCP_BINARY, "-c", "localhost:" + server_port,
+                    "-p", client_port] + client_flags, stdin=inp, stdout=out,
+                   stderr=err)
+    while client.poll() is None and time.time() - start < limit:
+      time.sleep(0.01)
+    elapsed = time.time() - start
+
+  # Give the server a moment to write out the rest.
+  while os.path.getsize(outfile) < nbytes and time.time() - start < limit:
+    time.sleep(0.01)
+  for host in [client, server]:
+    if host.poll() is None:
+      host.kill()
+      host.wait()
+
+  stats = None
+  with open(client_err) as f:
+    for line in f:
+      if line.startswith(STATS_PREFIX):
+        stats = json.loads(line[len(STATS_PREFIX):])
+  delivered = os.path.getsize(outfile)
+  correct = delivered == nbytes and filecmp.cmp(infile, outfile, shallow=False)
+  mbps = delivered * 8 / elapsed / 1e6 if elapsed > 0 else 0
+  retx_ratio = stats["retx_ratio"] if stats else None
+  return {
+    "size": size,
+    "bytes": nbytes,
+    "unreliability": PERF_FLAG_NAMES[flag],
+    "percent": PERF_PERCENT if flag else 0,
+    "window": PERF_WINDOW,
+    "correct": correct,
+    "elapsed_s": elapsed,
+    "mbps": mbps,
+    "data_segments_sent": stats["data_segments_sent"] if stats else None,
+    # Every byte of data, then the FIN.
+    "min_segments": (nbytes + MAX_SEG_DATA_SIZE - 1) // MAX_SEG_DATA_SIZE + 1,
+    "retransmits": stats["retransmits"] if stats else None,
+    "retx_ratio": retx_ratio,
+    "min_mbps": budget["min_mbps"],
+    "max_retx_ratio": budget["max_retx_ratio"],
+    "passed": correct and mbps >= budget["min_mbps"] and
+              retx_ratio is not None and
+              retx_ratio <= budget["max_retx_ratio"],
+  }
+
+
+def perf_tests(sizes, flags):
+  """
+  Function: perf_tests
+  --------------------
+  Makes the list of performance tests, one for each size and unreliability
+  flag.
+  """
+  tests = []
+  for size in sizes:
+    for flag in flags:
+      name = PERF_FLAG_NAMES[flag]
+      tests.append(("performance",
+                    "Transfers %s%s" % (size, "" if not flag else
+                                        " with %d%% %s" % (PERF_PERCENT, name)),
+                    (size, flag),
+                    "Sends %s from the client to the server%s. Checks the\n" %
+                    (size, "" if not flag else ", with %s" % name) +
+                    "throughput and retransmissions against the budget."))
+  return tests
+
 ################################# TESTER CODE ##################################
 
 def run_tests(tests):
@@ -735,6 +923,56 @@ def run_tests(tests):
     print "You will automatically receive a 0 if sliding window not implemented."
 
 
+def run_perf_tests(tests, budgets, output):
+  """
+  Function: run_perf_tests
+  ------------------------
+  Runs through the performance tests.
+
+  tests: The tests, from perf_tests().
+  budgets: Budget overrides.
+  output: File to write the results to as JSON, one line each, or None.
+  returns: Whether or not all of them passed.
+  """
+  num_success = 0
+  print "Starting performance tests..."
+  print "\nResults"
+  print "-------"
+
+  workdir = tempfile.mkdtemp(prefix="ctcp-perf-")
+  try:
+    for i, test in enumerate(tests):
+      test_info = "  %d. %s" % (i + 1, test[1])
+      print test_info,
+      sys.stdout.flush()
+
+      size, flag = test[2]
+      result = perf_transfer(workdir, size, flag,
+                             perf_budget(budgets, size, flag))
+      if result["passed"]:
+        num_success += 1
+      print "." * (70 - len(test_info)),
+      print "PASS" if result["passed"] else "FAIL"
+      print "     |-> %.3f Mbit/s (floor %g), %s/%d data segments " \
+            "(retransmits %s, ceiling %g%%)%s" % (
+              result["mbps"], result["min_mbps"],
+              result["data_segments_sent"], result["min_segments"],
+              "%.2f%%" % (result["retx_ratio"] * 100)
+              if result["retx_ratio"] is not None else "unknown",
+              result["max_retx_ratio"] * 100,
+              "" if result["correct"] else ", output incorrect")
+      sys.stdout.flush()
+      if output:
+        output.write(json.dumps(result, sort_keys=True) + "\n")
+        output.flush()
+      teardown()
+  finally:
+    shutil.rmtree(workdir, ignore_errors=True)
+
+  print "\nPASSED: %d/%d" % (num_success, len(tests))
+  return num_success == len(tests)
+
+
 def print_test_list():
   """
   Function: print_test_list
@@ -752,6 +990,11 @@ def print_test_list():
       print ""
   print ""
 
+  print "Performance Tests (--perf)\n--------------------------"
+  for i, test in enumerate(perf_tests(PERF_SIZES, PERF_FLAGS)):
+    print "  %d. %s" % (i + 1, test[1])
+  print ""
+
 
 def parse_args():
   """
@@ -761,7 +1004,7 @@ def parse_args():
 
   Returns: List of test numbers to run.
   """
-  global run_lab2
+  global run_lab2, run_perf, perf_budgets, perf_output, PERF_SLACK
 
   parser = argparse.ArgumentParser()
   parser.add_argument("--tests", type=int, nargs="+", help="Tests to run")
@@ -770,8 +1013,32 @@ def parse_args():
   parser.add_argument("--timeout", type=int, help="Tester timeout, in seconds")
   parser.add_argument("--lab2", action="store_const", const=True,
                       help="Run Lab 2 tests")
+  parser.add_argument("--perf", action="store_const", const=True,
+                      help="Run the performance tests instead")
+  parser.add_argument("--perf-sizes", type=lambda s: s.split(","),
+                      default=PERF_SIZES,
+                      help="Sizes to transfer, comma-separated (K, M, G "
+                           "suffixes)")
+  parser.add_argument("--perf-budgets", type=argparse.FileType("r"),
+                      help="JSON file of throughput floors and "
+                           "retransmission ceilings")
+  parser.add_argument("--perf-output", type=argparse.FileType("w"),
+                      help="Where to write performance results as JSON")
+  parser.add_argument("--perf-slack", type=int, default=PERF_SLACK,
+                      help="Seconds allowed for setup and teardown on top of "
+                           "the time a transfer takes at the throughput "
+                           "floor")
   args = parser.parse_args()
 
+  # Performance tests are run on their own, and numbered separately.
+  if args.perf:
+    run_perf = True
+    if args.perf_budgets:
+      perf_budgets = json.load(args.perf_budgets)
+    perf_output = args.perf_output
+    PERF_SLACK = args.perf_slack
+    return perf_tests(args.perf_sizes, PERF_FLAGS)
+
   # Get all the tests to run.
   if not args.tests:
     args.tests = range(1, len(TESTS) + (0 if not args.lab2 else 1))
@@ -838,4 +1105,8 @@ if __name__ == "__main__":
   teardown()
   tests_to_run = parse_args()
   verify()
-  run_tests(tests_to_run)
+  if run_perf:
+    if not run_perf_tests(tests_to_run, perf_budgets, perf_output):
+      sys.exit(1)
+  else:
+    run_tests(tests_to_run)